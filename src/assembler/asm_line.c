@@ -246,6 +246,29 @@ asm_line *new_asm_line_instruction_reg_mem(mempool *mp, instr_code op, gp_regist
     return l;
 }
 
+// for instructions that only write to the register of ModRegRM, e.g. "CMOVLT AX, BX"
+asm_line *new_asm_line_instruction_reg_regmem(mempool *mp, instr_code op, gp_register target_reg, asm_operand *source) {
+    asm_line *l;
+    if (source->type == OT_REGISTER) {
+        l = new_asm_line_instruction_reg_reg(mp, op, source->reg, target_reg);
+        l->per_type.instruction->direction_regmem_to_regimm = true;
+    } else {
+        l = new_asm_line_instruction_with_operands(mp, op, new_asm_operand_reg(mp, target_reg), source);
+    }
+    return l;
+}
+
+// e.g. "LEA AX, [BX+SI*4]"
+asm_line *new_asm_line_instruction_reg_mem_scaled(mempool *mp, instr_code op, gp_register target_reg, gp_register base_reg, gp_register index_reg, int scale) {
+    asm_line *l = new_asm_line_instruction_reg_mem(mp, op, target_reg, base_reg);
+
+    asm_instruction *i = l->per_type.instruction;
+    i->regmem_operand.per_type.mem.array_index_reg = index_reg;
+    i->regmem_operand.per_type.mem.array_item_size = scale;
+
+    return l;
+}
+
 asm_line *new_asm_line_instruction_mem_imm(mempool *mp, instr_code op, gp_register ptr_reg, data_size data_bits, long immediate) {
     asm_line *l = new_asm_line_instruction(mp, op);
 
@@ -314,10 +337,10 @@ int register_bits(gp_register r) {
 }
 
 bool register_is_extended(gp_register r) {
-    return (r >= REG_R9  && r <= REG_R15) 
-        || (r >= REG_R9B && r <= REG_R15B)
-        || (r >= REG_R9W && r <= REG_R15W)
-        || (r >= REG_R9D && r <= REG_R15D);
+    return (r >= REG_R8  && r <= REG_R15) 
+        || (r >= REG_R8B && r <= REG_R15B)
+        || (r >= REG_R8W && r <= REG_R15W)
+        || (r >= REG_R8D && r <= REG_R15D);
 }
 
 const char *register_name(gp_register r) {
@@ -451,6 +474,12 @@ data_size asm_instruction_data_size(asm_instruction *instr) {
                 !instr->regimm_operand.is_immediate && !instr->regimm_operand.is_register) {
         // e.g. "PUSH [RDX]"
         return instr->operands_data_size;
+    } else if (!instr->regmem_operand.is_register &&
+                !instr->regmem_operand.is_memory_by_reg &&
+                !instr->regmem_operand.is_mem_addr_by_symbol &&
+                instr->regimm_operand.is_immediate) {
+        // e.g. "PUSH 5", size must be explicit
+        return instr->operands_data_size;
     }
 
     fatal("Unexpected operands configuration!");
@@ -472,16 +501,30 @@ bool asm_instruction_has_immediate(asm_instruction *instr) {
 
 // ------------------------------------------------------------
 
+// operands name registers by their 16 bits version, to be printed in native size
+static void native_register_name(gp_register r, char *buffer, int buff_size) {
+    if (register_is_extended(r)) {
+        // R8W becomes R8 or R8D, no prefix for those
+        gp_register base = run_info->options->register_prefix == 'R' ? REG_R8 : REG_R8D;
+        snprintf(buffer, buff_size, "%s", register_name((r & 0x7) + base));
+    } else {
+        snprintf(buffer, buff_size, "%c%s", run_info->options->register_prefix, register_name(r));
+    }
+}
+
 static void append_operand_instruction(asm_operand *op, char *buffer, int buff_size) {
     char *pos = buffer + strlen(buffer);
     int len = buff_size - strlen(buffer);
+    char reg[8];
 
     if (op->type == OT_IMMEDIATE) {
         snprintf(pos, len, "0x%lx", op->immediate);
     } else if (op->type == OT_REGISTER) {
-        snprintf(pos, len, "%c%s", run_info->options->register_prefix, register_name(op->reg));
+        native_register_name(op->reg, reg, sizeof(reg));
+        snprintf(pos, len, "%s", reg);
     } else if (op->type == OT_MEM_POINTED_BY_REG) {
-        snprintf(pos, len, "[%c%s%+ld]", run_info->options->register_prefix, register_name(op->reg), op->offset);
+        native_register_name(op->reg, reg, sizeof(reg));
+        snprintf(pos, len, "[%s%+ld]", reg, op->offset);
     } else if (op->type == OT_MEM_OF_SYMBOL) {
         snprintf(pos, len, "%s", op->symbol_name);
     }
@@ -499,6 +542,7 @@ const char *instr_code_name(instr_code code) {
         case OC_INC: return "INC";
         case OC_DEC: return "DEC";
         case OC_MUL: return "MUL";
+        case OC_IMUL: return "IMUL";
         case OC_DIV: return "DIV";
         case OC_AND: return "AND";
         case OC_OR: return "OR";
@@ -507,8 +551,10 @@ const char *instr_code_name(instr_code code) {
         case OC_NEG: return "NEG";
         case OC_SHL: return "SHL";
         case OC_SHR: return "SHR";
+        case OC_SAR: return "SAR";
         case OC_JMP: return "JMP";
         case OC_CMP: return "CMP";
+        case OC_TEST: return "TEST";
         case OC_JEQ: return "JEQ";
         case OC_JNE: return "JNE";
         case OC_JAB: return "JAB";
@@ -519,9 +565,20 @@ const char *instr_code_name(instr_code code) {
         case OC_JGE: return "JGE";
         case OC_JLT: return "JLT";
         case OC_JLE: return "JLE";
+        case OC_CMOVEQ: return "CMOVEQ";
+        case OC_CMOVNE: return "CMOVNE";
+        case OC_CMOVAB: return "CMOVAB";
+        case OC_CMOVAE: return "CMOVAE";
+        case OC_CMOVBL: return "CMOVBL";
+        case OC_CMOVBE: return "CMOVBE";
+        case OC_CMOVGT: return "CMOVGT";
+        case OC_CMOVGE: return "CMOVGE";
+        case OC_CMOVLT: return "CMOVLT";
+        case OC_CMOVLE: return "CMOVLE";
         case OC_CALL: return "CALL";
         case OC_RET: return "RET";
         case OC_INT: return "INT";
+        case OC_SYSCALL: return "SYSCALL";
     }
     return "(unknown)";
 }
@@ -591,6 +648,12 @@ static void _instruction_to_str(asm_instruction *instr, str *str) {
     }
 }
 
+void asm_instruction_to_str(asm_instruction *instr, str *str, bool with_comment) {
+    // comments live on the line, there is none to print for a bare instruction
+    (void)with_comment;
+    _instruction_to_str(instr, str);
+}
+
 str *asm_line_to_str(mempool *mp, asm_line *line) {
     str *s = new_str(mp, NULL);
 
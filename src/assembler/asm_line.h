@@ -103,6 +103,7 @@ typedef enum instr_code {
     OC_INC,
     OC_DEC,
     OC_MUL,
+    OC_IMUL, // signed, DX:AX = AX * operand
     OC_DIV,
     OC_AND,
     OC_OR,
@@ -111,9 +112,11 @@ typedef enum instr_code {
     OC_NEG,
     OC_SHL,
     OC_SHR,
+    OC_SAR, // keeps the sign bit
     // (un)conditional branching
     OC_JMP,
     OC_CMP,
+    OC_TEST,
     OC_JEQ,
     OC_JNE,
     OC_JAB,
@@ -124,10 +127,24 @@ typedef enum instr_code {
     OC_JGE,
     OC_JLT,
     OC_JLE,
+    // conditional moves, same conditions as the jumps
+    OC_CMOVEQ,
+    OC_CMOVNE,
+    OC_CMOVAB,
+    OC_CMOVAE,
+    OC_CMOVBL,
+    OC_CMOVBE,
+    OC_CMOVGT,
+    OC_CMOVGE,
+    OC_CMOVLT,
+    OC_CMOVLE,
     // basic calls
     OC_CALL,
     OC_RET,
     OC_INT,
+    OC_SYSCALL,
+
+    OC_COUNT // not an instruction, for sizing tables per instruction
 } instr_code;
 
 
@@ -183,6 +200,8 @@ asm_line *new_asm_line_instruction_reg_reg(mempool *mp, instr_code op, gp_regist
 asm_line *new_asm_line_instruction_reg_imm(mempool *mp, instr_code op, gp_register target_reg, long immediate);
 asm_line *new_asm_line_instruction_mem_reg(mempool *mp, instr_code op, gp_register ptr_reg, gp_register src_reg);
 asm_line *new_asm_line_instruction_reg_mem(mempool *mp, instr_code op, gp_register target_reg, gp_register ptr_reg);
+asm_line *new_asm_line_instruction_reg_regmem(mempool *mp, instr_code op, gp_register target_reg, asm_operand *source);
+asm_line *new_asm_line_instruction_reg_mem_scaled(mempool *mp, instr_code op, gp_register target_reg, gp_register base_reg, gp_register index_reg, int scale);
 asm_line *new_asm_line_instruction_mem_imm(mempool *mp, instr_code op, gp_register ptr_reg, data_size data_bits, long immediate);
 
 
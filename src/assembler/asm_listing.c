@@ -36,6 +36,7 @@ asm_listing *new_asm_listing(mempool *mp) {
     l->lines = new_list(mp);
     l->next_label = NULL;
     l->next_comment = NULL;
+    l->with_comments = true;
     l->ops = &ops;
     l->mempool = mp;
 
@@ -87,6 +88,8 @@ static void asm_listing_set_next_label(asm_listing *lst, const char *label, ...)
 }
 
 static void asm_listing_set_next_comment(asm_listing *lst, char *comment, ...) {
+    if (!lst->with_comments)
+        return;
     va_list vl;
     va_start(vl, comment);
     lst->next_comment = new_strv(lst->mempool, comment, vl);
@@ -94,6 +97,8 @@ static void asm_listing_set_next_comment(asm_listing *lst, char *comment, ...) {
 }
 
 static void asm_listing_add_comment(asm_listing *lst, char *comment, ...) {
+    if (!lst->with_comments)
+        return;
     va_list vl;
     va_start(vl, comment);
     lst->next_comment = new_strv(lst->mempool, comment, vl);
@@ -10,6 +10,7 @@ struct asm_listing_ops;
 typedef struct asm_listing {
     str *next_label;
     str *next_comment;
+    bool with_comments; // false when no one will read the listing, comments are dropped
 
     mempool *mempool;
     list *lines; // item is asm_line
@@ -0,0 +1,467 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include "../utils/all.h"
+#include "asm_line.h"
+#include "asm_listing.h"
+#include "asm_peephole.h"
+
+
+/*
+    Peephole optimizations on the generated assembly.
+    Each rule looks at a window of consecutive instructions with the given opcodes,
+    comment only lines are skipped, but a label inside the window breaks it,
+    as the later instructions may be reached from elsewhere.
+    Rules are applied repeatedly, as one rewrite may enable another,
+    e.g. "PUSH AX; POP AX" leaves nothing behind, "PUSH AX; POP CX" leaves a MOV.
+*/
+
+#define MAX_WINDOW  2
+
+typedef struct peephole_data {
+    mempool *mempool;
+    asm_line **lines; // NULL where a line was removed
+    int lines_count;
+} peephole_data;
+
+typedef struct peephole_rule {
+    const char *name;
+    int window;                  // how many instructions are examined
+    instr_code ops[MAX_WINDOW];  // the opcode of each of them
+    bool (*matches)(peephole_data *pd, int *at);
+    void (*rewrite)(peephole_data *pd, int *at);
+    int hits;
+} peephole_rule;
+
+
+static bool _is_code(asm_line *line) {
+    return line->type == ALT_INSTRUCTION && line->per_type.instruction->operation != OC_NONE;
+}
+
+static asm_instruction *_instr(peephole_data *pd, int index) {
+    return pd->lines[index]->per_type.instruction;
+}
+
+static int _next_line(peephole_data *pd, int index) {
+    do {
+        index++;
+    } while (index < pd->lines_count && pd->lines[index] == NULL);
+    return index;
+}
+
+// gathers the window of instructions starting at index, false if not possible
+static bool _collect_window(peephole_data *pd, int index, peephole_rule *rule, int *at) {
+    if (pd->lines[index] == NULL || !_is_code(pd->lines[index]))
+        return false;
+    if (_instr(pd, index)->operation != rule->ops[0])
+        return false;
+    at[0] = index;
+
+    for (int k = 1; k < rule->window; k++) {
+        index = _next_line(pd, index);
+        while (index < pd->lines_count && pd->lines[index]->label == NULL && !_is_code(pd->lines[index])) {
+            if (pd->lines[index]->type != ALT_INSTRUCTION && pd->lines[index]->type != ALT_EMPTY)
+                return false; // a section, data etc.
+            index = _next_line(pd, index);
+        }
+        if (index >= pd->lines_count || pd->lines[index]->label != NULL)
+            return false;
+        if (!_is_code(pd->lines[index]) || _instr(pd, index)->operation != rule->ops[k])
+            return false;
+        at[k] = index;
+    }
+    return true;
+}
+
+static void _remove_line(peephole_data *pd, int index) {
+    asm_line *line = pd->lines[index];
+    int next = _next_line(pd, index);
+    asm_line *next_line = next < pd->lines_count ? pd->lines[next] : NULL;
+
+    if (line->label != NULL && (next_line == NULL || next_line->label != NULL)) {
+        // nowhere to move the label, keep it on an empty line
+        asm_line *empty = new_asm_line_instruction(pd->mempool, OC_NONE);
+        empty->label = line->label;
+        empty->comment = line->comment;
+        pd->lines[index] = empty;
+        return;
+    }
+    if (line->label != NULL)
+        next_line->label = line->label;
+    if (line->comment != NULL && next_line != NULL && next_line->comment == NULL)
+        next_line->comment = line->comment;
+    pd->lines[index] = NULL;
+}
+
+static void _replace_line(peephole_data *pd, int index, asm_line *replacement) {
+    replacement->label = pd->lines[index]->label;
+    replacement->comment = pd->lines[index]->comment;
+    pd->lines[index] = replacement;
+}
+
+static bool _same_regmem(asm_reg_or_mem_operand *a, asm_reg_or_mem_operand *b) {
+    if (a->is_register && b->is_register)
+        return a->per_type.reg == b->per_type.reg;
+
+    if (a->is_memory_by_reg && b->is_memory_by_reg)
+        return a->per_type.mem.pointer_reg == b->per_type.mem.pointer_reg &&
+               a->per_type.mem.displacement == b->per_type.mem.displacement &&
+               a->per_type.mem.array_index_reg == b->per_type.mem.array_index_reg &&
+               a->per_type.mem.array_item_size == b->per_type.mem.array_item_size;
+
+    if (a->is_mem_addr_by_symbol && b->is_mem_addr_by_symbol)
+        return strcmp(a->per_type.mem.displacement_symbol_name, b->per_type.mem.displacement_symbol_name) == 0;
+
+    return false;
+}
+
+static bool _is_memory(asm_reg_or_mem_operand *op) {
+    return op->is_memory_by_reg || op->is_mem_addr_by_symbol;
+}
+
+// whether a conditional jump may read the flags before anything sets them again
+static bool _flags_read_later(peephole_data *pd, int index) {
+    for (int i = _next_line(pd, index); i < pd->lines_count; i = _next_line(pd, i)) {
+        if (pd->lines[i]->type != ALT_INSTRUCTION)
+            continue;
+        switch (pd->lines[i]->per_type.instruction->operation) {
+            case OC_JEQ: case OC_JNE:
+            case OC_JAB: case OC_JAE: case OC_JBL: case OC_JBE:
+            case OC_JGT: case OC_JGE: case OC_JLT: case OC_JLE:
+            case OC_CMOVEQ: case OC_CMOVNE:
+            case OC_CMOVAB: case OC_CMOVAE: case OC_CMOVBL: case OC_CMOVBE:
+            case OC_CMOVGT: case OC_CMOVGE: case OC_CMOVLT: case OC_CMOVLE:
+                return true;
+            case OC_JMP:
+                return true; // we don't follow jumps
+            case OC_ADD: case OC_SUB: case OC_CMP: case OC_TEST:
+            case OC_AND: case OC_OR:  case OC_XOR: case OC_NEG:
+                return false; // all flags written
+            case OC_CALL: case OC_RET:
+                return false; // flags are not preserved across calls
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+// ------------------------------------------------------------------------
+
+// "MOV AX, AX"
+static bool _is_mov_to_self(peephole_data *pd, int *at) {
+    asm_instruction *mov = _instr(pd, at[0]);
+    // in 64 bits, a 32 bits move clears the upper half, it is not a no-op
+    return mov->regmem_operand.is_register && mov->regimm_operand.is_register &&
+           mov->regmem_operand.per_type.reg == mov->regimm_operand.per_type.reg &&
+           register_data_size(mov->regmem_operand.per_type.reg) != DATA_DWORD;
+}
+
+// "MOV [BP-4], AX; MOV CX, [BP-4]"
+static bool _is_store_reload(peephole_data *pd, int *at) {
+    asm_instruction *store = _instr(pd, at[0]);
+    asm_instruction *load = _instr(pd, at[1]);
+    if (store->direction_regmem_to_regimm || !_is_memory(&store->regmem_operand) || !store->regimm_operand.is_register)
+        return false;
+    if (!load->direction_regmem_to_regimm || !load->regimm_operand.is_register)
+        return false;
+    return _same_regmem(&store->regmem_operand, &load->regmem_operand) &&
+           register_data_size(store->regimm_operand.per_type.reg) == register_data_size(load->regimm_operand.per_type.reg);
+}
+
+// "ADD SP, 0"
+static bool _is_zero_addition(peephole_data *pd, int *at) {
+    asm_instruction *instr = _instr(pd, at[0]);
+    return instr->regimm_operand.is_immediate &&
+           instr->regimm_operand.per_type.immediate == 0 &&
+           !_flags_read_later(pd, at[0]);
+}
+
+// "PUSH x; POP reg"
+static bool _is_push_pop(peephole_data *pd, int *at) {
+    asm_instruction *push = _instr(pd, at[0]);
+    asm_instruction *pop = _instr(pd, at[1]);
+    if (!pop->regmem_operand.is_register)
+        return false;
+    gp_register target = pop->regmem_operand.per_type.reg;
+    if ((target & 0x7) == 4 && !register_is_extended(target))
+        return false; // POP SP
+    if (push->regmem_operand.is_register)
+        return register_data_size(push->regmem_operand.per_type.reg) == register_data_size(target);
+    return push->regimm_operand.is_immediate || _is_memory(&push->regmem_operand);
+}
+
+// "JMP L; L:"
+static bool _is_jump_to_next(peephole_data *pd, int *at) {
+    asm_instruction *jmp = _instr(pd, at[0]);
+    if (!jmp->regmem_operand.is_mem_addr_by_symbol)
+        return false;
+    const char *target = jmp->regmem_operand.per_type.mem.displacement_symbol_name;
+
+    for (int i = _next_line(pd, at[0]); i < pd->lines_count; i = _next_line(pd, i)) {
+        asm_line *line = pd->lines[i];
+        if (line->label != NULL && strcmp(str_charptr(line->label), target) == 0)
+            return true;
+        if (line->type != ALT_EMPTY && (line->type != ALT_INSTRUCTION || _is_code(line)))
+            return false;
+    }
+    return false;
+}
+
+// "MOV AX, 0"
+static bool _is_zeroing_mov(peephole_data *pd, int *at) {
+    asm_instruction *mov = _instr(pd, at[0]);
+    return mov->regmem_operand.is_register &&
+           mov->regimm_operand.is_immediate &&
+           mov->regimm_operand.per_type.immediate == 0 &&
+           !_flags_read_later(pd, at[0]);
+}
+
+static void _remove_first(peephole_data *pd, int *at) {
+    _remove_line(pd, at[0]);
+}
+
+static void _forward_stored_value(peephole_data *pd, int *at) {
+    gp_register stored = _instr(pd, at[0])->regimm_operand.per_type.reg;
+    gp_register loaded = _instr(pd, at[1])->regimm_operand.per_type.reg;
+    if (stored == loaded)
+        _remove_line(pd, at[1]);
+    else
+        _replace_line(pd, at[1], new_asm_line_instruction_reg_reg(pd->mempool, OC_MOV, loaded, stored));
+}
+
+static void _push_pop_to_mov(peephole_data *pd, int *at) {
+    asm_instruction *push = _instr(pd, at[0]);
+    gp_register target = _instr(pd, at[1])->regmem_operand.per_type.reg;
+
+    asm_line *mov;
+    if (push->regmem_operand.is_register) {
+        mov = push->regmem_operand.per_type.reg == target ? NULL :
+            new_asm_line_instruction_reg_reg(pd->mempool, OC_MOV, target, push->regmem_operand.per_type.reg);
+    } else if (push->regimm_operand.is_immediate) {
+        mov = new_asm_line_instruction_reg_imm(pd->mempool, OC_MOV, target, push->regimm_operand.per_type.immediate);
+    } else {
+        mov = new_asm_line_instruction(pd->mempool, OC_MOV);
+        mov->per_type.instruction->regmem_operand = push->regmem_operand;
+        mov->per_type.instruction->regimm_operand.is_register = true;
+        mov->per_type.instruction->regimm_operand.per_type.reg = target;
+    }
+
+    _remove_line(pd, at[1]);
+    if (mov == NULL)
+        _remove_line(pd, at[0]);
+    else
+        _replace_line(pd, at[0], mov);
+}
+
+static void _mov_to_xor(peephole_data *pd, int *at) {
+    gp_register reg = _instr(pd, at[0])->regmem_operand.per_type.reg;
+    _replace_line(pd, at[0], new_asm_line_instruction_reg_reg(pd->mempool, OC_XOR, reg, reg));
+}
+
+static peephole_rule rules[] = {
+    { "mov_to_self",  1, { OC_MOV },          _is_mov_to_self,   _remove_first,         0 },
+    { "store_reload", 2, { OC_MOV, OC_MOV },  _is_store_reload,  _forward_stored_value, 0 },
+    { "add_zero",     1, { OC_ADD },          _is_zero_addition, _remove_first,         0 },
+    { "sub_zero",     1, { OC_SUB },          _is_zero_addition, _remove_first,         0 },
+    { "push_pop",     2, { OC_PUSH, OC_POP }, _is_push_pop,      _push_pop_to_mov,      0 },
+    { "jump_to_next", 1, { OC_JMP },          _is_jump_to_next,  _remove_first,         0 },
+    { "zero_by_xor",  1, { OC_MOV },          _is_zeroing_mov,   _mov_to_xor,           0 },
+};
+
+#define RULES_COUNT  (int)(sizeof(rules) / sizeof(rules[0]))
+
+int asm_peephole_optimize(asm_listing *lst) {
+    // an array, so rules can look around and lines can be dropped cheaply
+    peephole_data pd;
+    pd.mempool = lst->mempool;
+    pd.lines_count = list_length(lst->lines);
+    pd.lines = malloc(sizeof(asm_line *) * (pd.lines_count + 1));
+    int n = 0;
+    for_list(lst->lines, asm_line, line)
+        pd.lines[n++] = line;
+
+    for (int r = 0; r < RULES_COUNT; r++)
+        rules[r].hits = 0;
+
+    int total = 0;
+    int changes;
+    int at[MAX_WINDOW];
+    do {
+        changes = 0;
+        for (int i = 0; i < pd.lines_count; i++) {
+            for (int r = 0; r < RULES_COUNT; r++) {
+                if (!_collect_window(&pd, i, &rules[r], at) || !rules[r].matches(&pd, at))
+                    continue;
+                rules[r].rewrite(&pd, at);
+                rules[r].hits++;
+                changes++;
+            }
+        }
+        total += changes;
+    } while (changes > 0);
+
+    if (total > 0) {
+        list_clear(lst->lines);
+        for (int i = 0; i < pd.lines_count; i++) {
+            if (pd.lines[i] != NULL)
+                list_add(lst->lines, pd.lines[i]);
+        }
+    }
+    free(pd.lines);
+    return total;
+}
+
+void asm_peephole_print_hits(FILE *stream) {
+    for (int r = 0; r < RULES_COUNT; r++)
+        fprintf(stream, "    %-14s %d\n", rules[r].name, rules[r].hits);
+}
+
+
+#ifdef INCLUDE_UNIT_TESTS
+static asm_listing *_listing_of(mempool *mp, int count, ...) {
+    asm_listing *lst = new_asm_listing(mp);
+    va_list vl;
+    va_start(vl, count);
+    for (int i = 0; i < count; i++)
+        lst->ops->add_line(lst, va_arg(vl, asm_line *));
+    va_end(vl);
+    return lst;
+}
+
+static instr_code _op_at(asm_listing *lst, int index) {
+    asm_line *line = list_get(lst->lines, index);
+    return line->per_type.instruction->operation;
+}
+
+void asm_peephole_unit_tests() {
+    mempool *mp = new_mempool();
+    asm_listing *lst;
+    asm_instruction *instr;
+
+    // store then reload becomes a register move, the move to self disappears
+    lst = _listing_of(mp, 4,
+        new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_mem_by_reg(mp, REG_BP, -4), new_asm_operand_reg(mp, REG_AX)),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_CX), new_asm_operand_mem_by_reg(mp, REG_BP, -4)),
+        new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_DX, REG_DX),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 2);
+    assert(list_length(lst->lines) == 3);
+    instr = ((asm_line *)list_get(lst->lines, 1))->per_type.instruction;
+    assert(instr->operation == OC_MOV);
+    assert(instr->regmem_operand.is_register && instr->regmem_operand.per_type.reg == REG_CX);
+    assert(instr->regimm_operand.is_register && instr->regimm_operand.per_type.reg == REG_AX);
+
+    // push/pop pairs become moves, or nothing at all
+    lst = _listing_of(mp, 5,
+        new_asm_line_instruction_with_operand(mp, OC_PUSH, new_asm_operand_imm(mp, 5)),
+        new_asm_line_instruction_for_register(mp, OC_POP, REG_AX),
+        new_asm_line_instruction_for_register(mp, OC_PUSH, REG_BX),
+        new_asm_line_instruction_for_register(mp, OC_POP, REG_BX),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 2);
+    assert(list_length(lst->lines) == 2);
+    instr = ((asm_line *)list_get(lst->lines, 0))->per_type.instruction;
+    assert(instr->operation == OC_MOV);
+    assert(instr->regimm_operand.is_immediate && instr->regimm_operand.per_type.immediate == 5);
+
+    // zeroing by XOR only where the flags are not needed, labels stay in place
+    lst = new_asm_listing(mp);
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_reg(mp, OC_CMP, REG_AX, REG_BX));
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_AX, 0));
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_JEQ, new_asm_operand_mem_by_sym(mp, "L1")));
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_AX, 0));
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_JMP, new_asm_operand_mem_by_sym(mp, "L1")));
+    lst->ops->set_next_label(lst, "L1");
+    lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 2);
+    assert(list_length(lst->lines) == 5);
+    assert(_op_at(lst, 1) == OC_MOV);
+    assert(_op_at(lst, 3) == OC_XOR);
+    assert(_op_at(lst, 4) == OC_RET);
+    assert(str_cmps(((asm_line *)list_get(lst->lines, 4))->label, "L1") == 0);
+
+    // a conditional move reads the flags just like a conditional jump
+    lst = _listing_of(mp, 4,
+        new_asm_line_instruction_reg_reg(mp, OC_CMP, REG_AX, REG_BX),
+        new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_DX, 0),
+        new_asm_line_instruction_reg_reg(mp, OC_CMOVLT, REG_DX, REG_CX),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 0);
+    assert(_op_at(lst, 1) == OC_MOV);
+
+    // adding zero still sets the flags, keep it when a Jcc or CMOVcc follows
+    lst = _listing_of(mp, 3,
+        new_asm_line_instruction_reg_imm(mp, OC_ADD, REG_AX, 0),
+        new_asm_line_instruction_with_operand(mp, OC_JEQ, new_asm_operand_mem_by_sym(mp, "L1")),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 0);
+    assert(list_length(lst->lines) == 3);
+    lst = _listing_of(mp, 3,
+        new_asm_line_instruction_reg_imm(mp, OC_SUB, REG_AX, 0),
+        new_asm_line_instruction_reg_reg(mp, OC_CMOVNE, REG_AX, REG_CX),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 0);
+    assert(list_length(lst->lines) == 3);
+
+    // ...but not when the flags are written again, or lost over a call, before any read
+    lst = _listing_of(mp, 7,
+        new_asm_line_instruction_reg_imm(mp, OC_ADD, REG_SP, 0),
+        new_asm_line_instruction_reg_reg(mp, OC_CMP, REG_AX, REG_BX),
+        new_asm_line_instruction_with_operand(mp, OC_JEQ, new_asm_operand_mem_by_sym(mp, "L1")),
+        new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_AX, 0),
+        new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_sym(mp, "g")),
+        new_asm_line_instruction_with_operand(mp, OC_JNE, new_asm_operand_mem_by_sym(mp, "L1")),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 2);
+    assert(list_length(lst->lines) == 6);
+    assert(_op_at(lst, 0) == OC_CMP);
+    assert(_op_at(lst, 2) == OC_XOR);
+
+    // flags are not followed through an unconditional jump
+    lst = _listing_of(mp, 3,
+        new_asm_line_instruction_reg_imm(mp, OC_ADD, REG_AX, 0),
+        new_asm_line_instruction_with_operand(mp, OC_JMP, new_asm_operand_mem_by_sym(mp, "L1")),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 0);
+
+    // a 32 bits move to self clears the upper half, the 16 bits one is a no-op
+    lst = _listing_of(mp, 3,
+        new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_EAX, REG_EAX),
+        new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_CX, REG_CX),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 1);
+    assert(list_length(lst->lines) == 2);
+    assert(_op_at(lst, 0) == OC_MOV);
+
+    // reloading the register just stored leaves the store alone
+    lst = _listing_of(mp, 3,
+        new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_mem_by_reg(mp, REG_BP, -8), new_asm_operand_reg(mp, REG_AX)),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_AX), new_asm_operand_mem_by_reg(mp, REG_BP, -8)),
+        new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 1);
+    assert(list_length(lst->lines) == 2);
+    assert(_op_at(lst, 0) == OC_MOV && _op_at(lst, 1) == OC_RET);
+
+    // a jump to the next line goes, its label is kept for the other jumps
+    lst = new_asm_listing(mp);
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_JMP, new_asm_operand_mem_by_sym(mp, "L3")));
+    lst->ops->set_next_label(lst, "L3");
+    lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_RET));
+    assert(asm_peephole_optimize(lst) == 1);
+    assert(list_length(lst->lines) == 1);
+    assert(_op_at(lst, 0) == OC_RET);
+    assert(str_cmps(((asm_line *)list_get(lst->lines, 0))->label, "L3") == 0);
+
+    // an instruction after a label may be reached from elsewhere, no window across it
+    lst = new_asm_listing(mp);
+    lst->ops->add_line(lst, new_asm_line_instruction_for_register(mp, OC_PUSH, REG_AX));
+    lst->ops->set_next_label(lst, "L2");
+    lst->ops->add_line(lst, new_asm_line_instruction_for_register(mp, OC_POP, REG_CX));
+    assert(asm_peephole_optimize(lst) == 0);
+    assert(list_length(lst->lines) == 2);
+
+    mempool_release(mp);
+}
+#endif
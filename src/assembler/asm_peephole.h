@@ -0,0 +1,15 @@
+#pragma once
+#include <stdio.h>
+#include "asm_listing.h"
+
+// rewrites short instruction sequences of the listing into cheaper ones,
+// returns the number of rewrites performed
+int asm_peephole_optimize(asm_listing *lst);
+
+// prints how many times each rule was applied by the last run
+void asm_peephole_print_hits(FILE *stream);
+
+
+#ifdef INCLUDE_UNIT_TESTS
+void asm_peephole_unit_tests();
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "../utils.h"
 #include "../run_info.h"
 #include "../linker/symbol_table.h"
@@ -9,6 +10,7 @@
 #include "asm_line.h"
 #include "asm_listing.h"
 #include "assembler.h"
+#include "parse_asm.h"
 #include "../linker/linker.h"
 #include "../elf/elf64_contents.h"
 
@@ -81,6 +83,7 @@ static bool verify_instructions() {
     VERIFY_INSTR1_REGISTER(OC_DEC,  REG_DI, "\xFF\xCF", 2);
     VERIFY_INSTR1_REGISTER(OC_NOT,  REG_DX, "\xf7\xd2", 2);
     VERIFY_INSTR1_REGISTER(OC_NEG,  REG_DX, "\xf7\xda", 2);
+    VERIFY_INSTR1_REGISTER(OC_IMUL, REG_CX, "\xf7\xe9", 2);
     VERIFY_INSTR1_REGISTER(OC_CALL, REG_AX, "\xff\xd0", 2);
 
     // modify dword pointed by register
@@ -120,6 +123,8 @@ static bool verify_instructions() {
     VERIFY_INSTR2_REG_REG(OC_AND, REG_AX, REG_DX, "\x21\xD0", 2);
     VERIFY_INSTR2_REG_REG(OC_OR,  REG_AX, REG_DX, "\x09\xD0", 2);
     VERIFY_INSTR2_REG_REG(OC_XOR, REG_AX, REG_DX, "\x31\xD0", 2);
+    VERIFY_INSTR2_REG_REG(OC_CMP, REG_AX, REG_DX, "\x39\xD0", 2);
+    VERIFY_INSTR2_REG_REG(OC_TEST, REG_CX, REG_CX, "\x85\xC9", 2);
 
     VERIFY_INSTR2_REG_IMMEDIATE(OC_MOV, REG_DX, 0x0,        "\xC7\xC2\x00\x00\x00\x00", 6);
     VERIFY_INSTR2_REG_IMMEDIATE(OC_MOV, REG_DX, 0x1,        "\xC7\xC2\x01\x00\x00\x00", 6);
@@ -128,6 +133,7 @@ static bool verify_instructions() {
     VERIFY_INSTR2_REG_IMMEDIATE(OC_SUB, REG_DX, 0x200,      "\x81\xEA\x00\x02\x00\x00", 6);
     VERIFY_INSTR2_REG_IMMEDIATE(OC_SHR, REG_DX, 0x3,        "\xC1\xEA\x03", 3);
     VERIFY_INSTR2_REG_IMMEDIATE(OC_SHL, REG_DX, 0x6,        "\xC1\xE2\x06", 3);
+    VERIFY_INSTR2_REG_IMMEDIATE(OC_SAR, REG_DX, 0x3,        "\xC1\xFA\x03", 3);
     VERIFY_INSTR2_REG_IMMEDIATE(OC_AND, REG_DX, 0xFF00,     "\x81\xE2\x00\xFF\x00\x00", 6);
     VERIFY_INSTR2_REG_IMMEDIATE(OC_OR,  REG_DX, 0xFF00,     "\x81\xCA\x00\xFF\x00\x00", 6);
     VERIFY_INSTR2_REG_IMMEDIATE(OC_XOR, REG_DX, 0x5555,     "\x81\xF2\x55\x55\x00\x00", 6);
@@ -445,3 +451,164 @@ static void test_create_hello_world_executable3() {
     // modules->v->add(modules, c);
     // x86_link(modules, 0x8048000, "hello.elf");
 }
+
+
+// ------------------------------------------------------------------
+// throughput of the encoders, on a mix of what the code generator emits
+
+#define BENCH_ENCODER_ROUNDS     10000
+#define BENCH_ASSEMBLER_ROUNDS   20
+#define BENCH_LISTING_REPEATS    1000  // functions in the module
+#define BENCH_STRESS_LABELS      50000
+
+static double _seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void _add_benchmark_mix_i386(mempool *mp, list *instructions) {
+    asm_line *lines[] = {
+        new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_AX), new_asm_operand_mem_by_reg(mp, REG_BP, 8)),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_mem_by_reg(mp, REG_BP, -4), new_asm_operand_reg(mp, REG_AX)),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_BX), new_asm_operand_imm(mp, 0x1234)),
+        new_asm_line_instruction_with_operands(mp, OC_ADD, new_asm_operand_reg(mp, REG_AX), new_asm_operand_reg(mp, REG_BX)),
+        new_asm_line_instruction_with_operands(mp, OC_SUB, new_asm_operand_reg(mp, REG_AX), new_asm_operand_imm(mp, 5)),
+        new_asm_line_instruction_with_operands(mp, OC_CMP, new_asm_operand_reg(mp, REG_AX), new_asm_operand_mem_by_reg(mp, REG_BP, 12)),
+        new_asm_line_instruction_with_operand(mp, OC_JLT, new_asm_operand_mem_by_sym(mp, "label")),
+        new_asm_line_instruction_with_operand(mp, OC_PUSH, new_asm_operand_reg(mp, REG_BX)),
+        new_asm_line_instruction_with_operand(mp, OC_POP, new_asm_operand_reg(mp, REG_BX)),
+        new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_sym(mp, "func")),
+        new_asm_line_instruction_with_operands(mp, OC_XOR, new_asm_operand_reg(mp, REG_DX), new_asm_operand_reg(mp, REG_DX)),
+        new_asm_line_instruction(mp, OC_RET),
+    };
+    for (int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++)
+        list_add(instructions, lines[i]->per_type.instruction);
+}
+
+static void _add_benchmark_mix_x86_64(mempool *mp, asm_listing *lst, int index) {
+    lst->ops->set_next_label(lst, "top_%d", index);
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_mem(mp, OC_MOV, REG_RAX, REG_RBP));
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_mem_by_reg(mp, REG_RBP, -8), new_asm_operand_reg(mp, REG_RAX)));
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_RBX, 0x1234));
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_reg(mp, OC_ADD, REG_RAX, REG_RBX));
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_imm(mp, OC_SUB, REG_RSP, 16));
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_imm(mp, OC_CMP, REG_RAX, 5));
+    char top[32];
+    snprintf(top, sizeof(top), "top_%d", index);
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_JLT, new_asm_operand_mem_by_sym(mp, top)));
+    lst->ops->add_line(lst, new_asm_line_instruction_for_register(mp, OC_PUSH, REG_RBX));
+    lst->ops->add_line(lst, new_asm_line_instruction_for_register(mp, OC_POP, REG_RBX));
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_sym(mp, "func")));
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_reg(mp, OC_XOR, REG_RAX, REG_RAX));
+    lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_RET));
+}
+
+// half the labels are global functions, half are data, like a big generated module
+static asm_listing *_symbols_stress_listing(mempool *mp, int labels) {
+    asm_listing *lst = new_asm_listing(mp);
+    for (int i = 0; i < labels / 2; i++)
+        lst->ops->add_line(lst, new_asm_line_directive_global(mp, new_strf(mp, "func_%d", i)));
+    for (int i = 0; i < labels / 2; i++) {
+        lst->ops->set_next_label(lst, "func_%d", i);
+        lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_RET));
+    }
+    lst->ops->add_line(lst, new_asm_line_directive_section(mp, new_str(mp, ".data")));
+    for (int i = 0; i < labels / 2; i++)
+        lst->ops->add_line(lst, new_asm_line_data_definition(mp, new_strf(mp, "var_%d", i), DATA_QWORD, 1, new_bin_from_zeros(mp, 8)));
+    return lst;
+}
+
+void perform_asm_benchmark() {
+    mempool *mp = new_mempool();
+    struct timespec start;
+
+    // the table driven i386 encoder, instruction by instruction
+    list *instructions = new_list(mp);
+    _add_benchmark_mix_i386(mp, instructions);
+    bin *code = new_bin(mp);
+    reloc_list *relocs = new_reloc_list();
+    x86_encoder *enc = new_x86_encoder(mp, code, relocs);
+    long count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < BENCH_ENCODER_ROUNDS; round++) {
+        for_list(instructions, asm_instruction, instr) {
+            if (!enc->encode_v4(enc, instr))
+                return;
+            count++;
+        }
+        enc->reset(enc);
+    }
+    double secs = _seconds_since(&start);
+    printf("i386 encoder:     %8ld instructions in %.3f sec, %10.0f instructions/sec\n", count, secs, count / secs);
+
+    // the x86_64 assembler, whole listings, with local jumps to resolve,
+    // on one thread and on one per CPU
+    asm_listing *lst = new_asm_listing(mp);
+    for (int i = 0; i < BENCH_LISTING_REPEATS; i++)
+        _add_benchmark_mix_x86_64(mp, lst, i);
+    int saved_threads = run_info->options->asm_threads;
+    for (int threads = 1; threads >= 0; threads--) {
+        run_info->options->asm_threads = threads;
+        count = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int round = 0; round < BENCH_ASSEMBLER_ROUNDS; round++) {
+            mempool *round_mp = new_mempool();
+            assembler *as = new_assembler(round_mp);
+            if (as->ops->assemble_listing_into_x86_64_code(as, lst, new_str(round_mp, "bench.c")) == NULL)
+                return;
+            count += list_length(lst->lines);
+            mempool_release(round_mp);
+        }
+        secs = _seconds_since(&start);
+        printf("x86_64 assembler: %8ld instructions in %.3f sec, %10.0f instructions/sec, %s\n", 
+            count, secs, count / secs, threads == 1 ? "one thread" : "one thread per CPU");
+    }
+
+    // the text front end, what "--assemble" does short of saving the file:
+    // parse the printed listing, assemble it, prepare the ELF contents
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *f = open_memstream(&text, &text_len);
+    lst->ops->print(lst, f);
+    fclose(f);
+    run_info->options->asm_threads = 1;
+    count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < BENCH_ASSEMBLER_ROUNDS; round++) {
+        mempool *round_mp = new_mempool();
+        asm_listing *parsed = new_asm_listing(round_mp);
+        parsed->with_comments = false;
+        f = fmemopen(text, text_len, "r");
+        bool ok = parse_asm_stream(parsed, f, "bench.asm");
+        fclose(f);
+        assembler *as = new_assembler(round_mp);
+        obj_module *mod = ok ? as->ops->assemble_listing_into_x86_64_code(as, parsed, new_str(round_mp, "bench.asm")) : NULL;
+        if (mod == NULL)
+            return;
+        mod->ops->prepare_elf_contents(mod, ELF_TYPE_REL, round_mp);
+        count += list_length(parsed->lines);
+        mempool_release(round_mp);
+    }
+    secs = _seconds_since(&start);
+    printf("x86_64 from text: %8ld instructions in %.3f sec, %10.0f instructions/sec, %.1f MB/sec\n", 
+        count, secs, count / secs, text_len * BENCH_ASSEMBLER_ROUNDS / secs / 1e6);
+    free(text);
+    run_info->options->asm_threads = saved_threads;
+
+    // symbols, the time per label should stay the same as they grow
+    for (int labels = BENCH_STRESS_LABELS / 4; labels <= BENCH_STRESS_LABELS; labels *= 2) {
+        mempool *stress_mp = new_mempool();
+        asm_listing *stress = _symbols_stress_listing(stress_mp, labels);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        assembler *as = new_assembler(stress_mp);
+        if (as->ops->assemble_listing_into_x86_64_code(as, stress, new_str(stress_mp, "stress.c")) == NULL)
+            return;
+        secs = _seconds_since(&start);
+        printf("x86_64 symbols:   %8d labels       in %.3f sec, %10.0f nanosec/label\n", 
+            labels, secs, secs * 1e9 / labels);
+        mempool_release(stress_mp);
+    }
+
+    mempool_release(mp);
+}
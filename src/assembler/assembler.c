@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "assembler.h"
 #include "../err_handler.h"
 #include "../run_info.h"
@@ -13,6 +15,7 @@
 #include "asm_line.h"
 #include "asm_listing.h"
 #include "../utils/all.h"
+#include "../utils.h"
 #include "../elf/obj_module.h"
 
 
@@ -23,10 +26,35 @@ struct assembler_data {
     
     // for the current module getting assembled.
     asm_listing *asm_listing;
-    list *globals; // item type is "str"
-    list *externs; // item type is "str"
+    hashtable *globals; // names declared ".global", item is the name
+    hashtable *externs; // names declared ".extern", item is the name
     obj_module *module;
     obj_section *curr_sect;
+    int bytes_saved; // by picking shorter encodings, reported in verbose mode
+    int padding_bytes; // NOPs added for alignment, reported in verbose mode
+
+    // for resolving jumps to labels of the module, see relax_local_jumps()
+    int *jump_targets;       // per line, line index of the label a jump goes to, -1 if not local
+    asm_line **lines;        // the lines of the listing, by index
+    int line_index;          // of the line being assembled
+    int lines_count;
+    size_t *line_offsets;    // offset of each line in its fragment
+    int *line_alignments;    // per line, the boundary it must start at, 1 for none
+    u8 *jump_forms;          // per line, enum jump_form
+    list *jump_fixups;       // item is struct jump_fixup
+};
+
+enum jump_form {
+    JUMP_SHORT = 0,  // EB cb, 7x cb, resolved by us
+    JUMP_NEAR,       // E9 cd, 0F 8x cd, resolved by us
+    JUMP_RELOCATED,  // E9 cd, 0F 8x cd, resolved by the linker
+};
+
+struct jump_fixup {
+    int line_index;
+    int target_line_index;
+    size_t displacement_offset;
+    size_t instruction_end; // displacement is relative to this
 };
 
 static obj_module *assemble_listing_into_x86_64_code(assembler *as, asm_listing *asm_list, str *module_name);
@@ -73,9 +101,11 @@ void assemble_listing_into_i386_code(mempool *mp, asm_listing *asm_list, obj_cod
         }
     }
 
-    printf("Sample resulting machine code\n");
-    bin_print_hex(obj->text->contents, 0, 0, -1, stdout);
-    printf("\n");
+    if (run_info->options->verbose) {
+        printf("Sample resulting machine code\n");
+        bin_print_hex(obj->text->contents, 0, 0, -1, stdout);
+        printf("\n");
+    }
 }
 
 
@@ -86,9 +116,6 @@ int compare_str_with_charptr(const void *a, const void *b) {
     char *char_ptr = (char *)b;
     return strcmp(str_charptr(s_ptr), char_ptr) == 0;
 }
-static int compare_str(const void *a, const void *b) {
-    return str_cmp((str *)a, (str *)b);
-}
 static inline u8 mod_reg_rm(u8 mod, u8 reg, u8 rm) {
     return ((mod & 0x3) << 6) | ((reg & 0x7) << 3) | (rm & 0x7);
 }
@@ -171,6 +198,7 @@ static bool encode_size_prefix_bytes(asm_instruction *instr,
     *need_66 = false;
     *need_67 = false;
     *need_rex = false;
+    *rex_value = REX_BASE_VALUE; // extended registers may still need it, see encode_addressing_bytes()
 
     if (data_width == DATA_BYTE) {
         if (opcode_8bits < 0 || opcode_8bits > 0xFF) {
@@ -197,15 +225,25 @@ static bool encode_size_prefix_bytes(asm_instruction *instr,
     return true;
 }
 
+static inline bool fits_in_s8(long value) {
+    return value >= -128 && value <= 127;
+}
+
+// the displacement goes in one byte (need_displacement8) or four (need_displacement32)
 static bool encode_addressing_bytes(asm_reg_or_mem_operand *oper, u8 modregrm_reg, 
     u8 *modregrm_value, 
     u32 *displacement32_value,
     u8 *rex_value,
+    bool *need_displacement8, 
     bool *need_displacement32, 
-    bool *need_symbol_relocation
+    bool *need_symbol_relocation,
+    bool *need_sib,
+    u8 *sib_value
 ) {
+    *need_displacement8 = false;
     *need_displacement32 = false;
     *need_symbol_relocation = false;
+    *need_sib = false;
 
     u8 mod;
     u8 rm;
@@ -224,11 +262,18 @@ static bool encode_addressing_bytes(asm_reg_or_mem_operand *oper, u8 modregrm_re
 
     } else if (oper->is_memory_by_reg) { 
         // memory, pointed by register
-        if (oper->per_type.mem.displacement != 0) {
-            mod = MOD_10_INDIRECT_MEM_FOUR_BYTES_DISPL;
+        // mod 00 with BP (or R13) means RIP relative, they need a displacement
+        // [BP-n] is the most common operand we have, most n fit in a signed byte
+        if (oper->per_type.mem.displacement != 0 || (oper->per_type.mem.pointer_reg & 0x7) == 5) {
+            if (fits_in_s8(oper->per_type.mem.displacement)) {
+                mod = MOD_01_INDIRECT_MEM_ONE_BYTE_DISPL;
+                *need_displacement8 = true;
+            } else {
+                mod = MOD_10_INDIRECT_MEM_FOUR_BYTES_DISPL;
+                *need_displacement32 = true;
+            }
             rm = (oper->per_type.mem.pointer_reg & 0x7);
             *displacement32_value = oper->per_type.mem.displacement;
-            *need_displacement32 = true;
         } else {
             mod = MOD_00_INDIRECT_MEM_NO_DISPLACEMENT;
             rm = (oper->per_type.mem.pointer_reg & 0x7);
@@ -237,6 +282,28 @@ static bool encode_addressing_bytes(asm_reg_or_mem_operand *oper, u8 modregrm_re
             (*rex_value) |= REX_MODREGRM_RM_EXTESION;
         if (register_is_extended(modregrm_reg))
             (*rex_value) |= REX_MODREGRM_REG_EXTENSION;
+        if (oper->per_type.mem.array_item_size > 0) {
+            // scaled index, e.g. [RBX+RSI*4], goes in the SIB, rm says so
+            u8 scale;
+            switch (oper->per_type.mem.array_item_size) {
+                case 1: scale = 0; break;
+                case 2: scale = 1; break;
+                case 4: scale = 2; break;
+                case 8: scale = 3; break;
+                default:
+                    error("Array item size must be 1, 2, 4 or 8, not %d", oper->per_type.mem.array_item_size);
+                    return false;
+            }
+            *need_sib = true;
+            *sib_value = (scale << 6) | ((oper->per_type.mem.array_index_reg & 0x7) << 3) | rm;
+            if (register_is_extended(oper->per_type.mem.array_index_reg))
+                (*rex_value) |= REX_SIB_INDEX_EXTENSION;
+            rm = RM_100_SIB_IF_MOD_NOT_11;
+        } else if (rm == RM_100_SIB_IF_MOD_NOT_11) {
+            // SP (or R12) as pointer needs a SIB, with no index
+            *need_sib = true;
+            *sib_value = (SP << 3) | rm;
+        }
         *modregrm_value = mod_reg_rm(mod, modregrm_reg, rm);
     } else if (oper->is_mem_addr_by_symbol) { 
         // memory, address of a symbol
@@ -266,15 +333,25 @@ static bool encode_immediate_info(asm_instruction *instr, bool *need_immediate,
     return true;
 }
 
+// two bytes opcodes are given with their escape byte, e.g. 0x0FAF for "0F AF"
+static void add_opcode_bytes(bin *contents, int opcode_value) {
+    if (opcode_value > 0xFF)
+        bin_add_byte(contents, (u8)(opcode_value >> 8));
+    bin_add_byte(contents, (u8)opcode_value);
+}
+
 static bool encode_instruction_with_regmem_operand(assembler_data *ad, asm_line *line, 
-        u8 opcode_8bits, u8 opcode_16plus, int opcode_ext,
+        int opcode_8bits, int opcode_16plus, int opcode_ext,
         asm_reg_or_mem_operand *operand) {
 
     bool need_66;
     bool need_67;
     bool need_rex;
+    bool need_displacement8;
     bool need_displacement32;
     bool need_symbol_relocation;
+    bool need_sib;
+    u8 sib_value;
     u8 rex_value;
     int opcode_value;
     u8 modregrm_value;
@@ -286,36 +363,46 @@ static bool encode_instruction_with_regmem_operand(assembler_data *ad, asm_line
         
     if (!encode_addressing_bytes(
             operand, opcode_ext, &modregrm_value, &displacement32_value, &rex_value, 
-            &need_displacement32, &need_symbol_relocation))
+            &need_displacement8, &need_displacement32, &need_symbol_relocation, &need_sib, &sib_value))
         return false;
+    need_rex = need_rex || rex_value != REX_BASE_VALUE;
 
     if (need_67)  bin_add_byte(ad->curr_sect->contents, 0x67);
     if (need_66)  bin_add_byte(ad->curr_sect->contents, 0x66);
     if (need_rex) bin_add_byte(ad->curr_sect->contents, rex_value);
-    bin_add_byte(ad->curr_sect->contents, (u8)opcode_value);
+    add_opcode_bytes(ad->curr_sect->contents, opcode_value);
     bin_add_byte(ad->curr_sect->contents, modregrm_value);
+    if (need_sib) bin_add_byte(ad->curr_sect->contents, sib_value);
     if (need_symbol_relocation) {
         str *name = new_str(ad->mempool, operand->per_type.mem.displacement_symbol_name);
         size_t offs = bin_len(ad->curr_sect->contents);
         ad->curr_sect->ops->add_relocation(ad->curr_sect, offs, name, 2, -4);
     }
+    if (need_displacement8) {
+        bin_add_byte(ad->curr_sect->contents, (u8)displacement32_value);
+        ad->bytes_saved += 3;
+    }
     if (need_displacement32) {
         bin_add_dword(ad->curr_sect->contents, displacement32_value);
     }
+    return true;
 }
 
 static bool encode_instruction_with_two_operands(assembler_data *ad, asm_line *line,
     int opcode_8bits_reg_to_rm, int opcode_16plus_reg_to_rm,
     int opcode_8bits_rm_to_reg, int opcode_16plus_rm_to_reg,
-    int opcode_8bits_imm, int opcode_16plus_imm,
+    int opcode_8bits_imm, int opcode_16plus_imm, int opcode_16plus_imm8,
     int opcode_extension_for_imm
 ) {
     bool need_66;
     bool need_67;
     bool need_rex;
+    bool need_displacement8;
     bool need_displacement32;
     bool need_symbol_relocation;
     bool need_immediate;
+    bool need_sib;
+    u8 sib_value;
     u8 rex_value;
     int opcode_value;
     u8 modregrm_value;
@@ -327,9 +414,14 @@ static bool encode_instruction_with_two_operands(assembler_data *ad, asm_line *l
     int opcode_8bits;
     int opcode_16plus;
     int modregrm_reg;
+    bool short_immediate = false;
     if (asm_instruction_has_immediate(inst)) {
+        // e.g. "83/5 ib" is "SUB rm16/32/64, imm8", sign extended
+        short_immediate = opcode_16plus_imm8 >= 0 && 
+            asm_instruction_data_size(inst) != DATA_BYTE &&
+            fits_in_s8(inst->regimm_operand.per_type.immediate);
         opcode_8bits  = opcode_8bits_imm;
-        opcode_16plus = opcode_16plus_imm;
+        opcode_16plus = short_immediate ? opcode_16plus_imm8 : opcode_16plus_imm;
         modregrm_reg  = opcode_extension_for_imm;
     } else if (inst->direction_regmem_to_regimm) {
         opcode_8bits  = opcode_8bits_rm_to_reg;
@@ -352,24 +444,34 @@ static bool encode_instruction_with_two_operands(assembler_data *ad, asm_line *l
 
     if (!encode_addressing_bytes(&inst->regmem_operand, modregrm_reg, 
             &modregrm_value, &displacement32_value, &rex_value, 
-            &need_displacement32, &need_symbol_relocation))
+            &need_displacement8, &need_displacement32, &need_symbol_relocation, &need_sib, &sib_value))
         return false;
+    need_rex = need_rex || rex_value != REX_BASE_VALUE;
     
     if (!encode_immediate_info(inst, &need_immediate, &immediate_size))
         return false;
+    if (short_immediate) {
+        ad->bytes_saved += (immediate_size == DATA_WORD) ? 1 : 3;
+        immediate_size = DATA_BYTE;
+    }
 
     // start adding bytes and relocation if needed
     if (need_67)  bin_add_byte(ad->curr_sect->contents, 0x67);
     if (need_66)  bin_add_byte(ad->curr_sect->contents, 0x66);
     if (need_rex) bin_add_byte(ad->curr_sect->contents, rex_value);
     
-    bin_add_byte(ad->curr_sect->contents, (u8)opcode_value);
+    add_opcode_bytes(ad->curr_sect->contents, opcode_value);
     bin_add_byte(ad->curr_sect->contents, modregrm_value);
+    if (need_sib) bin_add_byte(ad->curr_sect->contents, sib_value);
     if (need_symbol_relocation) {
         str *name = new_str(ad->mempool, inst->regmem_operand.per_type.mem.displacement_symbol_name);
         size_t offs = bin_len(ad->curr_sect->contents);
         ad->curr_sect->ops->add_relocation(ad->curr_sect, offs, name, 2, -4);
     }
+    if (need_displacement8) {
+        bin_add_byte(ad->curr_sect->contents, (u8)displacement32_value);
+        ad->bytes_saved += 3;
+    }
     if (need_displacement32) {
         bin_add_dword(ad->curr_sect->contents, displacement32_value);
     }
@@ -383,6 +485,35 @@ static bool encode_instruction_with_two_operands(assembler_data *ad, asm_line *l
         else if (immediate_size == DATA_QWORD)
             bin_add_qword(ad->curr_sect->contents, (u64)inst->regimm_operand.per_type.immediate);
     }
+    return true;
+}
+
+static bool encode_mov_register_immediate(assembler_data *ad, asm_instruction *instr) {
+    // B0+r ib, B8+r iw/id, the register is in the opcode, there is no ModRegRm.
+    // a 64 bits register gets the 32 bits form, writing a 32 bits register
+    // zeroes the upper half for free. negative values need the sign extension
+    // of REX.W C7/0 instead, we don't do the 10 bytes "B8+r io" either.
+    gp_register reg = instr->regmem_operand.per_type.reg;
+    s32 value = instr->regimm_operand.per_type.immediate;
+    data_size width = register_data_size(reg);
+    if (width == DATA_QWORD && value < 0)
+        return false;
+
+    if (width == DATA_WORD)
+        bin_add_byte(ad->curr_sect->contents, 0x66);
+    if (register_is_extended(reg))
+        bin_add_byte(ad->curr_sect->contents, REX_BASE_VALUE + REX_MODREGRM_RM_EXTESION);
+    bin_add_byte(ad->curr_sect->contents, (width == DATA_BYTE ? 0xB0 : 0xB8) + (reg & 0x7));
+    if (width == DATA_BYTE)
+        bin_add_byte(ad->curr_sect->contents, (u8)value);
+    else if (width == DATA_WORD)
+        bin_add_word(ad->curr_sect->contents, (u16)value);
+    else
+        bin_add_dword(ad->curr_sect->contents, (u32)value);
+
+    // the ModRegRm byte, plus the REX if it was there only for REX.W
+    ad->bytes_saved += (width == DATA_QWORD && !register_is_extended(reg)) ? 2 : 1;
+    return true;
 }
 
 static bool encode_simple_instruction_with_symbol32(assembler_data *ad, asm_line *line,
@@ -412,27 +543,223 @@ static bool encode_simple_instruction_with_symbol32(assembler_data *ad, asm_line
 
 
 
+static int jump_condition_code(instr_code op) {
+    // the "cc" part of 7x and 0F 8x
+    switch (op) {
+        case OC_JEQ: return 0x4;
+        case OC_JNE: return 0x5;
+        case OC_JAB: return 0x7;
+        case OC_JAE: return 0x3;
+        case OC_JBL: return 0x2;
+        case OC_JBE: return 0x6;
+        case OC_JGT: return 0xF;
+        case OC_JGE: return 0xD;
+        case OC_JLT: return 0xC;
+        case OC_JLE: return 0xE;
+        default:     return -1;
+    }
+}
+
+static int move_condition_code(instr_code op) {
+    // the "cc" part of 0F 4x, the same as the jump on that condition.
+    // not in jump_condition_code(), that one also tells which lines are jumps
+    switch (op) {
+        case OC_CMOVEQ: return jump_condition_code(OC_JEQ);
+        case OC_CMOVNE: return jump_condition_code(OC_JNE);
+        case OC_CMOVAB: return jump_condition_code(OC_JAB);
+        case OC_CMOVAE: return jump_condition_code(OC_JAE);
+        case OC_CMOVBL: return jump_condition_code(OC_JBL);
+        case OC_CMOVBE: return jump_condition_code(OC_JBE);
+        case OC_CMOVGT: return jump_condition_code(OC_JGT);
+        case OC_CMOVGE: return jump_condition_code(OC_JGE);
+        case OC_CMOVLT: return jump_condition_code(OC_JLT);
+        case OC_CMOVLE: return jump_condition_code(OC_JLE);
+        default:        return -1;
+    }
+}
+
+static bool encode_indirect_branch(assembler_data *ad, asm_line *line, int opcode_ext) {
+    /*  FF/2 call rm64, FF/4 jmp rm64
+        near branches are always 64 bits, there is no REX.W and no 66, whatever register is named */
+    asm_instruction near = *line->per_type.instruction;
+    asm_line near_line = *line;
+    if (near.regmem_operand.is_register) {
+        gp_register reg = near.regmem_operand.per_type.reg;
+        near.regmem_operand.per_type.reg = (register_is_extended(reg) ? REG_R8D : REG_EAX) + (reg & 0x7);
+    }
+    near.operands_data_size = DATA_DWORD;
+    near_line.per_type.instruction = &near;
+    return encode_instruction_with_regmem_operand(ad, &near_line, -1, 0xFF, opcode_ext, &near.regmem_operand);
+}
+
+static bool encode_jump(assembler_data *ad, asm_line *line) {
+    /*  EB cb     JMP rel8       7x cb     Jcc rel8
+        E9 cd     JMP rel32      0F 8x cd  Jcc rel32
+        labels of this module get their displacement after the pass, 
+        the rest get a relocation for the linker */
+    asm_instruction *instr = line->per_type.instruction;
+    if (!instr->regmem_operand.is_mem_addr_by_symbol) {
+        if (instr->operation == OC_JMP)
+            return encode_indirect_branch(ad, line, 4); // e.g. a tail call through a pointer
+        error("Conditional jumps only support memory by symbol");
+        return false;
+    }
+    char *target = instr->regmem_operand.per_type.mem.displacement_symbol_name;
+    bool conditional = instr->operation != OC_JMP;
+    int cc = jump_condition_code(instr->operation);
+
+    int target_index = ad->jump_targets[ad->line_index];
+    if (target_index == -1)
+        ad->jump_forms[ad->line_index] = JUMP_RELOCATED;
+
+    if (ad->jump_forms[ad->line_index] == JUMP_RELOCATED)
+        return encode_simple_instruction_with_symbol32(ad, line, 
+            conditional ? 0x0F : -1, conditional ? 0x80 + cc : 0xE9, target);
+
+    struct jump_fixup *f = mpalloc(ad->mempool, struct jump_fixup);
+    f->line_index = ad->line_index;
+    f->target_line_index = target_index;
+    if (ad->jump_forms[ad->line_index] == JUMP_SHORT) {
+        bin_add_byte(ad->curr_sect->contents, conditional ? 0x70 + cc : 0xEB);
+        f->displacement_offset = bin_len(ad->curr_sect->contents);
+        bin_add_byte(ad->curr_sect->contents, 0);
+        ad->bytes_saved += conditional ? 4 : 3;
+    } else {
+        if (conditional)
+            bin_add_byte(ad->curr_sect->contents, 0x0F);
+        bin_add_byte(ad->curr_sect->contents, conditional ? 0x80 + cc : 0xE9);
+        f->displacement_offset = bin_len(ad->curr_sect->contents);
+        bin_add_dword(ad->curr_sect->contents, 0);
+    }
+    f->instruction_end = bin_len(ad->curr_sect->contents);
+    list_add(ad->jump_fixups, f);
+    return true;
+}
+
+static bool encode_shift(assembler_data *ad, asm_line *line, int opcode_ext) {
+    /*  D0/n, D1/n     shift rm by one
+        C0/n, C1/n ib  shift rm by imm8
+        D2/n, D3/n     shift rm by CL
+        the count is a byte whatever the operand size, so the size comes from rm only */
+    asm_instruction *instr = line->per_type.instruction;
+    asm_instruction single = *instr;
+    asm_line single_line = *line;
+    single.regimm_operand.is_immediate = false;
+    single.regimm_operand.is_register = false;
+    single_line.per_type.instruction = &single;
+
+    if (instr->regimm_operand.is_immediate) {
+        s32 count = instr->regimm_operand.per_type.immediate;
+        if (count == 1) {
+            ad->bytes_saved += 1;
+            return encode_instruction_with_regmem_operand(ad, &single_line, 0xD0, 0xD1, opcode_ext, &single.regmem_operand);
+        }
+        if (!encode_instruction_with_regmem_operand(ad, &single_line, 0xC0, 0xC1, opcode_ext, &single.regmem_operand))
+            return false;
+        bin_add_byte(ad->curr_sect->contents, (u8)count);
+        return true;
+    }
+
+    gp_register count_reg = instr->regimm_operand.per_type.reg;
+    if (!instr->regimm_operand.is_register || (count_reg & 0x7) != CX || register_is_extended(count_reg)) {
+        error("Shifts take their count as an immediate or in CL");
+        return false;
+    }
+    return encode_instruction_with_regmem_operand(ad, &single_line, 0xD2, 0xD3, opcode_ext, &single.regmem_operand);
+}
+
+// for instructions that only write to the reg part of the ModRegRm, e.g. "CMOVLT r, rm"
+static bool encode_register_from_regmem(assembler_data *ad, asm_line *line, int opcode) {
+    asm_instruction *instr = line->per_type.instruction;
+    if (!instr->regimm_operand.is_register || 
+        (!instr->direction_regmem_to_regimm && !instr->regmem_operand.is_register)) {
+        error("%s needs a register target", instr_code_name(instr->operation));
+        return false;
+    }
+
+    // "reg <- reg" has the target in rm, swap them the way "reg <- mem" has it
+    asm_instruction swapped = *instr;
+    asm_line swapped_line = *line;
+    if (!instr->direction_regmem_to_regimm) {
+        swapped.regmem_operand.per_type.reg = instr->regimm_operand.per_type.reg;
+        swapped.regimm_operand.per_type.reg = instr->regmem_operand.per_type.reg;
+        swapped.direction_regmem_to_regimm = true;
+    }
+    swapped_line.per_type.instruction = &swapped;
+    return encode_instruction_with_two_operands(ad, &swapped_line, -1, -1, -1, opcode, -1, -1, -1, -1);
+}
+
+static bool encode_accumulator_operation(assembler_data *ad, asm_line *line, int opcode_ext) {
+    /*  F6/4, F7/4  mul rm,  DX:AX = AX * rm
+        F6/6, F7/6  div rm,  AX = DX:AX / rm, DX = DX:AX % rm
+        the listing may name the accumulator too, e.g. "MUL AX, CX", the operand is the other one */
+    asm_instruction *instr = line->per_type.instruction;
+    if (!instr->regimm_operand.is_register)
+        return encode_instruction_with_regmem_operand(ad, line, 0xF6, 0xF7, opcode_ext, &instr->regmem_operand);
+
+    gp_register accumulator = instr->direction_regmem_to_regimm ?
+        instr->regimm_operand.per_type.reg : instr->regmem_operand.per_type.reg;
+    if ((accumulator & 0x7) != AX || register_is_extended(accumulator) ||
+        (!instr->direction_regmem_to_regimm && !instr->regmem_operand.is_register)) {
+        error("%s works on the accumulator only", instr_code_name(instr->operation));
+        return false;
+    }
+
+    asm_instruction single = *instr;
+    asm_line single_line = *line;
+    if (!instr->direction_regmem_to_regimm)
+        single.regmem_operand.per_type.reg = instr->regimm_operand.per_type.reg;
+    single.regimm_operand.is_register = false;
+    single.operands_data_size = register_data_size(accumulator);
+    single_line.per_type.instruction = &single;
+    return encode_instruction_with_regmem_operand(ad, &single_line, 0xF6, 0xF7, opcode_ext, &single.regmem_operand);
+}
+
+static bool encode_imul(assembler_data *ad, asm_line *line) {
+    /*  F6/5, F7/5     imul rm, DX:AX = AX * rm
+        0F AF/r        imul r <- rm
+        6B/r ib        imul r <- r * imm8, sign extended
+        69/r iw/id     imul r <- r * imm16/32 */
+    asm_instruction *instr = line->per_type.instruction;
+    if (!instr->regimm_operand.is_register && !instr->regimm_operand.is_immediate)
+        return encode_instruction_with_regmem_operand(ad, line, 0xF6, 0xF7, 5, &instr->regmem_operand);
+
+    if (!instr->regmem_operand.is_register && !instr->direction_regmem_to_regimm) {
+        error("IMUL cannot write to memory");
+        return false;
+    }
+    if (instr->regimm_operand.is_immediate) {
+        // the three operands form, with the target register as the source too
+        return encode_instruction_with_two_operands(ad, line, -1, -1, -1, -1, -1, 0x69, 0x6B,
+            instr->regmem_operand.per_type.reg);
+    }
+
+    return encode_register_from_regmem(ad, line, 0x0FAF);
+}
+
 // assembles the instruction line into the current section of the current module.
 static void encode_instruction_line_x86_64(assembler_data *ad, asm_line *line) {
     // ref: http://ref.x86asm.net/coder64-abc.html#M
 
-    // register the symbol, if public
-    if (line->label != NULL) {
-        bool is_global = list_find_first(ad->globals, compare_str, line->label) != -1;
-        ad->curr_sect->ops->add_symbol(ad->curr_sect, line->label, bin_len(ad->curr_sect->contents), 0, is_global);
-    }
-
     asm_instruction *instr = line->per_type.instruction;
     data_size data_width = asm_instruction_data_size(instr);
     bool has_immediate = asm_instruction_has_immediate(instr);
 
     switch (instr->operation) {
+        case OC_NONE:
+            // comment lines, their label (if any) is registered by the caller
+            break;
         case OC_RET:
             bin_add_byte(ad->curr_sect->contents, 0xC3);
             break;
         case OC_NOP:
             bin_add_byte(ad->curr_sect->contents, 0x90);
             break;
+        case OC_SYSCALL:
+            // 0F 05, number in RAX, arguments in RDI, RSI, RDX, R10, R8, R9
+            bin_add_byte(ad->curr_sect->contents, 0x0F);
+            bin_add_byte(ad->curr_sect->contents, 0x05);
+            break;
         case OC_MOV:
             /*  88/r mov rm8 <- r8
                 89/r mov rm16/32/64 <- r16/32/64
@@ -442,18 +769,87 @@ static void encode_instruction_line_x86_64(assembler_data *ad, asm_line *line) {
                 B8+r mov r16/32/64 <- imm16/32/64
                 C6/0 mov rm8 <- imm8
                 C7/0 mov rm16/32/64 <- imm16/32/64 */
-            if (has_immediate) {
-                encode_instruction_with_two_operands(ad, line, 0x88, 0x89, 0x8A, 0x8B, 0xC6, 0xC7, 0);
-            } else {
-                encode_instruction_with_two_operands(ad, line, 0x88, 0x89, 0x8A, 0x8B, 0xC6, 0xC7, 0);
+            if (has_immediate && instr->regmem_operand.is_register && encode_mov_register_immediate(ad, instr))
+                break;
+            encode_instruction_with_two_operands(ad, line, 0x88, 0x89, 0x8A, 0x8B, 0xC6, 0xC7, -1, 0);
+            break;
+        case OC_ADD:
+            /*  00/r, 01/r add rm <- r
+                02/r, 03/r add r <- rm
+                80/0, 81/0 add rm <- imm
+                83/0       add rm16/32/64 <- imm8, sign extended */
+            encode_instruction_with_two_operands(ad, line, 0x00, 0x01, 0x02, 0x03, 0x80, 0x81, 0x83, 0);
+            break;
+        case OC_OR:
+            encode_instruction_with_two_operands(ad, line, 0x08, 0x09, 0x0A, 0x0B, 0x80, 0x81, 0x83, 1);
+            break;
+        case OC_AND:
+            encode_instruction_with_two_operands(ad, line, 0x20, 0x21, 0x22, 0x23, 0x80, 0x81, 0x83, 4);
+            break;
+        case OC_SUB:
+            encode_instruction_with_two_operands(ad, line, 0x28, 0x29, 0x2A, 0x2B, 0x80, 0x81, 0x83, 5);
+            break;
+        case OC_TEST:
+            /*  84/r, 85/r test rm, r  (no direction, it only sets the flags)
+                F6/0, F7/0 test rm, imm  (no sign extended imm8 form) */
+            encode_instruction_with_two_operands(ad, line, 0x84, 0x85, 0x84, 0x85, 0xF6, 0xF7, -1, 0);
+            break;
+        case OC_XOR:
+            /*  30/r, 31/r xor rm <- r
+                32/r, 33/r xor r <- rm
+                80/6, 81/6 xor rm <- imm 
+                83/6       xor rm16/32/64 <- imm8, sign extended */
+            if (instr->regmem_operand.is_register && instr->regimm_operand.is_register &&
+                instr->regmem_operand.per_type.reg == instr->regimm_operand.per_type.reg &&
+                register_data_size(instr->regmem_operand.per_type.reg) == DATA_QWORD) {
+                // zeroing a 64 bits register, the 32 bits one does it without REX.W
+                asm_instruction narrow = *instr;
+                asm_line narrow_line = *line;
+                narrow.regmem_operand.per_type.reg -= (REG_RAX - REG_EAX);
+                narrow.regimm_operand.per_type.reg -= (REG_RAX - REG_EAX);
+                narrow_line.per_type.instruction = &narrow;
+                if (!register_is_extended(narrow.regmem_operand.per_type.reg))
+                    ad->bytes_saved += 1;
+                encode_instruction_with_two_operands(ad, &narrow_line, 0x30, 0x31, 0x32, 0x33, 0x80, 0x81, 0x83, 6);
+                break;
             }
+            encode_instruction_with_two_operands(ad, line, 0x30, 0x31, 0x32, 0x33, 0x80, 0x81, 0x83, 6);
+            break;
+        case OC_CMP:
+            encode_instruction_with_two_operands(ad, line, 0x38, 0x39, 0x3A, 0x3B, 0x80, 0x81, 0x83, 7);
+            break;
+        case OC_NOT:
+            /* F6/2, F7/2 not rm */
+            encode_instruction_with_regmem_operand(ad, line, 0xF6, 0xF7, 2, &instr->regmem_operand);
+            break;
+        case OC_NEG:
+            /* F6/3, F7/3 neg rm */
+            encode_instruction_with_regmem_operand(ad, line, 0xF6, 0xF7, 3, &instr->regmem_operand);
+            break;
+        case OC_MUL:
+            encode_accumulator_operation(ad, line, 4);
+            break;
+        case OC_DIV:
+            encode_accumulator_operation(ad, line, 6);
+            break;
+        case OC_IMUL:
+            encode_imul(ad, line);
+            break;
+        case OC_SHL:
+            encode_shift(ad, line, 4);
+            break;
+        case OC_SHR:
+            encode_shift(ad, line, 5);
+            break;
+        case OC_SAR:
+            encode_shift(ad, line, 7);
             break;
         case OC_LEA:
             /* 8D/r LEA r16/32/64,m */
             // 8 bits are not supported
             // i think i have to break the "encode_instruction_with_two_operands()" function into two,
             // to ensure i can hardcode the "/r" part
-            encode_instruction_with_two_operands(ad, line, -1, -1, -1, 0x8D, -1, -1, -1);
+            encode_instruction_with_two_operands(ad, line, -1, -1, -1, 0x8D, -1, -1, -1, -1);
             break;
         case OC_PUSH:
             // one cannot push 8 or 32 bits reg/mem on stack in x86_64 mode, only 16 and 64
@@ -468,9 +864,20 @@ static void encode_instruction_line_x86_64(assembler_data *ad, asm_line *line) {
                     error("Cannot push 32 bits values in x86_64 mode");
                     return;
                 }
-                // 8bit opcode, 16/32/64 opcode, immediate value, immediate size?
-                error("Immediate push not implemented yet!");
-                // encode_instruction_with_immediate_operand(...);
+                s32 value = instr->regimm_operand.per_type.immediate;
+                if (data_width == DATA_WORD)
+                    bin_add_byte(ad->curr_sect->contents, 0x66);
+                if (fits_in_s8(value)) {
+                    bin_add_byte(ad->curr_sect->contents, 0x6A);
+                    bin_add_byte(ad->curr_sect->contents, (u8)value);
+                    ad->bytes_saved += (data_width == DATA_WORD) ? 1 : 3;
+                } else {
+                    bin_add_byte(ad->curr_sect->contents, 0x68);
+                    if (data_width == DATA_WORD)
+                        bin_add_word(ad->curr_sect->contents, (u16)value);
+                    else
+                        bin_add_dword(ad->curr_sect->contents, (u32)value); // sign extended to 64 bits
+                }
             } else {
                 if (data_width != DATA_WORD && data_width != DATA_QWORD) {
                     error("Only 16 and 64 bits can be pushed in x86_64 mode");
@@ -490,15 +897,40 @@ static void encode_instruction_line_x86_64(assembler_data *ad, asm_line *line) {
             }
             encode_instruction_with_regmem_operand(ad, line, -1, 0x8F, 0, &instr->regmem_operand);
             break;
+        case OC_JMP:
+        case OC_JEQ:
+        case OC_JNE:
+        case OC_JAB:
+        case OC_JAE:
+        case OC_JBL:
+        case OC_JBE:
+        case OC_JGT:
+        case OC_JGE:
+        case OC_JLT:
+        case OC_JLE:
+            encode_jump(ad, line);
+            break;
+        case OC_CMOVEQ:
+        case OC_CMOVNE:
+        case OC_CMOVAB:
+        case OC_CMOVAE:
+        case OC_CMOVBL:
+        case OC_CMOVBE:
+        case OC_CMOVGT:
+        case OC_CMOVGE:
+        case OC_CMOVLT:
+        case OC_CMOVLE:
+            /* 0F 40+cc/r cmovcc r16/32/64 <- rm, there is no 8 bits form */
+            encode_register_from_regmem(ad, line, 0x0F40 + move_condition_code(instr->operation));
+            break;
         case OC_CALL:
             /*  E8 cd CALL rel32   (Call near, relative, displacement relative to next instruction)
-                FF /2 CALL r/m32   (Call near, absolute indirect, address given in r/m32)
+                FF /2 CALL r/m64   (Call near, absolute indirect, address given in r/m64)
             */
             if (instr->regmem_operand.is_mem_addr_by_symbol) {
                 encode_simple_instruction_with_symbol32(ad, line, -1, 0xE8, instr->regmem_operand.per_type.mem.displacement_symbol_name);
-            } else if (instr->regmem_operand.is_memory_by_reg) {
-                error("CALL only supports memory by symbol for now");
-                // encode_instruction_with_regmem_operand(ad, line, 0xFF, 0x2, instr->regmem_operand)
+            } else if (instr->regmem_operand.is_register || instr->regmem_operand.is_memory_by_reg) {
+                encode_indirect_branch(ad, line, 2);
             } else {
                 error("CALL only supports memory by symbol or register");
             }
@@ -520,16 +952,231 @@ static void encode_instruction_line_x86_64(assembler_data *ad, asm_line *line) {
     // section->ops->add_symbol(section, sym_name, offset, ?, true);
 }
 
-static obj_module *assemble_listing_into_x86_64_code(assembler *as, asm_listing *asm_list, str *module_name) {
-    assembler_data *ad = (assembler_data *)as->priv_data;
+// a run of instruction lines, assembled into a section of its own, possibly on
+// another thread, and appended to the module section later. local jumps never
+// cross its bounds, so its contents do not depend on the other fragments.
+struct fragment {
+    int first_line;
+    int end_line;       // one past its last line
+    int alignment;      // the largest of its lines, its start gets aligned to it
+    assembler_data ad;  // a copy, with its own mempool, section and fixups
+    int passes;
+};
 
-    // prepare or clear the module being assembled
-    ad->asm_listing = asm_list;
-    ad->externs = new_list(ad->mempool); // item is str
-    ad->globals = new_list(ad->mempool); // item is str
+// smaller functions share a fragment, to keep the overhead down
+#define FRAGMENT_MIN_LINES  64
+
+// the recommended multi-byte NOPs, by length, e.g. "nop dword [rax+rax+0]" for five
+static const u8 nop_sequences[9][9] = {
+    { 0x90 },
+    { 0x66, 0x90 },
+    { 0x0F, 0x1F, 0x00 },
+    { 0x0F, 0x1F, 0x40, 0x00 },
+    { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+    { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+    { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
+
+// pads the code up to the alignment with as few NOPs as possible, returns the bytes added
+static int add_nop_padding(bin *code, int alignment) {
+    int length = (int)(round_up(bin_len(code), alignment) - bin_len(code));
+    for (int left = length; left > 0; left -= 9)
+        bin_add_mem(code, nop_sequences[(left > 9 ? 9 : left) - 1], left > 9 ? 9 : left);
+    return length;
+}
+
+// one pass over the lines of the fragment, into a new section. false on errors
+static bool assemble_fragment_pass(struct fragment *f) {
+    assembler_data *ad = &f->ad;
+    ad->curr_sect = new_obj_section(ad->mempool);
+    ad->bytes_saved = 0;
+    ad->padding_bytes = 0;
+    ad->jump_fixups = new_list(ad->mempool);
+
+    for (ad->line_index = f->first_line; ad->line_index < f->end_line; ad->line_index++) {
+        asm_line *line = ad->lines[ad->line_index];
+        // the fragment starts aligned, so aligning its offsets is enough
+        if (ad->line_alignments[ad->line_index] > 1)
+            ad->padding_bytes += add_nop_padding(ad->curr_sect->contents, ad->line_alignments[ad->line_index]);
+        ad->line_offsets[ad->line_index] = bin_len(ad->curr_sect->contents);
+        if (line->type != ALT_INSTRUCTION)
+            continue;
+
+        // whether it is exported is decided when appending to the module
+        if (line->label != NULL)
+            ad->curr_sect->ops->add_symbol(ad->curr_sect, line->label, bin_len(ad->curr_sect->contents), 0, false);
+
+        encode_instruction_line_x86_64(ad, line);
+        if (errors_count)
+            return false;
+    }
+    return true;
+}
+
+// true if a jump must change form, i.e. another pass is needed
+static bool relax_local_jumps(assembler_data *ad) {
+    bool changed = false;
+    for_list(ad->jump_fixups, struct jump_fixup, f) {
+        long displacement = (long)ad->line_offsets[f->target_line_index] - (long)f->instruction_end;
+        if (ad->jump_forms[f->line_index] == JUMP_SHORT && !fits_in_s8(displacement)) {
+            ad->jump_forms[f->line_index] = JUMP_NEAR;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void patch_local_jumps(assembler_data *ad) {
+    for_list(ad->jump_fixups, struct jump_fixup, f) {
+        bin *contents = ad->curr_sect->contents;
+        s32 displacement = (s32)((long)ad->line_offsets[f->target_line_index] - (long)f->instruction_end);
+        if (ad->jump_forms[f->line_index] == JUMP_SHORT) {
+            *(u8 *)bin_ptr_at(contents, f->displacement_offset) = (u8)displacement;
+        } else {
+            memcpy(bin_ptr_at(contents, f->displacement_offset), &displacement, sizeof(s32));
+        }
+    }
+}
+
+// jumps to labels of this module are resolved here, not by the linker.
+// they all start as short, the ones found out of range become near,
+// and we assemble again, until nothing changes. jumps only grow,
+// so this ends, usually in two passes.
+static void assemble_fragment(struct fragment *f) {
+    assembler_data *ad = &f->ad;
+
+    // labels outside the fragment, e.g. after a data definition, are left to the linker
+    for (int i = f->first_line; i < f->end_line; i++) {
+        int target = ad->jump_targets[i];
+        if (target != -1 && (target < f->first_line || target >= f->end_line))
+            ad->jump_forms[i] = JUMP_RELOCATED;
+    }
+
+    do {
+        f->passes++;
+        if (!assemble_fragment_pass(f))
+            return;
+    } while (relax_local_jumps(ad));
+    patch_local_jumps(ad);
+}
+
+// splits the instruction lines into fragments, at labels no local jump goes over.
+// when aligning, only at the most aligned ones, so any thread count gives the same code
+static int split_into_fragments(assembler_data *ad, struct fragment **fragments, int min_lines) {
+    int max_alignment = 1;
+    for (int i = 0; i < ad->lines_count; i++)
+        if (ad->line_alignments[i] > max_alignment)
+            max_alignment = ad->line_alignments[i];
+
+    // the start of line i is crossed by (crossings[0] + ... + crossings[i]) jumps
+    int *crossings = mpallocn(ad->mempool, sizeof(int) * (ad->lines_count + 1), crossings);
+    memset(crossings, 0, sizeof(int) * (ad->lines_count + 1));
+    for (int i = 0; i < ad->lines_count; i++) {
+        int target = ad->jump_targets[i];
+        if (target == -1)
+            continue;
+        crossings[(target < i ? target : i) + 1]++;
+        crossings[(target < i ? i : target) + 1]--;
+    }
+
+    int count = 0;
+    int crossing = 0;
+    struct fragment *f = NULL;
+    for (int i = 0; i < ad->lines_count; i++) {
+        crossing += crossings[i];
+        asm_line *line = ad->lines[i];
+        if (line->type != ALT_INSTRUCTION && line->type != ALT_EMPTY) {
+            f = NULL; // directives and data stay in order, in the module pass
+            continue;
+        }
+        if (f == NULL || (line->label != NULL && crossing == 0 && i - f->first_line >= min_lines
+                          && ad->line_alignments[i] == max_alignment)) {
+            f = mpalloc(ad->mempool, struct fragment);
+            f->first_line = i;
+            f->alignment = 1;
+            fragments[count++] = f;
+        }
+        f->end_line = i + 1;
+        if (ad->line_alignments[i] > f->alignment)
+            f->alignment = ad->line_alignments[i];
+    }
+    return count;
+}
+
+struct fragments_queue {
+    struct fragment **fragments;
+    int count;
+    int next; // taken atomically by the workers
+};
+
+static void *fragments_worker(void *arg) {
+    struct fragments_queue *q = (struct fragments_queue *)arg;
+    int index;
+    while ((index = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->count)
+        assemble_fragment(q->fragments[index]);
+    return NULL;
+}
+
+// assembles the fragments concurrently, returns the number of threads used
+static int assemble_fragments(assembler_data *ad, struct fragment **fragments, int count, int threads) {
+    if (threads > count)
+        threads = count;
+
+    // mempools are not thread safe, each fragment gets its own.
+    // the per line arrays are shared, each fragment touches only its lines.
+    for (int i = 0; i < count; i++) {
+        fragments[i]->ad = *ad;
+        fragments[i]->ad.mempool = new_mempool();
+    }
+
+    struct fragments_queue q = { .fragments = fragments, .count = count, .next = 0 };
+    pthread_t *workers = mpallocn(ad->mempool, sizeof(pthread_t) * (threads + 1), workers);
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, fragments_worker, &q) == 0)
+        started++;
+    fragments_worker(&q); // this thread works too
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    return started + 1;
+}
+
+// appends the fragment contents to the current section, moving symbols and relocations along
+static void append_fragment(assembler_data *ad, struct fragment *f) {
+    obj_section *fragment_sect = f->ad.curr_sect;
+    if (f->alignment > 1) {
+        ad->padding_bytes += add_nop_padding(ad->curr_sect->contents, f->alignment);
+        if (f->alignment > ad->curr_sect->alignment)
+            ad->curr_sect->alignment = f->alignment;
+    }
+    size_t base = bin_len(ad->curr_sect->contents);
+    bin_cat(ad->curr_sect->contents, fragment_sect->contents);
+
+    for_list(fragment_sect->symbols, obj_symbol, sym) {
+        bool is_global = hashtable_contains(ad->globals, sym->name);
+        ad->curr_sect->ops->add_symbol(ad->curr_sect, sym->name, base + sym->value, sym->size, is_global);
+    }
+    for_list(fragment_sect->relocations, obj_relocation, rel) {
+        ad->curr_sect->ops->add_relocation(ad->curr_sect, base + rel->offset,
+            new_str(ad->mempool, str_charptr(rel->symbol_name)), rel->type, rel->addendum);
+    }
+    ad->bytes_saved += f->ad.bytes_saved;
+    ad->padding_bytes += f->ad.padding_bytes;
+}
+
+// the module, from the directives, data and the assembled fragments, in order. false on errors
+static bool assemble_module(assembler_data *ad, str *module_name, struct fragment **fragments, int count) {
+
+    // prepare the module being assembled
+    ad->externs = new_hashtable(ad->mempool, 64);
+    ad->globals = new_hashtable(ad->mempool, 64);
     ad->module = new_obj_module(ad->mempool);
     ad->module->name = module_name;
     ad->curr_sect = NULL;
+    ad->bytes_saved = 0;
+    ad->padding_bytes = 0;
 
     asm_directive *named_def;
     
@@ -541,11 +1188,17 @@ static obj_module *assemble_listing_into_x86_64_code(assembler *as, asm_listing
         ad->module->ops->add_section(ad->module, ad->curr_sect);
     }
     
-    for_list(asm_list->lines, asm_line, line) {
-        switch (line->type) {
-            case ALT_EMPTY:
-                break; 
+    int next_fragment = 0;
+    for (int i = 0; i < ad->lines_count; i++) {
+        asm_line *line = ad->lines[i];
+        if (next_fragment < count && fragments[next_fragment]->first_line == i) {
+            struct fragment *f = fragments[next_fragment++];
+            append_fragment(ad, f);
+            i = f->end_line - 1;
+            continue;
+        }
 
+        switch (line->type) {
             case ALT_SECTION:  // e.g. ".section .data"
                 // find or create section
                 named_def = line->per_type.named_definition;
@@ -557,17 +1210,13 @@ static obj_module *assemble_listing_into_x86_64_code(assembler *as, asm_listing
                 break;
 
             case ALT_EXTERN:   // e.g. ".extern <name>"
-                // add to externs if not already there
                 named_def = line->per_type.named_definition;
-                if (list_find_first(ad->externs, compare_str, named_def->name) == -1)
-                    list_add(ad->externs, named_def->name);
+                hashtable_set(ad->externs, named_def->name, named_def->name);
                 break;
 
             case ALT_GLOBAL:   // e.g. ".global <name>"
-                // add to globals if not already there
                 named_def = line->per_type.named_definition;
-                if (list_find_first(ad->globals, compare_str, named_def->name) == -1)
-                    list_add(ad->globals, named_def->name);
+                hashtable_set(ad->globals, named_def->name, named_def->name);
                 break;
 
             case ALT_DATA:    // "<name:> db, dw, dd, dq value [, value [, ...]]"
@@ -576,32 +1225,140 @@ static obj_module *assemble_listing_into_x86_64_code(assembler *as, asm_listing
                 obj_symbol *sym = ad->curr_sect->ops->find_symbol(ad->curr_sect, data_def->name, false);
                 if (sym != NULL) {
                     error("Symbol '%s' already defined!", str_charptr(data_def->name));
-                    return NULL;
+                    return false;
                 }
-                bool is_global = list_find_first(ad->globals, compare_str, data_def->name) != -1;
-                bool is_extern = list_find_first(ad->externs, compare_str, data_def->name) != -1;
+                bool is_global = hashtable_contains(ad->globals, data_def->name);
                 size_t value = bin_len(ad->curr_sect->contents);
                 bin_cat(ad->curr_sect->contents, data_def->initial_value);
                 sym = ad->curr_sect->ops->add_symbol(ad->curr_sect, data_def->name, value, data_def->length_bytes, is_global);
                 break;
-                
-            case ALT_INSTRUCTION:  // MOV RAX, 0x1234
-                asm_instruction *instr = line->per_type.instruction;
-                encode_instruction_line_x86_64(ad, line);
-                if (errors_count) return NULL;
-                break;
 
             default:
                 error("Unsupported assembly line type %d", line->type);
-                return NULL;
+                return false;
+        }
+    }
+
+    return true;
+}
+
+#define CALLED_OR_EXPORTED  1
+#define JUMPED_TO           2
+#define JUMPED_BACK_TO      4
+
+// functions start at labels called or exported, or following a RET and not jumped to.
+// loops start at the labels of backward jumps. the rest need no alignment.
+static void find_aligned_lines(assembler_data *ad, hashtable *labels) {
+    int align_functions = run_info->options->align_functions;
+    int align_loops = run_info->options->align_loops;
+    for (int i = 0; i < ad->lines_count; i++)
+        ad->line_alignments[i] = 1;
+    if (align_functions <= 1 && align_loops <= 1)
+        return;
+
+    u8 *marks = mpallocn(ad->mempool, ad->lines_count + 1, marks);
+    memset(marks, 0, ad->lines_count + 1);
+    for (int i = 0; i < ad->lines_count; i++) {
+        asm_line *line = ad->lines[i];
+        int target = ad->jump_targets[i];
+        if (target != -1)
+            marks[target] |= JUMPED_TO | (target <= i ? JUMPED_BACK_TO : 0);
+
+        int *p = NULL;
+        if (line->type == ALT_GLOBAL) {
+            p = hashtable_get(labels, line->per_type.named_definition->name);
+        } else if (line->type == ALT_INSTRUCTION && line->per_type.instruction->operation == OC_CALL
+                   && line->per_type.instruction->regmem_operand.is_mem_addr_by_symbol) {
+            p = hashtable_get(labels, new_str(ad->mempool, 
+                line->per_type.instruction->regmem_operand.per_type.mem.displacement_symbol_name));
+        }
+        if (p != NULL)
+            marks[*p] |= CALLED_OR_EXPORTED;
+    }
+
+    bool after_return = true; // or after data, or at the start
+    for (int i = 0; i < ad->lines_count; i++) {
+        asm_line *line = ad->lines[i];
+        if (line->type == ALT_EMPTY)
+            continue;
+        if (line->type != ALT_INSTRUCTION) {
+            after_return = true;
+            continue;
+        }
+
+        if (line->label != NULL) {
+            bool is_function = (marks[i] & CALLED_OR_EXPORTED) || (after_return && !(marks[i] & JUMPED_TO));
+            if (is_function && align_functions > ad->line_alignments[i])
+                ad->line_alignments[i] = align_functions;
+            if ((marks[i] & JUMPED_BACK_TO) && align_loops > ad->line_alignments[i])
+                ad->line_alignments[i] = align_loops;
+        }
+        if (line->per_type.instruction->operation != OC_NONE)
+            after_return = line->per_type.instruction->operation == OC_RET;
+    }
+}
+
+static obj_module *assemble_listing_into_x86_64_code(assembler *as, asm_listing *asm_list, str *module_name) {
+    assembler_data *ad = (assembler_data *)as->priv_data;
+    ad->asm_listing = asm_list;
+
+    ad->lines_count = list_length(asm_list->lines);
+    ad->lines = mpallocn(ad->mempool, sizeof(asm_line *) * (ad->lines_count + 1), lines);
+    ad->jump_targets = mpallocn(ad->mempool, sizeof(int) * (ad->lines_count + 1), jump_targets);
+    ad->line_offsets = mpallocn(ad->mempool, sizeof(size_t) * (ad->lines_count + 1), line_offsets);
+    ad->line_alignments = mpallocn(ad->mempool, sizeof(int) * (ad->lines_count + 1), line_alignments);
+    ad->jump_forms = mpallocn(ad->mempool, ad->lines_count + 1, jump_forms);
+    memset(ad->jump_forms, JUMP_SHORT, ad->lines_count + 1);
+
+    // the labels are looked up once, not on every pass
+    hashtable *labels = new_hashtable(ad->mempool, ad->lines_count + 1);
+    int index = 0;
+    for_list(asm_list->lines, asm_line, line) {
+        ad->lines[index] = line;
+        if (line->label != NULL) {
+            int *p = mpalloc(ad->mempool, int);
+            *p = index;
+            hashtable_set(labels, line->label, p);
+        }
+        index++;
+    }
+    index = 0;
+    for_list(asm_list->lines, asm_line, line) {
+        ad->jump_targets[index] = -1;
+        asm_instruction *instr = (line->type == ALT_INSTRUCTION) ? line->per_type.instruction : NULL;
+        bool is_jump = instr != NULL && (instr->operation == OC_JMP || jump_condition_code(instr->operation) != -1);
+        if (is_jump && instr->regmem_operand.is_mem_addr_by_symbol) {
+            int *p = hashtable_get(labels, new_str(ad->mempool, instr->regmem_operand.per_type.mem.displacement_symbol_name));
+            if (p != NULL)
+                ad->jump_targets[index] = *p;
         }
+        index++;
     }
+    find_aligned_lines(ad, labels);
+
+    // functions are assembled independently, then put together.
+    // a single thread gains nothing from splitting them apart.
+    int threads = run_info->options->asm_threads;
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct fragment **fragments = mpallocn(ad->mempool, sizeof(struct fragment *) * (ad->lines_count + 1), fragments);
+    int count = split_into_fragments(ad, fragments, threads > 1 ? FRAGMENT_MIN_LINES : ad->lines_count);
+    if (count > 0)
+        threads = assemble_fragments(ad, fragments, count, threads);
+
+    bool assembled = errors_count == 0 && assemble_module(ad, module_name, fragments, count);
+    int passes = 0;
+    for (int i = 0; i < count; i++) {
+        if (fragments[i]->passes > passes)
+            passes = fragments[i]->passes;
+        mempool_release(fragments[i]->ad.mempool);
+    }
+    if (!assembled)
+        return NULL;
 
-    // now that we assembled all the module, one optimization might be,
-    // to go back and resolve local relocations (e.g. if/else end labels)
-    // these can be local jumps to offset relative to the end of the instruction,
-    // or to function label + offset
-    // another way is to have local jumps as addendums from the start of the function
+    if (run_info->options->verbose)
+        printf("Assembled module %s in %d fragments on %d threads, up to %d passes, shorter encodings saved %d bytes, alignment took %d bytes\n", 
+            module_name == NULL ? "" : str_charptr(module_name), count, threads, passes, ad->bytes_saved, ad->padding_bytes);
 
     return ad->module;
 }
@@ -611,6 +1368,10 @@ static obj_module *assemble_listing_into_x86_64_code(assembler *as, asm_listing
 #ifdef INCLUDE_UNIT_TESTS
 static void test_simple_assembly();
 static void test_instructions_encoding();
+static void test_local_jumps();
+static void test_parallel_fragments();
+static void test_code_alignment();
+static void test_converter_instructions();
 #define verify_instr_encoding(asm, bytes, len)  __verify_instr_encoding(asm, bytes, len, __LINE__)
 static void __verify_instr_encoding(asm_line *line, char *expected_bytes, int expected_len, int line_no);
 
@@ -620,6 +1381,10 @@ void assembler_unit_tests() {
     // maybe test creation and allocation of data in a data section
     test_simple_assembly();
     test_instructions_encoding();
+    test_local_jumps();
+    test_parallel_fragments();
+    test_code_alignment();
+    test_converter_instructions();
 }
 
 static void test_simple_assembly() {
@@ -670,6 +1435,265 @@ static void test_simple_assembly() {
     mempool_release(mp);
 }
 
+static void test_local_jumps() {
+    mempool *mp = new_mempool();
+    asm_listing *list = new_asm_listing(mp);
+
+    //  top: JEQ  end       74 xx, becomes 0F 84 after the NOPs grow
+    //       JMP  top       EB fc
+    //       JMP  elsewhere E9 + relocation
+    //       NOP x 130
+    //  end: RET
+    list->ops->set_next_label(list, "top");
+    list->ops->add_line(list, new_asm_line_instruction_with_operand(mp, OC_JEQ, new_asm_operand_mem_by_sym(mp, "end")));
+    list->ops->add_line(list, new_asm_line_instruction_with_operand(mp, OC_JMP, new_asm_operand_mem_by_sym(mp, "top")));
+    list->ops->add_line(list, new_asm_line_instruction_with_operand(mp, OC_JMP, new_asm_operand_mem_by_sym(mp, "elsewhere")));
+    for (int i = 0; i < 130; i++)
+        list->ops->add_line(list, new_asm_line_instruction(mp, OC_NOP));
+    list->ops->set_next_label(list, "end");
+    list->ops->add_line(list, new_asm_line_instruction(mp, OC_RET));
+
+    assembler *as = new_assembler(mp);
+    obj_module *mod = as->ops->assemble_listing_into_x86_64_code(as, list, new_str(mp, "jumps.c"));
+    assert(mod != NULL);
+    obj_section *sect = list_get(mod->sections, 0);
+    assert(bin_len(sect->contents) == 6 + 2 + 5 + 130 + 1);
+
+    // 0F 84 rel32, to the RET at 143, from the end of the instruction at 6
+    assert(memcmp(bin_ptr_at(sect->contents, 0), "\x0f\x84\x89\x00\x00\x00", 6) == 0);
+    // EB rel8, back to 0 from 8
+    assert(memcmp(bin_ptr_at(sect->contents, 6), "\xeb\xf8", 2) == 0);
+    assert(memcmp(bin_ptr_at(sect->contents, 8), "\xe9", 1) == 0);
+
+    // only the unknown label needs the linker
+    assert(list_length(sect->relocations) == 1);
+    obj_relocation *r = list_get(sect->relocations, 0);
+    assert(r->offset == 9);
+    assert(str_cmps(r->symbol_name, "elsewhere") == 0);
+
+    mempool_release(mp);
+}
+
+static obj_module *_assemble_on_threads(mempool *mp, asm_listing *list, int threads) {
+    int saved_threads = run_info->options->asm_threads;
+    run_info->options->asm_threads = threads;
+    assembler *as = new_assembler(mp);
+    obj_module *mod = as->ops->assemble_listing_into_x86_64_code(as, list, new_str(mp, "fragments.c"));
+    run_info->options->asm_threads = saved_threads;
+    return mod;
+}
+
+static void test_parallel_fragments() {
+    mempool *mp = new_mempool();
+    asm_listing *list = new_asm_listing(mp);
+
+    // functions with local jumps both ways and calls to each other,
+    // enough of them to make several fragments
+    char exit_label[16], own_label[16], next_label[16];
+    for (int i = 0; i < 24; i++) {
+        snprintf(exit_label, sizeof(exit_label), "func%d_exit", i);
+        snprintf(own_label, sizeof(own_label), "func%d", i);
+        snprintf(next_label, sizeof(next_label), "func%d", (i + 1) % 24);
+        list->ops->set_next_label(list, "%s", own_label);
+        list->ops->add_line(list, new_asm_line_instruction_reg_imm(mp, OC_CMP, REG_RAX, i));
+        list->ops->add_line(list, new_asm_line_instruction_with_operand(mp, OC_JEQ, new_asm_operand_mem_by_sym(mp, exit_label)));
+        for (int j = 0; j < i * 8; j++)
+            list->ops->add_line(list, new_asm_line_instruction(mp, OC_NOP));
+        list->ops->add_line(list, new_asm_line_instruction_with_operand(mp, OC_JNE, new_asm_operand_mem_by_sym(mp, own_label)));
+        list->ops->add_line(list, new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_sym(mp, next_label)));
+        list->ops->set_next_label(list, "%s", exit_label);
+        list->ops->add_line(list, new_asm_line_instruction(mp, OC_RET));
+    }
+
+    obj_module *serial = _assemble_on_threads(mp, list, 1);
+    obj_module *parallel = _assemble_on_threads(mp, list, 4);
+    assert(serial != NULL && parallel != NULL);
+    obj_section *s = list_get(serial->sections, 0);
+    obj_section *p = list_get(parallel->sections, 0);
+
+    // the same bytes, symbols and relocations, whatever the threads
+    assert(bin_len(s->contents) == bin_len(p->contents));
+    assert(memcmp(bin_ptr_at(s->contents, 0), bin_ptr_at(p->contents, 0), bin_len(s->contents)) == 0);
+    assert(list_length(s->symbols) == 48 && list_length(p->symbols) == 48);
+    for (int i = 0; i < 48; i++) {
+        obj_symbol *a = list_get(s->symbols, i);
+        obj_symbol *b = list_get(p->symbols, i);
+        assert(str_cmp(a->name, b->name) == 0 && a->value == b->value);
+    }
+    assert(list_length(s->relocations) == 24 && list_length(p->relocations) == 24);
+    for (int i = 0; i < 24; i++) {
+        obj_relocation *a = list_get(s->relocations, i);
+        obj_relocation *b = list_get(p->relocations, i);
+        assert(str_cmp(a->symbol_name, b->symbol_name) == 0 && a->offset == b->offset);
+    }
+
+    // the last function: CMP RAX, 23 (4), JEQ near (6), 184 NOPs, JNE near back (6), CALL func0
+    obj_symbol *last = list_get(p->symbols, 46);
+    assert(str_cmps(last->name, "func23") == 0);
+    obj_relocation *call = list_get(p->relocations, 23);
+    assert(str_cmps(call->symbol_name, "func0") == 0);
+    assert(call->offset == last->value + 4 + 6 + 184 + 6 + 1);
+    assert(memcmp(bin_ptr_at(p->contents, last->value + 4), "\x0f\x84\xc3\x00\x00\x00", 6) == 0);
+
+    mempool_release(mp);
+}
+
+static void test_code_alignment() {
+    mempool *mp = new_mempool();
+    asm_listing *list = new_asm_listing(mp);
+
+    // functions, each a loop jumping back to its head
+    char func_label[16], loop_label[16];
+    for (int i = 0; i < 12; i++) {
+        snprintf(func_label, sizeof(func_label), "func%d", i);
+        snprintf(loop_label, sizeof(loop_label), "loop%d", i);
+        list->ops->set_next_label(list, "%s", func_label);
+        list->ops->add_line(list, new_asm_line_instruction_reg_imm(mp, OC_CMP, REG_RAX, i));
+        list->ops->set_next_label(list, "%s", loop_label);
+        for (int j = 0; j < i * 3 + 1; j++)
+            list->ops->add_line(list, new_asm_line_instruction(mp, OC_NOP));
+        list->ops->add_line(list, new_asm_line_instruction_with_operand(mp, OC_JNE, new_asm_operand_mem_by_sym(mp, loop_label)));
+        list->ops->add_line(list, new_asm_line_instruction(mp, OC_RET));
+    }
+
+    int saved_functions = run_info->options->align_functions;
+    int saved_loops = run_info->options->align_loops;
+    run_info->options->align_functions = 16;
+    run_info->options->align_loops = 32;
+    obj_module *serial = _assemble_on_threads(mp, list, 1);
+    obj_module *parallel = _assemble_on_threads(mp, list, 4);
+    run_info->options->align_functions = saved_functions;
+    run_info->options->align_loops = saved_loops;
+    assert(serial != NULL && parallel != NULL);
+    obj_section *s = list_get(serial->sections, 0);
+    obj_section *p = list_get(parallel->sections, 0);
+
+    // the same bytes whatever the threads, the section keeps the largest alignment
+    assert(bin_len(s->contents) == bin_len(p->contents));
+    assert(memcmp(bin_ptr_at(s->contents, 0), bin_ptr_at(p->contents, 0), bin_len(s->contents)) == 0);
+    assert(s->alignment == 32 && p->alignment == 32);
+    assert(list_length(p->symbols) == 24);
+    for (int i = 0; i < 24; i++) {
+        obj_symbol *sym = list_get(p->symbols, i);
+        assert(sym->value % (i % 2 == 0 ? 16 : 32) == 0);
+    }
+
+    // CMP RAX, 0 (4), then 28 bytes of NOPs to loop0, the longest ones first
+    obj_symbol *loop0 = list_get(p->symbols, 1);
+    assert(loop0->value == 32);
+    assert(memcmp(bin_ptr_at(p->contents, 4), "\x66\x0f\x1f\x84\x00\x00\x00\x00\x00", 9) == 0);
+    assert(memcmp(bin_ptr_at(p->contents, 22), "\x66\x0f\x1f\x84\x00\x00\x00\x00\x00\x90", 10) == 0);
+
+    // loop0: NOP, JNE loop0 (2), RET, then padding up to func1
+    obj_symbol *func1 = list_get(p->symbols, 2);
+    assert(func1->value == 48);
+    assert(memcmp(bin_ptr_at(p->contents, 32), "\x90\x75\xfd\xc3", 4) == 0);
+
+    mempool_release(mp);
+}
+
+// every operation the IR converter selects, in the forms it selects them,
+// must assemble. a new operation fails here until it is added and encoded.
+static void test_converter_instructions() {
+    mempool *mp = new_mempool();
+    asm_listing *list = new_asm_listing(mp);
+    asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+    asm_operand *cx = new_asm_operand_reg(mp, REG_CX);
+    asm_operand *local = new_asm_operand_mem_by_reg(mp, REG_BP, -8);
+    asm_operand *global = new_asm_operand_mem_by_sym(mp, "g");
+    asm_operand *five = new_asm_operand_imm(mp, 5);
+    asm_operand *top = new_asm_operand_mem_by_sym(mp, "top");
+
+    asm_line *lines[] = {
+        new_asm_line_instruction_for_register(mp, OC_PUSH, REG_BP),
+        new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_BP, REG_SP),
+        new_asm_line_instruction_for_reserving_stack_space(mp, 16),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, ax, five),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, ax, local),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, local, ax),
+        new_asm_line_instruction_with_operands(mp, OC_MOV, global, ax),
+        new_asm_line_instruction_mem_imm(mp, OC_MOV, REG_BP, DATA_DWORD, 5),
+        new_asm_line_instruction_with_operand(mp, OC_PUSH, five),
+        new_asm_line_instruction_with_operand(mp, OC_PUSH, local),
+        new_asm_line_instruction_with_operand(mp, OC_PUSH, global),
+        new_asm_line_instruction_for_register(mp, OC_POP, REG_AX),
+        new_asm_line_instruction_with_operands(mp, OC_LEA, ax, local),
+        new_asm_line_instruction_reg_mem_scaled(mp, OC_LEA, REG_AX, REG_AX, REG_CX, 4),
+        new_asm_line_instruction_with_operands(mp, OC_ADD, ax, cx),
+        new_asm_line_instruction_with_operands(mp, OC_ADD, ax, local),
+        new_asm_line_instruction_with_operands(mp, OC_SUB, ax, five),
+        new_asm_line_instruction_with_operands(mp, OC_AND, ax, five),
+        new_asm_line_instruction_with_operands(mp, OC_OR, ax, cx),
+        new_asm_line_instruction_with_operands(mp, OC_XOR, ax, ax),
+        new_asm_line_instruction_with_operands(mp, OC_MUL, ax, cx),
+        new_asm_line_instruction_with_operands(mp, OC_MUL, ax, local),
+        new_asm_line_instruction_with_operands(mp, OC_DIV, ax, cx),
+        new_asm_line_instruction_with_operands(mp, OC_DIV, ax, local),
+        new_asm_line_instruction_for_register(mp, OC_IMUL, REG_CX),
+        new_asm_line_instruction_for_register(mp, OC_NOT, REG_AX),
+        new_asm_line_instruction_for_register(mp, OC_NEG, REG_AX),
+        new_asm_line_instruction_reg_imm(mp, OC_SHL, REG_AX, 3),
+        new_asm_line_instruction_reg_imm(mp, OC_SHR, REG_DX, 31),
+        new_asm_line_instruction_reg_imm(mp, OC_SAR, REG_DX, 1),
+        new_asm_line_instruction_with_operands(mp, OC_SHL, ax, cx),
+        new_asm_line_instruction_with_operands(mp, OC_SHR, ax, cx),
+        new_asm_line_instruction_with_operands(mp, OC_CMP, ax, five),
+        new_asm_line_instruction_with_operands(mp, OC_CMP, local, five),
+        new_asm_line_instruction_with_operands(mp, OC_CMP, ax, local),
+        new_asm_line_instruction_with_operands(mp, OC_TEST, ax, ax),
+        new_asm_line_instruction_with_operand(mp, OC_JEQ, top),
+        new_asm_line_instruction_with_operand(mp, OC_JNE, top),
+        new_asm_line_instruction_with_operand(mp, OC_JAB, top),
+        new_asm_line_instruction_with_operand(mp, OC_JAE, top),
+        new_asm_line_instruction_with_operand(mp, OC_JBL, top),
+        new_asm_line_instruction_with_operand(mp, OC_JBE, top),
+        new_asm_line_instruction_with_operand(mp, OC_JGT, top),
+        new_asm_line_instruction_with_operand(mp, OC_JGE, top),
+        new_asm_line_instruction_with_operand(mp, OC_JLT, top),
+        new_asm_line_instruction_with_operand(mp, OC_JLE, top),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVEQ, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVNE, REG_AX, local),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVAB, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVAE, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVBL, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVBE, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVGT, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVGE, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVLT, REG_AX, cx),
+        new_asm_line_instruction_reg_regmem(mp, OC_CMOVLE, REG_AX, global),
+        new_asm_line_instruction_with_operand(mp, OC_CALL, global),
+        new_asm_line_instruction_for_register(mp, OC_CALL, REG_AX),
+        new_asm_line_instruction(mp, OC_NOP),
+        new_asm_line_instruction(mp, OC_SYSCALL),
+        new_asm_line_instruction_with_operand(mp, OC_JMP, top),
+        new_asm_line_instruction_for_register(mp, OC_JMP, REG_AX),
+        new_asm_line_instruction(mp, OC_RET),
+    };
+    int count = sizeof(lines) / sizeof(lines[0]);
+
+    bool listed[OC_COUNT];
+    memset(listed, 0, sizeof(listed));
+    list->ops->set_next_label(list, "top");
+    for (int i = 0; i < count; i++) {
+        list->ops->add_line(list, lines[i]);
+        listed[lines[i]->per_type.instruction->operation] = true;
+    }
+    for (int op = OC_NONE + 1; op < OC_COUNT; op++) {
+        // the converter never selects these, nor does the peephole pass
+        if (op == OC_INC || op == OC_DEC || op == OC_INT)
+            continue;
+        assertm(listed[op], instr_code_name(op));
+    }
+
+    int errors = errors_count;
+    assembler *as = new_assembler(mp);
+    obj_module *mod = as->ops->assemble_listing_into_x86_64_code(as, list, new_str(mp, "converter.c"));
+    assert(mod != NULL);
+    assert(errors_count == errors);
+
+    mempool_release(mp);
+}
+
 void test_instructions_encoding() {
     mempool *mp = new_mempool();
     asm_line *l;
@@ -693,28 +1717,28 @@ void test_instructions_encoding() {
     //       b1    55            mov    cl,0x55
     // 66    b9    66 55         mov    cx,0x5566
     //       b9    77 66 55 00   mov    ecx,0x556677
-    // 48    c7 c1 55 44 33 22   mov    rcx,0x22334455
+    //       b9    55 44 33 22   mov    ecx,0x22334455  (for rcx, upper half zeroed)
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_CL, 0x55);
-    verify_instr_encoding(l, "\xC6\xC1\x55", 3);
+    verify_instr_encoding(l, "\xB1\x55", 2);
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_CX, 0x5566);
-    verify_instr_encoding(l, "\x66\xC7\xC1\x66\x55", 5);
+    verify_instr_encoding(l, "\x66\xB9\x66\x55", 4);
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_ECX, 0x556677);
-    verify_instr_encoding(l, "\xC7\xC1\x77\x66\x55\x00", 6);
+    verify_instr_encoding(l, "\xB9\x77\x66\x55\x00", 5);
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_RCX, 0x22334455);
-    verify_instr_encoding(l, "\x48\xc7\xc1\x55\x44\x33\x22", 7);
+    verify_instr_encoding(l, "\xb9\x55\x44\x33\x22", 5);
 
     //       b2    aa            mov    dl,0xaa
     // 66    ba    aa bb         mov    dx,0xbbaa
     //       ba    aa bb cc 00   mov    edx,0xccbbaa
-    // 48    c7 c2 aa bb cc 00   mov    rdx,0xccbbaa
+    // 48    c7 c2 ff ff ff ff   mov    rdx,-1  (negative needs the sign extension)
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_DL, 0xAA);
-    verify_instr_encoding(l, "\xC6\xC2\xAA", 3);
+    verify_instr_encoding(l, "\xB2\xAA", 2);
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_DX, 0xBBAA);
-    verify_instr_encoding(l, "\x66\xC7\xC2\xaa\xbb", 5);
+    verify_instr_encoding(l, "\x66\xBA\xaa\xbb", 4);
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_EDX, 0xCCBBAA);
-    verify_instr_encoding(l, "\xC7\xC2\xaa\xbb\xcc\x00", 6);
-    l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_RDX, 0xCCBBAA);
-    verify_instr_encoding(l, "\x48\xc7\xc2\xaa\xbb\xcc\x00", 7);
+    verify_instr_encoding(l, "\xBA\xaa\xbb\xcc\x00", 5);
+    l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_RDX, -1);
+    verify_instr_encoding(l, "\x48\xc7\xc2\xff\xff\xff\xff", 7);
 
     // 67    88 0a              mov    BYTE PTR [edx],cl  (size is deduced by source)
     // 67 66 89 0a              mov    WORD PTR [edx],cx
@@ -771,18 +1795,52 @@ void test_instructions_encoding() {
     verify_instr_encoding(l, "\x4c\x89\xc9", 3);
     
     // 4c 8b 09                mov    r9,QWORD PTR [rcx]
-    // 49 c7 c1 7b 00 00 00    mov    r9,0x7b
+    // 41 b9 7b 00 00 00       mov    r9d,0x7b  (for r9)
     // 49 89 09                mov    QWORD PTR [r9],rcx
     // 49 c7 01 7b 00 00 00    mov    QWORD PTR [r9],0x7b
     l = new_asm_line_instruction_reg_mem(mp, OC_MOV, REG_R9, REG_RCX);
     verify_instr_encoding(l, "\x4c\x8b\x09", 3);
     l = new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_R9, 123);
-    verify_instr_encoding(l, "\x49\xc7\xc1\x7b\x00\x00\x00", 7);
+    verify_instr_encoding(l, "\x41\xb9\x7b\x00\x00\x00", 6);
     l = new_asm_line_instruction_mem_reg(mp, OC_MOV, REG_R9, REG_RCX);
     verify_instr_encoding(l, "\x49\x89\x09", 3);
     l = new_asm_line_instruction_mem_imm(mp, OC_MOV, REG_R9, DATA_QWORD, 123);
     verify_instr_encoding(l, "\x49\xc7\x01\x7b\x00\x00\x00", 7);
 
+    // 48 89 0c 24             mov    QWORD PTR [rsp],rcx  (SP as pointer needs a SIB)
+    // 48 8b 0c 24             mov    rcx,QWORD PTR [rsp]
+    // 49 89 0c 24             mov    QWORD PTR [r12],rcx
+    l = new_asm_line_instruction_mem_reg(mp, OC_MOV, REG_RSP, REG_RCX);
+    verify_instr_encoding(l, "\x48\x89\x0c\x24", 4);
+    l = new_asm_line_instruction_reg_mem(mp, OC_MOV, REG_RCX, REG_RSP);
+    verify_instr_encoding(l, "\x48\x8b\x0c\x24", 4);
+    l = new_asm_line_instruction_mem_reg(mp, OC_MOV, REG_R12, REG_RCX);
+    verify_instr_encoding(l, "\x49\x89\x0c\x24", 4);
+
+    // 48 89 4d 00             mov    QWORD PTR [rbp+0x0],rcx  (mod 00 would be RIP relative)
+    // 48 8b 4d f8             mov    rcx,QWORD PTR [rbp-0x8]
+    // 48 8b 8d 00 ff ff ff    mov    rcx,QWORD PTR [rbp-0x100]
+    l = new_asm_line_instruction_mem_reg(mp, OC_MOV, REG_RBP, REG_RCX);
+    verify_instr_encoding(l, "\x48\x89\x4d\x00", 4);
+    l = new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_RCX), new_asm_operand_mem_by_reg(mp, REG_RBP, -8));
+    verify_instr_encoding(l, "\x48\x8b\x4d\xf8", 4);
+    l = new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_RCX), new_asm_operand_mem_by_reg(mp, REG_RBP, -256));
+    verify_instr_encoding(l, "\x48\x8b\x8d\x00\xff\xff\xff", 7);
+
+    // 48 83 ec 10             sub    rsp,0x10
+    // 48 81 ec 00 01 00 00    sub    rsp,0x100
+    // 83 7d fc 00             cmp    DWORD PTR [rbp-0x4],0x0
+    // 48 03 45 10             add    rax,QWORD PTR [rbp+0x10]
+    l = new_asm_line_instruction_reg_imm(mp, OC_SUB, REG_RSP, 0x10);
+    verify_instr_encoding(l, "\x48\x83\xec\x10", 4);
+    l = new_asm_line_instruction_reg_imm(mp, OC_SUB, REG_RSP, 0x100);
+    verify_instr_encoding(l, "\x48\x81\xec\x00\x01\x00\x00", 7);
+    l = new_asm_line_instruction_with_operands(mp, OC_CMP, new_asm_operand_mem_by_reg(mp, REG_RBP, -4), new_asm_operand_imm(mp, 0));
+    l->per_type.instruction->operands_data_size = DATA_DWORD;
+    verify_instr_encoding(l, "\x83\x7d\xfc\x00", 4);
+    l = new_asm_line_instruction_with_operands(mp, OC_ADD, new_asm_operand_reg(mp, REG_RAX), new_asm_operand_mem_by_reg(mp, REG_RBP, 16));
+    verify_instr_encoding(l, "\x48\x03\x45\x10", 4);
+
     // complex examples, with both modregrm and sib, displacement and immediate
     // mov    WORD PTR [rbx+rdx*4-0x200],0x7b
     //     -> 66 c7 84 93 00 fe ff ff 7b 00
@@ -791,6 +1849,162 @@ void test_instructions_encoding() {
     // mov    QWORD PTR [rbx+rdx*4-0x200],0x7b
     //     -> 48 c7 84 93 00 fe ff ff 7b 00 00 00
 
+    // 48 8d 04 40             lea    rax,[rax+rax*2]
+    // 4a 8d 04 cb             lea    rax,[rbx+r9*8]
+    l = new_asm_line_instruction_reg_mem_scaled(mp, OC_LEA, REG_RAX, REG_RAX, REG_RAX, 2);
+    verify_instr_encoding(l, "\x48\x8d\x04\x40", 4);
+    l = new_asm_line_instruction_reg_mem_scaled(mp, OC_LEA, REG_RAX, REG_RBX, REG_R9, 8);
+    verify_instr_encoding(l, "\x4a\x8d\x04\xcb", 4);
+
+    // 66 85 c0                test   ax,ax  (what comparing with zero becomes)
+    // 84 db                   test   bl,bl
+    // 4d 85 c0                test   r8,r8
+    // 48 85 4d f8             test   QWORD PTR [rbp-0x8],rcx
+    // f7 c1 00 01 00 00       test   ecx,0x100
+    l = new_asm_line_instruction_reg_reg(mp, OC_TEST, REG_AX, REG_AX);
+    verify_instr_encoding(l, "\x66\x85\xc0", 3);
+    l = new_asm_line_instruction_reg_reg(mp, OC_TEST, REG_BL, REG_BL);
+    verify_instr_encoding(l, "\x84\xdb", 2);
+    l = new_asm_line_instruction_reg_reg(mp, OC_TEST, REG_R8, REG_R8);
+    verify_instr_encoding(l, "\x4d\x85\xc0", 3);
+    l = new_asm_line_instruction_with_operands(mp, OC_TEST, new_asm_operand_reg(mp, REG_RCX), new_asm_operand_mem_by_reg(mp, REG_RBP, -8));
+    verify_instr_encoding(l, "\x48\x85\x4d\xf8", 4);
+    l = new_asm_line_instruction_reg_imm(mp, OC_TEST, REG_ECX, 0x100);
+    verify_instr_encoding(l, "\xf7\xc1\x00\x01\x00\x00", 6);
+
+    // 66 c1 e0 03             shl    ax,0x3
+    // 48 c1 e0 20             shl    rax,0x20
+    // 48 c1 ea 3f             shr    rdx,0x3f
+    // d1 fa                   sar    edx,1
+    // 49 c1 f9 05             sar    r9,0x5
+    // 66 d3 e0                shl    ax,cl  (the count register is given in the operation size)
+    // c0 e8 04                shr    al,0x4
+    // 48 c1 7d f0 02          sar    QWORD PTR [rbp-0x10],0x2
+    l = new_asm_line_instruction_reg_imm(mp, OC_SHL, REG_AX, 3);
+    verify_instr_encoding(l, "\x66\xc1\xe0\x03", 4);
+    l = new_asm_line_instruction_reg_imm(mp, OC_SHL, REG_RAX, 32);
+    verify_instr_encoding(l, "\x48\xc1\xe0\x20", 4);
+    l = new_asm_line_instruction_reg_imm(mp, OC_SHR, REG_RDX, 63);
+    verify_instr_encoding(l, "\x48\xc1\xea\x3f", 4);
+    l = new_asm_line_instruction_reg_imm(mp, OC_SAR, REG_EDX, 1);
+    verify_instr_encoding(l, "\xd1\xfa", 2);
+    l = new_asm_line_instruction_reg_imm(mp, OC_SAR, REG_R9, 5);
+    verify_instr_encoding(l, "\x49\xc1\xf9\x05", 4);
+    l = new_asm_line_instruction_with_operands(mp, OC_SHL, new_asm_operand_reg(mp, REG_AX), new_asm_operand_reg(mp, REG_CX));
+    verify_instr_encoding(l, "\x66\xd3\xe0", 3);
+    l = new_asm_line_instruction_reg_imm(mp, OC_SHR, REG_AL, 4);
+    verify_instr_encoding(l, "\xc0\xe8\x04", 3);
+    l = new_asm_line_instruction_mem_imm(mp, OC_SAR, REG_RBP, DATA_QWORD, 2);
+    l->per_type.instruction->regmem_operand.per_type.mem.displacement = -16;
+    verify_instr_encoding(l, "\x48\xc1\x7d\xf0\x02", 5);
+
+    // 48 f7 d8                neg    rax
+    // 66 f7 d8                neg    ax
+    // 41 f7 da                neg    r10d
+    l = new_asm_line_instruction_for_register(mp, OC_NEG, REG_RAX);
+    verify_instr_encoding(l, "\x48\xf7\xd8", 3);
+    l = new_asm_line_instruction_for_register(mp, OC_NEG, REG_AX);
+    verify_instr_encoding(l, "\x66\xf7\xd8", 3);
+    l = new_asm_line_instruction_for_register(mp, OC_NEG, REG_R10D);
+    verify_instr_encoding(l, "\x41\xf7\xda", 3);
+
+    // 48 f7 e9                imul   rcx
+    // 66 f7 e9                imul   cx
+    // 48 0f af c1             imul   rax,rcx
+    // 4c 0f af 45 f8          imul   r8,QWORD PTR [rbp-0x8]
+    // 6b c0 0a                imul   eax,eax,0xa
+    // 48 69 d2 e8 03 00 00    imul   rdx,rdx,0x3e8
+    // 4d 6b c9 03             imul   r9,r9,0x3
+    l = new_asm_line_instruction_for_register(mp, OC_IMUL, REG_RCX);
+    verify_instr_encoding(l, "\x48\xf7\xe9", 3);
+    l = new_asm_line_instruction_for_register(mp, OC_IMUL, REG_CX);
+    verify_instr_encoding(l, "\x66\xf7\xe9", 3);
+    l = new_asm_line_instruction_reg_reg(mp, OC_IMUL, REG_RAX, REG_RCX);
+    verify_instr_encoding(l, "\x48\x0f\xaf\xc1", 4);
+    l = new_asm_line_instruction_with_operands(mp, OC_IMUL, new_asm_operand_reg(mp, REG_R8), new_asm_operand_mem_by_reg(mp, REG_RBP, -8));
+    verify_instr_encoding(l, "\x4c\x0f\xaf\x45\xf8", 5);
+    l = new_asm_line_instruction_reg_imm(mp, OC_IMUL, REG_EAX, 10);
+    verify_instr_encoding(l, "\x6b\xc0\x0a", 3);
+    l = new_asm_line_instruction_reg_imm(mp, OC_IMUL, REG_RDX, 1000);
+    verify_instr_encoding(l, "\x48\x69\xd2\xe8\x03\x00\x00", 7);
+    l = new_asm_line_instruction_reg_imm(mp, OC_IMUL, REG_R9, 3);
+    verify_instr_encoding(l, "\x4d\x6b\xc9\x03", 4);
+
+    // 66 f7 e1                mul    cx  (listed as "MUL AX, CX")
+    // 48 f7 65 f8             mul    QWORD PTR [rbp-0x8]
+    // 66 f7 f1                div    cx
+    // f7 75 f0                div    DWORD PTR [rbp-0x10]
+    // 48 f7 f3                div    rbx
+    // 48 f7 d0                not    rax
+    // 66 f7 d0                not    ax
+    l = new_asm_line_instruction_with_operands(mp, OC_MUL, new_asm_operand_reg(mp, REG_AX), new_asm_operand_reg(mp, REG_CX));
+    verify_instr_encoding(l, "\x66\xf7\xe1", 3);
+    l = new_asm_line_instruction_with_operands(mp, OC_MUL, new_asm_operand_reg(mp, REG_RAX), new_asm_operand_mem_by_reg(mp, REG_RBP, -8));
+    verify_instr_encoding(l, "\x48\xf7\x65\xf8", 4);
+    l = new_asm_line_instruction_with_operands(mp, OC_DIV, new_asm_operand_reg(mp, REG_AX), new_asm_operand_reg(mp, REG_CX));
+    verify_instr_encoding(l, "\x66\xf7\xf1", 3);
+    l = new_asm_line_instruction_with_operands(mp, OC_DIV, new_asm_operand_reg(mp, REG_EAX), new_asm_operand_mem_by_reg(mp, REG_RBP, -16));
+    verify_instr_encoding(l, "\xf7\x75\xf0", 3);
+    l = new_asm_line_instruction_for_register(mp, OC_DIV, REG_RBX);
+    verify_instr_encoding(l, "\x48\xf7\xf3", 3);
+    l = new_asm_line_instruction_for_register(mp, OC_NOT, REG_RAX);
+    verify_instr_encoding(l, "\x48\xf7\xd0", 3);
+    l = new_asm_line_instruction_for_register(mp, OC_NOT, REG_AX);
+    verify_instr_encoding(l, "\x66\xf7\xd0", 3);
+
+    // ff d0                   call   rax  (as "CALL AX", branches are always 64 bits)
+    // 41 ff d3                call   r11
+    // ff 55 f8                call   QWORD PTR [rbp-0x8]
+    // ff e0                   jmp    rax
+    // 41 ff e3                jmp    r11
+    l = new_asm_line_instruction_for_register(mp, OC_CALL, REG_AX);
+    verify_instr_encoding(l, "\xff\xd0", 2);
+    l = new_asm_line_instruction_for_register(mp, OC_CALL, REG_R11);
+    verify_instr_encoding(l, "\x41\xff\xd3", 3);
+    l = new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_reg(mp, REG_RBP, -8));
+    verify_instr_encoding(l, "\xff\x55\xf8", 3);
+    l = new_asm_line_instruction_for_register(mp, OC_JMP, REG_RAX);
+    verify_instr_encoding(l, "\xff\xe0", 2);
+    l = new_asm_line_instruction_for_register(mp, OC_JMP, REG_R11W);
+    verify_instr_encoding(l, "\x41\xff\xe3", 3);
+
+    // 66 0f 44 c1             cmove  ax,cx
+    // 0f 4c c2                cmovl  eax,edx
+    // 48 0f 4f 45 f8          cmovg  rax,QWORD PTR [rbp-0x8]
+    // 4c 0f 43 cb             cmovae r9,rbx
+    // 49 0f 46 d4             cmovbe rdx,r12  (given as "reg <- reg", target in rm)
+    l = new_asm_line_instruction_reg_regmem(mp, OC_CMOVEQ, REG_AX, new_asm_operand_reg(mp, REG_CX));
+    verify_instr_encoding(l, "\x66\x0f\x44\xc1", 4);
+    l = new_asm_line_instruction_reg_regmem(mp, OC_CMOVLT, REG_EAX, new_asm_operand_reg(mp, REG_EDX));
+    verify_instr_encoding(l, "\x0f\x4c\xc2", 3);
+    l = new_asm_line_instruction_reg_regmem(mp, OC_CMOVGT, REG_RAX, new_asm_operand_mem_by_reg(mp, REG_RBP, -8));
+    verify_instr_encoding(l, "\x48\x0f\x4f\x45\xf8", 5);
+    l = new_asm_line_instruction_reg_regmem(mp, OC_CMOVAE, REG_R9, new_asm_operand_reg(mp, REG_RBX));
+    verify_instr_encoding(l, "\x4c\x0f\x43\xcb", 4);
+    l = new_asm_line_instruction_reg_reg(mp, OC_CMOVBE, REG_RDX, REG_R12);
+    verify_instr_encoding(l, "\x49\x0f\x46\xd4", 4);
+
+    // 31 c0                   xor    eax,eax  (for rax, upper half zeroed)
+    // 48 31 d8                xor    rax,rbx
+    l = new_asm_line_instruction_reg_reg(mp, OC_XOR, REG_RAX, REG_RAX);
+    verify_instr_encoding(l, "\x31\xc0", 2);
+    l = new_asm_line_instruction_reg_reg(mp, OC_XOR, REG_RAX, REG_RBX);
+    verify_instr_encoding(l, "\x48\x31\xd8", 3);
+
+    // 45 31 e4                xor    r12d,r12d  (for r12, still needs REX.RB)
+    // 41 01 c0                add    r8d,eax
+    l = new_asm_line_instruction_reg_reg(mp, OC_XOR, REG_R12, REG_R12);
+    verify_instr_encoding(l, "\x45\x31\xe4", 3);
+    l = new_asm_line_instruction_reg_reg(mp, OC_ADD, REG_R8D, REG_EAX);
+    verify_instr_encoding(l, "\x41\x01\xc0", 3);
+
+    // 6a 05                   push   0x5
+    // 68 00 01 00 00          push   0x100
+    l = new_asm_line_instruction_with_operand(mp, OC_PUSH, new_asm_operand_imm(mp, 5));
+    verify_instr_encoding(l, "\x6a\x05", 2);
+    l = new_asm_line_instruction_with_operand(mp, OC_PUSH, new_asm_operand_imm(mp, 0x100));
+    verify_instr_encoding(l, "\x68\x00\x01\x00\x00", 5);
+
     l = new_asm_line_instruction_for_register(mp, OC_PUSH, REG_DI);
     verify_instr_encoding(l, "\x66\xff\xf7", 3);
     l = new_asm_line_instruction_for_register(mp, OC_PUSH, REG_RDI);
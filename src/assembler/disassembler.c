@@ -0,0 +1,759 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../err_handler.h"
+#include "../utils/all.h"
+#include "asm_line.h"
+#include "disassembler.h"
+
+
+/*
+    Decodes x86_64 machine code back into asm_instructions, for verifying
+    what the assembler encodes and for listing object files and executables.
+    It knows the forms the assembler emits, and the multi-byte NOPs it pads with:
+
+        [66] [67] [REX]  00-3B/r          ADD, OR, AND, SUB, XOR, CMP
+                         80/n, 81/n, 83/n the same, with an immediate
+                         88-8B/r, C6/0, C7/0, B0+r, B8+r   MOV
+                         8D/r             LEA
+                         84/r, 85/r       TEST
+                         F6/n, F7/n       TEST imm, NOT, NEG, MUL, IMUL, DIV
+                         C0/n, C1/n, D0-D3/n   SHL, SHR, SAR
+                         0F AF/r, 6B/r, 69/r   IMUL
+                         0F 4x/r          CMOVcc
+                         FF/6, 6A, 68, 8F/0   PUSH, POP
+                         EB, E9, 7x, 0F 8x, E8, FF/2, FF/4   JMP, Jcc, CALL
+                         90, 0F 1F/0, C3, 0F 05   NOP, RET, SYSCALL
+
+    Anything else, e.g. the code of other compilers, is left undecoded.
+*/
+
+#define REX_W  0x08  // 64 bits operands
+#define REX_R  0x04  // extends the reg of ModRegRm
+#define REX_X  0x02  // extends the index of SIB
+#define REX_B  0x01  // extends the rm of ModRegRm, the base of SIB, or the register in the opcode
+
+// the reading position in the code, with what the prefixes said
+struct decoder {
+    const u8 *code;
+    size_t available;
+    size_t pos;
+    bool prefix_66;   // 16 bits operands
+    bool prefix_67;   // 32 bits addresses
+    u8 rex;           // zero if there was none
+    bool failed;      // ran out of bytes, or a form we don't encode
+};
+
+// the "/digit" of 80, 81 and 83, also the rows of 00-3B. ADC and SBB are not ours
+static const instr_code arithmetic_operations[8] = {
+    OC_ADD, OC_OR, OC_NONE, OC_NONE, OC_AND, OC_SUB, OC_XOR, OC_CMP
+};
+
+// by the "cc" part of 7x and 0F 8x
+static const instr_code jump_operations[16] = {
+    [0x2] = OC_JBL, [0x3] = OC_JAE, [0x4] = OC_JEQ, [0x5] = OC_JNE,
+    [0x6] = OC_JBE, [0x7] = OC_JAB, [0xC] = OC_JLT, [0xD] = OC_JGE,
+    [0xE] = OC_JLE, [0xF] = OC_JGT,
+};
+
+// ... and of 0F 4x
+static const instr_code move_operations[16] = {
+    [0x2] = OC_CMOVBL, [0x3] = OC_CMOVAE, [0x4] = OC_CMOVEQ, [0x5] = OC_CMOVNE,
+    [0x6] = OC_CMOVBE, [0x7] = OC_CMOVAB, [0xC] = OC_CMOVLT, [0xD] = OC_CMOVGE,
+    [0xE] = OC_CMOVLE, [0xF] = OC_CMOVGT,
+};
+
+// the "/digit" of F6 and F7, of C0, C1 and D0-D3. IDIV, ROL, RCL and the like are not ours
+static const instr_code unary_operations[8] = {
+    [2] = OC_NOT, [3] = OC_NEG, [4] = OC_MUL, [5] = OC_IMUL, [6] = OC_DIV
+};
+static const instr_code shift_operations[8] = {
+    [4] = OC_SHL, [5] = OC_SHR, [7] = OC_SAR
+};
+
+static u8 next_byte(struct decoder *d) {
+    if (d->pos >= d->available) {
+        d->failed = true;
+        return 0;
+    }
+    return d->code[d->pos++];
+}
+
+static s32 next_s8(struct decoder *d) {
+    return (s8)next_byte(d);
+}
+
+static s32 next_s32(struct decoder *d) {
+    u32 value = 0;
+    for (int i = 0; i < 4; i++)
+        value |= (u32)next_byte(d) << (i * 8);
+    return (s32)value;
+}
+
+// immediates are 16 bits for 16 bits operands, 32 bits (sign extended) for the rest
+static s32 next_immediate(struct decoder *d, data_size width) {
+    if (width != DATA_WORD)
+        return next_s32(d);
+    u16 value = next_byte(d);
+    value |= (u16)next_byte(d) << 8;
+    return (s16)value;
+}
+
+// number is 0-15, REX extension included
+static gp_register register_of(struct decoder *d, int number, data_size width) {
+    // with a REX, 4-7 would be SPL, BPL, SIL, DIL, we never encode those
+    if (width == DATA_BYTE && d->rex != 0 && number >= 4 && number <= 7)
+        d->failed = true;
+    int size_index = (width == DATA_BYTE) ? 0 : (width == DATA_WORD) ? 1 : (width == DATA_DWORD) ? 2 : 3;
+    return (gp_register)(((number & 0x8) ? 32 : 0) + size_index * 8 + (number & 0x7));
+}
+
+// the ModRegRm byte, with the SIB and the displacement that may follow.
+// the rm part goes to the operand, the reg part is returned, REX.R included
+static int decode_modregrm(struct decoder *d, asm_reg_or_mem_operand *operand, data_size width) {
+    u8 modregrm = next_byte(d);
+    int mod = modregrm >> 6;
+    int reg = ((modregrm >> 3) & 0x7) | ((d->rex & REX_R) ? 8 : 0);
+    int rm = (modregrm & 0x7) | ((d->rex & REX_B) ? 8 : 0);
+
+    if (mod == 3) {
+        operand->is_register = true;
+        operand->per_type.reg = register_of(d, rm, width);
+        return reg;
+    }
+    if (mod == 0 && (rm & 0x7) == 5) {
+        // RIP relative, this is how addresses of symbols get encoded
+        operand->is_mem_addr_by_symbol = true;
+        operand->per_type.mem.displacement = next_s32(d);
+        return reg;
+    }
+
+    data_size pointer_width = d->prefix_67 ? DATA_DWORD : DATA_QWORD;
+    operand->is_memory_by_reg = true;
+    if ((rm & 0x7) == 4) {
+        // SP (or R12) says a SIB follows, its index is none when it is SP too
+        u8 sib = next_byte(d);
+        int index = ((sib >> 3) & 0x7) | ((d->rex & REX_X) ? 8 : 0);
+        rm = (sib & 0x7) | ((d->rex & REX_B) ? 8 : 0);
+        if (mod == 0 && (rm & 0x7) == 5)
+            d->failed = true; // no base, just a displacement, we don't encode those
+        if (index != 4) {
+            operand->per_type.mem.array_index_reg = register_of(d, index, pointer_width);
+            operand->per_type.mem.array_item_size = 1 << (sib >> 6);
+        }
+    }
+    operand->per_type.mem.pointer_reg = register_of(d, rm, pointer_width);
+    if (mod == 1)
+        operand->per_type.mem.displacement = next_s8(d);
+    else if (mod == 2)
+        operand->per_type.mem.displacement = next_s32(d);
+    return reg;
+}
+
+// e.g. 01/r "ADD rm, r" or 03/r "ADD r, rm"
+static void decode_two_operands(struct decoder *d, asm_instruction *instr, instr_code op, data_size width, bool rm_to_reg) {
+    int reg = decode_modregrm(d, &instr->regmem_operand, width);
+    instr->operation = op;
+    instr->operands_data_size = width;
+    instr->direction_regmem_to_regimm = rm_to_reg;
+    instr->regimm_operand.is_register = true;
+    instr->regimm_operand.per_type.reg = register_of(d, reg, width);
+}
+
+// e.g. 81/5 "SUB rm, imm32" or 83/5 "SUB rm, imm8", the operation is in the reg part
+static void decode_operand_and_immediate(struct decoder *d, asm_instruction *instr, const instr_code *ops_by_reg, data_size width, bool short_immediate) {
+    int reg = decode_modregrm(d, &instr->regmem_operand, width);
+    instr->operation = ops_by_reg[reg & 0x7];
+    instr->operands_data_size = width;
+    instr->regimm_operand.is_immediate = true;
+    instr->regimm_operand.per_type.immediate = short_immediate ? next_s8(d) : next_immediate(d, width);
+}
+
+// e.g. F7/3 "NEG rm", the operation is in the reg part
+static void decode_single_operand(struct decoder *d, asm_instruction *instr, const instr_code *ops_by_reg, data_size width) {
+    int reg = decode_modregrm(d, &instr->regmem_operand, width);
+    instr->operation = ops_by_reg[reg & 0x7];
+    instr->operands_data_size = width;
+}
+
+// jumps and calls, the target is the displacement from the end of the instruction
+static void decode_relative(struct decoder *d, asm_instruction *instr, instr_code op, bool short_displacement) {
+    instr->operation = op;
+    instr->regmem_operand.is_mem_addr_by_symbol = true;
+    instr->regmem_operand.per_type.mem.displacement = short_displacement ? next_s8(d) : next_s32(d);
+}
+
+int x86_64_decode_instruction(const u8 *code, size_t available, asm_instruction *instr) {
+    struct decoder decoder = { .code = code, .available = available };
+    struct decoder *d = &decoder;
+    memset(instr, 0, sizeof(asm_instruction));
+
+    // prefixes, in the order we emit them, though any order decodes
+    u8 op = next_byte(d);
+    while (op == 0x66 || op == 0x67) {
+        if (op == 0x66) d->prefix_66 = true;
+        else d->prefix_67 = true;
+        op = next_byte(d);
+    }
+    if ((op & 0xF0) == 0x40) {
+        d->rex = op;
+        op = next_byte(d);
+    }
+    data_size width = (d->rex & REX_W) ? DATA_QWORD : (d->prefix_66 ? DATA_WORD : DATA_DWORD);
+    data_size stack_width = d->prefix_66 ? DATA_WORD : DATA_QWORD; // no 32 bits on the stack
+
+    static const instr_code mov_only[8] = { OC_MOV };
+    static const instr_code push_or_branch[8] = { [2] = OC_CALL, [4] = OC_JMP, [6] = OC_PUSH };
+    static const instr_code test_only[8] = { OC_TEST };
+    static const instr_code pop_only[8] = { OC_POP };
+    static const instr_code nop_only[8] = { OC_NOP };
+
+    if (op < 0x40 && (op & 0x7) < 4 && arithmetic_operations[op >> 3] != OC_NONE) {
+        // the low bits say 8 bits or not, and the direction
+        decode_two_operands(d, instr, arithmetic_operations[op >> 3], (op & 1) ? width : DATA_BYTE, (op & 2) != 0);
+    } else if (op >= 0x88 && op <= 0x8B) {
+        decode_two_operands(d, instr, OC_MOV, (op & 1) ? width : DATA_BYTE, (op & 2) != 0);
+    } else if (op == 0x84 || op == 0x85) {
+        decode_two_operands(d, instr, OC_TEST, (op & 1) ? width : DATA_BYTE, false);
+    } else if (op == 0xF6 || op == 0xF7) {
+        data_size operand_width = (op & 1) ? width : DATA_BYTE;
+        size_t modregrm_pos = d->pos;
+        if (modregrm_pos < d->available && ((d->code[modregrm_pos] >> 3) & 0x7) == 0) {
+            // F6/0 ib, F7/0 iw/id, TEST has no sign extended form
+            decode_operand_and_immediate(d, instr, test_only, operand_width, op == 0xF6);
+        } else {
+            decode_single_operand(d, instr, unary_operations, operand_width);
+        }
+    } else if (op == 0xC0 || op == 0xC1 || (op >= 0xD0 && op <= 0xD3)) {
+        // by an imm8, by one, or by CL, which we list in the operation size like "SHL AX, CX"
+        data_size operand_width = (op & 1) ? width : DATA_BYTE;
+        decode_single_operand(d, instr, shift_operations, operand_width);
+        if (op == 0xC0 || op == 0xC1) {
+            instr->regimm_operand.is_immediate = true;
+            instr->regimm_operand.per_type.immediate = next_s8(d);
+        } else if (op == 0xD0 || op == 0xD1) {
+            instr->regimm_operand.is_immediate = true;
+            instr->regimm_operand.per_type.immediate = 1;
+        } else {
+            instr->regimm_operand.is_register = true;
+            instr->regimm_operand.per_type.reg = register_of(d, 1, operand_width);
+        }
+    } else if (op == 0x69 || op == 0x6B) {
+        // the three operands IMUL, we only encode it with the same register twice
+        int reg = decode_modregrm(d, &instr->regmem_operand, width);
+        if (!instr->regmem_operand.is_register || instr->regmem_operand.per_type.reg != register_of(d, reg, width))
+            d->failed = true;
+        instr->operation = OC_IMUL;
+        instr->operands_data_size = width;
+        instr->regimm_operand.is_immediate = true;
+        instr->regimm_operand.per_type.immediate = (op == 0x6B) ? next_s8(d) : next_immediate(d, width);
+    } else if (op == 0x8D) {
+        decode_two_operands(d, instr, OC_LEA, width, true);
+        if (instr->regmem_operand.is_register)
+            d->failed = true;
+    } else if (op == 0x80 || op == 0x81 || op == 0x83) {
+        decode_operand_and_immediate(d, instr, arithmetic_operations, op == 0x80 ? DATA_BYTE : width, op != 0x81);
+    } else if (op == 0xC6 || op == 0xC7) {
+        decode_operand_and_immediate(d, instr, mov_only, op == 0xC6 ? DATA_BYTE : width, op == 0xC6);
+    } else if (op >= 0xB0 && op <= 0xBF) {
+        // the register is in the opcode, REX.W would make it the 10 bytes form, not ours
+        data_size reg_width = (op < 0xB8) ? DATA_BYTE : width;
+        if (d->rex & REX_W)
+            d->failed = true;
+        instr->operation = OC_MOV;
+        instr->operands_data_size = reg_width;
+        instr->regmem_operand.is_register = true;
+        instr->regmem_operand.per_type.reg = register_of(d, (op & 0x7) | ((d->rex & REX_B) ? 8 : 0), reg_width);
+        instr->regimm_operand.is_immediate = true;
+        instr->regimm_operand.per_type.immediate = (reg_width == DATA_BYTE) ? next_s8(d) : next_immediate(d, reg_width);
+    } else if (op == 0xFF || op == 0x8F) {
+        // near branches are 64 bits, even without REX.W
+        size_t modregrm_pos = d->pos;
+        bool is_branch = op == 0xFF && modregrm_pos < d->available && ((d->code[modregrm_pos] >> 3) & 0x7) != 6;
+        decode_single_operand(d, instr, (op == 0xFF) ? push_or_branch : pop_only, is_branch ? DATA_QWORD : stack_width);
+        if (is_branch && d->prefix_66)
+            d->failed = true;
+    } else if (op == 0x6A || op == 0x68) {
+        instr->operation = OC_PUSH;
+        instr->operands_data_size = stack_width;
+        instr->regimm_operand.is_immediate = true;
+        instr->regimm_operand.per_type.immediate = (op == 0x6A) ? next_s8(d) : next_immediate(d, stack_width);
+    } else if (op == 0x90) {
+        instr->operation = OC_NOP;
+    } else if (op == 0xC3) {
+        instr->operation = OC_RET;
+    } else if (op == 0xE8 || op == 0xE9 || op == 0xEB) {
+        decode_relative(d, instr, op == 0xE8 ? OC_CALL : OC_JMP, op == 0xEB);
+    } else if (op >= 0x70 && op <= 0x7F) {
+        decode_relative(d, instr, jump_operations[op & 0xF], true);
+    } else if (op == 0x0F) {
+        op = next_byte(d);
+        if (op == 0x05) {
+            instr->operation = OC_SYSCALL;
+        } else if (op == 0x1F) {
+            // the multi-byte NOPs of the alignment padding, e.g. "NOP DWORD PTR [RAX+RAX*1+0]"
+            decode_operand_and_immediate(d, instr, nop_only, width, false);
+            instr->regimm_operand.is_immediate = false;
+            d->pos -= (width == DATA_WORD) ? 2 : 4; // there was no immediate
+        } else if (op >= 0x80 && op <= 0x8F) {
+            decode_relative(d, instr, jump_operations[op & 0xF], false);
+        } else if (op >= 0x40 && op <= 0x4F) {
+            decode_two_operands(d, instr, move_operations[op & 0xF], width, true);
+        } else if (op == 0xAF) {
+            decode_two_operands(d, instr, OC_IMUL, width, true);
+        } else {
+            d->failed = true;
+        }
+    } else {
+        d->failed = true;
+    }
+
+    if (d->failed || instr->operation == OC_NONE)
+        return 0;
+    return (int)d->pos;
+}
+
+// ------------------------------------------------------------
+
+static int compare_symbols_by_value(const void *a, const void *b) {
+    obj_symbol *s1 = *(obj_symbol **)a;
+    obj_symbol *s2 = *(obj_symbol **)b;
+    if (s1->value != s2->value)
+        return s1->value < s2->value ? -1 : 1;
+    return str_cmp(s1->name, s2->name);
+}
+
+static int compare_relocations_by_offset(const void *a, const void *b) {
+    obj_relocation *r1 = *(obj_relocation **)a;
+    obj_relocation *r2 = *(obj_relocation **)b;
+    return r1->offset < r2->offset ? -1 : (r1->offset > r2->offset ? 1 : 0);
+}
+
+// the symbol at the address, or the closest one before it, as "name+0x12"
+static str *name_of_address(obj_section *sect, obj_symbol **symbols, int count, size_t address, mempool *mp) {
+    if (address >= sect->address && address <= sect->address + bin_len(sect->contents)) {
+        int low = 0, high = count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (symbols[mid]->value <= address) low = mid + 1;
+            else high = mid;
+        }
+        if (low > 0 && symbols[low - 1]->value == address)
+            return new_str(mp, str_charptr(symbols[low - 1]->name));
+        if (low > 0)
+            return new_strf(mp, "%s+0x%lx", str_charptr(symbols[low - 1]->name), address - symbols[low - 1]->value);
+    }
+    return new_strf(mp, "0x%lx", address);
+}
+
+static void disassemble_section(obj_section *sect, FILE *stream, mempool *mp) {
+    int symbols_count = list_length(sect->symbols);
+    obj_symbol **symbols = mpallocn(mp, sizeof(obj_symbol *) * (symbols_count + 1), symbols);
+    int index = 0;
+    for_list(sect->symbols, obj_symbol, sym)
+        symbols[index++] = sym;
+    qsort(symbols, symbols_count, sizeof(obj_symbol *), compare_symbols_by_value);
+
+    int relocations_count = list_length(sect->relocations);
+    obj_relocation **relocations = mpallocn(mp, sizeof(obj_relocation *) * (relocations_count + 1), relocations);
+    index = 0;
+    for_list(sect->relocations, obj_relocation, rel)
+        relocations[index++] = rel;
+    qsort(relocations, relocations_count, sizeof(obj_relocation *), compare_relocations_by_offset);
+
+    size_t length = bin_len(sect->contents);
+    fprintf(stream, "Section %s, %lu bytes at 0x%lx\n", str_charptr(sect->name), length, sect->address);
+    if (length == 0)
+        return;
+
+    const u8 *code = bin_ptr_at(sect->contents, 0);
+    int next_symbol = 0;
+    int next_relocation = 0;
+    str *text = new_str(mp, NULL);
+    char bytes[64];
+    asm_instruction instr;
+
+    for (size_t offset = 0; offset < length; ) {
+        size_t address = sect->address + offset;
+        for (; next_symbol < symbols_count && symbols[next_symbol]->value <= address; next_symbol++) {
+            if (symbols[next_symbol]->value == address)
+                fprintf(stream, "%s:\n", str_charptr(symbols[next_symbol]->name));
+        }
+
+        str_clear(text);
+        int instr_len = x86_64_decode_instruction(code + offset, length - offset, &instr);
+        if (instr_len == 0) {
+            instr_len = 1;
+            str_catf(text, "db   0x%02x", code[offset]);
+        } else {
+            if (instr.regmem_operand.is_mem_addr_by_symbol) {
+                // a relocation names the target, otherwise the symbols around it do
+                while (next_relocation < relocations_count && relocations[next_relocation]->offset < offset)
+                    next_relocation++;
+                str *target;
+                if (next_relocation < relocations_count && relocations[next_relocation]->offset < offset + instr_len) {
+                    obj_relocation *rel = relocations[next_relocation];
+                    long delta = rel->addendum + (long)(offset + instr_len - rel->offset);
+                    target = delta == 0 ? new_str(mp, str_charptr(rel->symbol_name)) :
+                        new_strf(mp, "%s%+ld", str_charptr(rel->symbol_name), delta);
+                } else {
+                    size_t target_address = address + instr_len + instr.regmem_operand.per_type.mem.displacement;
+                    target = name_of_address(sect, symbols, symbols_count, target_address, mp);
+                }
+                instr.regmem_operand.per_type.mem.displacement_symbol_name = (char *)str_charptr(target);
+            }
+            asm_instruction_to_str(&instr, text, false);
+        }
+
+        bytes[0] = '\0';
+        for (int i = 0; i < instr_len && i < 16; i++)
+            snprintf(bytes + i * 3, sizeof(bytes) - i * 3, "%02x ", code[offset + i]);
+        fprintf(stream, "  %8lx:  %-30s %s\n", address, bytes, str_charptr(text));
+        offset += instr_len;
+    }
+}
+
+void x86_64_disassemble_module(obj_module *module, FILE *stream) {
+    mempool *mp = new_mempool();
+
+    for_list(module->sections, obj_section, sect) {
+        if (!sect->flags.executable)
+            continue;
+        disassemble_section(sect, stream, mp);
+    }
+
+    mempool_release(mp);
+}
+
+
+#ifdef INCLUDE_UNIT_TESTS
+#include "../utils/unit_tests.h"
+#include "../run_info.h"
+#include "asm_listing.h"
+#include "assembler.h"
+
+static void test_decode_round_trip();
+static void test_decode_jumps_and_listing();
+static void test_decode_padding();
+
+void disassembler_unit_tests() {
+    test_decode_round_trip();
+    test_decode_jumps_and_listing();
+    test_decode_padding();
+}
+
+static obj_section *_assembled(mempool *mp, asm_listing *lst) {
+    assembler *as = new_assembler(mp);
+    obj_module *m = as->ops->assemble_listing_into_x86_64_code(as, lst, new_str(mp, "disassembler.c"));
+    return m == NULL ? NULL : list_get(m->sections, 0);
+}
+
+static asm_line *_with_memory(asm_line *l, gp_register base, long displacement, gp_register index, int scale) {
+    asm_reg_or_mem_operand *operand = &l->per_type.instruction->regmem_operand;
+    operand->is_register = false;
+    operand->is_memory_by_reg = true;
+    operand->per_type.mem.pointer_reg = base;
+    operand->per_type.mem.displacement = displacement;
+    operand->per_type.mem.array_index_reg = index;
+    operand->per_type.mem.array_item_size = scale;
+    return l;
+}
+
+static gp_register _register(int number, int size_index) {
+    return (gp_register)(((number & 0x8) ? 32 : 0) + size_index * 8 + (number & 0x7));
+}
+
+// the assembler picks the shorter 32 bits forms of these, they zero the upper half all the same
+static void _narrow(asm_instruction *i) {
+    if (!i->regmem_operand.is_register || register_data_size(i->regmem_operand.per_type.reg) != DATA_QWORD)
+        return;
+    gp_register reg = i->regmem_operand.per_type.reg;
+    if (i->operation == OC_MOV && i->regimm_operand.is_immediate && i->regimm_operand.per_type.immediate >= 0) {
+        i->regmem_operand.per_type.reg -= (REG_RAX - REG_EAX);
+    } else if (i->operation == OC_XOR && i->regimm_operand.is_register && i->regimm_operand.per_type.reg == reg) {
+        i->regmem_operand.per_type.reg -= (REG_RAX - REG_EAX);
+        i->regimm_operand.per_type.reg -= (REG_RAX - REG_EAX);
+    }
+}
+
+static bool _same_instruction(asm_instruction *a, asm_instruction *b) {
+    asm_reg_or_mem_operand *m1 = &a->regmem_operand, *m2 = &b->regmem_operand;
+    asm_reg_or_imm_operand *r1 = &a->regimm_operand, *r2 = &b->regimm_operand;
+    if (a->operation != b->operation || asm_instruction_data_size(a) != asm_instruction_data_size(b))
+        return false;
+
+    if (m1->is_register != m2->is_register || m1->is_memory_by_reg != m2->is_memory_by_reg ||
+        m1->is_mem_addr_by_symbol != m2->is_mem_addr_by_symbol)
+        return false;
+    if (m1->is_register && m1->per_type.reg != m2->per_type.reg)
+        return false;
+    if (m1->is_memory_by_reg && (m1->per_type.mem.pointer_reg != m2->per_type.mem.pointer_reg ||
+            m1->per_type.mem.displacement != m2->per_type.mem.displacement ||
+            m1->per_type.mem.array_item_size != m2->per_type.mem.array_item_size ||
+            (m1->per_type.mem.array_item_size > 0 && m1->per_type.mem.array_index_reg != m2->per_type.mem.array_index_reg)))
+        return false;
+
+    if (r1->is_register != r2->is_register || r1->is_immediate != r2->is_immediate)
+        return false;
+    if (r1->is_register && (r1->per_type.reg != r2->per_type.reg || a->direction_regmem_to_regimm != b->direction_regmem_to_regimm))
+        return false;
+    if (r1->is_immediate) {
+        // only as many bits as the operation takes
+        data_size width = asm_instruction_data_size(a);
+        u32 mask = (width == DATA_BYTE) ? 0xFF : (width == DATA_WORD) ? 0xFFFF : 0xFFFFFFFF;
+        if (((u32)r1->per_type.immediate & mask) != ((u32)r2->per_type.immediate & mask))
+            return false;
+    }
+    return true;
+}
+
+static void test_decode_round_trip() {
+    mempool *mp = new_mempool();
+    asm_listing *lst = new_asm_listing(mp);
+    #define add(line)  lst->ops->add_line(lst, line)
+
+    // every register of every size, against another one, and with immediates
+    instr_code ops[] = { OC_MOV, OC_ADD, OC_OR, OC_AND, OC_SUB, OC_XOR, OC_CMP };
+    for (int o = 0; o < 7; o++) {
+        for (int size = 0; size < 4; size++) {
+            for (int n = 0; n < 16; n++) {
+                if (size == 0 && n >= 4 && n <= 7)
+                    continue; // AH-BH cannot go with a REX
+                int other = (n * 5 + 3) % 16;
+                if (size == 0 && other >= 4 && other <= 7)
+                    other -= 4;
+                add(new_asm_line_instruction_reg_reg(mp, ops[o], _register(n, size), _register(other, size)));
+                asm_line *l = new_asm_line_instruction_reg_reg(mp, ops[o], _register(other, size), _register(n, size));
+                l->per_type.instruction->direction_regmem_to_regimm = true;
+                add(l);
+                add(new_asm_line_instruction_reg_imm(mp, ops[o], _register(n, size), 5));
+                add(new_asm_line_instruction_reg_imm(mp, ops[o], _register(n, size), -3));
+                add(new_asm_line_instruction_reg_imm(mp, ops[o], _register(n, size), size == 0 ? 100 : 1000));
+            }
+        }
+    }
+    for (int n = 0; n < 16; n++)
+        add(new_asm_line_instruction_reg_reg(mp, OC_XOR, _register(n, 3), _register(n, 3)));
+
+    // all the addressing forms, from and to memory
+    struct { gp_register base; long displacement; gp_register index; int scale; } addresses[] = {
+        { REG_RBP, -8, 0, 0 }, { REG_RSP, 16, 0, 0 }, { REG_R12, 0, 0, 0 }, { REG_R13, 0, 0, 0 },
+        { REG_RAX, 0x1000, 0, 0 }, { REG_RBX, 0, REG_RSI, 4 }, { REG_R8, -0x80, REG_R9, 8 },
+        { REG_RDI, 12, REG_R12, 2 }, { REG_RCX, 0, REG_RDX, 1 }, { REG_EBX, 4, 0, 0 },
+    };
+    gp_register regs[] = { REG_AL, REG_R9B, REG_CX, REG_R10W, REG_EDX, REG_R11D, REG_RSI, REG_R15 };
+    for (int a = 0; a < 10; a++) {
+        #define at(line)  _with_memory(line, addresses[a].base, addresses[a].displacement, addresses[a].index, addresses[a].scale)
+        for (int o = 0; o < 7; o++) {
+            for (int r = 0; r < 8; r++) {
+                add(at(new_asm_line_instruction_mem_reg(mp, ops[o], REG_RAX, regs[r])));
+                add(at(new_asm_line_instruction_reg_mem(mp, ops[o], regs[r], REG_RAX)));
+            }
+            add(at(new_asm_line_instruction_mem_imm(mp, ops[o], REG_RAX, DATA_BYTE, 7)));
+            add(at(new_asm_line_instruction_mem_imm(mp, ops[o], REG_RAX, DATA_WORD, 300)));
+            add(at(new_asm_line_instruction_mem_imm(mp, ops[o], REG_RAX, DATA_DWORD, -1)));
+            add(at(new_asm_line_instruction_mem_imm(mp, ops[o], REG_RAX, DATA_QWORD, 100000)));
+        }
+        add(at(new_asm_line_instruction_reg_mem(mp, OC_LEA, REG_RAX, REG_RAX)));
+        add(at(new_asm_line_instruction_reg_mem(mp, OC_LEA, REG_R10D, REG_RAX)));
+        add(at(new_asm_line_instruction_with_operand(mp, OC_PUSH, new_asm_operand_mem_by_reg(mp, REG_RAX, 0))));
+        add(at(new_asm_line_instruction_with_operand(mp, OC_POP, new_asm_operand_mem_by_reg(mp, REG_RAX, 0))));
+        #undef at
+    }
+
+    // the stack, symbols and the simple ones
+    for (int n = 0; n < 16; n++) {
+        add(new_asm_line_instruction_for_register(mp, OC_PUSH, _register(n, 3)));
+        add(new_asm_line_instruction_for_register(mp, OC_POP, _register(n, 1)));
+    }
+    add(new_asm_line_instruction_with_operand(mp, OC_PUSH, new_asm_operand_imm(mp, 5)));
+    add(new_asm_line_instruction_with_operand(mp, OC_PUSH, new_asm_operand_imm(mp, -1000)));
+
+    // what multiplying, dividing, shifting and selecting need
+    instr_code unary_ops[] = { OC_NOT, OC_NEG, OC_MUL, OC_IMUL, OC_DIV };
+    instr_code shift_ops[] = { OC_SHL, OC_SHR, OC_SAR };
+    instr_code move_ops[] = { OC_CMOVEQ, OC_CMOVNE, OC_CMOVAB, OC_CMOVAE, OC_CMOVBL, OC_CMOVBE, OC_CMOVGT, OC_CMOVGE, OC_CMOVLT, OC_CMOVLE };
+    for (int size = 0; size < 4; size++) {
+        for (int n = 0; n < 16; n++) {
+            if (size == 0 && n >= 4 && n <= 7)
+                continue;
+            int other = (n * 7 + 2) % 16;
+            if (size == 0 && other >= 4 && other <= 7)
+                other -= 4;
+            add(new_asm_line_instruction_reg_reg(mp, OC_TEST, _register(n, size), _register(other, size)));
+            add(new_asm_line_instruction_reg_imm(mp, OC_TEST, _register(n, size), size == 0 ? 0x40 : 0x100));
+            for (int o = 0; o < 5; o++)
+                add(new_asm_line_instruction_for_register(mp, unary_ops[o], _register(n, size)));
+            for (int o = 0; o < 3; o++) {
+                add(new_asm_line_instruction_reg_imm(mp, shift_ops[o], _register(n, size), 1));
+                add(new_asm_line_instruction_reg_imm(mp, shift_ops[o], _register(n, size), 5));
+                add(new_asm_line_instruction_reg_reg(mp, shift_ops[o], _register(n, size), _register(1, size)));
+            }
+            if (size == 0)
+                continue; // no 8 bits forms for these
+            add(new_asm_line_instruction_reg_regmem(mp, OC_IMUL, _register(n, size), new_asm_operand_reg(mp, _register(other, size))));
+            add(new_asm_line_instruction_reg_imm(mp, OC_IMUL, _register(n, size), 10));
+            add(new_asm_line_instruction_reg_imm(mp, OC_IMUL, _register(n, size), 1000));
+            add(new_asm_line_instruction_reg_regmem(mp, move_ops[n % 10], _register(n, size), new_asm_operand_reg(mp, _register(other, size))));
+        }
+    }
+    for (int o = 0; o < 10; o++)
+        add(new_asm_line_instruction_reg_regmem(mp, move_ops[o], REG_R9, new_asm_operand_mem_by_reg(mp, REG_RBP, -8)));
+    add(new_asm_line_instruction_reg_regmem(mp, OC_IMUL, REG_EAX, new_asm_operand_mem_by_reg(mp, REG_R12, 0x200)));
+    add(new_asm_line_instruction_with_operand(mp, OC_NEG, new_asm_operand_mem_by_reg(mp, REG_RBP, -16)));
+    add(new_asm_line_instruction_mem_imm(mp, OC_SAR, REG_RBP, DATA_DWORD, 3));
+    add(new_asm_line_instruction_mem_reg(mp, OC_TEST, REG_RSI, REG_DX));
+    for (int n = 0; n < 16; n++) {
+        add(new_asm_line_instruction_for_register(mp, OC_CALL, _register(n, 3)));
+        add(new_asm_line_instruction_for_register(mp, OC_JMP, _register(n, 3)));
+    }
+    add(new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_reg(mp, REG_RBP, -8)));
+    add(new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_RAX), new_asm_operand_mem_by_sym(mp, "data")));
+    add(new_asm_line_instruction_with_operands(mp, OC_ADD, new_asm_operand_mem_by_sym(mp, "data"), new_asm_operand_reg(mp, REG_R8D)));
+    add(new_asm_line_instruction(mp, OC_NOP));
+    add(new_asm_line_instruction(mp, OC_SYSCALL));
+    add(new_asm_line_instruction(mp, OC_RET));
+    #undef add
+
+    obj_section *s = _assembled(mp, lst);
+    assert(s != NULL);
+    if (s == NULL)
+        return;
+
+    // decode each back, it must be what we encoded, and encode the same again
+    const u8 *code = bin_ptr_at(s->contents, 0);
+    size_t length = bin_len(s->contents);
+    size_t offset = 0;
+    int mismatches = 0;
+    asm_listing *decoded = new_asm_listing(mp);
+    for_list(lst->lines, asm_line, line) {
+        asm_instruction expected = *line->per_type.instruction;
+        _narrow(&expected);
+        asm_line *copy = new_asm_line_instruction(mp, OC_NONE);
+        asm_instruction *instr = copy->per_type.instruction;
+        int instr_len = x86_64_decode_instruction(code + offset, length - offset, instr);
+        if (instr_len == 0 || !_same_instruction(&expected, instr)) {
+            str *got = new_str(mp, NULL);
+            if (instr_len > 0)
+                asm_instruction_to_str(instr, got, false);
+            printf("\n  '%s' decoded as '%s', at offset 0x%lx\n", str_charptr(asm_line_to_str(mp, line)), str_charptr(got), offset);
+            mismatches++;
+            break;
+        }
+        if (instr->regmem_operand.is_mem_addr_by_symbol)
+            instr->regmem_operand.per_type.mem.displacement_symbol_name = expected.regmem_operand.per_type.mem.displacement_symbol_name;
+        decoded->ops->add_line(decoded, copy);
+        offset += instr_len;
+    }
+    assert(mismatches == 0);
+    assert(offset == length);
+    assert(list_length(decoded->lines) == list_length(lst->lines));
+
+    obj_section *again = _assembled(mp, decoded);
+    assert(again != NULL && bin_len(again->contents) == length);
+    assert(again != NULL && memcmp(bin_ptr_at(again->contents, 0), code, length) == 0);
+
+    // truncated, or not ours
+    asm_instruction instr;
+    assert(x86_64_decode_instruction((u8 *)"\xe8\x00\x00", 3, &instr) == 0);
+    assert(x86_64_decode_instruction((u8 *)"\x48", 1, &instr) == 0);
+    assert(x86_64_decode_instruction((u8 *)"\x6b\xc3\x05", 3, &instr) == 0);  // IMUL EAX, EBX, 5
+    assert(x86_64_decode_instruction((u8 *)"\xf7\xf8", 2, &instr) == 0);      // IDIV EAX
+    assert(x86_64_decode_instruction((u8 *)"\xd1\xc0", 2, &instr) == 0);      // ROL EAX, 1
+    assert(x86_64_decode_instruction((u8 *)"\x40\x88\xe0", 3, &instr) == 0);  // MOV AL, SPL
+
+    mempool_release(mp);
+}
+
+static void test_decode_jumps_and_listing() {
+    mempool *mp = new_mempool();
+    asm_listing *lst = new_asm_listing(mp);
+
+    lst->ops->set_next_label(lst, "func");
+    lst->ops->add_line(lst, new_asm_line_instruction_reg_imm(mp, OC_CMP, REG_RAX, 1));
+    lst->ops->set_next_label(lst, "again");
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_JEQ, new_asm_operand_mem_by_sym(mp, "done")));
+    for (int i = 0; i < 200; i++)
+        lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_NOP));
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_JNE, new_asm_operand_mem_by_sym(mp, "again")));
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_sym(mp, "other")));
+    lst->ops->add_line(lst, new_asm_line_instruction_with_operand(mp, OC_JMP, new_asm_operand_mem_by_sym(mp, "elsewhere")));
+    lst->ops->set_next_label(lst, "done");
+    lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_RET));
+
+    assembler *as = new_assembler(mp);
+    obj_module *m = as->ops->assemble_listing_into_x86_64_code(as, lst, new_str(mp, "jumps.c"));
+    assert(m != NULL);
+    if (m == NULL)
+        return;
+    obj_section *s = list_get(m->sections, 0);
+    const u8 *code = bin_ptr_at(s->contents, 0);
+    asm_instruction instr;
+
+    // JEQ done is short, JNE again is near, the call goes to the linker
+    assert(x86_64_decode_instruction(code + 4, bin_len(s->contents) - 4, &instr) == 6);
+    assert(instr.operation == OC_JEQ && 4 + 6 + instr.regmem_operand.per_type.mem.displacement == bin_len(s->contents) - 1);
+    assert(x86_64_decode_instruction(code + 210, bin_len(s->contents) - 210, &instr) == 6);
+    assert(instr.operation == OC_JNE && 210 + 6 + instr.regmem_operand.per_type.mem.displacement == 4);
+    assert(x86_64_decode_instruction(code + 216, bin_len(s->contents) - 216, &instr) == 5);
+    assert(instr.operation == OC_CALL && instr.regmem_operand.is_mem_addr_by_symbol);
+
+    // the listing names the targets, by label or by relocation
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *f = open_memstream(&text, &text_len);
+    x86_64_disassemble_module(m, f);
+    fclose(f);
+    assert(strstr(text, "\nagain:\n") != NULL);
+    assert(strstr(text, "JEQ  done\n") != NULL);
+    assert(strstr(text, "JNE  again\n") != NULL);
+    assert(strstr(text, "e8 00 00 00 00                 CALL other\n") != NULL);
+    assert(strstr(text, "JMP  elsewhere\n") != NULL);
+    free(text);
+
+    mempool_release(mp);
+}
+
+static void test_decode_padding() {
+    mempool *mp = new_mempool();
+    asm_listing *lst = new_asm_listing(mp);
+
+    // functions of 1 to 16 bytes, padded with every NOP length
+    char label[16];
+    for (int i = 0; i < 16; i++) {
+        snprintf(label, sizeof(label), "func%d", i);
+        lst->ops->set_next_label(lst, "%s", label);
+        for (int j = 0; j < i; j++)
+            lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_NOP));
+        lst->ops->add_line(lst, new_asm_line_instruction(mp, OC_RET));
+    }
+    int saved = run_info->options->align_functions;
+    run_info->options->align_functions = 16;
+    obj_section *s = _assembled(mp, lst);
+    run_info->options->align_functions = saved;
+    assert(s != NULL && bin_len(s->contents) == 16 * 16);
+    if (s == NULL)
+        return;
+
+    int returns = 0, undecoded = 0, longest_nop = 0;
+    asm_instruction instr;
+    for (size_t offset = 0; offset < bin_len(s->contents); ) {
+        int instr_len = x86_64_decode_instruction(bin_ptr_at(s->contents, offset), bin_len(s->contents) - offset, &instr);
+        if (instr_len == 0) {
+            undecoded++;
+            break;
+        }
+        if (instr.operation == OC_RET)
+            returns++;
+        else if (instr.operation == OC_NOP && instr_len > longest_nop)
+            longest_nop = instr_len;
+        offset += instr_len;
+    }
+    assert(undecoded == 0);
+    assert(returns == 16);
+    assert(longest_nop == 9);
+
+    mempool_release(mp);
+}
+
+#endif
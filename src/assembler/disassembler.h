@@ -0,0 +1,20 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include "asm_line.h"
+#include "../elf/obj_module.h"
+
+// decodes the x86_64 instruction at the start of the code, the forms our assembler encodes.
+// relative jumps and calls, and RIP relative memory, get a memory by symbol operand
+// with no name, the displacement is from the end of the instruction.
+// returns the instruction length, 0 if the bytes are not something we decode
+int x86_64_decode_instruction(const u8 *code, size_t available, asm_instruction *instr);
+
+// prints the code sections of an object file or executable, one instruction per line,
+// with its address and bytes, labeled by the symbols, targets named after them
+void x86_64_disassemble_module(obj_module *module, FILE *stream);
+
+
+#ifdef INCLUDE_UNIT_TESTS
+void disassembler_unit_tests();
+#endif
@@ -1,12 +1,44 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "asm_allocator.h"
 #include "../../run_info.h"
-
+#include "../../err_handler.h"
+
+
+/*
+    Temp registers are allocated once per function, by linear scan
+    over their live intervals, before any code is emitted:
+    - an interval spans from the first to the last entry mentioning the temp reg,
+      extended to the end of any loop it is live in (see run_statistics)
+    - intervals are visited by start, taking a free cpu register if any,
+      otherwise whichever interval is read furthest in the future goes to stack
+    - intervals crossing calls prefer registers the callees preserve,
+      otherwise they are split: they keep their register, but live on stack
+      during the calls, unless read too rarely to be worth the stores and loads.
+*/
+
+#define MAX_GP_REGS  14
+
+// a live interval of a temp register, and the storage we gave it
+struct temp_interval {
+    int reg_no;
+    int start; // first and last entry index it is live in
+    int end;
+    int *uses_arr; // entry indexes mentioning it, ascending
+    int uses_len;
+    int calls_crossed;
+    bool avoid_cx; // live across a shift, which uses CL
+    bool avoid_dx; // live across a multiplication or division
+    bool saved_around_calls;
+    bool reported;
+    struct storage value;
+    struct storage home; // where it stays during calls
+};
 
 struct asm_allocator_data {
-    asm_listing *listing; // to grab stack space at runtime.
+    asm_listing *listing; // for the stack info comments
     int lowest_bp_offset; // equal to negative BP offset of last variable
 
     // function arguments and local variables.
@@ -16,12 +48,11 @@ struct asm_allocator_data {
     } *named_storage_arr;
     int named_storage_arr_len;
 
-    // allocatable to temp_registers
-    struct temp_storage_slot {
-        int holder_reg; // non-zero means allocated.
-        struct storage value; 
-    } *temp_storage_arr;
-    int temp_storage_arr_len;
+    // temp registers of the current function, indexed by reg_no - min_reg_no
+    struct temp_interval *intervals_arr;
+    int intervals_arr_len;
+    int min_reg_no;
+    mempool *intervals_mempool;
 
     mempool *mempool;
 };
@@ -30,6 +61,9 @@ struct asm_allocator_data {
 static void _reset(asm_allocator *a);
 static void _declare_local_symbol(asm_allocator *a, const char *symbol, int size, int bp_offset);
 static void _generate_stack_info_comments(asm_allocator *a);
+static int _allocate_temp_regs(asm_allocator *a, ir_listing *ir, int start, int end, allocation_stats *stats);
+static int _get_regs_saved_around_call(asm_allocator *a, int call_index, int max, storage *regs, storage *homes);
+static bool _is_gp_reg_used(asm_allocator *a, gp_register r);
 static bool _get_named_storage(asm_allocator *a, const char *symbol_name, storage *target); // false = not found
 static void _get_temp_reg_storage(asm_allocator *a, int temp_reg_no, storage *target, bool *allocated);
 static bool _is_treg_a_gp_reg(asm_allocator *a, int reg_no);
@@ -42,6 +76,9 @@ static struct storage_allocator_ops ops = {
     .reset = _reset,
     .declare_local_symbol = _declare_local_symbol,
     .generate_stack_info_comments = _generate_stack_info_comments,
+    .allocate_temp_regs = _allocate_temp_regs,
+    .get_regs_saved_around_call = _get_regs_saved_around_call,
+    .is_gp_reg_used = _is_gp_reg_used,
     .get_named_storage = _get_named_storage,
     .get_temp_reg_storage = _get_temp_reg_storage,
     .is_treg_a_gp_reg = _is_treg_a_gp_reg,
@@ -68,7 +105,7 @@ asm_allocator *new_asm_allocator(mempool *mp, asm_listing *listing) {
 static void _reset(asm_allocator *a) {
     struct asm_allocator_data *data = (struct asm_allocator_data *)a->private_data;
     
-    // clear all temp storage, put the first 5 gp registers
+    // clear all named and temp storage
     if (data->named_storage_arr != NULL) {
         free(data->named_storage_arr);
         data->named_storage_arr = NULL;
@@ -76,30 +113,13 @@ static void _reset(asm_allocator *a) {
     }
     data->lowest_bp_offset = 0;
 
-    if (data->temp_storage_arr != NULL) {
-        free(data->named_storage_arr);
-        data->temp_storage_arr = NULL;
-        data->temp_storage_arr_len = 0;
+    if (data->intervals_mempool != NULL) {
+        mempool_release(data->intervals_mempool);
+        data->intervals_mempool = NULL;
     }
-
-    // prepare the slots for the gp registers
-    // AX is excluded to be allowed to work in any situation
-    // SP and BP are excluded, as they ar eneeded for functions to work.
-    // BX, CX, DX, SI, DI can be allocated.
-
-    data->temp_storage_arr_len = 5;
-    data->temp_storage_arr = malloc(data->temp_storage_arr_len * sizeof(struct temp_storage_slot));
-    memset(data->temp_storage_arr, 0, data->temp_storage_arr_len * sizeof(struct temp_storage_slot));
-    for (int i = 0; i < 5; i++)
-        data->temp_storage_arr[i].value.is_gp_reg = 1;
-    
-    data->temp_storage_arr[0].value.gp_reg = REG_BX;
-    data->temp_storage_arr[1].value.gp_reg = REG_CX;
-    data->temp_storage_arr[2].value.gp_reg = REG_DX;
-    data->temp_storage_arr[3].value.gp_reg = REG_SI;
-    data->temp_storage_arr[4].value.gp_reg = REG_DI;
-
-    // printf("Prepared storage allocation table:\n"); for (int j=0;j<data->temp_storage_arr_len;j++) printf("  #%d  owner=%d, is_gp=%d, gp=%d, is_bp_off=%d, bp_off=%d\n", j, data->temp_storage_arr[j].holder_reg, data->temp_storage_arr[j].value.is_gp_reg, data->temp_storage_arr[j].value.gp_reg, data->temp_storage_arr[j].value.is_stack_var, data->temp_storage_arr[j].value.bp_offset);
+    data->intervals_arr = NULL;
+    data->intervals_arr_len = 0;
+    data->min_reg_no = 0;
 }
 
 static void _declare_local_symbol(asm_allocator *a, const char *symbol, int size, int bp_offset) {
@@ -150,86 +170,352 @@ static bool _get_named_storage(asm_allocator *a, const char *symbol_name, storag
     return false; // not found
 }
 
-static void _get_temp_reg_storage(asm_allocator *a, int temp_reg_no, storage *target, bool *allocated) {
-    struct asm_allocator_data *data = (struct asm_allocator_data *)a->private_data;
-    *allocated = false;
-    
-    // first see if this register already holds something.
-    for (int i = 0; i < data->temp_storage_arr_len; i++) {
-        if (data->temp_storage_arr[i].holder_reg == temp_reg_no) {
-            memcpy(target, &data->temp_storage_arr[i].value, sizeof(storage));
-            return;
+// AX is excluded to be allowed to work in any situation
+// SP is excluded, BP too, unless we omit the frame pointer.
+static gp_register allocatable_regs[MAX_GP_REGS - 1] = {
+    REG_BX, REG_CX, REG_DX, REG_SI, REG_DI,
+    // only in 64 bits mode, the converter treats them as native size like the above
+    REG_R8W, REG_R9W, REG_R10W, REG_R11W, REG_R12W, REG_R13W, REG_R14W, REG_R15W
+};
+
+// returns the number of registers, BP goes last, it costs a save
+static int _get_register_pool(gp_register *regs) {
+    int count = run_info->options->is_32_bits ? 5 : MAX_GP_REGS - 1;
+    memcpy(regs, allocatable_regs, sizeof(gp_register) * count);
+    if (run_info->options->omit_frame_pointer)
+        regs[count++] = REG_BP;
+    return count;
+}
+
+struct reg_range {
+    int min;
+    int max;
+};
+
+static void _find_reg_range(ir_value *v, void *pdata, int idata) {
+    struct reg_range *r = (struct reg_range *)pdata;
+    if (v == NULL || v->type != IR_TREG)
+        return;
+    if (v->val.temp_reg_no < r->min) r->min = v->val.temp_reg_no;
+    if (v->val.temp_reg_no > r->max) r->max = v->val.temp_reg_no;
+}
+
+struct collect_data {
+    struct asm_allocator_data *data;
+    bool recording; // first pass only counts
+};
+
+static void _collect_use(ir_value *v, void *pdata, int idata) {
+    struct collect_data *cd = (struct collect_data *)pdata;
+    if (v == NULL || v->type != IR_TREG)
+        return;
+
+    struct temp_interval *t = &cd->data->intervals_arr[v->val.temp_reg_no - cd->data->min_reg_no];
+    if (cd->recording) {
+        if (t->uses_len == 0 || t->uses_arr[t->uses_len - 1] != idata)
+            t->uses_arr[t->uses_len++] = idata;
+    } else {
+        if (t->start == -1)
+            t->start = idata;
+        else if (t->end == idata)
+            return; // mentioned twice in the same entry
+        t->end = idata;
+        t->uses_len++;
+    }
+}
+
+static int _next_use(struct temp_interval *t, int position) {
+    for (int i = 0; i < t->uses_len; i++) {
+        if (t->uses_arr[i] >= position)
+            return t->uses_arr[i];
+    }
+    return INT_MAX; // only live to go around a loop
+}
+
+static bool _reg_allowed(struct temp_interval *t, gp_register r) {
+    return !(r == REG_CX && t->avoid_cx) && !(r == REG_DX && t->avoid_dx);
+}
+
+static void _set_stack_storage(struct temp_interval *t) {
+    t->value.is_gp_reg = false;
+    t->value.is_stack_var = true;
+    t->saved_around_calls = false;
+}
+
+static int _compare_starts(const void *a, const void *b) {
+    struct temp_interval *t1 = *(struct temp_interval **)a;
+    struct temp_interval *t2 = *(struct temp_interval **)b;
+    if (t1->start != t2->start)
+        return t1->start - t2->start;
+    return t1->reg_no - t2->reg_no;
+}
+
+static void _find_live_ranges(struct asm_allocator_data *data, ir_listing *ir, int start, int end) {
+    struct collect_data cd = { data, false };
+    for (int i = start; i < end; i++)
+        ir->entries_arr[i]->ops->foreach_ir_value(ir->entries_arr[i], _collect_use, &cd, i);
+
+    for (int k = 0; k < data->intervals_arr_len; k++) {
+        struct temp_interval *t = &data->intervals_arr[k];
+        if (t->start == -1)
+            continue;
+        t->uses_arr = mpallocn(data->intervals_mempool, sizeof(int) * t->uses_len, uses_arr);
+        t->uses_len = 0;
+
+        int last = ir->ops->get_register_last_usage(ir, t->reg_no);
+        if (last > t->end)
+            t->end = last;
+    }
+    cd.recording = true;
+    for (int i = start; i < end; i++)
+        ir->entries_arr[i]->ops->foreach_ir_value(ir->entries_arr[i], _collect_use, &cd, i);
+
+    // see what each interval has to survive
+    for (int i = start; i < end; i++) {
+        ir_entry *e = ir->entries_arr[i];
+        bool is_call = (e->type == IR_FUNCTION_CALL && !e->t.function_call.is_tail_call);
+        bool uses_cx = false;
+        bool uses_dx = false;
+        if (e->type == IR_THREE_ADDR_CODE) {
+            ir_operation op = e->t.three_address_code.op;
+            ir_value *op2 = e->t.three_address_code.op2;
+            uses_cx = (op == IR_LSH || op == IR_RSH);
+            // constant divisors and factors, or the dividend they replace, go in CX
+            uses_cx |= ((op == IR_MUL || op == IR_DIV || op == IR_MOD) && op2 != NULL && op2->type == IR_IMM);
+            uses_dx = (op == IR_MUL || op == IR_DIV || op == IR_MOD);
         }
+        if (!is_call && !uses_cx && !uses_dx)
+            continue;
+
+        // operands are read before, results written after, so only the ones strictly across
+        for (int k = 0; k < data->intervals_arr_len; k++) {
+            struct temp_interval *t = &data->intervals_arr[k];
+            if (t->start == -1 || t->start >= i || t->end <= i)
+                continue;
+            if (is_call) t->calls_crossed++;
+            if (uses_cx) t->avoid_cx = true;
+            if (uses_dx) t->avoid_dx = true;
+        }
+    }
+}
+
+// with the System V convention, callees preserve BX and R12-R15 for us.
+// otherwise mcc functions use any register without saving it, except BP.
+static bool _clobbered_by_calls(gp_register r) {
+    if (r == REG_BP)
+        return false;
+    if (!run_info->options->sysv_calls)
+        return true;
+    return !(r == REG_BX || (r >= REG_R12W && r <= REG_R15W));
+}
+
+// a free register, of the preserved kind or of the clobbered kind
+static int _find_free_reg(struct temp_interval **owners, gp_register *regs, int regs_count, struct temp_interval *t, bool preserved) {
+    for (int r = 0; r < regs_count; r++) {
+        if (owners[r] == NULL && _reg_allowed(t, regs[r]) &&
+            _clobbered_by_calls(regs[r]) != preserved)
+            return r;
     }
+    return -1;
+}
 
-    // if we got here, we need to allocate a storage
-    *allocated = true;
+static void _linear_scan(struct temp_interval **order, int count) {
+    gp_register regs[MAX_GP_REGS];
+    int regs_count = _get_register_pool(regs);
+    struct temp_interval *owners[MAX_GP_REGS];
+    memset(owners, 0, sizeof(owners));
 
-    // find the first unowned slot to assign to this register
-    for (int i = 0; i < data->temp_storage_arr_len; i++) {
-        if (data->temp_storage_arr[i].holder_reg == 0) {
-            data->temp_storage_arr[i].holder_reg = temp_reg_no;
-            memcpy(target, &data->temp_storage_arr[i].value, sizeof(storage));
-            return;
+    for (int i = 0; i < count; i++) {
+        struct temp_interval *t = order[i];
+
+        // expire what ended, operands are read before the result is written
+        for (int r = 0; r < regs_count; r++) {
+            if (owners[r] != NULL && owners[r]->end <= t->start)
+                owners[r] = NULL;
+        }
+
+        // survive calls for free if we can, keep the preserved ones for that
+        int chosen = -1;
+        if (t->calls_crossed > 0)
+            chosen = _find_free_reg(owners, regs, regs_count, t, true);
+        if (chosen == -1) {
+            // not worth a register, if there are more calls to survive than reads
+            if (t->calls_crossed > 0 && t->calls_crossed >= t->uses_len - 1) {
+                _set_stack_storage(t);
+                continue;
+            }
+            chosen = _find_free_reg(owners, regs, regs_count, t, false);
         }
+        if (chosen == -1)
+            chosen = _find_free_reg(owners, regs, regs_count, t, true);
+
+        if (chosen == -1) {
+            // spill whoever is read furthest in the future, possibly ourselves
+            int furthest = _next_use(t, t->start + 1);
+            for (int r = 0; r < regs_count; r++) {
+                if (!_reg_allowed(t, regs[r]))
+                    continue;
+                int next = _next_use(owners[r], t->start);
+                if (next > furthest) {
+                    furthest = next;
+                    chosen = r;
+                }
+            }
+            if (chosen == -1) {
+                _set_stack_storage(t);
+                continue;
+            }
+            _set_stack_storage(owners[chosen]);
+        }
+
+        owners[chosen] = t;
+        t->value.is_gp_reg = true;
+        t->value.is_stack_var = false;
+        t->value.gp_reg = regs[chosen];
+        t->saved_around_calls = (t->calls_crossed > 0 && _clobbered_by_calls(t->value.gp_reg));
     }
+}
 
-    // take more space from stack, add one more slot, allocate it.
-    // temp registers have the size of the architecture (32 or 64 bits)
+// stack slots for the spilled intervals, and for the ones saved during calls
+static int _assign_stack_slots(struct asm_allocator_data *data, struct temp_interval **order, int count) {
     int size = run_info->options->pointer_size_bytes;
-    data->lowest_bp_offset -= size;
-    data->listing->ops->set_next_comment(data->listing, "grab some space for temp register");
-
-    // we need assembler here... to allocate stack for temp register...
-    data->listing->ops->add_line(data->listing, new_asm_line_instruction_for_reserving_stack_space(data->mempool, size));
-    data->temp_storage_arr_len += 1;
-    data->temp_storage_arr = realloc(data->temp_storage_arr, data->temp_storage_arr_len * sizeof(struct temp_storage_slot));
+    int *slot_ends = mpallocn(data->intervals_mempool, sizeof(int) * (count + 1), slot_ends);
+    int slots = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct temp_interval *t = order[i];
+        if (!t->value.is_stack_var && !t->saved_around_calls)
+            continue;
+
+        int slot = 0;
+        while (slot < slots && slot_ends[slot] >= t->start)
+            slot++;
+        if (slot == slots)
+            slots++;
+        slot_ends[slot] = t->end;
+
+        storage *s = t->value.is_stack_var ? &t->value : &t->home;
+        s->is_stack_var = true;
+        s->bp_offset = data->lowest_bp_offset - size * (slot + 1);
+        s->size = size;
+    }
 
-    // set the slot data, copy to target
-    struct temp_storage_slot *s = &data->temp_storage_arr[data->temp_storage_arr_len - 1];
-    s->value.bp_offset = data->lowest_bp_offset;
-    s->value.is_stack_var = true;
-    s->value.size = size;
-    s->holder_reg = temp_reg_no;
-    memcpy(target, &s->value, sizeof(storage));
+    data->lowest_bp_offset -= size * slots;
+    return size * slots;
 }
 
-static bool _is_treg_a_gp_reg(asm_allocator *a, int reg_no) {
+static int _allocate_temp_regs(asm_allocator *a, ir_listing *ir, int start, int end, allocation_stats *stats) {
     struct asm_allocator_data *data = (struct asm_allocator_data *)a->private_data;
+    memset(stats, 0, sizeof(allocation_stats));
+
+    struct reg_range range = { INT_MAX, 0 };
+    for (int i = start; i < end; i++)
+        ir->entries_arr[i]->ops->foreach_ir_value(ir->entries_arr[i], _find_reg_range, &range, i);
+    if (range.max == 0)
+        return 0;
+
+    mempool *mp = new_mempool();
+    data->intervals_mempool = mp;
+    data->min_reg_no = range.min;
+    data->intervals_arr_len = range.max - range.min + 1;
+    data->intervals_arr = mpallocn(mp, sizeof(struct temp_interval) * data->intervals_arr_len, intervals_arr);
+    memset(data->intervals_arr, 0, sizeof(struct temp_interval) * data->intervals_arr_len);
+    for (int k = 0; k < data->intervals_arr_len; k++) {
+        data->intervals_arr[k].reg_no = range.min + k;
+        data->intervals_arr[k].start = -1;
+    }
+    _find_live_ranges(data, ir, start, end);
 
-    for (int i = 0; i < data->temp_storage_arr_len; i++) {
-        if (data->temp_storage_arr[i].holder_reg == reg_no) {
-            return data->temp_storage_arr[i].value.is_gp_reg;
-        }
+    struct temp_interval **order = mpallocn(mp, sizeof(struct temp_interval *) * data->intervals_arr_len, order);
+    int count = 0;
+    for (int k = 0; k < data->intervals_arr_len; k++) {
+        if (data->intervals_arr[k].start != -1)
+            order[count++] = &data->intervals_arr[k];
     }
-    return false;
+    qsort(order, count, sizeof(struct temp_interval *), _compare_starts);
+
+    _linear_scan(order, count);
+    int stack_bytes = _assign_stack_slots(data, order, count);
+
+    for (int i = 0; i < count; i++) {
+        stats->temp_regs++;
+        if (order[i]->value.is_gp_reg) stats->in_registers++;
+        if (order[i]->value.is_stack_var) stats->spilled++;
+        if (order[i]->saved_around_calls) stats->saved_around_calls++;
+    }
+    return stack_bytes;
 }
 
-static bool _is_treg_a_stack_var(asm_allocator *a, int reg_no) {
+static int _get_regs_saved_around_call(asm_allocator *a, int call_index, int max, storage *regs, storage *homes) {
     struct asm_allocator_data *data = (struct asm_allocator_data *)a->private_data;
-    
-    for (int i = 0; i < data->temp_storage_arr_len; i++) {
-        if (data->temp_storage_arr[i].holder_reg == reg_no) {
-            return data->temp_storage_arr[i].value.is_stack_var;
-        }
+    int count = 0;
+
+    for (int k = 0; k < data->intervals_arr_len && count < max; k++) {
+        struct temp_interval *t = &data->intervals_arr[k];
+        if (!t->saved_around_calls || t->start >= call_index || t->end <= call_index)
+            continue;
+        regs[count] = t->value;
+        homes[count] = t->home;
+        count++;
+    }
+    return count;
+}
+
+static bool _is_gp_reg_used(asm_allocator *a, gp_register r) {
+    struct asm_allocator_data *data = (struct asm_allocator_data *)a->private_data;
+
+    for (int k = 0; k < data->intervals_arr_len; k++) {
+        struct temp_interval *t = &data->intervals_arr[k];
+        if (t->start != -1 && t->value.is_gp_reg && t->value.gp_reg == r)
+            return true;
     }
     return false;
 }
 
-static void _release_temp_reg_storage(asm_allocator *a, int temp_reg_no) {
+static struct temp_interval *_find_interval(struct asm_allocator_data *data, int reg_no) {
+    int k = reg_no - data->min_reg_no;
+    if (k < 0 || k >= data->intervals_arr_len || data->intervals_arr[k].start == -1)
+        return NULL;
+    return &data->intervals_arr[k];
+}
+
+static void _get_temp_reg_storage(asm_allocator *a, int temp_reg_no, storage *target, bool *allocated) {
     struct asm_allocator_data *data = (struct asm_allocator_data *)a->private_data;
     
-    for (int i = 0; i < data->temp_storage_arr_len; i++) {
-        if (data->temp_storage_arr[i].holder_reg == temp_reg_no) {
-            data->temp_storage_arr[i].holder_reg = 0;
-            return;
-        }
+    struct temp_interval *t = _find_interval(data, temp_reg_no);
+    if (t == NULL) {
+        error("internal bug, no storage planned for temp register r%d", temp_reg_no);
+        memset(target, 0, sizeof(storage));
+        *allocated = false;
+        return;
     }
+
+    // first time it is asked for, it counts as allocated
+    *allocated = !t->reported;
+    t->reported = true;
+    memcpy(target, &t->value, sizeof(storage));
+}
+
+static bool _is_treg_a_gp_reg(asm_allocator *a, int reg_no) {
+    struct temp_interval *t = _find_interval((struct asm_allocator_data *)a->private_data, reg_no);
+    return t != NULL && t->value.is_gp_reg;
+}
+
+static bool _is_treg_a_stack_var(asm_allocator *a, int reg_no) {
+    struct temp_interval *t = _find_interval((struct asm_allocator_data *)a->private_data, reg_no);
+    return t != NULL && t->value.is_stack_var;
+}
+
+static void _release_temp_reg_storage(asm_allocator *a, int temp_reg_no) {
+    // nothing to do, the plan already knows where each interval ends
 }
 
 static void _storage_to_str(asm_allocator *a, storage *stor, str *s) {
     if (stor->is_gp_reg) {
-        str_cats(s, register_name(stor->gp_reg));
+        if (register_is_extended(stor->gp_reg))
+            str_cats(s, register_name(stor->gp_reg - REG_R8W + REG_R8));
+        else
+            str_cats(s, register_name(stor->gp_reg));
     } else if (stor->is_stack_var) {
         str_catf(s, "[BP%+d] (%d bytes)", stor->bp_offset, stor->size);
     }
@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include "../asm_listing.h"
+#include "../../compiler/codegen/ir_listing.h"
 #include "../../utils/all.h"
 
 
@@ -22,10 +23,21 @@ typedef struct storage {
     int size;
 } storage;
 
+// how well the temp registers of a function fit in the cpu registers
+typedef struct allocation_stats {
+    int temp_regs;
+    int in_registers;
+    int spilled;            // living on stack for their whole lifetime
+    int saved_around_calls; // in a register, stored to stack during calls
+} allocation_stats;
+
 struct storage_allocator_ops {
     void (*reset)(asm_allocator *a);
     void (*declare_local_symbol)(asm_allocator *a, const char *symbol, int size, int bp_offset);
     void (*generate_stack_info_comments)(asm_allocator *a);
+    int (*allocate_temp_regs)(asm_allocator *a, ir_listing *ir, int start, int end, allocation_stats *stats); // returns stack bytes needed
+    int (*get_regs_saved_around_call)(asm_allocator *a, int call_index, int max, storage *regs, storage *homes);
+    bool (*is_gp_reg_used)(asm_allocator *a, gp_register r); // by any temp register
 
     bool (*get_named_storage)(asm_allocator *a, const char *symbol_name, storage *target); // false = not found
     void (*get_temp_reg_storage)(asm_allocator *a, int reg_no, storage *target, bool *allocated);
@@ -40,9 +40,8 @@ struct x86_encoder *new_x86_encoder(mempool *mp, bin *code_out, reloc_list *relo
 
 
 static bool _encode_v4(x86_encoder *encoder, asm_instruction *instr) {
+    // called for every instruction, everything lives on the stack
     struct encoding_info enc_info;
-    mempool *mp = new_mempool();
-    str *s;
 
     if (!load_encoding_info(instr, &enc_info)) {
         error("Failed loading encoding info for operation '%s'\n", instr_code_name(instr->operation));
@@ -52,7 +51,6 @@ static bool _encode_v4(x86_encoder *encoder, asm_instruction *instr) {
     encoded_instruction enc_instr;
     if (!encode_asm_instruction(instr, &enc_info, &enc_instr)) {
         error("Failed encoding instruction: '%s'\n", instr_code_name(instr->operation));
-        mempool_release(mp);
         return false;
     }
 
@@ -61,7 +59,7 @@ static bool _encode_v4(x86_encoder *encoder, asm_instruction *instr) {
     pack_encoded_instruction(&enc_instr, encoder->output);
 
     // show the conversion
-    // s = new_str(mp, NULL);
+    // str *s = new_str(encoder->mempool, NULL);
     // asm_instruction_to_str(instr, s, false);
     // printf("%-20s >> ", str_charptr(s));
     // str_clear(s);
@@ -159,13 +157,17 @@ static bool encode_asm_instr_operands(asm_instruction *instr, struct encoding_in
             // see if we have an array notation (item must be 1,2,4 or 8)
             if (instr->regmem_operand.per_type.mem.array_item_size == 0)
             {
-                // it's invalid to use SP as pointer, the notation is used for the SIB
-                if (instr->regmem_operand.per_type.mem.pointer_reg == REG_SP)
-                    return false;
-                
-                // no SIB byte, proceed normally
-                // "Mod" part will be set by the displacement size
-                result->values.modregrm_byte |= instr->regmem_operand.per_type.mem.pointer_reg;
+                if ((instr->regmem_operand.per_type.mem.pointer_reg & 0x7) == (REG_SP & 0x7)) {
+                    // SP as pointer, the notation is used for the SIB,
+                    // so we need one with no index and SP as base
+                    result->values.modregrm_byte |= (0x4);
+                    result->flags.have_sib = true;
+                    result->values.sib_byte = (0x4 << 3) | (REG_SP & 0x7);
+                } else {
+                    // no SIB byte, proceed normally
+                    // "Mod" part will be set by the displacement size
+                    result->values.modregrm_byte |= instr->regmem_operand.per_type.mem.pointer_reg;
+                }
             }
             else // we have item size, use SIB
             {
@@ -187,8 +189,10 @@ static bool encode_asm_instr_operands(asm_instruction *instr, struct encoding_in
                 result->values.sib_byte |= (instr->regmem_operand.per_type.mem.pointer_reg & 0x7);
             }
             
-            // SIB or not, add possible displacement
-            if (instr->regmem_operand.per_type.mem.displacement == 0) {
+            // SIB or not, add possible displacement.
+            // BP as base with mod 00 means no base, so it gets a zero byte
+            if (instr->regmem_operand.per_type.mem.displacement == 0 &&
+                (instr->regmem_operand.per_type.mem.pointer_reg & 0x7) != (REG_BP & 0x7)) {
                 // no displacement, set mod to 00
                 result->values.modregrm_byte |= (0x0 << 6);
             } else if (instr->regmem_operand.per_type.mem.displacement >= -128 && instr->regmem_operand.per_type.mem.displacement <= 127) {
@@ -54,11 +54,13 @@ struct encoding_info_table_row {
     { OC_POP,  "   8F .... /0 y. __ " }, // essentially 0x8F and a ModRM, short hand would be '01011rrr'
     { OC_MOV,  "   88 yy.. /. y. __ " }, // move between reg, mem
     { OC_MOV,  "   C6 y... /0 y. 32 " }, // for immediates (target in modregrm: mem or reg)
+    { OC_LEA,  "   8D .... /. y. __ " }, // address of the memory operand into reg, no memory access
     { OC_RET,  "   C3 .... /. .. __ " }, // return inside segment
     { OC_CALL, "   E8 .... /. .y __ " }, // direct call, full displacement (4bytes)
     { OC_CALL, "   FF .... /2 y. __ " }, // indirect call, through register
-    { OC_CMP,  "   34 yy.. /. y. __ " }, // move between reg, mem
+    { OC_CMP,  "   38 yy.. /. y. __ " }, // compare between reg, mem
     { OC_CMP,  "   80 yy.. /7 y. sb " }, // for immediates (target in modregrm: mem or reg)
+    { OC_TEST, "   84 y... /. y. __ " }, // AND without storing the result, no direction bit
     { OC_JMP,  "   E9 ..y. .. .. __ " }, // direct, through symbol (resolved by linker)
     { OC_JMP,  "   FF .... /4 y. __ " }, // indirect, through register
     { OC_JEQ,  "0F 84 .... /. .y __ " }, // the following with full displacement, e.g. 4 bytes
@@ -71,11 +73,22 @@ struct encoding_info_table_row {
     { OC_JGE,  "0F 8D .... /. .y __ " }, // (for signed ints) jump if greater or equal
     { OC_JLT,  "0F 8C .... /. .y __ " }, // (for signed ints) jump if less
     { OC_JLE,  "0F 8E .... /. .y __ " }, // (for signed ints) jump if less or equal
+    { OC_CMOVEQ, "0F 44 .... /. y. __ " }, // the following move reg/mem into reg, if the condition holds
+    { OC_CMOVNE, "0F 45 .... /. y. __ " },
+    { OC_CMOVAB, "0F 47 .... /. y. __ " },
+    { OC_CMOVAE, "0F 43 .... /. y. __ " },
+    { OC_CMOVBL, "0F 42 .... /. y. __ " },
+    { OC_CMOVBE, "0F 46 .... /. y. __ " },
+    { OC_CMOVGT, "0F 4F .... /. y. __ " },
+    { OC_CMOVGE, "0F 4D .... /. y. __ " },
+    { OC_CMOVLT, "0F 4C .... /. y. __ " },
+    { OC_CMOVLE, "0F 4E .... /. y. __ " },
     { OC_ADD,  "   00 yy.. /. y. __ " }, // add between reg, mem
     { OC_ADD,  "   80 y... /0 yy sb " }, // add immediate (32/8 bits depending on sign expansion bit)
     { OC_SUB,  "   28 yy.. /. y. __ " }, // sub between reg, mem
     { OC_SUB,  "   80 y... /5 yy sb " }, // sub immediate
     { OC_MUL,  "   F6 y... /4 y. __ " }, // multiply AX with register or memory location
+    { OC_IMUL, "   F6 y... /5 y. __ " }, // signed multiply AX with register or memory location, high part in DX
     { OC_DIV,  "   F6 y... /6 y. __ " }, // divide AX with register or memory location, remainder in DX
     { OC_INT,  "   CD .... /. .. 08 " }, // a one byte immediate
     { OC_INC,  "   FF y... /0 y. __ " }, // inc's memory or register
@@ -90,60 +103,90 @@ struct encoding_info_table_row {
     { OC_XOR,  "   80 y.y. /6 y. sb " }, // immediate to reg/mem
     { OC_SHL,  "   C0 y... /4 y. 08 " }, // shift mem/reg left by 8bit immediate
     { OC_SHR,  "   C0 y... /5 y. 08 " }, // shift mem/reg right by 8bit immediate
+    { OC_SAR,  "   C0 y... /7 y. 08 " }, // shift mem/reg right by 8bit immediate, keeping the sign
 
 };
 //   0     1     2     3     4     5     6     7     8     9     A     B     C     D     E     F
 // 0000  0001  0010  0011  0100  0101  0110  0111  1000  1001  1010  1011  1100  1101  1110  1111  
 
 
-bool load_encoding_info(asm_instruction *inst, struct encoding_info *info) {
-    bool needs_immediate = inst->regimm_operand.is_immediate;
-    bool needs_displacement = inst->regmem_operand.is_mem_addr_by_symbol;
+#define ROWS_COUNT  (sizeof(encoding_rows) / sizeof(encoding_rows[0]))
+
+// the rows above, decoded once. for each operation and operand form
+// (immediate or not, address of symbol or not), the index of its row, plus one.
+// zero means the operation has no encoding for that form.
+static struct encoding_info decoded_rows[ROWS_COUNT];
+static unsigned char row_per_form[OC_COUNT][2][2];
+static bool table_decoded = false;
+
+static void decode_row(struct encoding_info_table_row *entry, struct encoding_info *info) {
+    info->has_instruction_expansion_byte  = HAS_BYTE(entry->table_str, INSTR_EXPANSION_BYTE_POS);
+    info->instruction_expansion_byte      = GET_BYTE(entry->table_str, INSTR_EXPANSION_BYTE_POS);
+    info->base_opcode_byte                = GET_BYTE(entry->table_str, MAIN_OPCODE_POS);
+    info->has_width_bit                   = IS_TRUE(entry->table_str, WIDTH_BIT_POS);
+    info->has_direction_bit               = IS_TRUE(entry->table_str, DIRECTION_BIT_POS);
+    info->has_opcode_extension            = HAS_BYTE(entry->table_str, OPCODE_EXTENSION_POS);
+    info->opcode_extension_value          = HEX_DIGIT(entry->table_str[OPCODE_EXTENSION_POS]);
+    info->is_reg_part_of_opcode           = IS_TRUE(entry->table_str, REGISTER_PART_POS);
+    info->needs_modregrm                  = IS_TRUE(entry->table_str, NEEDS_MODREGRM_POS);
+    info->displacement_without_modrm      = IS_TRUE(entry->table_str, HAS_DISPLACEMENT_POS);
+
+    if (memcmp(&entry->table_str[IMMEDIATE_SUPPORT], "sb", 2) == 0)
+        info->immediate_support = IMM_SIGN_EXP_BIT;
+    else if (memcmp(&entry->table_str[IMMEDIATE_SUPPORT], "32", 2) == 0)
+        info->immediate_support = IMM_FIXED32;
+    else if (memcmp(&entry->table_str[IMMEDIATE_SUPPORT], "08", 2) == 0)
+        info->immediate_support = IMM_FIXED8;
+    else
+        info->immediate_support = IMM_NONE;
+}
+
+static bool row_supports_form(instr_code op, struct encoding_info *info, bool needs_immediate, bool is_symbol_address) {
+    bool needs_displacement = is_symbol_address;
+    if (needs_immediate && info->immediate_support == IMM_NONE)
+        return false;
+    if (needs_displacement && !(info->needs_modregrm || info->displacement_without_modrm))
+        return false;
     
-    for (int i = 0; i < sizeof(encoding_rows) / sizeof(encoding_rows[0]); i++) {
-        struct encoding_info_table_row *entry = &encoding_rows[i];
-        if (entry->op != inst->operation)
-            continue;
-
-        // parse the info
-        info->has_instruction_expansion_byte  = HAS_BYTE(entry->table_str, INSTR_EXPANSION_BYTE_POS);
-        info->instruction_expansion_byte      = GET_BYTE(entry->table_str, INSTR_EXPANSION_BYTE_POS);
-        info->base_opcode_byte                = GET_BYTE(entry->table_str, MAIN_OPCODE_POS);
-        info->has_width_bit                   = IS_TRUE(entry->table_str, WIDTH_BIT_POS);
-        info->has_direction_bit               = IS_TRUE(entry->table_str, DIRECTION_BIT_POS);
-        info->has_opcode_extension            = HAS_BYTE(entry->table_str, OPCODE_EXTENSION_POS);
-        info->opcode_extension_value          = HEX_DIGIT(entry->table_str[OPCODE_EXTENSION_POS]);
-        info->is_reg_part_of_opcode           = IS_TRUE(entry->table_str, REGISTER_PART_POS);
-        info->needs_modregrm                  = IS_TRUE(entry->table_str, NEEDS_MODREGRM_POS);
-        info->displacement_without_modrm      = IS_TRUE(entry->table_str, HAS_DISPLACEMENT_POS);
-
-        if (memcmp(&entry->table_str[IMMEDIATE_SUPPORT], "sb", 2) == 0)
-            info->immediate_support = IMM_SIGN_EXP_BIT;
-        else if (memcmp(&entry->table_str[IMMEDIATE_SUPPORT], "32", 2) == 0)
-            info->immediate_support = IMM_FIXED32;
-        else if (memcmp(&entry->table_str[IMMEDIATE_SUPPORT], "08", 2) == 0)
-            info->immediate_support = IMM_FIXED8;
-        else
-            info->immediate_support = IMM_NONE;
-
-        if (needs_immediate && info->immediate_support == IMM_NONE)
-            continue;
-        if (needs_displacement && !(info->needs_modregrm || info->displacement_without_modrm))
-            continue;
+    if (op == OC_CALL) {
+        // CALL is different when we call a displacement or through a register.
+        if (is_symbol_address && !info->displacement_without_modrm)
+            return false;
         
-        if (inst->operation == OC_CALL) {
-            // CALL is different when we call a displacement or through a register.
-            if (inst->regmem_operand.is_mem_addr_by_symbol && !info->displacement_without_modrm)
-                continue;
-            
-            // through a pointer or address pointed by a register
-            if (!inst->regmem_operand.is_mem_addr_by_symbol && info->displacement_without_modrm)
-                continue;
-        }
-
-        return true;
+        // through a pointer or address pointed by a register
+        if (!is_symbol_address && info->displacement_without_modrm)
+            return false;
     }
+    return true;
+}
+
+static void decode_table() {
+    for (int i = 0; i < ROWS_COUNT; i++)
+        decode_row(&encoding_rows[i], &decoded_rows[i]);
 
-    return false;
+    // the first row that fits, as rows are listed in order of preference
+    for (int i = ROWS_COUNT - 1; i >= 0; i--) {
+        instr_code op = encoding_rows[i].op;
+        for (int imm = 0; imm < 2; imm++) {
+            for (int sym = 0; sym < 2; sym++) {
+                if (row_supports_form(op, &decoded_rows[i], imm, sym))
+                    row_per_form[op][imm][sym] = i + 1;
+            }
+        }
+    }
+    table_decoded = true;
 }
 
+bool load_encoding_info(asm_instruction *inst, struct encoding_info *info) {
+    if (!table_decoded)
+        decode_table();
+
+    int row = row_per_form[inst->operation]
+        [inst->regimm_operand.is_immediate ? 1 : 0]
+        [inst->regmem_operand.is_mem_addr_by_symbol ? 1 : 0];
+    if (row == 0)
+        return false;
+
+    *info = decoded_rows[row - 1];
+    return true;
+}
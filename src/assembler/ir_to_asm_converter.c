@@ -1,7 +1,7 @@
 #include "ir_to_asm_converter.h"
 #include "../utils/all.h"
 
-static asm_operand *resolve_ir_value_to_asm_operand(ir_value *v);
+static asm_operand *resolve_ir_value_to_asm_operand(ir_value *v, asm_operand *o);
 
 static void code_prologue(mempool *mp);
 static void code_epilogue(mempool *mp);
@@ -15,6 +15,17 @@ static void code_binary_operation(mempool *mp, ir_entry *e, ir_value *lvalue, ir
 static void assemble_function(mempool *mp, ir_listing *ir, int start, int end);
 
 
+// System V AMD64, where the first integer or pointer arguments go
+#define SYSV_ARG_REGS  6
+static gp_register sysv_arg_regs[SYSV_ARG_REGS] = { REG_DI, REG_SI, REG_DX, REG_CX, REG_R8W, REG_R9W };
+
+// ... and what a callee must give back as it found it, BP is always one of them
+#define PRESERVED_REGS  6
+static gp_register preserved_regs[PRESERVED_REGS] = { REG_BX, REG_R12W, REG_R13W, REG_R14W, REG_R15W, REG_BP };
+
+// the part of the stack below SP, that leaf functions may use without reserving
+#define RED_ZONE_SIZE  128
+
 static struct assembler_data {
     asm_allocator *allocator;
     asm_listing *listing;
@@ -22,13 +33,61 @@ static struct assembler_data {
     // as we assemble each function
     struct ir_entry_func_def_info *func_def;
     int stack_space_for_local_vars;
+    int entry_index;
+
+    // callee saved registers we use, and where we keep the caller's values
+    gp_register preserved_regs[PRESERVED_REGS];
+    int preserved_offsets[PRESERVED_REGS];
+    int preserved_count;
+
+    // without a frame pointer, the frame is addressed through SP,
+    // which moves as we push arguments
+    bool omit_frame_pointer;
+    int frame_to_sp;  // SP after the prologue, relative to where BP would be
+    int pushed_bytes; // since the prologue
+
+    // entries up to this one were coded along with an earlier one
+    int coded_until;
+
+    // reused for the text of comments, we code many entries
+    str *scratch;
 } ad;
 
 
-// for converting temp registers and local symbols to assembly operands
-asm_operand *resolve_ir_value_to_asm_operand(ir_value *v) {
-    mempool *mp = new_mempool();
-    asm_operand *o = malloc(sizeof(asm_operand));
+// BP relative offsets are kept everywhere, this makes them SP relative if needed
+static gp_register frame_reg() {
+    return ad.omit_frame_pointer ? REG_SP : REG_BP;
+}
+
+static int frame_offset(int bp_offset) {
+    return ad.omit_frame_pointer ? bp_offset - ad.frame_to_sp + ad.pushed_bytes : bp_offset;
+}
+
+static asm_operand *new_frame_operand(mempool *mp, int bp_offset) {
+    return new_asm_operand_mem_by_reg(mp, frame_reg(), frame_offset(bp_offset));
+}
+
+// without a pushed BP, the arguments are one word closer
+static int first_arg_offset() {
+    return run_info->options->pointer_size_bytes * (ad.omit_frame_pointer ? 1 : 2);
+}
+
+
+// the IR entry as the comment of the next line, if anyone is going to read it
+static void comment_ir_entry(mempool *mp, ir_entry *e, const char *note) {
+    if (!ad.listing->with_comments)
+        return;
+    str *s = e->ops->to_string(mp, e);
+    if (note == NULL)
+        ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
+    else
+        ad.listing->ops->set_next_comment(ad.listing, "IR: %s, %s", str_charptr(s), note);
+}
+
+// for converting temp registers and local symbols to assembly operands.
+// fills in the operand the caller provides (usually on its stack) and returns it,
+// they are only needed until they are copied into an asm_line.
+static asm_operand *resolve_ir_value_to_asm_operand(ir_value *v, asm_operand *o) {
     storage s;
     bool allocated;
 
@@ -38,18 +97,18 @@ asm_operand *resolve_ir_value_to_asm_operand(ir_value *v) {
     if (v->type == IR_TREG) {
         // could be either a register or stack value, depending on allocation
         ad.allocator->ops->get_temp_reg_storage(ad.allocator, v->val.temp_reg_no, &s, &allocated);
-        if (allocated) {
-            str *st = new_str(mp, NULL);
-            ad.allocator->ops->storage_to_str(ad.allocator, &s, st);
-            ad.listing->ops->add_comment(ad.listing, "%s allocated to r%d", str_charptr(st), v->val.temp_reg_no);
+        if (allocated && ad.listing->with_comments) {
+            str_clear(ad.scratch);
+            ad.allocator->ops->storage_to_str(ad.allocator, &s, ad.scratch);
+            ad.listing->ops->add_comment(ad.listing, "%s allocated to r%d", str_charptr(ad.scratch), v->val.temp_reg_no);
         }
         if (s.is_gp_reg) {
             o->type = OT_REGISTER;
             o->reg = s.gp_reg;
         } else if (s.is_stack_var) {
             o->type = OT_MEM_POINTED_BY_REG;
-            o->reg = REG_BP;
-            o->offset = s.bp_offset;
+            o->reg = frame_reg();
+            o->offset = frame_offset(s.bp_offset);
         }
     } else if (v->type == IR_SYM) {
         // could be a local or global symbol
@@ -59,8 +118,8 @@ asm_operand *resolve_ir_value_to_asm_operand(ir_value *v) {
                 return NULL;
             }
             o->type = OT_MEM_POINTED_BY_REG;
-            o->reg = REG_BP;
-            o->offset = s.bp_offset;
+            o->reg = frame_reg();
+            o->offset = frame_offset(s.bp_offset);
         } else {
             // not found in local symbols, let linker sort this out
             o->type = OT_MEM_OF_SYMBOL;
@@ -80,10 +139,12 @@ asm_operand *resolve_ir_value_to_asm_operand(ir_value *v) {
 
 static void code_prologue(mempool *mp) {
     ad.listing->ops->set_next_label(ad.listing, ad.func_def->func_name);
-    ad.listing->ops->set_next_comment(ad.listing, "establish stack frame");
+    ad.listing->ops->set_next_comment(ad.listing, ad.omit_frame_pointer ? "no frame pointer" : "establish stack frame");
 
-    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_PUSH, REG_BP));
-    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_BP, REG_SP));
+    if (!ad.omit_frame_pointer) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_PUSH, REG_BP));
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_BP, REG_SP));
+    }
 
     if (ad.stack_space_for_local_vars > 0) {
         ad.listing->ops->set_next_comment(ad.listing, "reserve %d bytes for local vars", ad.stack_space_for_local_vars);
@@ -94,46 +155,198 @@ static void code_prologue(mempool *mp) {
 
     ad.allocator->ops->generate_stack_info_comments(ad.allocator);
 
+    // arguments passed in registers live with the local vars
+    int reg_args = run_info->options->sysv_calls ? ad.func_def->args_len : 0;
+    if (reg_args > SYSV_ARG_REGS)
+        reg_args = SYSV_ARG_REGS;
+    for (int i = 0; i < reg_args; i++) {
+        storage s;
+        ad.allocator->ops->get_named_storage(ad.allocator, ad.func_def->args_arr[i].name, &s);
+        ad.listing->ops->set_next_comment(ad.listing, "argument \"%s\" passed in register", ad.func_def->args_arr[i].name);
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV,
+            new_frame_operand(mp, s.bp_offset),
+            new_asm_operand_reg(mp, sysv_arg_regs[i])));
+    }
+
     // callee saved registers
-    // CX and AX are clobbered during a call
+    for (int i = 0; i < ad.preserved_count; i++) {
+        ad.listing->ops->set_next_comment(ad.listing, "callee saved register");
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV,
+            new_frame_operand(mp, ad.preserved_offsets[i]),
+            new_asm_operand_reg(mp, ad.preserved_regs[i])));
+    }
+}
+
+static void code_restore_preserved_regs(mempool *mp) {
+    for (int i = 0; i < ad.preserved_count; i++) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV,
+            new_asm_operand_reg(mp, ad.preserved_regs[i]),
+            new_frame_operand(mp, ad.preserved_offsets[i])));
+    }
+}
+
+static void code_tear_down_frame(mempool *mp, char *comment) {
+    ad.listing->ops->set_next_comment(ad.listing, comment);
+    if (!ad.omit_frame_pointer) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_SP, REG_BP));
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_POP, REG_BP));
+    } else if (ad.stack_space_for_local_vars > 0) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_ADD, 
+            new_asm_operand_reg(mp, REG_SP),
+            new_asm_operand_imm(mp, ad.stack_space_for_local_vars)));
+    }
 }
 
 static void code_epilogue(mempool *mp) {
     ad.listing->ops->set_next_label(ad.listing, "%s_exit", ad.func_def->func_name);
-    ad.listing->ops->set_next_comment(ad.listing, "tear down stack frame");
-    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_SP, REG_BP));
-    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_POP, REG_BP));
+    code_restore_preserved_regs(mp);
+    code_tear_down_frame(mp, "tear down stack frame");
     ad.listing->ops->add_line(ad.listing, new_asm_line_instruction(mp, OC_RET));
 }
 
-static void code_function_call(mempool *mp, struct ir_entry *e) {
-    struct ir_entry_function_call_info *c = &e->t.function_call;
-    str *s = e->ops->to_string(mp, e);
-    ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
-
+static bool _is_pending_source(asm_operand **sources, bool *done, int count, gp_register reg) {
+    for (int i = 0; i < count; i++) {
+        if (!done[i] && sources[i]->type == OT_REGISTER && sources[i]->reg == reg)
+            return true;
+    }
+    return false;
+}
 
-    // caller saved registers
+// loads the register arguments, as a parallel move:
+// a source may well be the target register of another argument
+static void code_register_arguments(mempool *mp, ir_value **args, int count) {
+    asm_operand operands[SYSV_ARG_REGS];
+    asm_operand *sources[SYSV_ARG_REGS];
+    bool done[SYSV_ARG_REGS];
+    for (int i = 0; i < count; i++) {
+        sources[i] = resolve_ir_value_to_asm_operand(args[i], &operands[i]);
+        done[i] = false;
+    }
 
+    int remaining = count;
+    while (remaining > 0) {
+        bool progress = false;
+        for (int i = 0; i < count; i++) {
+            if (done[i])
+                continue;
+            done[i] = true; // we don't block ourselves
+            if (_is_pending_source(sources, done, count, sysv_arg_regs[i])) {
+                done[i] = false;
+                continue;
+            }
+            if (sources[i]->type != OT_REGISTER || sources[i]->reg != sysv_arg_regs[i])
+                ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV,
+                    new_asm_operand_reg(mp, sysv_arg_regs[i]), sources[i]));
+            remaining--;
+            progress = true;
+        }
+        if (progress)
+            continue;
+
+        // all waiting on each other, free one target through AX
+        for (int i = 0; i < count; i++) {
+            if (done[i])
+                continue;
+            gp_register target = sysv_arg_regs[i];
+            asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_AX, target));
+            for (int j = 0; j < count; j++) {
+                if (!done[j] && sources[j]->type == OT_REGISTER && sources[j]->reg == target)
+                    sources[j] = ax;
+            }
+            break;
+        }
+    }
+}
 
-    // allocate for returned value, if any is expected, before pushing
-    asm_operand *lval;
-    if (c->lvalue != NULL) {
-        lval = resolve_ir_value_to_asm_operand(c->lvalue);
+static void code_function_call(mempool *mp, struct ir_entry *e) {
+    struct ir_entry_function_call_info *c = &e->t.function_call;
+    comment_ir_entry(mp, e, NULL);
+
+    bool sysv = run_info->options->sysv_calls;
+    int reg_args = sysv ? c->args_len : 0;
+    if (reg_args > SYSV_ARG_REGS)
+        reg_args = SYSV_ARG_REGS;
+    int ptr_size = run_info->options->pointer_size_bytes;
+
+    // caller saved registers, the ones that live on after the call
+    storage regs[16], homes[16];
+    int saved = 0;
+    if (!c->is_tail_call)
+        saved = ad.allocator->ops->get_regs_saved_around_call(ad.allocator, ad.entry_index, 16, regs, homes);
+    for (int i = 0; i < saved; i++) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV,
+            new_frame_operand(mp, homes[i].bp_offset),
+            new_asm_operand_reg(mp, regs[i].gp_reg)));
     }
-    
+
     int bytes_pushed = 0;
-    for (int i = c->args_len - 1; i >= 0; i--) {
-        asm_operand *op = resolve_ir_value_to_asm_operand(c->args_arr[i]);
+    if (sysv && !c->is_tail_call && (c->args_len - reg_args) % 2 == 1) {
+        // the stack must be 16 bytes aligned at the call
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_SUB,
+            new_asm_operand_reg(mp, REG_SP), new_asm_operand_imm(mp, ptr_size)));
+        bytes_pushed += ptr_size;
+        ad.pushed_bytes += ptr_size;
+    }
+    for (int i = c->args_len - 1; i >= reg_args; i--) {
+        asm_operand op_op;
+        asm_operand *op = resolve_ir_value_to_asm_operand(c->args_arr[i], &op_op);
         ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operand(mp, OC_PUSH, op));
-        bytes_pushed += run_info->options->pointer_size_bytes; // how can we be sure?
+        bytes_pushed += ptr_size; // how can we be sure?
+        ad.pushed_bytes += ptr_size;
     }
 
-    asm_operand *addr = resolve_ir_value_to_asm_operand(c->func_addr);
+    asm_operand addr_op;
+    asm_operand *addr = resolve_ir_value_to_asm_operand(c->func_addr, &addr_op);
+    if (reg_args > 0) {
+        // the address may be in a register we are about to overwrite
+        bool keep_addr = (addr->type == OT_REGISTER);
+        if (keep_addr) {
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operand(mp, OC_PUSH, addr));
+            ad.pushed_bytes += ptr_size;
+        }
+        code_register_arguments(mp, c->args_arr, reg_args);
+        if (keep_addr) {
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_POP, REG_AX));
+            ad.pushed_bytes -= ptr_size;
+            addr = new_asm_operand_reg(mp, REG_AX);
+        }
+    }
+    if (sysv && addr->type == OT_MEM_OF_SYMBOL) {
+        ad.listing->ops->set_next_comment(ad.listing, "no vector registers, in case callee is variadic");
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_AX, 0));
+    }
+
+    if (c->is_tail_call) {
+        // move the stack arguments to where our caller pushed ours,
+        // then leave our frame and let the callee return to our caller
+        asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+        if (sysv && addr->type == OT_REGISTER) {
+            // keep it away from the registers we are about to restore
+            if (addr->reg != REG_AX)
+                ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, addr));
+            addr = ax;
+            ax = new_asm_operand_reg(mp, REG_R11W);
+        }
+        for (int i = reg_args; i < c->args_len; i++) {
+            int offset = first_arg_offset() + ptr_size * (i - reg_args);
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_POP, ax->reg));
+            ad.pushed_bytes -= ptr_size;
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV,
+                new_frame_operand(mp, offset), ax));
+        }
+        code_restore_preserved_regs(mp);
+        code_tear_down_frame(mp, "tear down stack frame, tail call");
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operand(mp, OC_JMP, addr));
+        return;
+    }
     ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operand(mp, OC_CALL, addr));
 
     // grab returned value, if any is expected
     if (c->lvalue != NULL) {
         asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+        asm_operand lval_op;
+        asm_operand *lval = resolve_ir_value_to_asm_operand(c->lvalue, &lval_op);
         ad.listing->ops->set_next_comment(ad.listing, "grab returned value");
         ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, lval, ax));
     }
@@ -144,30 +357,90 @@ static void code_function_call(mempool *mp, struct ir_entry *e) {
         ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_ADD, 
             new_asm_operand_reg(mp, REG_SP), 
             new_asm_operand_imm(mp, bytes_pushed)));
+        ad.pushed_bytes -= bytes_pushed;
     }
 
     // caller restore registers (except AX)
+    for (int i = 0; i < saved; i++) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV,
+            new_asm_operand_reg(mp, regs[i].gp_reg),
+            new_frame_operand(mp, homes[i].bp_offset)));
+    }
 }
 
-static void code_conditional_jump(mempool *mp, ir_entry *e) {
-    // emit two things: compare, then appropriate jump.
-    // conditions depend on whether the values are signed or unsigned,
-    // good info here: https://www.cs.princeton.edu/courses/archive/spr18/cos217/lectures/14_Assembly2.pdf
+// the comparison that holds after swapping its two sides
+static ir_comparison mirror_comparison(ir_comparison cmp) {
+    switch (cmp) {
+        case IR_GT: return IR_LT;
+        case IR_GE: return IR_LE;
+        case IR_LT: return IR_GT;
+        case IR_LE: return IR_GE;
+        default:    return cmp; // EQ and NE do not care
+    }
+}
 
-    struct ir_entry_cond_jump_info *j = &e->t.conditional_jump;
-    asm_operand *op1 = resolve_ir_value_to_asm_operand(j->v1);
-    asm_operand *op2 = resolve_ir_value_to_asm_operand(j->v2);
-    
-    str *s = e->ops->to_string(mp, e);
-    ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
+static bool evaluate_comparison(long v1, ir_comparison cmp, long v2, bool is_unsigned) {
+    if (is_unsigned) {
+        unsigned long u1 = (unsigned long)v1, u2 = (unsigned long)v2;
+        switch (cmp) {
+            case IR_GT: return u1 > u2;
+            case IR_GE: return u1 >= u2;
+            case IR_LT: return u1 < u2;
+            case IR_LE: return u1 <= u2;
+            default:    break; // EQ and NE are the same either way
+        }
+    }
+    switch (cmp) {
+        case IR_EQ: return v1 == v2;
+        case IR_NE: return v1 != v2;
+        case IR_GT: return v1 > v2;
+        case IR_GE: return v1 >= v2;
+        case IR_LT: return v1 < v2;
+        case IR_LE: return v1 <= v2;
+    }
+    return false;
+}
 
-    // this version does not support immediates in op1 (e.g. "if (1 == a)")
+static ir_comparison inverse_comparison(ir_comparison cmp) {
+    switch (cmp) {
+        case IR_EQ: return IR_NE;
+        case IR_NE: return IR_EQ;
+        case IR_GT: return IR_LE;
+        case IR_GE: return IR_LT;
+        case IR_LT: return IR_GE;
+        case IR_LE: return IR_GT;
+    }
+    return cmp;
+}
+
+// the jump or conditional move taken when the comparison holds
+static instr_code condition_instruction(ir_comparison cmp, bool is_unsigned, bool is_move) {
+    switch (cmp) {
+        case IR_EQ: return is_move ? OC_CMOVEQ : OC_JEQ;
+        case IR_NE: return is_move ? OC_CMOVNE : OC_JNE;
+        case IR_GT: return is_unsigned ? (is_move ? OC_CMOVAB : OC_JAB) : (is_move ? OC_CMOVGT : OC_JGT);
+        case IR_GE: return is_unsigned ? (is_move ? OC_CMOVAE : OC_JAE) : (is_move ? OC_CMOVGE : OC_JGE);
+        case IR_LT: return is_unsigned ? (is_move ? OC_CMOVBL : OC_JBL) : (is_move ? OC_CMOVLT : OC_JLT);
+        case IR_LE: return is_unsigned ? (is_move ? OC_CMOVBE : OC_JBE) : (is_move ? OC_CMOVLE : OC_JLE);
+    }
+    return is_move ? OC_CMOVEQ : OC_JEQ;
+}
+
+// sets the flags for "op1 <cmp> op2", returns the comparison to test them with.
+// they cannot be both immediates
+static ir_comparison code_compare(mempool *mp, asm_operand *op1, ir_comparison cmp, asm_operand *op2) {
     if (op1->type == OT_IMMEDIATE) {
-        error("comparison op1 cannot be an immediate");
-        return;
+        // CMP takes immediates on the right only, e.g. "if (1 == a)"
+        asm_operand *tmp = op1;
+        op1 = op2;
+        op2 = tmp;
+        cmp = mirror_comparison(cmp);
     }
 
-    if ((op1->type == OT_MEM_POINTED_BY_REG || op1->type == OT_MEM_OF_SYMBOL) &&
+    if (op1->type == OT_REGISTER && op2->type == OT_IMMEDIATE && op2->immediate == 0) {
+        // shorter, no immediate to encode
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_TEST, op1, op1));
+    } else if ((op1->type == OT_MEM_POINTED_BY_REG || op1->type == OT_MEM_OF_SYMBOL) &&
         (op2->type == OT_MEM_POINTED_BY_REG || op2->type == OT_MEM_OF_SYMBOL)) {
         // we cannot compare memory to memory (e.g. "(a > b)"), we must bring one into AX
         asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
@@ -176,26 +449,172 @@ static void code_conditional_jump(mempool *mp, ir_entry *e) {
     } else {
         ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_CMP, op1, op2));
     }
+    return cmp;
+}
 
-    // find the opcode, depending on the comparison flag
-    instr_code op;
-    switch (j->cmp) {
-        case IR_EQ: op = OC_JEQ; break;
-        case IR_NE: op = OC_JNE; break;
-        // let's use unsigned comparisons for now
-        case IR_GT: op = OC_JAB; break;
-        case IR_GE: op = OC_JAE; break;
-        case IR_LT: op = OC_JBL; break;
-        case IR_LE: op = OC_JBE; break;
-    }
+static void code_conditional_jump(mempool *mp, ir_entry *e) {
+    // emit two things: compare, then appropriate jump.
+    // conditions depend on whether the values are signed or unsigned,
+    // good info here: https://www.cs.princeton.edu/courses/archive/spr18/cos217/lectures/14_Assembly2.pdf
 
+    struct ir_entry_cond_jump_info *j = &e->t.conditional_jump;
+    asm_operand op1_op;
+    asm_operand *op1 = resolve_ir_value_to_asm_operand(j->v1, &op1_op);
+    asm_operand op2_op;
+    asm_operand *op2 = resolve_ir_value_to_asm_operand(j->v2, &op2_op);
     asm_operand *addr = new_asm_operand_mem_by_sym(mp, j->target_label);
+    
+    comment_ir_entry(mp, e, NULL);
+
+    if (op1->type == OT_IMMEDIATE && op2->type == OT_IMMEDIATE) {
+        // known in advance, either always jump or never
+        if (evaluate_comparison(op1->immediate, j->cmp, op2->immediate, j->is_unsigned))
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operand(mp, OC_JMP, addr));
+        return;
+    }
+
+    ir_comparison cmp = code_compare(mp, op1, j->cmp, op2);
+    instr_code op = condition_instruction(cmp, j->is_unsigned, false);
     ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operand(mp, op, addr));
 }
 
+/*
+    If-conversion of small branches that only pick a value:
+        if a < b goto L1          if a < b goto L2
+        x = c                     x = c
+        goto L2                 L2:
+      L1:
+        x = d
+      L2:
+    Both values are moved, CMOVcc keeps the one the condition picks,
+    so there is no jump to mispredict. As both arms now always run,
+    we only do it when each arm is a single copy, past that a well
+    predicted branch is cheaper than what we'd execute for nothing.
+*/
+struct select_info {
+    ir_value *lvalue;
+    ir_value *if_taken;      // what the lvalue gets when the jump is taken
+    ir_value *if_not_taken;
+    int last_index;          // of the entries the CMOVcc replaces
+};
+
+static bool _is_plain_copy(ir_entry *e) {
+    return e->type == IR_THREE_ADDR_CODE && e->t.three_address_code.lvalue != NULL &&
+        e->t.three_address_code.op1 == NULL && e->t.three_address_code.op == IR_NONE &&
+        e->t.three_address_code.op2 != NULL;
+}
+
+static bool _same_ir_value(ir_value *a, ir_value *b) {
+    if (a->type != b->type)
+        return false;
+    if (a->type == IR_TREG)
+        return a->val.temp_reg_no == b->val.temp_reg_no;
+    if (a->type == IR_SYM)
+        return strcmp(a->val.symbol_name, b->val.symbol_name) == 0;
+    return false;
+}
+
+static bool _is_label(ir_entry *e, const char *label) {
+    return e->type == IR_LABEL && strcmp(e->t.label.str, label) == 0;
+}
+
+static int _label_jumps(ir_listing *ir, int start, int end, const char *label) {
+    int count = 0;
+    for (int i = start; i < end; i++) {
+        ir_entry *e = ir->entries_arr[i];
+        if ((e->type == IR_CONDITIONAL_JUMP && strcmp(e->t.conditional_jump.target_label, label) == 0) ||
+            (e->type == IR_UNCONDITIONAL_JUMP && strcmp(e->t.unconditional_jump.str, label) == 0))
+            count++;
+    }
+    return count;
+}
+
+static bool _find_select(ir_listing *ir, int start, int end, int index, struct select_info *sel) {
+    if (run_info->options->optimization_level == 0 || run_info->options->no_if_conversion)
+        return false;
+    ir_entry *jump = ir->entries_arr[index];
+    const char *target = jump->t.conditional_jump.target_label;
+    if (jump->t.conditional_jump.v1->type == IR_IMM && jump->t.conditional_jump.v2->type == IR_IMM)
+        return false; // no branch to save
+    if (index + 2 >= end || !_is_plain_copy(ir->entries_arr[index + 1]))
+        return false;
+
+    sel->lvalue = ir->entries_arr[index + 1]->t.three_address_code.lvalue;
+    sel->if_not_taken = ir->entries_arr[index + 1]->t.three_address_code.op2;
+    if (_is_label(ir->entries_arr[index + 2], target)) {
+        // no else arm, the lvalue keeps its value. we'd write it on both paths,
+        // fine for locals, but not for what others may be looking at
+        storage s;
+        if (sel->lvalue->type == IR_SYM && !ad.allocator->ops->get_named_storage(ad.allocator, sel->lvalue->val.symbol_name, &s))
+            return false;
+        sel->if_taken = sel->lvalue;
+        sel->last_index = index + 1;
+        return true;
+    }
+
+    if (index + 5 >= end)
+        return false;
+    ir_entry *skip = ir->entries_arr[index + 2];
+    ir_entry *other = ir->entries_arr[index + 4];
+    if (skip->type != IR_UNCONDITIONAL_JUMP || !_is_label(ir->entries_arr[index + 3], target) ||
+        !_is_plain_copy(other) || !_is_label(ir->entries_arr[index + 5], skip->t.unconditional_jump.str))
+        return false;
+    if (!_same_ir_value(other->t.three_address_code.lvalue, sel->lvalue))
+        return false;
+    if (_label_jumps(ir, start, end, target) != 1)
+        return false; // the else arm is reached from elsewhere too
+    sel->if_taken = other->t.three_address_code.op2;
+    sel->last_index = index + 4;
+    return true;
+}
+
+// returns false, without coding anything, if it needs a register we do not have
+static bool code_conditional_move(mempool *mp, ir_entry *e, struct select_info *sel) {
+    struct ir_entry_cond_jump_info *j = &e->t.conditional_jump;
+    asm_operand op1_op;
+    asm_operand *op1 = resolve_ir_value_to_asm_operand(j->v1, &op1_op);
+    asm_operand op2_op;
+    asm_operand *op2 = resolve_ir_value_to_asm_operand(j->v2, &op2_op);
+    asm_operand lop_op;
+    asm_operand *lop = resolve_ir_value_to_asm_operand(sel->lvalue, &lop_op);
+    asm_operand taken_op;
+    asm_operand *taken = resolve_ir_value_to_asm_operand(sel->if_taken, &taken_op);
+    asm_operand not_taken_op;
+    asm_operand *not_taken = resolve_ir_value_to_asm_operand(sel->if_not_taken, &not_taken_op);
+    asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+
+    // CMOVcc only moves from register or memory, into a register
+    bool both_immediate = (taken->type == OT_IMMEDIATE && not_taken->type == OT_IMMEDIATE);
+    if (both_immediate && lop->type != OT_REGISTER)
+        return false;
+
+    comment_ir_entry(mp, e, "as a conditional move");
+
+    // moves do not change the flags, the values can be loaded after comparing
+    ir_comparison cmp = code_compare(mp, op1, j->cmp, op2);
+    if (both_immediate) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, taken));
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, lop, not_taken));
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_regmem(mp, 
+            condition_instruction(cmp, j->is_unsigned, true), lop->reg, ax));
+        return true;
+    }
+
+    if (taken->type == OT_IMMEDIATE) {
+        asm_operand *tmp = taken;
+        taken = not_taken;
+        not_taken = tmp;
+        cmp = inverse_comparison(cmp);
+    }
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, not_taken));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_regmem(mp, 
+        condition_instruction(cmp, j->is_unsigned, true), REG_AX, taken));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, lop, ax));
+    return true;
+}
+
 static void code_unconditional_jump(mempool *mp, ir_entry *e, char *label) {
-    str *s = e->ops->to_string(mp, e);
-    ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
+    comment_ir_entry(mp, e, NULL);
 
     asm_operand *addr = new_asm_operand_mem_by_sym(mp, label);
     ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operand(mp, OC_JMP, addr));
@@ -203,12 +622,12 @@ static void code_unconditional_jump(mempool *mp, ir_entry *e, char *label) {
 
 static void code_return_statement(mempool *mp, ir_entry *e) {
     struct ir_entry_return_info *info = &e->t.return_stmt;
-    str *s = e->ops->to_string(mp, e);
-    ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
+    comment_ir_entry(mp, e, NULL);
 
     if (info->ret_val != NULL) {
         asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
-        asm_operand *val = resolve_ir_value_to_asm_operand(info->ret_val);
+        asm_operand val_op;
+        asm_operand *val = resolve_ir_value_to_asm_operand(info->ret_val, &val_op);
         ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax,  val));
     }
 
@@ -220,11 +639,12 @@ static void code_return_statement(mempool *mp, ir_entry *e) {
 }
 
 static void code_simple_assignment(mempool *mp, ir_entry *e, ir_value *lvalue, ir_value *rvalue) {
-    str *s = e->ops->to_string(mp, e);
-    ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
+    comment_ir_entry(mp, e, NULL);
 
-    asm_operand *lop = resolve_ir_value_to_asm_operand(lvalue);
-    asm_operand *rop = resolve_ir_value_to_asm_operand(rvalue);
+    asm_operand lop_op;
+    asm_operand *lop = resolve_ir_value_to_asm_operand(lvalue, &lop_op);
+    asm_operand rop_op;
+    asm_operand *rop = resolve_ir_value_to_asm_operand(rvalue, &rop_op);
 
     if ((lop->type == OT_MEM_POINTED_BY_REG || lop->type == OT_MEM_OF_SYMBOL) &&
         (rop->type == OT_MEM_POINTED_BY_REG || rop->type == OT_MEM_OF_SYMBOL)) {
@@ -243,12 +663,13 @@ static void code_unary_operation(mempool *mp, ir_entry *e, ir_value *lvalue, ir_
     // NOT/NEG AX
     // MOV a, AX
 
-    str *s = e->ops->to_string(mp, e);
-    ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
+    comment_ir_entry(mp, e, NULL);
 
     asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
-    asm_operand *lop = resolve_ir_value_to_asm_operand(lvalue);
-    asm_operand *rop = resolve_ir_value_to_asm_operand(rvalue);
+    asm_operand lop_op;
+    asm_operand *lop = resolve_ir_value_to_asm_operand(lvalue, &lop_op);
+    asm_operand rop_op;
+    asm_operand *rop = resolve_ir_value_to_asm_operand(rvalue, &rop_op);
 
     switch (op) {
         case IR_NOT:
@@ -277,23 +698,278 @@ static void code_unary_operation(mempool *mp, ir_entry *e, ir_value *lvalue, ir_
     }
 }
 
+// whether the constant fits the signed 32 bits immediate of an instruction
+static bool _fits_imm32(long value) {
+    return value >= -2147483648L && value <= 2147483647L;
+}
+
+// k, if value is 2^k, otherwise -1
+static int _power_of_two(long value) {
+    if (value <= 0 || (value & (value - 1)) != 0)
+        return -1;
+    int k = 0;
+    while ((1L << k) != value)
+        k++;
+    return k;
+}
+
+// immediates are sign extended from 32 bits, wider ones are built in two halves
+static void code_load_constant(mempool *mp, gp_register reg, long value) {
+    if (_fits_imm32(value)) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_MOV, reg, value));
+        return;
+    }
+    long low = (int)(value & 0xFFFFFFFF);
+    long high = (int)((value >> 32) ^ (low < 0 ? 0xFFFFFFFF : 0));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_MOV, reg, high));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SHL, reg, 32));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_XOR, reg, low));
+}
+
+/*
+    The magic number and shift for signed division by a constant,
+    so that x / d is the high half of x * magic, shifted right,
+    see "Hacker's Delight", chapter 10. d must not be -1, 0 or 1.
+*/
+static void _signed_magic(long d, int bits, long *magic, int *shift) {
+    u64 mask = (bits == 64) ? ~0UL : ((1UL << bits) - 1);
+    u64 two_n1 = 1UL << (bits - 1);
+    u64 abs_d = (u64)(d < 0 ? -d : d);
+    u64 t = two_n1 + ((u64)d >> 63);
+    u64 abs_nc = t - 1 - t % abs_d;
+    int p = bits - 1;
+    u64 q1 = two_n1 / abs_nc, r1 = two_n1 - q1 * abs_nc;
+    u64 q2 = two_n1 / abs_d,  r2 = two_n1 - q2 * abs_d;
+    u64 delta;
+    do {
+        p++;
+        q1 = (2 * q1) & mask; r1 = (2 * r1) & mask;
+        if (r1 >= abs_nc) { q1 = (q1 + 1) & mask; r1 = (r1 - abs_nc) & mask; }
+        q2 = (2 * q2) & mask; r2 = (2 * r2) & mask;
+        if (r2 >= abs_d) { q2 = (q2 + 1) & mask; r2 = (r2 - abs_d) & mask; }
+        delta = (abs_d - r2) & mask;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    u64 m = (q2 + 1) & mask;
+    if (d < 0) m = (-m) & mask;
+    // sign extend it to a long
+    if (bits < 64 && (m & two_n1))
+        m |= ~mask;
+    *magic = (long)m;
+    *shift = p - bits;
+}
+
+// AX = x * c, returns false if there's nothing better than a multiplication
+static bool code_multiply_by_constant(mempool *mp, asm_operand *x, long c) {
+    asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+    long abs_c = c < 0 ? -c : c;
+    int k = 0;
+    while (abs_c != 0 && (abs_c & (1L << k)) == 0)
+        k++;
+    long odd = abs_c >> k;
+
+    if (c == 0) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_AX, 0));
+        return true;
+    }
+    if (odd != 1 && odd != 3 && odd != 5 && odd != 9)
+        return false;
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, x));
+    if (odd != 1) {
+        // x*3, x*5 and x*9 are addresses of the form [x+x*2], [x+x*4], [x+x*8]
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_mem_scaled(mp, OC_LEA, REG_AX, REG_AX, REG_AX, odd - 1));
+    }
+    if (k > 0)
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SHL, REG_AX, k));
+    if (c < 0)
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_NEG, REG_AX));
+    return true;
+}
+
+// DX = x < 0 ? 2^k - 1 : 0, x being in AX. what rounds a signed shift towards zero
+static void code_power_of_two_bias(mempool *mp, int k, int bits) {
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_DX, REG_AX));
+    if (k > 1)
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SAR, REG_DX, bits - 1));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SHR, REG_DX, bits - k));
+}
+
+// AX = x / d or x % d, returns false if there's nothing better than a division
+static bool code_divide_by_constant(mempool *mp, asm_operand *x, ir_operation op, long d, bool is_unsigned) {
+    asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+    int bits = run_info->options->pointer_size_bytes * 8;
+    long abs_d = d < 0 ? -d : d;
+    int k = _power_of_two(is_unsigned ? d : abs_d);
+
+    if (d == 0 || (is_unsigned && d < 0))
+        return false;
+
+    if (abs_d == 1) {
+        // x / 1 is x, x % 1 is zero
+        if (op == IR_MOD) {
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_AX, 0));
+        } else {
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, x));
+            if (d < 0)
+                ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_NEG, REG_AX));
+        }
+        return true;
+    }
+
+    if (is_unsigned) {
+        if (k == -1)
+            return false;
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, x));
+        if (op == IR_DIV)
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SHR, REG_AX, k));
+        else
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_AND, REG_AX, d - 1));
+        return true;
+    }
+
+    if (k != -1) {
+        // shifting right rounds down, negative dividends need a bias to round towards zero
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, x));
+        code_power_of_two_bias(mp, k, bits);
+        if (op == IR_DIV) {
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_ADD, REG_AX, REG_DX));
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SAR, REG_AX, k));
+            if (d < 0)
+                ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_NEG, REG_AX));
+        } else {
+            // the remainder takes the sign of the dividend, whatever the sign of d
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_ADD, REG_DX, REG_AX));
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_AND, REG_DX, -abs_d));
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_SUB, REG_AX, REG_DX));
+        }
+        return true;
+    }
+
+    // the high half of x * magic, corrected and shifted, is the quotient
+    long magic;
+    int shift;
+    _signed_magic(d, bits, &magic, &shift);
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_CX), x));
+    code_load_constant(mp, REG_AX, magic);
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_IMUL, REG_CX));
+    if (d > 0 && magic < 0)
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_ADD, REG_DX, REG_CX));
+    if (d < 0 && magic > 0)
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_SUB, REG_DX, REG_CX));
+    if (shift > 0)
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SAR, REG_DX, shift));
+    // add one for negative quotients, they were rounded down
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_AX, REG_DX));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_SHR, REG_AX, bits - 1));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_ADD, REG_AX, REG_DX));
+    if (op == IR_MOD) {
+        // x - (x / d) * d
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_imm(mp, OC_MOV, REG_DX, d));
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_IMUL, REG_DX));
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_for_register(mp, OC_NEG, REG_AX));
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_reg(mp, OC_ADD, REG_AX, REG_CX));
+    }
+    return true;
+}
+
+// "t = idx * {2,4,8}" at index, right before "u = base + t", t used nowhere else
+static bool _is_scaled_index(ir_listing *ir, int index, int end) {
+    if (index < 0 || index + 1 >= end)
+        return false;
+    ir_entry *e = ir->entries_arr[index];
+    ir_entry *next = ir->entries_arr[index + 1];
+    if (e->type != IR_THREE_ADDR_CODE || next->type != IR_THREE_ADDR_CODE)
+        return false;
+    struct ir_entry_three_addr_code_info *mul = &e->t.three_address_code;
+    struct ir_entry_three_addr_code_info *add = &next->t.three_address_code;
+    if (mul->op != IR_MUL || mul->lvalue == NULL || mul->op1 == NULL || mul->lvalue->type != IR_TREG)
+        return false;
+    if (mul->op1->type == IR_IMM || mul->op2->type != IR_IMM)
+        return false;
+    long scale = mul->op2->val.immediate;
+    if (scale != 2 && scale != 4 && scale != 8)
+        return false;
+    if (add->op != IR_ADD || add->lvalue == NULL || add->op1 == NULL || add->op1->type == IR_IMM || add->op2->type == IR_IMM)
+        return false;
+    int t = mul->lvalue->val.temp_reg_no;
+    bool t_first = add->op1->type == IR_TREG && add->op1->val.temp_reg_no == t;
+    bool t_second = add->op2->type == IR_TREG && add->op2->val.temp_reg_no == t;
+    if (t_first == t_second)
+        return false;
+    return ir->ops->get_register_last_usage(ir, t) == index + 1;
+}
+
+// "u = base + idx * s" as a single LEA, using the multiplication at the entry before
+static void code_scaled_index_addition(mempool *mp, ir_entry *e, ir_entry *mul) {
+    comment_ir_entry(mp, e, NULL);
+
+    struct ir_entry_three_addr_code_info *c = &e->t.three_address_code;
+    int t = mul->t.three_address_code.lvalue->val.temp_reg_no;
+    bool t_first = c->op1->type == IR_TREG && c->op1->val.temp_reg_no == t;
+    asm_operand lop_op;
+    asm_operand *lop = resolve_ir_value_to_asm_operand(c->lvalue, &lop_op);
+    asm_operand base_op;
+    asm_operand *base = resolve_ir_value_to_asm_operand(t_first ? c->op2 : c->op1, &base_op);
+    asm_operand index_op;
+    asm_operand *index = resolve_ir_value_to_asm_operand(mul->t.three_address_code.op1, &index_op);
+    int scale = (int)mul->t.three_address_code.op2->val.immediate;
+    asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
+
+    // the multiplication kept DX clear for anything that lives across it
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, base));
+    gp_register index_reg = REG_DX;
+    if (index->type == OT_REGISTER)
+        index_reg = index->reg;
+    else
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_DX), index));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_reg_mem_scaled(mp, OC_LEA, REG_AX, REG_AX, index_reg, scale));
+    ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, lop, ax));
+}
+
 static void code_binary_operation(mempool *mp, ir_entry *e, ir_value *lvalue, ir_value *rvalue1, ir_operation op, ir_value *rvalue2) {
     // e.g. "lval = rval1 + rval2"
     // MOV AX, rval1
     // ADD AX, rval2
     // MOV lval, AX
 
-    str *s = e->ops->to_string(mp, e);
-    ad.listing->ops->set_next_comment(ad.listing, "IR: %s", str_charptr(s));
+    comment_ir_entry(mp, e, NULL);
     
     asm_operand *ax = new_asm_operand_reg(mp, REG_AX);
     asm_operand *cx = new_asm_operand_reg(mp, REG_CX);
     asm_operand *dx = new_asm_operand_reg(mp, REG_DX);
-    asm_operand *lop = resolve_ir_value_to_asm_operand(lvalue);
-    asm_operand *rop1 = resolve_ir_value_to_asm_operand(rvalue1);
-    asm_operand *rop2 = resolve_ir_value_to_asm_operand(rvalue2);
+    asm_operand lop_op;
+    asm_operand *lop = resolve_ir_value_to_asm_operand(lvalue, &lop_op);
+    asm_operand rop1_op;
+    asm_operand *rop1 = resolve_ir_value_to_asm_operand(rvalue1, &rop1_op);
+    asm_operand rop2_op;
+    asm_operand *rop2 = resolve_ir_value_to_asm_operand(rvalue2, &rop2_op);
+
+    // constant operands allow cheaper instructions than MUL and DIV
+    if (op == IR_MUL && rop1->type == OT_IMMEDIATE && rop2->type != OT_IMMEDIATE) {
+        asm_operand *swap = rop1;
+        rop1 = rop2;
+        rop2 = swap;
+    }
+    if (rop1->type != OT_IMMEDIATE && rop2->type == OT_IMMEDIATE && _fits_imm32(rop2->immediate)) {
+        bool selected = false;
+        if (op == IR_MUL) {
+            selected = code_multiply_by_constant(mp, rop1, rop2->immediate);
+        } else if (op == IR_DIV || op == IR_MOD) {
+            selected = code_divide_by_constant(mp, rop1, op, rop2->immediate, e->t.three_address_code.is_unsigned);
+        }
+        if (selected) {
+            ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, lop, ax));
+            return;
+        }
+    }
 
     ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, ax, rop1));
+
+    // MUL and DIV do not take immediates, AX and DX are theirs
+    if ((op == IR_MUL || op == IR_DIV || op == IR_MOD) && rop2->type == OT_IMMEDIATE) {
+        ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_MOV, cx, rop2));
+        rop2 = cx;
+    }
     switch (op) {
         case IR_ADD:
             ad.listing->ops->add_line(ad.listing, new_asm_line_instruction_with_operands(mp, OC_ADD, ax, rop2));
@@ -345,7 +1021,6 @@ static void _release_temp_reg_allocations(ir_value *v, void *pdata, int idata) {
         return;
 
     // most of this just for user friendly comments!
-    mempool *mp = new_mempool();
     ir_listing *ir = (ir_listing *)pdata;
     storage s;
     bool allocated;
@@ -353,13 +1028,14 @@ static void _release_temp_reg_allocations(ir_value *v, void *pdata, int idata) {
     int reg_no = v->val.temp_reg_no;
     int last_register_index = ir->ops->get_register_last_usage(ir, reg_no);
     if (curr_index >= last_register_index) {
-        ad.allocator->ops->get_temp_reg_storage(ad.allocator, reg_no, &s, &allocated);
-        str *st = new_str(mp, NULL);
-        ad.allocator->ops->storage_to_str(ad.allocator, &s, st);
+        if (ad.listing->with_comments) {
+            ad.allocator->ops->get_temp_reg_storage(ad.allocator, reg_no, &s, &allocated);
+            str_clear(ad.scratch);
+            ad.allocator->ops->storage_to_str(ad.allocator, &s, ad.scratch);
+            ad.listing->ops->add_comment(ad.listing, "%s released from r%d", str_charptr(ad.scratch), reg_no);
+        }
         ad.allocator->ops->release_temp_reg_storage(ad.allocator, reg_no);
-        ad.listing->ops->add_comment(ad.listing, "%s released from r%d", str_charptr(st), reg_no);
     }
-    mempool_release(mp);
 }
 
 static void assemble_function(mempool *mp, ir_listing *ir, int start, int end) {
@@ -378,24 +1054,39 @@ static void assemble_function(mempool *mp, ir_listing *ir, int start, int end) {
     ad.allocator->ops->reset(ad.allocator);
     
     // declare stack variables and their offsets from BP:
-    // this allows the allocator to grab more stack space as needed
+    // this allows the allocator to place spilled temp registers below them
     //   BP + n = last argument (that was pushed first, right-to-left)
     //   BP + 8 = first argument (that was pushed last of the arguments)
+    //            with System V calls, that's the seventh, the first six come in registers
     //   BP + 4 = return address (that was pushed last)
     //   BP + 0 = previous BP
     //   BP - 4 = first local variable
     //   BP - n = local variable
 
-    int bp_offset = run_info->options->pointer_size_bytes * 2; // skip pushed EBP and return address
-    for (int i = 0; i < ad.func_def->args_len; i++) {
+    int ptr_size = run_info->options->pointer_size_bytes;
+    int reg_args = run_info->options->sysv_calls ? ad.func_def->args_len : 0;
+    if (reg_args > SYSV_ARG_REGS)
+        reg_args = SYSV_ARG_REGS;
+
+    ad.omit_frame_pointer = run_info->options->omit_frame_pointer;
+    ad.pushed_bytes = 0;
+    int bp_offset = first_arg_offset(); // skip pushed EBP and return address
+    for (int i = reg_args; i < ad.func_def->args_len; i++) {
         ad.allocator->ops->declare_local_symbol(ad.allocator, 
             ad.func_def->args_arr[i].name, ad.func_def->args_arr[i].size,
             bp_offset);
-        bp_offset += ad.func_def->args_arr[i].size;
+        bp_offset += ptr_size; // each argument is pushed as a whole word
     }
 
     bp_offset = 0; // to subtract the size of the first local variable, not of BP
     ad.stack_space_for_local_vars = 0;
+    for (int i = 0; i < reg_args; i++) {
+        // stored there by the prologue
+        bp_offset -= ptr_size;
+        ad.allocator->ops->declare_local_symbol(ad.allocator, 
+            ad.func_def->args_arr[i].name, ptr_size, bp_offset);
+        ad.stack_space_for_local_vars += ptr_size;
+    }
     for (int i = start; i < end; i++) {
         ir_entry *e = ir->entries_arr[i];
         if (e->type == IR_DATA_DECLARATION && e->t.data_decl.storage == IR_LOCAL) {
@@ -407,10 +1098,54 @@ static void assemble_function(mempool *mp, ir_listing *ir, int start, int end) {
         }
     }
 
+    // plan the temp registers, spilled ones need stack space too
+    allocation_stats stats;
+    ad.stack_space_for_local_vars += ad.allocator->ops->allocate_temp_regs(ad.allocator, ir, start, end, &stats);
+    if (run_info->options->verbose)
+        printf("    %s(): %d temp regs, %d in registers, %d spilled, %d split around calls\n",
+            ad.func_def->func_name, stats.temp_regs, stats.in_registers, stats.spilled, stats.saved_around_calls);
+
+    // our callers expect BP back, and with System V calls a few more
+    ad.preserved_count = 0;
+    for (int i = 0; i < PRESERVED_REGS; i++) {
+        if (preserved_regs[i] != REG_BP && !run_info->options->sysv_calls)
+            continue;
+        if (!ad.allocator->ops->is_gp_reg_used(ad.allocator, preserved_regs[i]))
+            continue;
+        ad.stack_space_for_local_vars += ptr_size;
+        ad.preserved_regs[ad.preserved_count] = preserved_regs[i];
+        ad.preserved_offsets[ad.preserved_count] = -ad.stack_space_for_local_vars;
+        ad.preserved_count++;
+    }
+
+    // leaf functions can keep their frame below SP, without moving it
+    bool is_leaf = true;
+    for (int i = start; i < end; i++) {
+        if (ir->entries_arr[i]->type == IR_FUNCTION_CALL)
+            is_leaf = false;
+    }
+    if (ad.omit_frame_pointer && is_leaf && !run_info->options->is_32_bits &&
+        ad.stack_space_for_local_vars <= RED_ZONE_SIZE) {
+        ad.stack_space_for_local_vars = 0;
+    } else if (run_info->options->sysv_calls) {
+        // so the stack stays 16 bytes aligned for our calls,
+        // the return address is there too, if we don't push BP
+        int extra = ad.omit_frame_pointer ? ptr_size : 0;
+        ad.stack_space_for_local_vars = ((ad.stack_space_for_local_vars + extra + 15) & ~15) - extra;
+    }
+    ad.frame_to_sp = ad.omit_frame_pointer ? -ad.stack_space_for_local_vars : 0;
+
     code_prologue(mp);
 
+    ad.coded_until = -1;
     for (int i = start; i < end; i++) {
         ir_entry *e = ir->entries_arr[i];
+        ad.entry_index = i;
+
+        if (i <= ad.coded_until) {
+            e->ops->foreach_ir_value(e, _release_temp_reg_allocations, ir, i);
+            continue;
+        }
 
         switch (e->type) {
             case IR_FUNCTION_DEFINITION:
@@ -431,6 +1166,13 @@ static void assemble_function(mempool *mp, ir_listing *ir, int start, int end) {
                 } else if (c->lvalue != NULL && c->op1 == NULL && c->op != IR_NONE && c->op2 != NULL) {
                     // "lv = <unary> r2"
                     code_unary_operation(mp, e, c->lvalue, c->op, c->op2);
+                } else if (_is_scaled_index(ir, i, end)) {
+                    // "t = idx * 4" becomes part of the LEA of the addition that follows
+                    if (ad.listing->with_comments)
+                        ad.listing->ops->add_comment(ad.listing, "IR: %s, scaled index of the next one", str_charptr(e->ops->to_string(mp, e)));
+                } else if (_is_scaled_index(ir, i - 1, end)) {
+                    // "lv = base + t"
+                    code_scaled_index_addition(mp, e, ir->entries_arr[i - 1]);
                 } else if (c->lvalue != NULL && c->op1 != NULL && c->op2 != NULL) {
                     // "lv = r1 <+> r2"
                     code_binary_operation(mp, e, c->lvalue, c->op1, c->op, c->op2);
@@ -447,7 +1189,11 @@ static void assemble_function(mempool *mp, ir_listing *ir, int start, int end) {
                 code_function_call(mp, e);
                 break;
             case IR_CONDITIONAL_JUMP:
-                code_conditional_jump(mp, e);
+                struct select_info sel;
+                if (_find_select(ir, start, end, i, &sel) && code_conditional_move(mp, e, &sel))
+                    ad.coded_until = sel.last_index;
+                else
+                    code_conditional_jump(mp, e);
                 break;
             case IR_UNCONDITIONAL_JUMP:
                 code_unconditional_jump(mp, e, e->t.unconditional_jump.str);
@@ -471,9 +1217,12 @@ void convert_ir_listing_to_asm_listing(mempool *mp, ir_listing *ir_list, asm_lis
     // prepare our things
     ad.allocator = new_asm_allocator(mp, asm_list);
     ad.listing = asm_list;
+    ad.scratch = new_str(mp, NULL);
 
     // calculate temp register usage and last mention
     ir_list->ops->run_statistics(ir_list);
+    if (run_info->options->verbose)
+        printf("--------- Register allocation ---------\n");
 
     // emit assembly code to reserve .data, .bss and .rodata
     // db, dw, dd, dq etc.
@@ -494,3 +1243,133 @@ void convert_ir_listing_to_asm_listing(mempool *mp, ir_listing *ir_list, asm_lis
     }
 }
 
+
+
+#ifdef INCLUDE_UNIT_TESTS
+// function "f" with argument "a" and local "x", the given entries, then "return x"
+static ir_listing *_new_select_listing(int count, ...) {
+    ir_listing *l = new_ir_listing();
+    struct ir_entry_func_arg_info *args = malloc(sizeof(struct ir_entry_func_arg_info));
+    args[0].name = "a";
+    args[0].size = 4;
+    l->ops->add(l, new_ir_function_definition("f", args, 1, 4));
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "x", IR_LOCAL));
+    va_list entries;
+    va_start(entries, count);
+    for (int i = 0; i < count; i++)
+        l->ops->add(l, va_arg(entries, ir_entry *));
+    va_end(entries);
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("x")));
+    l->ops->add(l, new_ir_function_end());
+    return l;
+}
+
+// converts at the given level, counting the conditional moves and jumps
+static void _count_selects(mempool *mp, ir_listing *ir, int level, int *cmovs, int *jumps) {
+    int saved_level = run_info->options->optimization_level;
+    run_info->options->optimization_level = level;
+    asm_listing *lst = new_asm_listing(mp);
+    convert_ir_listing_to_asm_listing(mp, ir, lst);
+    run_info->options->optimization_level = saved_level;
+
+    *cmovs = 0;
+    *jumps = 0;
+    for (int i = 0; i < list_length(lst->lines); i++) {
+        asm_line *line = list_get(lst->lines, i);
+        if (line->type != ALT_INSTRUCTION)
+            continue;
+        instr_code op = line->per_type.instruction->operation;
+        if (op >= OC_CMOVEQ && op <= OC_CMOVLE)
+            (*cmovs)++;
+        else if (op >= OC_JEQ && op <= OC_JLE)
+            (*jumps)++;
+    }
+}
+
+static void _find_select_unit_tests() {
+    mempool *mp = new_mempool();
+    ir_listing *l;
+    int cmovs, jumps;
+
+    // if a < 5 goto L1; x = a; goto L2; L1: x = 7; L2: -> one CMOVGE
+    l = _new_select_listing(6,
+        new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LT, new_ir_value_immediate(5), "L1"),
+        new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_symbol("a")),
+        new_ir_unconditional_jump("L2"),
+        new_ir_label("L1"),
+        new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_immediate(7)),
+        new_ir_label("L2"));
+    _count_selects(mp, l, 1, &cmovs, &jumps);
+    assert(cmovs == 1 && jumps == 0);
+    _count_selects(mp, l, 0, &cmovs, &jumps);
+    assert(cmovs == 0 && jumps == 1);
+    l->ops->free(l);
+
+    // one armed, x keeps its value otherwise: if a < 5 goto L1; x = a; L1:
+    l = _new_select_listing(3,
+        new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LT, new_ir_value_immediate(5), "L1"),
+        new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_symbol("a")),
+        new_ir_label("L1"));
+    _count_selects(mp, l, 1, &cmovs, &jumps);
+    assert(cmovs == 1 && jumps == 0);
+    l->ops->free(l);
+
+    // one armed on a global, others may see it written: if a < 5 goto L1; g = a; L1:
+    l = _new_select_listing(3,
+        new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LT, new_ir_value_immediate(5), "L1"),
+        new_ir_assignment(new_ir_value_symbol("g"), new_ir_value_symbol("a")),
+        new_ir_label("L1"));
+    _count_selects(mp, l, 1, &cmovs, &jumps);
+    assert(cmovs == 0 && jumps == 1);
+    l->ops->free(l);
+
+    // the else arm is also reached from an earlier jump, it stays a branch
+    l = _new_select_listing(7,
+        new_ir_conditional_jump(new_ir_value_symbol("a"), IR_EQ, new_ir_value_immediate(9), "L1"),
+        new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LT, new_ir_value_immediate(5), "L1"),
+        new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_symbol("a")),
+        new_ir_unconditional_jump("L2"),
+        new_ir_label("L1"),
+        new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_immediate(7)),
+        new_ir_label("L2"));
+    _count_selects(mp, l, 1, &cmovs, &jumps);
+    assert(cmovs == 0 && jumps == 2);
+    l->ops->free(l);
+
+    // the arms assign different things: if a < 5 goto L1; x = a; goto L2; L1: a = 7; L2:
+    l = _new_select_listing(6,
+        new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LT, new_ir_value_immediate(5), "L1"),
+        new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_symbol("a")),
+        new_ir_unconditional_jump("L2"),
+        new_ir_label("L1"),
+        new_ir_assignment(new_ir_value_symbol("a"), new_ir_value_immediate(7)),
+        new_ir_label("L2"));
+    _count_selects(mp, l, 1, &cmovs, &jumps);
+    assert(cmovs == 0 && jumps == 1);
+    l->ops->free(l);
+
+    mempool_release(mp);
+}
+
+void ir_to_asm_converter_unit_tests() {
+    long magic;
+    int shift;
+
+    // the values listed in "Hacker's Delight"
+    _signed_magic(3, 32, &magic, &shift);
+    assert(magic == 0x55555556 && shift == 0);
+    _signed_magic(7, 32, &magic, &shift);
+    assert(magic == (int)0x92492493 && shift == 2);
+    _signed_magic(-5, 32, &magic, &shift);
+    assert(magic == (int)0x99999999 && shift == 1);
+    _signed_magic(7, 64, &magic, &shift);
+    assert(magic == 0x4924924924924925L && shift == 1);
+
+    assert(_power_of_two(1) == 0);
+    assert(_power_of_two(64) == 6);
+    assert(_power_of_two(48) == -1);
+    assert(_power_of_two(-8) == -1);
+
+    _find_select_unit_tests();
+}
+#endif
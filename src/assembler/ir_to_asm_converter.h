@@ -8,3 +8,8 @@
 
 // given an Intemediate Representation listing, generate an assembly listing.
 void convert_ir_listing_to_asm_listing(mempool *mp, ir_listing *ir_list, asm_listing *asm_list);
+
+
+#ifdef INCLUDE_UNIT_TESTS
+void ir_to_asm_converter_unit_tests();
+#endif
@@ -1,79 +1,828 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include "../err_handler.h"
+#include "../utils/all.h"
+#include "asm_line.h"
+#include "asm_listing.h"
+#include "parse_asm.h"
 
 
+/*
+    Reads assembly source into an asm_listing, one line at a time.
+    It understands what asm_listing prints, and the intel syntax of GNU as:
+
+        .intel_syntax noprefix
+        .global _start
+        _start:     mov  rdi, [rsp]         # comment
+        main_exit:  MOV  QWORD PTR [BP-8], 0x0          ; comment
+                    lea  rax, [rbx+rsi*4+8]
+        .data
+        msg:        db   "hello", 10
+
+    Mnemonics, registers and size names are case insensitive.
+    Data needs a label, strings go in byte units only.
+*/
+
+#define MAX_WORD  128
+
 #define is_eof(c)         ((c)=='\0')
 #define is_whitespace(c)  ((c)==' ' || (c)=='\t')
 #define is_newline(c)     ((c)=='\n' || (c)=='\r')
 #define is_label(c)       ((c)==':')
 #define is_comma(c)       ((c)==',')
-#define is_comment(c)     ((c)==';')
-#define is_alphanum(c)    (((c)>='a'&&(c)<='z') || ((c)>='A'&&(c)<='Z') || ((c)>='0'&&(c)<='9') || (c)=='_')
-#define is_op_symbol(c)   (((c)=='[') || ((c)==']') || ((c)=='+') || ((c)=='-'))
+#define is_comment(c)     ((c)==';' || (c)=='#')
+#define is_digit(c)       ((c)>='0' && (c)<='9')
+#define is_alphanum(c)    (((c)>='a'&&(c)<='z') || ((c)>='A'&&(c)<='Z') || is_digit(c) || (c)=='_')
+#define is_symbol(c)      (is_alphanum(c) || (c)=='.' || (c)=='$' || (c)=='@')
+#define is_line_end(c)    (is_eof(c) || is_newline(c) || is_comment(c))
+
+struct named_code {
+    const char *name;
+    int code;
+};
+
+struct parsed_operand {
+    enum operand_type type; // OT_NONE when only a size was given, e.g. "RET QWORD PTR"
+    data_size size;         // from "QWORD PTR" etc, DATA_UNKNOWN if not given
+    gp_register reg;        // the register, or the base of the memory
+    gp_register index_reg;
+    int scale;              // zero when there is no index
+    long value;             // the immediate, or the displacement
+    char symbol[MAX_WORD];
+};
+
+typedef struct asm_parser {
+    asm_listing *lst;
+    const char *filename;
+    int line_no;
+    const char *p; // position in the line
+    char here[48]; // for error messages
+} asm_parser;
+
+
+// --------------------------------------------------------------
+
+static struct named_code mnemonics[OC_COUNT + 32];
+static int mnemonics_count;
+static struct named_code registers[64];
+static int registers_count;
+
+// the names of GNU as and the Intel manuals, for the ones we spell differently
+static struct named_code aliases[] = {
+    { "JE", OC_JEQ }, { "JZ", OC_JEQ }, { "JNZ", OC_JNE },
+    { "JA", OC_JAB }, { "JNBE", OC_JAB }, { "JNB", OC_JAE }, { "JNC", OC_JAE },
+    { "JB", OC_JBL }, { "JC", OC_JBL }, { "JNAE", OC_JBL }, { "JNA", OC_JBE },
+    { "JG", OC_JGT }, { "JNLE", OC_JGT }, { "JNL", OC_JGE },
+    { "JL", OC_JLT }, { "JNGE", OC_JLT }, { "JNG", OC_JLE },
+    { "CMOVE", OC_CMOVEQ }, { "CMOVZ", OC_CMOVEQ }, { "CMOVNZ", OC_CMOVNE },
+    { "CMOVA", OC_CMOVAB }, { "CMOVNB", OC_CMOVAE }, { "CMOVB", OC_CMOVBL }, { "CMOVNA", OC_CMOVBE },
+    { "CMOVG", OC_CMOVGT }, { "CMOVL", OC_CMOVLT }, { "CMOVNL", OC_CMOVGE }, { "CMOVNG", OC_CMOVLE },
+};
+
+static int _compare_named_codes(const void *a, const void *b) {
+    return strcasecmp(((struct named_code *)a)->name, ((struct named_code *)b)->name);
+}
+
+// the names are sorted once, then looked up by binary search
+static void _prepare_names() {
+    if (mnemonics_count > 0)
+        return;
+
+    for (int code = OC_NONE + 1; code < OC_COUNT; code++)
+        mnemonics[mnemonics_count++] = (struct named_code){ instr_code_name(code), code };
+    for (int i = 0; i < sizeof(aliases) / sizeof(aliases[0]); i++)
+        mnemonics[mnemonics_count++] = aliases[i];
+    qsort(mnemonics, mnemonics_count, sizeof(struct named_code), _compare_named_codes);
+
+    for (int reg = 0; reg < 64; reg++)
+        registers[registers_count++] = (struct named_code){ register_name(reg), reg };
+    qsort(registers, registers_count, sizeof(struct named_code), _compare_named_codes);
+}
 
+static int _find_name(struct named_code *table, int count, const char *name) {
+    struct named_code key = { name, 0 };
+    struct named_code *found = bsearch(&key, table, count, sizeof(struct named_code), _compare_named_codes);
+    return found == NULL ? -1 : found->code;
+}
+
+static data_size _size_keyword(const char *word) {
+    if (strcasecmp(word, "BYTE") == 0)  return DATA_BYTE;
+    if (strcasecmp(word, "WORD") == 0)  return DATA_WORD;
+    if (strcasecmp(word, "DWORD") == 0) return DATA_DWORD;
+    if (strcasecmp(word, "QWORD") == 0) return DATA_QWORD;
+    return DATA_UNKNOWN;
+}
+
+static data_size _data_keyword(const char *word, bool *zero_terminated) {
+    *zero_terminated = false;
+    if (strcasecmp(word, "db") == 0 || strcmp(word, ".byte") == 0 || strcmp(word, ".ascii") == 0)
+        return DATA_BYTE;
+    if (strcmp(word, ".asciz") == 0 || strcmp(word, ".string") == 0) {
+        *zero_terminated = true;
+        return DATA_BYTE;
+    }
+    if (strcasecmp(word, "dw") == 0 || strcmp(word, ".word") == 0 || strcmp(word, ".short") == 0)
+        return DATA_WORD;
+    if (strcasecmp(word, "dd") == 0 || strcmp(word, ".long") == 0 || strcmp(word, ".int") == 0)
+        return DATA_DWORD;
+    if (strcasecmp(word, "dq") == 0 || strcmp(word, ".quad") == 0)
+        return DATA_QWORD;
+    return DATA_UNKNOWN;
+}
+
+// --------------------------------------------------------------
+
+static inline void skip_whitespace(asm_parser *ps) {
+    while (is_whitespace(*ps->p)) ps->p++;
+}
 
-static inline void skip_whitespace(char **stream) {
-    while (is_whitespace(**stream)) (*stream)++;
+// what we stumbled upon, for error messages
+static const char *_here(asm_parser *ps) {
+    if (is_line_end(*ps->p))
+        return "end of line";
+    snprintf(ps->here, sizeof(ps->here), "'%.40s'", ps->p);
+    char *newline = strpbrk(ps->here + 1, "\r\n");
+    if (newline != NULL)
+        strcpy(newline, "'");
+    return ps->here;
+}
+
+// a label, mnemonic, register or symbol. empty if there is none here
+static bool grab_word(asm_parser *ps, char *target) {
+    int len = 0;
+    while (is_symbol(*ps->p)) {
+        if (len == MAX_WORD - 1) {
+            error_at(ps->filename, ps->line_no, "name too long, up to %d characters are supported", MAX_WORD - 1);
+            return false;
+        }
+        target[len++] = *ps->p++;
+    }
+    target[len] = '\0';
+    return true;
+}
+
+// decimal, or hex with a "0x" prefix, possibly negative
+static bool grab_number(asm_parser *ps, long *value) {
+    bool negative = false;
+    if (*ps->p == '-' || *ps->p == '+') {
+        negative = (*ps->p == '-');
+        ps->p++;
+        skip_whitespace(ps);
+    }
+    if (!is_digit(*ps->p)) {
+        error_at(ps->filename, ps->line_no, "expected a number at %s", _here(ps));
+        return false;
+    }
+    char *end;
+    unsigned long n = strtoul(ps->p, &end, 0);
+    if (is_symbol(*end)) {
+        error_at(ps->filename, ps->line_no, "malformed number at %s", _here(ps));
+        return false;
+    }
+    ps->p = end;
+    *value = negative ? -(long)n : (long)n;
+    return true;
 }
 
-static inline void skip_to_next_line(char **stream) {
-    while (!is_newline(**stream) && !is_eof(**stream)) (*stream)++;
-    while (is_newline(**stream)) (*stream)++;
+static bool expect_line_end(asm_parser *ps) {
+    skip_whitespace(ps);
+    if (!is_line_end(*ps->p)) {
+        error_at(ps->filename, ps->line_no, "unexpected %s", _here(ps));
+        return false;
+    }
+    return true;
 }
 
-static inline void skip_to_eof(char **stream) {
-    while (!is_eof(**stream)) (*stream)++;
+// --------------------------------------------------------------
+
+static void set_label(asm_parser *ps, const char *label) {
+    // two labels in a row, the first one gets a line of its own
+    if (ps->lst->next_label != NULL)
+        ps->lst->ops->add_line(ps->lst, new_asm_line_instruction(ps->lst->mempool, OC_NONE));
+    ps->lst->ops->set_next_label(ps->lst, "%s", label);
 }
 
-static inline void grab_token(char **stream, char *target, int target_size) {
-    target_size--; // to allow for terminator
-    while (is_alphanum(**stream) || is_op_symbol(**stream)) {
-        *target++ = **stream;
-        (*stream)++;
-        if (--target_size == 0)
+// e.g. "[RBP-8]", "[rbx + rsi*4 + 8]", "[rip + msg]"
+static bool parse_memory(asm_parser *ps, struct parsed_operand *op) {
+    char word[MAX_WORD];
+    bool has_base = false, rip_relative = false;
+    int sign = 1;
+    ps->p++; // the '['
+
+    while (true) {
+        skip_whitespace(ps);
+        if (is_digit(*ps->p)) {
+            long n;
+            if (!grab_number(ps, &n))
+                return false;
+            skip_whitespace(ps);
+            if (*ps->p == '*') {
+                // "4*RSI"
+                ps->p++;
+                skip_whitespace(ps);
+                if (!grab_word(ps, word))
+                    return false;
+                int reg = _find_name(registers, registers_count, word);
+                if (reg == -1 || op->scale != 0) {
+                    error_at(ps->filename, ps->line_no, "expected an index register after '*'");
+                    return false;
+                }
+                op->index_reg = reg;
+                op->scale = n;
+            } else {
+                op->value += sign * n;
+            }
+        } else {
+            if (!grab_word(ps, word))
+                return false;
+            if (word[0] == '\0') {
+                error_at(ps->filename, ps->line_no, "unexpected %s in memory operand", _here(ps));
+                return false;
+            }
+            int reg = _find_name(registers, registers_count, word);
+            skip_whitespace(ps);
+            if (strcasecmp(word, "RIP") == 0) {
+                rip_relative = true;
+            } else if (reg != -1 && *ps->p == '*') {
+                long n;
+                ps->p++;
+                skip_whitespace(ps);
+                if (!grab_number(ps, &n))
+                    return false;
+                if (op->scale != 0) {
+                    error_at(ps->filename, ps->line_no, "only one index register is supported");
+                    return false;
+                }
+                op->index_reg = reg;
+                op->scale = n;
+            } else if (reg != -1 && !has_base) {
+                op->reg = reg;
+                has_base = true;
+            } else if (reg != -1 && op->scale == 0) {
+                op->index_reg = reg;
+                op->scale = 1;
+            } else if (reg == -1 && op->symbol[0] == '\0' && sign > 0) {
+                strcpy(op->symbol, word);
+            } else {
+                error_at(ps->filename, ps->line_no, "unsupported memory operand term '%s'", word);
+                return false;
+            }
+        }
+
+        skip_whitespace(ps);
+        if (*ps->p == ']') {
+            ps->p++;
             break;
+        } else if (*ps->p == '+' || *ps->p == '-') {
+            sign = (*ps->p == '-') ? -1 : 1;
+            ps->p++;
+        } else {
+            error_at(ps->filename, ps->line_no, "expected '+', '-' or ']' at %s", _here(ps));
+            return false;
+        }
     }
-    *target = '\0';
+
+    if (op->symbol[0] != '\0') {
+        // the encoder makes every symbol address RIP relative
+        if (has_base || op->scale != 0 || op->value != 0) {
+            error_at(ps->filename, ps->line_no, "symbols cannot be combined with registers or offsets");
+            return false;
+        }
+        op->type = OT_MEM_OF_SYMBOL;
+        return true;
+    }
+    if (rip_relative || !has_base) {
+        error_at(ps->filename, ps->line_no, "memory operands need a base register or a symbol");
+        return false;
+    }
+    if (op->scale != 0 && op->scale != 1 && op->scale != 2 && op->scale != 4 && op->scale != 8) {
+        error_at(ps->filename, ps->line_no, "scale must be 1, 2, 4 or 8, not %d", op->scale);
+        return false;
+    }
+    if (op->value < INT32_MIN || op->value > INT32_MAX) {
+        error_at(ps->filename, ps->line_no, "displacement does not fit in 32 bits");
+        return false;
+    }
+    op->type = OT_MEM_POINTED_BY_REG;
+    return true;
 }
 
+static bool parse_operand(asm_parser *ps, struct parsed_operand *op) {
+    char word[MAX_WORD];
+    memset(op, 0, sizeof(struct parsed_operand));
 
+    skip_whitespace(ps);
+    const char *start = ps->p;
+    if (!grab_word(ps, word))
+        return false;
 
-// expecting the following format:
-//       <label>:   <opcode> [ <op1> [ , <op2> ]] [ ; line comment ]
-// label is expected on first column, opcode must be after whitespace
-// returns true if we gotten the opcode, all the rest are optional.
-void parse_asm_line(char **stream, char *label, char *opcode, char *op1, char *op2, int line_no, int str_size) {
-    char *placeholders[4];
+    // "QWORD PTR [...]", or plain "QWORD [...]"
+    op->size = _size_keyword(word);
+    if (op->size != DATA_UNKNOWN) {
+        skip_whitespace(ps);
+        const char *before_ptr = ps->p;
+        if (!grab_word(ps, word))
+            return false;
+        if (strcasecmp(word, "PTR") != 0)
+            ps->p = before_ptr;
+        skip_whitespace(ps);
+        start = ps->p;
+        if (!grab_word(ps, word))
+            return false;
+    }
+
+    if (word[0] == '\0' && *ps->p == '[') {
+        return parse_memory(ps, op);
+
+    } else if (word[0] == '\0' && (is_comma(*ps->p) || is_line_end(*ps->p))) {
+        if (op->size == DATA_UNKNOWN) {
+            error_at(ps->filename, ps->line_no, "missing operand");
+            return false;
+        }
+        op->type = OT_NONE; // only the size, e.g. "RET QWORD PTR"
+        return true;
 
-    placeholders[0] = label;
-    placeholders[1] = opcode;
-    placeholders[2] = op1;
-    placeholders[3] = op2;
+    } else if (is_digit(start[0]) || start[0] == '-' || start[0] == '+') {
+        ps->p = start;
+        if (!grab_number(ps, &op->value))
+            return false;
+        // signed or unsigned 32 bits, e.g. 0xffffffff for -1
+        if (op->value < INT32_MIN || op->value > UINT32_MAX) {
+            error_at(ps->filename, ps->line_no, "immediate value does not fit in 32 bits");
+            return false;
+        }
+        op->type = OT_IMMEDIATE;
+        return true;
 
-    // parts: label, opcode, op1, op2
-    // assume we are at start of the word each time
-    for (int part = 0; part < 4 && !is_eof(**stream); part++) {
-        *placeholders[part] = '\0';
-        grab_token(stream, placeholders[part], 64);
-        if (part == 0 && strlen(placeholders[part]) > 0 && !is_label(**stream)) {
-            error("was expecting a color after label at start of line");
-            return;
+    } else if (word[0] != '\0') {
+        int reg = _find_name(registers, registers_count, word);
+        if (reg != -1) {
+            op->type = OT_REGISTER;
+            op->reg = reg;
+        } else {
+            // e.g. "CALL main", the address of the symbol
+            op->type = OT_MEM_OF_SYMBOL;
+            strcpy(op->symbol, word);
         }
+        return true;
+    }
 
-        skip_whitespace(stream);
-        if (is_eof(**stream)) break;
+    error_at(ps->filename, ps->line_no, "unexpected %s", _here(ps));
+    return false;
+}
 
-        if (part == 2 && is_comma(**stream)) {
-            (*stream)++;
+static asm_operand *_to_asm_operand(asm_operand *target, struct parsed_operand *op) {
+    memset(target, 0, sizeof(asm_operand));
+    target->type = op->type;
+    target->reg = op->reg;
+    target->immediate = op->value;
+    target->offset = op->value;
+    target->symbol_name = op->symbol;
+    return target;
+}
+
+static bool _is_memory(struct parsed_operand *op) {
+    return op->type == OT_MEM_POINTED_BY_REG || op->type == OT_MEM_OF_SYMBOL;
+}
+
+static bool parse_instruction(asm_parser *ps, const char *mnemonic) {
+    mempool *mp = ps->lst->mempool;
+    int code = _find_name(mnemonics, mnemonics_count, mnemonic);
+    if (code == -1) {
+        error_at(ps->filename, ps->line_no, "unknown instruction '%s'", mnemonic);
+        return false;
+    }
+
+    struct parsed_operand ops[2];
+    int count = 0;
+    skip_whitespace(ps);
+    while (!is_line_end(*ps->p)) {
+        if (count == 2) {
+            error_at(ps->filename, ps->line_no, "up to two operands are supported");
+            return false;
+        }
+        if (!parse_operand(ps, &ops[count]))
+            return false;
+        count++;
+        skip_whitespace(ps);
+        if (is_comma(*ps->p))
+            ps->p++;
+        else if (!is_line_end(*ps->p)) {
+            error_at(ps->filename, ps->line_no, "expected ',' at %s", _here(ps));
+            return false;
         }
+    }
 
-        skip_whitespace(stream);
-        if (is_eof(**stream)) break;
+    // a lone size is not an operand, e.g. "RET  QWORD PTR"
+    data_size size = DATA_UNKNOWN;
+    for (int i = 0; i < count; i++)
+        if (ops[i].size != DATA_UNKNOWN)
+            size = ops[i].size;
+    if (count > 0 && ops[count - 1].type == OT_NONE)
+        count--;
+    if (count == 2 && ops[0].type == OT_NONE) {
+        error_at(ps->filename, ps->line_no, "missing operand");
+        return false;
+    }
 
-        if (is_comment(**stream)) {
-            skip_to_next_line(stream);
-            break;
+    asm_line *line;
+    asm_operand a, b;
+    if (count == 0) {
+        line = new_asm_line_instruction(mp, code);
+    } else if (count == 1) {
+        line = new_asm_line_instruction_with_operand(mp, code, _to_asm_operand(&a, &ops[0]));
+    } else {
+        if (_is_memory(&ops[0]) && _is_memory(&ops[1])) {
+            error_at(ps->filename, ps->line_no, "memory to memory operations cannot be encoded");
+            return false;
+        }
+        if (ops[0].type == OT_IMMEDIATE) {
+            error_at(ps->filename, ps->line_no, "the target operand cannot be an immediate");
+            return false;
         }
+        if (code >= OC_CMOVEQ && code <= OC_CMOVLE && ops[0].type == OT_REGISTER)
+            line = new_asm_line_instruction_reg_regmem(mp, code, ops[0].reg, _to_asm_operand(&b, &ops[1]));
+        else
+            line = new_asm_line_instruction_with_operands(mp, code, _to_asm_operand(&a, &ops[0]), _to_asm_operand(&b, &ops[1]));
     }
+
+    asm_instruction *instr = line->per_type.instruction;
+    if (size != DATA_UNKNOWN)
+        instr->operands_data_size = size;
+    for (int i = 0; i < count; i++) {
+        if (ops[i].type == OT_MEM_POINTED_BY_REG && ops[i].scale != 0) {
+            instr->regmem_operand.per_type.mem.array_index_reg = ops[i].index_reg;
+            instr->regmem_operand.per_type.mem.array_item_size = ops[i].scale;
+        }
+    }
+
+    ps->lst->ops->add_line(ps->lst, line);
+    return true;
+}
+
+// e.g. "msg: db "hello", 10, 0" or "table: .quad 1, 2, 3"
+static bool parse_data(asm_parser *ps, data_size unit_size, bool zero_terminated) {
+    asm_listing *lst = ps->lst;
+    if (lst->next_label == NULL) {
+        error_at(ps->filename, ps->line_no, "data definitions need a label");
+        return false;
+    }
+    str *name = lst->next_label;
+    lst->next_label = NULL;
+
+    bin *data = new_bin(lst->mempool);
+    int units = 0;
+    skip_whitespace(ps);
+    while (!is_line_end(*ps->p)) {
+        if (*ps->p == '"' || *ps->p == '\'') {
+            if (unit_size != DATA_BYTE) {
+                error_at(ps->filename, ps->line_no, "strings are only supported in byte data");
+                return false;
+            }
+            char quote = *ps->p++;
+            while (*ps->p != quote) {
+                char c = *ps->p++;
+                if (is_eof(c) || is_newline(c)) {
+                    error_at(ps->filename, ps->line_no, "unterminated string");
+                    return false;
+                }
+                if (c == '\\') {
+                    c = *ps->p++;
+                    switch (c) {
+                        case 'n': c = '\n'; break;
+                        case 'r': c = '\r'; break;
+                        case 't': c = '\t'; break;
+                        case '0': c = '\0'; break;
+                        case '\\': case '"': case '\'': break;
+                        default:
+                            error_at(ps->filename, ps->line_no, "unsupported escape sequence '\\%c'", c);
+                            return false;
+                    }
+                }
+                bin_add_byte(data, (u8)c);
+                units++;
+            }
+            ps->p++;
+        } else {
+            long value;
+            if (!grab_number(ps, &value))
+                return false;
+            switch (unit_size) {
+                case DATA_BYTE:  bin_add_byte(data, (u8)value); break;
+                case DATA_WORD:  bin_add_word(data, (u16)value); break;
+                case DATA_DWORD: bin_add_dword(data, (u32)value); break;
+                case DATA_QWORD: bin_add_qword(data, (u64)value); break;
+                default: break; // the directives only give the four sizes
+            }
+            units++;
+        }
+        skip_whitespace(ps);
+        if (is_comma(*ps->p)) {
+            ps->p++;
+            skip_whitespace(ps);
+        } else if (!is_line_end(*ps->p)) {
+            error_at(ps->filename, ps->line_no, "expected ',' at %s", _here(ps));
+            return false;
+        }
+    }
+    if (zero_terminated) {
+        bin_add_byte(data, 0);
+        units++;
+    }
+
+    lst->ops->add_line(lst, new_asm_line_data_definition(lst->mempool, name, unit_size, units, data));
+    return true;
+}
+
+// the directives that name symbols or a section, the rest are ignored or refused
+static bool parse_directive(asm_parser *ps, const char *directive) {
+    asm_listing *lst = ps->lst;
+    char word[MAX_WORD];
+    const char *name = directive[0] == '.' ? directive + 1 : directive;
+
+    if (strcmp(name, "text") == 0 || strcmp(name, "data") == 0 ||
+        strcmp(name, "bss") == 0 || strcmp(name, "rodata") == 0) {
+        lst->ops->select_section(lst, ".%s", name);
+        return expect_line_end(ps);
+
+    } else if (strcasecmp(name, "section") == 0) {
+        skip_whitespace(ps);
+        if (!grab_word(ps, word))
+            return false;
+        if (word[0] == '\0') {
+            error_at(ps->filename, ps->line_no, "expected a section name");
+            return false;
+        }
+        lst->ops->select_section(lst, "%s", word);
+        // flags and type, e.g. ', "ax", @progbits', are of no use to us
+        return true;
+
+    } else if (strcasecmp(name, "global") == 0 || strcmp(name, "globl") == 0 || strcasecmp(name, "extern") == 0) {
+        bool is_extern = strcasecmp(name, "extern") == 0;
+        do {
+            skip_whitespace(ps);
+            if (!grab_word(ps, word))
+                return false;
+            if (word[0] == '\0') {
+                error_at(ps->filename, ps->line_no, "expected a symbol name");
+                return false;
+            }
+            if (is_extern)
+                lst->ops->declare_extern(lst, "%s", word);
+            else
+                lst->ops->declare_global(lst, "%s", word);
+            skip_whitespace(ps);
+        } while (is_comma(*ps->p) && ps->p++);
+        return expect_line_end(ps);
+
+    } else if (strcmp(name, "intel_syntax") == 0 || strcmp(name, "intel_mnemonic") == 0 ||
+               strcmp(name, "file") == 0 || strcmp(name, "ident") == 0 ||
+               strcmp(name, "type") == 0 || strcmp(name, "size") == 0) {
+        // nothing that changes the bytes we produce
+        return true;
+    }
+
+    error_at(ps->filename, ps->line_no, "unsupported directive '%s'", directive);
+    return false;
+}
+
+// --------------------------------------------------------------
+
+// expecting the following format:
+//       [ <label>: ] [ <opcode> [ <op1> [ , <op2> ]] ] [ ; line comment ]
+//       [ <label>: ] <data keyword> <value> [, <value> ...]
+//       <name> db|dw|dd|dq <value> [, <value> ...]
+//       <directive> [ <arguments> ]
+bool parse_asm_line(asm_listing *lst, const char *text, const char *filename, int line_no) {
+    asm_parser parser = { lst, filename, line_no, text, "" };
+    asm_parser *ps = &parser;
+    char word[MAX_WORD];
+    bool zero_terminated;
+    _prepare_names();
+
+    skip_whitespace(ps);
+    if (is_line_end(*ps->p))
+        return true;
+    if (!grab_word(ps, word))
+        return false;
+    if (word[0] == '\0') {
+        error_at(filename, line_no, "unexpected %s", _here(ps));
+        return false;
+    }
+
+    if (is_label(*ps->p)) {
+        ps->p++;
+        set_label(ps, word);
+        skip_whitespace(ps);
+        if (is_line_end(*ps->p))
+            return true;
+        if (!grab_word(ps, word))
+            return false;
+    } else if (_find_name(mnemonics, mnemonics_count, word) == -1 && word[0] != '.' &&
+               _data_keyword(word, &zero_terminated) == DATA_UNKNOWN) {
+        // maybe the NASM way, "msg db 'hi'", labels data without a colon
+        const char *after_name = ps->p;
+        char keyword[MAX_WORD];
+        skip_whitespace(ps);
+        if (!grab_word(ps, keyword))
+            return false;
+        if (_data_keyword(keyword, &zero_terminated) != DATA_UNKNOWN) {
+            set_label(ps, word);
+            strcpy(word, keyword);
+        } else {
+            ps->p = after_name;
+        }
+    }
+
+    data_size unit_size = _data_keyword(word, &zero_terminated);
+    if (unit_size != DATA_UNKNOWN)
+        return parse_data(ps, unit_size, zero_terminated);
+    if (word[0] == '.' || strcasecmp(word, "section") == 0 ||
+        strcasecmp(word, "global") == 0 || strcasecmp(word, "extern") == 0)
+        return parse_directive(ps, word);
+    return parse_instruction(ps, word);
+}
+
+bool parse_asm_stream(asm_listing *lst, FILE *stream, const char *filename) {
+    int errors_before = errors_count;
+    char *line = NULL;
+    size_t capacity = 0;
+    int line_no = 0;
+
+    // the buffer is reused, only the parsed lines are kept
+    while (getline(&line, &capacity, stream) != -1)
+        parse_asm_line(lst, line, filename, ++line_no);
+    free(line);
+
+    // a label at the very end still marks the end of the code
+    if (lst->next_label != NULL)
+        lst->ops->add_line(lst, new_asm_line_instruction(lst->mempool, OC_NONE));
+
+    return errors_count == errors_before;
+}
+
+
+#ifdef INCLUDE_UNIT_TESTS
+#include "../utils/unit_tests.h"
+#include "assembler.h"
+
+static void test_parse_instructions();
+static void test_parse_directives_and_data();
+static void test_listing_round_trip();
+
+void parse_asm_unit_tests() {
+    test_parse_instructions();
+    test_parse_directives_and_data();
+    test_listing_round_trip();
+}
+
+static asm_instruction *_parsed_instruction(mempool *mp, const char *text) {
+    asm_listing *lst = new_asm_listing(mp);
+    if (!parse_asm_line(lst, text, "test.asm", 1) || list_length(lst->lines) != 1)
+        return NULL;
+    asm_line *line = list_get(lst->lines, 0);
+    return line->type == ALT_INSTRUCTION ? line->per_type.instruction : NULL;
+}
+
+static void test_parse_instructions() {
+    mempool *mp = new_mempool();
+    asm_instruction *i;
+
+    i = _parsed_instruction(mp, "mov rax, rdi");
+    assert(i != NULL && i->operation == OC_MOV && !i->direction_regmem_to_regimm);
+    assert(i->regmem_operand.is_register && i->regmem_operand.per_type.reg == REG_RAX);
+    assert(i->regimm_operand.is_register && i->regimm_operand.per_type.reg == REG_RDI);
+
+    // loading from memory goes the other way
+    i = _parsed_instruction(mp, "  MOV  AX, QWORD PTR [BP-8]    ; comment");
+    assert(i != NULL && i->direction_regmem_to_regimm);
+    assert(i->regmem_operand.is_memory_by_reg && i->regmem_operand.per_type.mem.pointer_reg == REG_BP);
+    assert(i->regmem_operand.per_type.mem.displacement == -8);
+    assert(i->regimm_operand.per_type.reg == REG_AX);
+
+    i = _parsed_instruction(mp, "lea rax, [rbx + rsi*4 + 0x10]  # comment");
+    assert(i != NULL && i->operation == OC_LEA);
+    assert(i->regmem_operand.per_type.mem.pointer_reg == REG_RBX);
+    assert(i->regmem_operand.per_type.mem.array_index_reg == REG_RSI);
+    assert(i->regmem_operand.per_type.mem.array_item_size == 4);
+    assert(i->regmem_operand.per_type.mem.displacement == 16);
+
+    i = _parsed_instruction(mp, "CMP  DWORD PTR [RBP+16], 0xffffffff");
+    assert(i != NULL && i->operands_data_size == DATA_DWORD);
+    assert(i->regimm_operand.is_immediate && i->regimm_operand.per_type.immediate == -1);
+
+    i = _parsed_instruction(mp, "je .L2");
+    assert(i != NULL && i->operation == OC_JEQ && i->regmem_operand.is_mem_addr_by_symbol);
+    assert(strcmp(i->regmem_operand.per_type.mem.displacement_symbol_name, ".L2") == 0);
+
+    i = _parsed_instruction(mp, "CALL QWORD PTR printf");
+    assert(i != NULL && i->operation == OC_CALL && i->regmem_operand.is_mem_addr_by_symbol);
+
+    i = _parsed_instruction(mp, "RET  QWORD PTR ");
+    assert(i != NULL && i->operation == OC_RET && !i->regmem_operand.is_register);
+
+    i = _parsed_instruction(mp, "cmovl rax, rbx");
+    assert(i != NULL && i->operation == OC_CMOVLT && i->direction_regmem_to_regimm);
+    assert(i->regimm_operand.per_type.reg == REG_RAX && i->regmem_operand.per_type.reg == REG_RBX);
+
+    i = _parsed_instruction(mp, "syscall");
+    assert(i != NULL && i->operation == OC_SYSCALL);
+
+    // refused, with an error each
+    int errors_before = errors_count;
+    assert(_parsed_instruction(mp, "mov [rax], [rbx]") == NULL);
+    assert(_parsed_instruction(mp, "frobnicate rax") == NULL);
+    assert(_parsed_instruction(mp, "mov rax, [rbx*3]") == NULL);
+    assert(_parsed_instruction(mp, "add rax, 0x123456789") == NULL);
+    assert(errors_count > errors_before);
+    errors_count = errors_before;
+
+    mempool_release(mp);
+}
+
+static void test_parse_directives_and_data() {
+    mempool *mp = new_mempool();
+    asm_listing *lst = new_asm_listing(mp);
+    const char *source[] = {
+        ".intel_syntax noprefix",
+        ".global _start, main",
+        "extern printf",
+        ".data",
+        "msg:    .asciz \"hi\\n\"",
+        "nums    dw 1, -1",
+        ".text",
+        "_start:",
+        "",
+        "main:   ret",
+    };
+    for (int i = 0; i < sizeof(source) / sizeof(source[0]); i++)
+        assert(parse_asm_line(lst, source[i], "test.asm", i + 1));
+
+    assert(list_length(lst->lines) == 9);
+    asm_line *line = list_get(lst->lines, 1);
+    assert(line->type == ALT_GLOBAL && str_cmps(line->per_type.named_definition->name, "main") == 0);
+    line = list_get(lst->lines, 3);
+    assert(line->type == ALT_SECTION && str_cmps(line->per_type.named_definition->name, ".data") == 0);
+
+    line = list_get(lst->lines, 4);
+    assert(line->type == ALT_DATA && str_cmps(line->per_type.data_definition->name, "msg") == 0);
+    assert(line->per_type.data_definition->length_bytes == 4);
+    assert(memcmp(bin_ptr_at(line->per_type.data_definition->initial_value, 0), "hi\n\0", 4) == 0);
+    line = list_get(lst->lines, 5);
+    assert(line->type == ALT_DATA && str_cmps(line->per_type.data_definition->name, "nums") == 0);
+    assert(memcmp(bin_ptr_at(line->per_type.data_definition->initial_value, 0), "\x01\x00\xff\xff", 4) == 0);
+
+    // a label alone is a line of its own when another one follows
+    line = list_get(lst->lines, 7);
+    assert(line->type == ALT_INSTRUCTION && line->per_type.instruction->operation == OC_NONE);
+    assert(str_cmps(line->label, "_start") == 0);
+    line = list_get(lst->lines, 8);
+    assert(line->per_type.instruction->operation == OC_RET && str_cmps(line->label, "main") == 0);
+
+    mempool_release(mp);
+}
+
+static void test_listing_round_trip() {
+    mempool *mp = new_mempool();
+    asm_listing *original = new_asm_listing(mp);
+
+    original->ops->set_next_label(original, "func");
+    original->ops->add_line(original, new_asm_line_instruction_for_register(mp, OC_PUSH, REG_RBP));
+    original->ops->add_line(original, new_asm_line_instruction_reg_reg(mp, OC_MOV, REG_RBP, REG_RSP));
+    original->ops->add_line(original, new_asm_line_instruction_for_reserving_stack_space(mp, 24));
+    original->ops->set_next_label(original, "again");
+    original->ops->add_line(original, new_asm_line_instruction_mem_imm(mp, OC_CMP, REG_RBP, DATA_QWORD, -200));
+    original->ops->add_line(original, new_asm_line_instruction_with_operand(mp, OC_JGE, new_asm_operand_mem_by_sym(mp, "done")));
+    original->ops->add_line(original, new_asm_line_instruction_reg_mem_scaled(mp, OC_LEA, REG_RAX, REG_RBX, REG_R9, 8));
+    original->ops->add_line(original, new_asm_line_instruction_with_operands(mp, OC_MOV, new_asm_operand_reg(mp, REG_RCX), new_asm_operand_mem_by_reg(mp, REG_RBP, -16)));
+    original->ops->add_line(original, new_asm_line_instruction_with_operands(mp, OC_ADD, new_asm_operand_mem_by_reg(mp, REG_RBP, -16), new_asm_operand_reg(mp, REG_RCX)));
+    original->ops->add_line(original, new_asm_line_instruction_with_operand(mp, OC_CALL, new_asm_operand_mem_by_sym(mp, "other")));
+    original->ops->add_line(original, new_asm_line_instruction_with_operand(mp, OC_JMP, new_asm_operand_mem_by_sym(mp, "again")));
+    original->ops->set_next_label(original, "done");
+    original->ops->add_line(original, new_asm_line_instruction(mp, OC_RET));
+
+    // print it, parse it back, both must assemble the same
+    asm_listing *parsed = new_asm_listing(mp);
+    int line_no = 0;
+    for_list(original->lines, asm_line, line)
+        assert(parse_asm_line(parsed, str_charptr(asm_line_to_str(mp, line)), "test.asm", ++line_no));
+    assert(list_length(parsed->lines) == list_length(original->lines));
+
+    assembler *as1 = new_assembler(mp);
+    assembler *as2 = new_assembler(mp);
+    obj_module *m1 = as1->ops->assemble_listing_into_x86_64_code(as1, original, new_str(mp, "original"));
+    obj_module *m2 = as2->ops->assemble_listing_into_x86_64_code(as2, parsed, new_str(mp, "parsed"));
+    assert(m1 != NULL && m2 != NULL);
+    obj_section *s1 = list_get(m1->sections, 0);
+    obj_section *s2 = list_get(m2->sections, 0);
+    assert(bin_len(s1->contents) > 0 && bin_len(s1->contents) == bin_len(s2->contents));
+    assert(memcmp(bin_ptr_at(s1->contents, 0), bin_ptr_at(s2->contents, 0), bin_len(s1->contents)) == 0);
+    assert(list_length(s1->relocations) == 1 && list_length(s2->relocations) == 1);
+
+    mempool_release(mp);
 }
 
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+#include "asm_listing.h"
+
+// parses one line of assembly source into the listing, false on errors.
+// a label alone on its line is kept for the line that follows it.
+bool parse_asm_line(asm_listing *lst, const char *text, const char *filename, int line_no);
+
+// reads assembly source a line at a time, parsing each into the listing,
+// the text is never held in memory as a whole. false on errors
+bool parse_asm_stream(asm_listing *lst, FILE *stream, const char *filename);
+
+
+#ifdef INCLUDE_UNIT_TESTS
+void parse_asm_unit_tests();
+#endif
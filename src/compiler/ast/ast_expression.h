@@ -22,6 +22,7 @@ typedef struct ast_expression {
     // house keeping
     token *token;
     ast_data_type *result_type;
+    int registers_needed; // Sethi-Ullman number, zero until codegen labels it
     struct ast_expression_ops *ops;
     mempool *mempool;
 } ast_expression;
@@ -131,7 +131,7 @@ ast_operator to_binary_operator(token_type type) {
         case TOK_EQUAL_SIGN:      return OP_ASSIGNMENT;
         case TOK_DBL_PIPE:        return OP_LOGICAL_OR;
         case TOK_DBL_AMPERSAND:   return OP_LOGICAL_AND;
-        case TOK_EXCLAMANTION:    return OP_LOGICAL_NOT;
+        case TOK_EXCLAM_EQUAL:    return OP_NE;
         case TOK_DBL_EQUAL_SIGN:  return OP_EQ;
         case TOK_DBL_LESS_THAN:   return OP_LSHIFT;
         case TOK_DBL_GRATER_THAN: return OP_RSHIFT;
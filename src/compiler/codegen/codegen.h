@@ -47,5 +47,6 @@ void code_gen_generate_for_statement(code_gen *cg, ast_statement *stmt);
 
 // codegen_expr.c
 void code_gen_generate_for_expression(code_gen *cg, ir_value *lvalue, ast_expression *expr);
+void codegen_unit_tests();
 
 
@@ -10,6 +10,10 @@
 #include "../ast/all.h"
 #include "../ast/all.h"
 #include "../ast/all.h"
+#include "../lexer/lexer.h"
+#include "../parser/parser.h"
+#include "../analysis/analysis.h"
+#include "../../utils/unit_tests.h"
 #include "codegen.h"
 
 
@@ -69,13 +73,68 @@ static void gen_func_call(code_gen *cg, ir_value *lvalue, ast_expression *expr)
     cg->ir->ops->add(cg->ir, new_ir_function_call(lvalue, func_addr, argc, ir_values_arr));
 }
 
+// whether evaluating the expression can change anything, e.g. calls or assignments.
+// a division by zero faults, but we don't count that: with two divisions in
+// an expression, reordering may change which one faults first, and that's fine here
+static bool has_side_effects(ast_expression *expr) {
+    if (expr == NULL)
+        return false;
+    switch (expr->op) {
+        case OP_NUM_LITERAL:
+        case OP_CHR_LITERAL:
+        case OP_STR_LITERAL:
+        case OP_BOOL_LITERAL:
+        case OP_SYMBOL_NAME:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_BITWISE_AND:
+        case OP_BITWISE_OR:
+        case OP_BITWISE_XOR:
+        case OP_BITWISE_NOT:
+            return has_side_effects(expr->arg1) || has_side_effects(expr->arg2);
+        default:
+            return true;
+    }
+}
+
+// how many temp regs evaluating the expression keeps live at most,
+// if the more demanding operand is evaluated first (Sethi-Ullman numbering)
+static int label_registers_needed(ast_expression *expr) {
+    if (expr->registers_needed > 0)
+        return expr->registers_needed;
+
+    int need = 1;
+    if (expr->arg1 != NULL && expr->arg2 != NULL) {
+        int need1 = label_registers_needed(expr->arg1);
+        int need2 = label_registers_needed(expr->arg2);
+        need = (need1 == need2) ? need1 + 1 : (need1 > need2 ? need1 : need2);
+    } else if (expr->arg1 != NULL || expr->arg2 != NULL) {
+        need = label_registers_needed(expr->arg1 != NULL ? expr->arg1 : expr->arg2);
+    }
+
+    expr->registers_needed = need;
+    return need;
+}
+
 static void gen_binary_op(code_gen *cg, ir_value *lvalue, ast_expression *expr) {
 
     ir_value *r1 = new_ir_value_temp_reg(cg->ops->next_reg_num(cg));
-    cg->ops->generate_for_expression(cg, r1, expr->arg1);
-
     ir_value *r2 = new_ir_value_temp_reg(cg->ops->next_reg_num(cg));
-    cg->ops->generate_for_expression(cg, r2, expr->arg2);
+
+    // while the second operand is evaluated, the result of the first one is kept,
+    // so the one needing more registers goes first, if order cannot be told apart
+    bool arg2_first = label_registers_needed(expr->arg2) > label_registers_needed(expr->arg1) &&
+        !has_side_effects(expr->arg1) && !has_side_effects(expr->arg2);
+    if (arg2_first) {
+        cg->ops->generate_for_expression(cg, r2, expr->arg2);
+        cg->ops->generate_for_expression(cg, r1, expr->arg1);
+    } else {
+        cg->ops->generate_for_expression(cg, r1, expr->arg1);
+        cg->ops->generate_for_expression(cg, r2, expr->arg2);
+    }
     
     ir_operation op = IR_NONE;
     switch (expr->op) {
@@ -95,7 +154,10 @@ static void gen_binary_op(code_gen *cg, ir_value *lvalue, ast_expression *expr)
             break;
     }
 
-    cg->ir->ops->add(cg->ir, new_ir_three_address_code(lvalue, r1, op, r2));
+    ir_entry *e = new_ir_three_address_code(lvalue, r1, op, r2);
+    ast_data_type *type = expr->arg1->result_type;
+    e->t.three_address_code.is_unsigned = (type != NULL && (type->family == TF_POINTER || type->family == TF_ARRAY));
+    cg->ir->ops->add(cg->ir, e);
 }
 
 void code_gen_generate_for_expression(code_gen *cg, ir_value *lvalue, ast_expression *expr) {
@@ -128,6 +190,7 @@ void code_gen_generate_for_expression(code_gen *cg, ir_value *lvalue, ast_expres
         case OP_SUB:
         case OP_MUL:
         case OP_DIV:
+        case OP_MOD:
         case OP_BITWISE_AND:
         case OP_BITWISE_OR:
         case OP_BITWISE_XOR:
@@ -183,3 +246,45 @@ void code_gen_generate_for_expression(code_gen *cg, ir_value *lvalue, ast_expres
     }
 }
 
+
+#ifdef INCLUDE_UNIT_TESTS
+// the IR codegen emits for the source code, entries "; " separated
+static str *_generated_ir(mempool *mp, const char *source_code) {
+    list *tokens = lexer_parse_source_code_into_tokens(mp, new_str(mp, "file1.c"), new_str(mp, source_code));
+    ast_module *ast = parse_file_tokens_into_ast(mp, tokens);
+    perform_module_analysis(ast);
+    assert(errors_count == 0);
+
+    // not freed afterwards, as in the compile path, codegen shares values between entries
+    ir_listing *ir = new_ir_listing();
+    code_gen *cg = new_code_generator(ir);
+    cg->ops->generate_for_module(cg, ast);
+    str *s = new_str(mp, NULL);
+    for (int i = 0; i < ir->length; i++) {
+        if (i > 0)
+            str_cats(s, "; ");
+        str_cat(s, ir->entries_arr[i]->ops->to_string(mp, ir->entries_arr[i]));
+    }
+    return s;
+}
+
+void codegen_unit_tests() {
+    mempool *mp = new_mempool();
+
+    // the right side needs two registers, the left one, so the right side goes first, "a - b" inside it too
+    str *ir = _generated_ir(mp, "int f(int a, int b) { return a + b * (a - b); }");
+    assert(str_cmps(ir, "function \"f\" (a:4, b:4) -> 4; r6 = a; r7 = b; r5 = r6 - r7; r4 = b; "
+                        "r3 = r4 * r5; r2 = a; r1 = r2 + r3; return r1; function end") == 0);
+
+    // the same shapes, but with a call or a store in the right side, keep the source order
+    ir = _generated_ir(mp, "int g(int x) { return x; } int f(int a, int b) { return a + g(b) * (a - b); }");
+    assert(str_cmps(ir, "function \"g\" (x:4) -> 4; r1 = x; return r1; function end; "
+                        "function \"f\" (a:4, b:4) -> 4; r3 = a; r7 = b; r5 = call g passing r7; r8 = a; r9 = b; "
+                        "r6 = r8 - r9; r4 = r5 * r6; r2 = r3 + r4; return r2; function end") == 0);
+    ir = _generated_ir(mp, "int f(int a, int b) { return a + b++ * (a - b); }");
+    assert(str_cmps(ir, "function \"f\" (a:4, b:4) -> 4; r2 = a; r6 = b; b = r6 + 1; r4 = r6; r7 = a; r8 = b; "
+                        "r5 = r7 - r8; r3 = r4 * r5; r1 = r2 + r3; return r1; function end") == 0);
+
+    mempool_release(mp);
+}
+#endif
@@ -49,7 +49,7 @@ static void declare_expr_strings(code_gen *cg, ast_expression *expr) {
         int num = cg->ops->next_label_num(cg);
         char sym_name[16];
         snprintf(sym_name, sizeof(sym_name) - 1, "__str_%d", num);
-        sym_name[16] = 0;
+        sym_name[sizeof(sym_name) - 1] = 0;
         
         cg->ir->ops->add(cg->ir, new_ir_data_declaration(
             strlen(expr->value.str) + 1, expr->value.str, 
@@ -13,33 +13,67 @@
 #include "codegen.h"
 
 
-// we generate for the false condition, to allow to skip an "if"s body.
-static void gen_false_cond_jump(code_gen *cg, ast_expression *expr, char *label_fmt, int label_num) {
+static bool is_comparison(ast_operator op) {
+    return op == OP_GE || op == OP_GT || op == OP_LE || op == OP_LT || op == OP_EQ || op == OP_NE;
+}
 
-    ir_value *v1;
-    ir_comparison cmp = IR_NONE;
-    ir_value *v2;
+static ir_comparison to_ir_comparison(ast_operator op, bool negate) {
+    switch (op) {
+        case OP_EQ: return negate ? IR_NE : IR_EQ;
+        case OP_NE: return negate ? IR_EQ : IR_NE;
+        case OP_GT: return negate ? IR_LE : IR_GT;
+        case OP_GE: return negate ? IR_LT : IR_GE;
+        case OP_LT: return negate ? IR_GE : IR_LT;
+        case OP_LE: return negate ? IR_GT : IR_LE;
+    }
+    return IR_EQ; // not a comparison
+}
+
+// jumps to the label if the condition evaluates to jump_if, falls through otherwise.
+// logical operators short circuit into more jumps, no 0/1 values are computed.
+static void gen_cond_jump(code_gen *cg, ast_expression *expr, bool jump_if, char *label_fmt, int label_num) {
     ast_operator op = expr->op;
+    int skip_num;
+
+    if (op == OP_LOGICAL_NOT) {
+        gen_cond_jump(cg, expr->arg1, !jump_if, label_fmt, label_num);
+
+    } else if ((op == OP_LOGICAL_AND && !jump_if) || (op == OP_LOGICAL_OR && jump_if)) {
+        // either side decides it, both go to the same target
+        gen_cond_jump(cg, expr->arg1, jump_if, label_fmt, label_num);
+        gen_cond_jump(cg, expr->arg2, jump_if, label_fmt, label_num);
+
+    } else if (op == OP_LOGICAL_AND || op == OP_LOGICAL_OR) {
+        // the left side can only decide the opposite, skip the right side then
+        skip_num = cg->ops->next_label_num(cg);
+        gen_cond_jump(cg, expr->arg1, !jump_if, "cond_%d_skip", skip_num);
+        gen_cond_jump(cg, expr->arg2, jump_if, label_fmt, label_num);
+        cg->ir->ops->add(cg->ir, new_ir_label("cond_%d_skip", skip_num));
+
+    } else if (op == OP_BOOL_LITERAL) {
+        if (expr->value.bln == jump_if)
+            cg->ir->ops->add(cg->ir, new_ir_unconditional_jump(label_fmt, label_num));
+
+    } else if (is_comparison(op)) {
+        ir_value *v1 = cg->ops->create_ir_value(cg, expr->arg1);
+        ir_value *v2 = cg->ops->create_ir_value(cg, expr->arg2);
+        ir_entry *e = new_ir_conditional_jump(v1, to_ir_comparison(op, !jump_if), v2, label_fmt, label_num);
+        // analysis found the types already, addresses compare unsigned
+        ast_data_type *type = expr->arg1->result_type;
+        e->t.conditional_jump.is_unsigned = (type != NULL && (type->family == TF_POINTER || type->family == TF_ARRAY));
+        cg->ir->ops->add(cg->ir, e);
 
-    if (op == OP_GE || op == OP_GT || op == OP_LE || op == OP_LT || op == OP_EQ || op == OP_NE) {
-        switch (expr->op) {
-            case OP_EQ: cmp = IR_NE; break;
-            case OP_NE: cmp = IR_EQ; break;
-            case OP_GT: cmp = IR_LE; break;
-            case OP_GE: cmp = IR_LT; break;
-            case OP_LT: cmp = IR_GE; break;
-            case OP_LE: cmp = IR_GT; break;
-        }
-        v1 = cg->ops->create_ir_value(cg, expr->arg1);
-        v2 = cg->ops->create_ir_value(cg, expr->arg2);
     } else {
         // evaluate expression in a boolean (non-zero) context
-        v1 = cg->ops->create_ir_value(cg, expr);
-        v2 = new_ir_value_immediate(0);
-        cmp = IR_EQ;
+        ir_value *v1 = cg->ops->create_ir_value(cg, expr);
+        ir_value *v2 = new_ir_value_immediate(0);
+        cg->ir->ops->add(cg->ir, new_ir_conditional_jump(v1, jump_if ? IR_NE : IR_EQ, v2, label_fmt, label_num));
     }
+}
 
-    cg->ir->ops->add(cg->ir, new_ir_conditional_jump(v1, cmp, v2, label_fmt, label_num));
+// we generate for the false condition, to allow to skip an "if"s body.
+static void gen_false_cond_jump(code_gen *cg, ast_expression *expr, char *label_fmt, int label_num) {
+    gen_cond_jump(cg, expr, false, label_fmt, label_num);
 }
 
 void code_gen_generate_for_statement(code_gen *cg, ast_statement *stmt) {
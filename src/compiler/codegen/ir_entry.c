@@ -96,6 +96,7 @@ ir_entry *new_ir_three_address_code(ir_value *lvalue, ir_value *op1, ir_operatio
     e->t.three_address_code.op1 = op1;
     e->t.three_address_code.op = op;
     e->t.three_address_code.op2 = op2;
+    e->t.three_address_code.is_unsigned = false;
     e->ops = &ops;
     return e;
 }
@@ -107,6 +108,7 @@ ir_entry *new_ir_function_call(ir_value *lvalue, ir_value *func_addr, int args_l
     e->t.function_call.func_addr = func_addr;
     e->t.function_call.args_len = args_len;
     e->t.function_call.args_arr = args_arr; // we assume it was created for us.
+    e->t.function_call.is_tail_call = false;
     e->ops = &ops;
     return e;
 }
@@ -127,6 +129,7 @@ ir_entry *new_ir_conditional_jump(ir_value *v1, ir_comparison cmp, ir_value *v2,
     e->t.conditional_jump.cmp = cmp;
     e->t.conditional_jump.v2 = v2;
     e->t.conditional_jump.target_label = strdup(buffer);
+    e->t.conditional_jump.is_unsigned = false;
     e->ops = &ops;
     return e;
 }
@@ -163,7 +166,7 @@ ir_entry *new_ir_function_end() {
 }
 
 static char *ir_operation_name(ir_operation op) {
-    char *names[] = { "none", "+",  "-",  "*",  "/",  "neg", 
+    char *names[] = { "none", "+",  "-",  "*",  "/",  "%",  "neg", 
         "&", "|", "^", "~", "<<", ">>", "addr_of", "value_at", };
     if (op >= 0 && op < sizeof(names) / sizeof(names[0]))
         return names[op];
@@ -243,7 +246,7 @@ static str *_to_string(mempool *mp, ir_entry *e) {
                 str_catf(s, " ");
             }
             if (e->t.three_address_code.op != IR_NONE) {
-                str_catf(s, "%s ", ir_operation_name(e->t.three_address_code.op));
+                str_catf(s, "%s%s ", ir_operation_name(e->t.three_address_code.op), e->t.three_address_code.is_unsigned ? "u" : "");
             }
             ir_value_to_string(e->t.three_address_code.op2, s);
             break;
@@ -253,7 +256,7 @@ static str *_to_string(mempool *mp, ir_entry *e) {
                 ir_value_to_string(e->t.function_call.lvalue, s);
                 str_catf(s, " = ");
             }
-            str_catf(s, "call ");
+            str_catf(s, e->t.function_call.is_tail_call ? "tail call " : "call ");
             ir_value_to_string(e->t.function_call.func_addr, s);
             if (e->t.function_call.args_len > 0) {
                 str_catf(s, " passing ");
@@ -267,7 +270,7 @@ static str *_to_string(mempool *mp, ir_entry *e) {
         case IR_CONDITIONAL_JUMP:
             str_catf(s, "if ");
             ir_value_to_string(e->t.conditional_jump.v1, s);
-            str_catf(s, " %s ", ir_comparison_name(e->t.conditional_jump.cmp));
+            str_catf(s, " %s%s ", ir_comparison_name(e->t.conditional_jump.cmp), e->t.conditional_jump.is_unsigned ? "u" : "");
             ir_value_to_string(e->t.conditional_jump.v2, s);
             str_catf(s, " goto %s", e->t.conditional_jump.target_label);
             break;
@@ -288,6 +291,8 @@ static str *_to_string(mempool *mp, ir_entry *e) {
             str_catf(s, "function end");
             break;
     }
+
+    return s;
 }
 
 
@@ -349,7 +354,7 @@ static void _print(ir_entry *e, FILE *stream) {
                 fprintf(stream, " ");
             }
             if (e->t.three_address_code.op != IR_NONE) {
-                fprintf(stream, "%s ", ir_operation_name(e->t.three_address_code.op));
+                fprintf(stream, "%s%s ", ir_operation_name(e->t.three_address_code.op), e->t.three_address_code.is_unsigned ? "u" : "");
             }
             print_ir_value(e->t.three_address_code.op2, stream);
             break;
@@ -375,7 +380,7 @@ static void _print(ir_entry *e, FILE *stream) {
             fprintf(stream, "    ");
             fprintf(stream, "if ");
             print_ir_value(e->t.conditional_jump.v1, stream);
-            fprintf(stream, " %s ", ir_comparison_name(e->t.conditional_jump.cmp));
+            fprintf(stream, " %s%s ", ir_comparison_name(e->t.conditional_jump.cmp), e->t.conditional_jump.is_unsigned ? "u" : "");
             print_ir_value(e->t.conditional_jump.v2, stream);
             fprintf(stream, " goto %s", e->t.conditional_jump.target_label);
             break;
@@ -426,6 +431,7 @@ static void _foreach_ir_value(ir_entry *e, ir_value_visitor visitor, void *pdata
             struct ir_entry_cond_jump_info *j = &e->t.conditional_jump;
             visitor(j->v1, pdata, idata);
             visitor(j->v2, pdata, idata);
+            break;
         case IR_RETURN:
             struct ir_entry_return_info *r = &e->t.return_stmt;
             if (r->ret_val != NULL)
@@ -440,6 +446,7 @@ static void _free(ir_entry *e) {
         case IR_FUNCTION_DEFINITION:
             free_nullable(e->t.function_def.func_name);
             free_nullable(e->t.function_def.args_arr);
+            break;
         case IR_COMMENT:
             free_nullable(e->t.comment.str);
             break;
@@ -81,6 +81,7 @@ struct ir_entry_three_addr_code_info {
     ir_value *op1; // null for unary operators (not, neg, etc)
     ir_operation op;
     ir_value *op2;
+    bool is_unsigned; // e.g. pointers, ints are signed
 };
 
 struct ir_entry_function_call_info {
@@ -88,6 +89,7 @@ struct ir_entry_function_call_info {
     ir_value *func_addr; // symbol or register or address etc.
     int args_len;
     ir_value **args_arr; // malloc()'d array of pointers
+    bool is_tail_call; // reuses the caller's frame, does not return here
 };
 
 struct ir_entry_cond_jump_info {
@@ -95,6 +97,7 @@ struct ir_entry_cond_jump_info {
     ir_comparison cmp;
     ir_value *v2;
     char *target_label;
+    bool is_unsigned; // e.g. pointers, ints are signed
 };
 
 struct ir_entry_return_info {
@@ -6,6 +6,9 @@
 
 
 static void _add(ir_listing *l, ir_entry *entry);
+static void _insert(ir_listing *l, int index, ir_entry *entry);
+static void _remove(ir_listing *l, int index);
+static ir_entry *_detach(ir_listing *l, int index);
 static void _print(ir_listing *l, FILE *stream);
 static int _find_next_function_def(ir_listing *l, int start);
 static void _run_statistics(ir_listing *l);
@@ -14,6 +17,9 @@ static void _free(ir_listing *l);
 
 static struct ir_listing_ops ops = {
     .add = _add,
+    .insert = _insert,
+    .remove = _remove,
+    .detach = _detach,
     .print = _print,
     .find_next_function_def = _find_next_function_def,
     .run_statistics = _run_statistics,
@@ -26,6 +32,7 @@ ir_listing *new_ir_listing() {
     l->capacity = 10;
     l->length = 0;
     l->entries_arr = malloc(sizeof(ir_listing *) * l->capacity);
+    memset(&l->statistics, 0, sizeof(l->statistics));
     l->ops = &ops;
     return l;
 }
@@ -40,6 +47,35 @@ static void _add(ir_listing *l, ir_entry *entry) {
     l->length++;
 }
 
+static void _insert(ir_listing *l, int index, ir_entry *entry) {
+    if (index < 0 || index > l->length)
+        return;
+    if (l->length + 1 >= l->capacity) {
+        l->capacity *= 2;
+        l->entries_arr = realloc(l->entries_arr, sizeof(ir_listing *) * l->capacity);
+    }
+
+    memmove(&l->entries_arr[index + 1], &l->entries_arr[index], sizeof(ir_entry *) * (l->length - index));
+    l->entries_arr[index] = entry;
+    l->length++;
+}
+
+static void _remove(ir_listing *l, int index) {
+    ir_entry *e = _detach(l, index);
+    if (e != NULL)
+        e->ops->free(e);
+}
+
+static ir_entry *_detach(ir_listing *l, int index) {
+    if (index < 0 || index >= l->length)
+        return NULL;
+
+    ir_entry *e = l->entries_arr[index];
+    memmove(&l->entries_arr[index], &l->entries_arr[index + 1], sizeof(ir_entry *) * (l->length - index - 1));
+    l->length--;
+    return e;
+}
+
 static void _print(ir_listing *l ,FILE *stream) {
     mempool *mp = new_mempool();
 
@@ -96,6 +132,69 @@ static void _statistics_find_each_register_last_index(ir_value *v, void *pdata,
     }
 }
 
+static void _statistics_find_each_register_first_index(ir_value *v, void *pdata, int idata) {
+    int *first_usage_arr = (int *)pdata;
+    if (v != NULL && v->type == IR_TREG && first_usage_arr[v->val.temp_reg_no] == -1)
+        first_usage_arr[v->val.temp_reg_no] = idata;
+}
+
+static void _extend_usage_over_loops(ir_listing *l) {
+    // a register defined before a loop and used inside it, must survive 
+    // until the backwards jump, as the loop body will run again.
+    int *first_usage_arr = malloc(sizeof(int) * (l->statistics.max_reg_no + 1));
+    for (int reg_no = 0; reg_no <= l->statistics.max_reg_no; reg_no++)
+        first_usage_arr[reg_no] = -1;
+    for (int i = 0; i < l->length; i++) {
+        ir_entry *e = l->entries_arr[i];
+        e->ops->foreach_ir_value(e, _statistics_find_each_register_first_index, first_usage_arr, i);
+    }
+
+    // the labels are looked up once, not on every iteration
+    mempool *mp = new_mempool();
+    hashtable *labels = new_hashtable(mp, l->length + 1);
+    for (int i = 0; i < l->length; i++) {
+        ir_entry *e = l->entries_arr[i];
+        str *label = e->type == IR_LABEL ? new_str(mp, e->t.label.str) : NULL;
+        if (label != NULL && !hashtable_contains(labels, label)) {
+            int *p = mpalloc(mp, int);
+            *p = i;
+            hashtable_set(labels, label, p);
+        }
+    }
+    int *back_target_arr = mpallocn(mp, sizeof(int) * (l->length + 1), back_target_arr);
+    for (int j = 0; j < l->length; j++) {
+        ir_entry *e = l->entries_arr[j];
+        const char *label = NULL;
+        if (e->type == IR_UNCONDITIONAL_JUMP)
+            label = e->t.unconditional_jump.str;
+        else if (e->type == IR_CONDITIONAL_JUMP)
+            label = e->t.conditional_jump.target_label;
+        int *p = label == NULL ? NULL : hashtable_get(labels, new_str(mp, label));
+        back_target_arr[j] = (p != NULL && *p <= j) ? *p : -1;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int j = 0; j < l->length; j++) {
+            int t = back_target_arr[j];
+            if (t == -1)
+                continue;
+
+            for (int reg_no = l->statistics.min_reg_no; reg_no <= l->statistics.max_reg_no; reg_no++) {
+                int *last = &l->statistics.reg_last_usage_arr[reg_no];
+                if (first_usage_arr[reg_no] != -1 && first_usage_arr[reg_no] < t && *last >= t && *last < j) {
+                    *last = j;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    free(first_usage_arr);
+    mempool_release(mp);
+}
+
 static void _run_statistics(ir_listing *l) {
     // find min/max registers, as well as last time each is mentioned
     l->statistics.min_reg_no = 0;
@@ -113,12 +212,13 @@ static void _run_statistics(ir_listing *l) {
 
     // now make the array and run again to find last index
     l->statistics.regs_count = l->statistics.max_reg_no - l->statistics.min_reg_no + 1;
-    l->statistics.reg_last_usage_arr = malloc(sizeof(int) * l->statistics.regs_count);
-    memset(l->statistics.reg_last_usage_arr, 0, sizeof(int) * l->statistics.regs_count);
+    l->statistics.reg_last_usage_arr = malloc(sizeof(int) * (l->statistics.max_reg_no + 1));
+    memset(l->statistics.reg_last_usage_arr, 0, sizeof(int) * (l->statistics.max_reg_no + 1));
     for (int i = 0; i < l->length; i++) {
         ir_entry *e = l->entries_arr[i];
         e->ops->foreach_ir_value(e, _statistics_find_each_register_last_index, l, i);
     }
+    _extend_usage_over_loops(l);
 
     // print the "last-used" array for sanity check
     // for (int regno = 0; regno < l->statistics.regs_count; regno++)
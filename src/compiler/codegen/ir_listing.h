@@ -24,6 +24,9 @@ ir_listing *new_ir_listing();
 
 struct ir_listing_ops {
     void (*add)(ir_listing *l, ir_entry *entry);
+    void (*insert)(ir_listing *l, int index, ir_entry *entry);
+    void (*remove)(ir_listing *l, int index); // also frees the entry
+    ir_entry *(*detach)(ir_listing *l, int index); // caller owns the entry
     void (*print)(ir_listing *l, FILE *stream);
     int (*find_next_function_def)(ir_listing *l, int start);
     void (*run_statistics)(ir_listing *l);
@@ -6,9 +6,10 @@
 
 ir_value *new_ir_value_symbol(const char *symbol_name) {
     // symbols represent addresses in our IR, not values
+    // we keep our own copy, callers may pass temporary buffers
     ir_value *v = malloc(sizeof(ir_value));
     v->type = IR_SYM;
-    v->val.symbol_name = symbol_name;
+    v->val.symbol_name = symbol_name == NULL ? NULL : strdup(symbol_name);
     return v;
 }
 
@@ -26,6 +27,17 @@ ir_value *new_ir_value_immediate(int value) {
     return v;
 }
 
+ir_value *clone_ir_value(ir_value *v) {
+    // each value owns its symbol name, so duplicate it
+    if (v == NULL) return NULL;
+    ir_value *c = malloc(sizeof(ir_value));
+    c->type = v->type;
+    c->val = v->val;
+    if (v->type == IR_SYM && v->val.symbol_name != NULL)
+        c->val.symbol_name = strdup(v->val.symbol_name);
+    return c;
+}
+
 void print_ir_value(ir_value *v, FILE *stream) {
     if (v == NULL)
         fprintf(stream, "(null)");
@@ -18,6 +18,7 @@ typedef struct ir_value {
 ir_value *new_ir_value_symbol(const char *symbol_name);
 ir_value *new_ir_value_temp_reg(int temp_reg_no);
 ir_value *new_ir_value_immediate(int value);
+ir_value *clone_ir_value(ir_value *v);
 
 // instead of ops struct, maybe hard-named values
 void print_ir_value(ir_value *v, FILE *stream);
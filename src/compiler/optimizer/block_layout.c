@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "optimizer.h"
+
+
+/*
+    Jump optimizations on the block order codegen gives us.
+    - jumps to a jump go straight to the final target
+    - "if c goto L1; goto L2; L1:" becomes "if !c goto L2; L1:"
+    - jumps to the block that follows anyway are removed
+    - code after an unconditional jump, up to the next label, is unreachable
+    - labels nobody jumps to no longer split blocks
+    - "L: if c goto E; body; goto L; E:" is rotated, so the loop
+      tests at the bottom and the back edge is the conditional jump:
+      "L: if c goto E; L_body: body; if !c goto L_body; E:"
+    Each of them may expose more of the others, so we repeat until nothing changes.
+*/
+
+#define MAX_THREADING_HOPS  16
+
+static const char *_jump_target(ir_entry *e) {
+    if (e->type == IR_UNCONDITIONAL_JUMP)
+        return e->t.unconditional_jump.str;
+    if (e->type == IR_CONDITIONAL_JUMP)
+        return e->t.conditional_jump.target_label;
+    return NULL;
+}
+
+static void _set_jump_target(ir_entry *e, const char *label) {
+    char *copy = strdup(label);
+    if (e->type == IR_UNCONDITIONAL_JUMP) {
+        free(e->t.unconditional_jump.str);
+        e->t.unconditional_jump.str = copy;
+    } else {
+        free(e->t.conditional_jump.target_label);
+        e->t.conditional_jump.target_label = copy;
+    }
+}
+
+static ir_comparison _inverse_comparison(ir_comparison cmp) {
+    switch (cmp) {
+        case IR_EQ: return IR_NE;
+        case IR_NE: return IR_EQ;
+        case IR_GT: return IR_LE;
+        case IR_GE: return IR_LT;
+        case IR_LT: return IR_GE;
+        case IR_LE: return IR_GT;
+    }
+    return cmp;
+}
+
+static int _find_label(ir_listing *l, int start, int end, const char *label) {
+    for (int i = start; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type == IR_LABEL && strcmp(e->t.label.str, label) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// skips labels and comments, they generate no code
+static int _next_code(ir_listing *l, int index, int end) {
+    while (index < end && (l->entries_arr[index]->type == IR_LABEL || l->entries_arr[index]->type == IR_COMMENT))
+        index++;
+    return index;
+}
+
+// whether the label is among the ones right at index, i.e. execution falls into it
+static bool _falls_into_label(ir_listing *l, int index, int end, const char *label) {
+    for (int i = index; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type == IR_LABEL && strcmp(e->t.label.str, label) == 0)
+            return true;
+        if (e->type != IR_LABEL && e->type != IR_COMMENT)
+            return false;
+    }
+    return false;
+}
+
+static int _thread_jumps(ir_listing *l, int start, int end) {
+    int count = 0;
+    for (int i = start + 1; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        const char *target = _jump_target(e);
+        if (target == NULL)
+            continue;
+
+        const char *final = target;
+        for (int hops = 0; hops < MAX_THREADING_HOPS; hops++) {
+            int label = _find_label(l, start, end, final);
+            if (label == -1)
+                break;
+            int next = _next_code(l, label, end);
+            if (next >= end || l->entries_arr[next]->type != IR_UNCONDITIONAL_JUMP)
+                break;
+            const char *further = l->entries_arr[next]->t.unconditional_jump.str;
+            if (strcmp(further, final) == 0 || strcmp(further, target) == 0)
+                break; // an endless loop, leave it be
+            final = further;
+        }
+        if (final != target) {
+            _set_jump_target(e, final);
+            count++;
+        }
+    }
+    return count;
+}
+
+static int _invert_over_jumps(ir_listing *l, int start, int *end) {
+    int count = 0;
+    for (int i = start + 1; i < *end - 1; i++) {
+        ir_entry *cond = l->entries_arr[i];
+        ir_entry *jump = l->entries_arr[i + 1];
+        if (cond->type != IR_CONDITIONAL_JUMP || jump->type != IR_UNCONDITIONAL_JUMP)
+            continue;
+        if (!_falls_into_label(l, i + 2, *end, cond->t.conditional_jump.target_label))
+            continue;
+
+        cond->t.conditional_jump.cmp = _inverse_comparison(cond->t.conditional_jump.cmp);
+        _set_jump_target(cond, jump->t.unconditional_jump.str);
+        l->ops->remove(l, i + 1);
+        (*end)--;
+        count++;
+    }
+    return count;
+}
+
+static int _remove_jumps_to_next(ir_listing *l, int start, int *end) {
+    int count = 0;
+    for (int i = *end - 1; i > start; i--) {
+        const char *target = _jump_target(l->entries_arr[i]);
+        if (target == NULL || !_falls_into_label(l, i + 1, *end, target))
+            continue;
+        l->ops->remove(l, i);
+        (*end)--;
+        count++;
+    }
+    return count;
+}
+
+static int _remove_unreachable(ir_listing *l, int start, int *end) {
+    int count = 0;
+    for (int i = start + 1; i < *end - 1; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type != IR_UNCONDITIONAL_JUMP && !ir_entry_is_function_exit(e))
+            continue;
+        while (i + 1 < *end) {
+            enum ir_entry_type type = l->entries_arr[i + 1]->type;
+            if (type == IR_LABEL || type == IR_FUNCTION_END || type == IR_DATA_DECLARATION || type == IR_COMMENT)
+                break;
+            l->ops->remove(l, i + 1);
+            (*end)--;
+            count++;
+        }
+    }
+    return count;
+}
+
+static int _remove_unused_labels(ir_listing *l, int start, int *end) {
+    int count = 0;
+    for (int i = *end - 1; i > start; i--) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type != IR_LABEL)
+            continue;
+        bool used = false;
+        for (int j = start + 1; j < *end && !used; j++) {
+            const char *target = _jump_target(l->entries_arr[j]);
+            used = (target != NULL && strcmp(target, e->t.label.str) == 0);
+        }
+        if (used)
+            continue;
+        l->ops->remove(l, i);
+        (*end)--;
+        count++;
+    }
+    return count;
+}
+
+static int _rotate_loops(ir_listing *l, int start, int *end) {
+    int count = 0;
+    for (int i = start + 1; i < *end; i++) {
+        ir_entry *back = l->entries_arr[i];
+        if (back->type != IR_UNCONDITIONAL_JUMP)
+            continue;
+
+        // the header must be nothing but the test, it gets duplicated
+        int header = _find_label(l, start, i, back->t.unconditional_jump.str);
+        if (header == -1)
+            continue;
+        int test_index = _next_code(l, header, i);
+        ir_entry *test = l->entries_arr[test_index];
+        if (test_index >= i || test->type != IR_CONDITIONAL_JUMP)
+            continue;
+        if (!_falls_into_label(l, i + 1, *end, test->t.conditional_jump.target_label))
+            continue;
+
+        char body_label[128];
+        snprintf(body_label, sizeof(body_label), "%s_body", back->t.unconditional_jump.str);
+        ir_entry *bottom = new_ir_conditional_jump(
+            clone_ir_value(test->t.conditional_jump.v1),
+            _inverse_comparison(test->t.conditional_jump.cmp),
+            clone_ir_value(test->t.conditional_jump.v2),
+            "%s", body_label);
+        bottom->t.conditional_jump.is_unsigned = test->t.conditional_jump.is_unsigned;
+
+        l->ops->remove(l, i);
+        l->ops->insert(l, i, bottom);
+        l->ops->insert(l, test_index + 1, new_ir_label("%s", body_label));
+        (*end)++;
+        i++;
+        count++;
+    }
+    return count;
+}
+
+int ir_optimize_jumps(ir_listing *l, int func_start) {
+    int end = ir_function_end(l, func_start);
+    int total = 0;
+    int changes;
+    do {
+        changes = _thread_jumps(l, func_start, end);
+        changes += _invert_over_jumps(l, func_start, &end);
+        changes += _remove_jumps_to_next(l, func_start, &end);
+        changes += _remove_unreachable(l, func_start, &end);
+        changes += _remove_unused_labels(l, func_start, &end);
+        total += changes;
+    } while (changes > 0);
+
+    // after the others, so the bottom test is not undone as a jump to next
+    changes = _rotate_loops(l, func_start, &end);
+    if (changes > 0)
+        total += changes + _remove_unused_labels(l, func_start, &end);
+    return total;
+}
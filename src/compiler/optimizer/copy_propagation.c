@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "optimizer.h"
+
+
+/*
+    Codegen produces lots of "r5 = n", "r6 = 1", "r18 = r19" entries,
+    each of them costs a temp register and a MOV in the converter.
+    Here we forward those values to where the temp reg is used,
+    then merge whatever copy related temp regs do not interfere.
+*/
+
+struct reg_counts {
+    int min_reg_no;
+    int regs_count;
+    int *defs; // indexed by reg_no - min_reg_no
+    int *uses;
+};
+
+static void _count_use(ir_entry *e, ir_value **slot, void *pdata) {
+    struct reg_counts *c = (struct reg_counts *)pdata;
+    if ((*slot)->type == IR_TREG)
+        c->uses[(*slot)->val.temp_reg_no - c->min_reg_no]++;
+}
+
+static void _count_defs_and_uses(ir_listing *l, int start, int end, struct reg_counts *c) {
+    memset(c->defs, 0, sizeof(int) * (c->regs_count + 1));
+    memset(c->uses, 0, sizeof(int) * (c->regs_count + 1));
+    for (int i = start; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        ir_value *lv = ir_entry_lvalue(e);
+        if (lv != NULL && lv->type == IR_TREG)
+            c->defs[lv->val.temp_reg_no - c->min_reg_no]++;
+        ir_entry_foreach_rvalue_slot(e, _count_use, c);
+    }
+}
+
+struct replace_data {
+    struct reg_counts *counts;
+    int reg_no;        // the temp reg to replace
+    ir_value *value;   // what to put in its place
+    int max_replacements;
+    int replaced;
+};
+
+static void _replace_use(ir_entry *e, ir_value **slot, void *pdata) {
+    struct replace_data *d = (struct replace_data *)pdata;
+    if ((*slot)->type != IR_TREG || (*slot)->val.temp_reg_no != d->reg_no)
+        return;
+    if (d->replaced >= d->max_replacements)
+        return;
+    if (!ir_entry_slot_accepts(e, slot, d->value->type))
+        return;
+
+    free_ir_value(*slot);
+    *slot = clone_ir_value(d->value);
+    d->counts->uses[d->reg_no - d->counts->min_reg_no]--;
+    if (d->value->type == IR_TREG)
+        d->counts->uses[d->value->val.temp_reg_no - d->counts->min_reg_no]++;
+    d->replaced++;
+}
+
+static void _find_use(ir_entry *e, ir_value **slot, void *pdata) {
+    struct replace_data *d = (struct replace_data *)pdata;
+    if ((*slot)->type == IR_TREG && (*slot)->val.temp_reg_no == d->reg_no)
+        d->replaced++;
+}
+
+static bool _entry_uses_reg(ir_entry *e, int reg_no) {
+    struct replace_data d = { NULL, reg_no, NULL, 0, 0 };
+    ir_entry_foreach_rvalue_slot(e, _find_use, &d);
+    return d.replaced > 0;
+}
+
+// forwards the value of the copy at index i, within its basic block.
+// returns true if the copy is no longer needed.
+static bool _propagate_copy(ir_listing *l, int i, int end, struct reg_counts *c) {
+    ir_entry *copy = l->entries_arr[i];
+    ir_value *lv = copy->t.three_address_code.lvalue;
+    ir_value *src = copy->t.three_address_code.op2;
+    int reg_index = lv->val.temp_reg_no - c->min_reg_no;
+
+    // variables live in memory, we can only forward a single read,
+    // as long as nothing may write to the variable in between.
+    bool is_memory = (src->type == IR_SYM);
+    if (is_memory && c->uses[reg_index] != 1)
+        return false;
+
+    struct replace_data d = { c, lv->val.temp_reg_no, src, is_memory ? 1 : 0x7fffffff, 0 };
+    for (int j = i + 1; j < end && c->uses[reg_index] > 0; j++) {
+        ir_entry *e = l->entries_arr[j];
+        if (e->type == IR_LABEL)
+            break;
+
+        // a use in this entry reads before the entry writes
+        ir_entry_foreach_rvalue_slot(e, _replace_use, &d);
+        if (is_memory && _entry_uses_reg(e, d.reg_no))
+            break; // the use could not take a memory operand
+
+        if (is_memory) {
+            ir_value *target = ir_entry_lvalue(e);
+            if (e->type == IR_FUNCTION_CALL)
+                break; // callee might change it
+            if (target != NULL && target->type == IR_SYM && strcmp(target->val.symbol_name, src->val.symbol_name) == 0)
+                break;
+        }
+        if (ir_entry_is_block_end(e))
+            break;
+    }
+
+    if (c->uses[reg_index] > 0)
+        return false;
+    if (src->type == IR_TREG)
+        c->uses[src->val.temp_reg_no - c->min_reg_no]--;
+    c->defs[reg_index]--;
+    return true;
+}
+
+int ir_propagate_copies(ir_listing *l, int func_start) {
+    mempool *mp = new_mempool();
+    flow_graph *g = new_flow_graph(mp, l, func_start);
+    if (g->regs_count == 0) {
+        mempool_release(mp);
+        return 0;
+    }
+
+    struct reg_counts c;
+    c.min_reg_no = g->min_reg_no;
+    c.regs_count = g->regs_count;
+    c.defs = mpallocn(mp, sizeof(int) * (c.regs_count + 1), defs);
+    c.uses = mpallocn(mp, sizeof(int) * (c.regs_count + 1), uses);
+    int end = g->end;
+    _count_defs_and_uses(l, func_start, end, &c);
+
+    int propagated = 0;
+    for (int i = func_start + 1; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (!ir_entry_is_copy(e))
+            continue;
+        ir_value *lv = e->t.three_address_code.lvalue;
+        ir_value *src = e->t.three_address_code.op2;
+        if (lv->type != IR_TREG || c.defs[lv->val.temp_reg_no - c.min_reg_no] != 1)
+            continue;
+        if (src->type == IR_TREG && (c.defs[src->val.temp_reg_no - c.min_reg_no] != 1 || src->val.temp_reg_no == lv->val.temp_reg_no))
+            continue;
+
+        if (_propagate_copy(l, i, end, &c)) {
+            l->ops->remove(l, i);
+            end--;
+            i--;
+            propagated++;
+        }
+    }
+
+    mempool_release(mp);
+    return propagated;
+}
+
+static int _find_root(int *parent, int n) {
+    while (parent[n] != n) {
+        parent[n] = parent[parent[n]];
+        n = parent[n];
+    }
+    return n;
+}
+
+struct rename_data {
+    int min_reg_no;
+    int *parent;
+};
+
+static void _rename_to_root(ir_value *v, void *pdata, int idata) {
+    struct rename_data *d = (struct rename_data *)pdata;
+    if (v != NULL && v->type == IR_TREG)
+        v->val.temp_reg_no = _find_root(d->parent, v->val.temp_reg_no - d->min_reg_no) + d->min_reg_no;
+}
+
+struct live_data {
+    int min_reg_no;
+    bool *live;
+};
+
+static void _mark_live(ir_entry *e, ir_value **slot, void *pdata) {
+    struct live_data *d = (struct live_data *)pdata;
+    if ((*slot)->type == IR_TREG)
+        d->live[(*slot)->val.temp_reg_no - d->min_reg_no] = true;
+}
+
+static bool _is_treg_copy(ir_entry *e) {
+    return ir_entry_is_copy(e) &&
+        e->t.three_address_code.lvalue->type == IR_TREG &&
+        e->t.three_address_code.op2->type == IR_TREG;
+}
+
+int ir_coalesce_temp_regs(ir_listing *l, int func_start) {
+    mempool *mp = new_mempool();
+    flow_graph *g = new_flow_graph(mp, l, func_start);
+    int n = g->regs_count;
+    if (n == 0) {
+        mempool_release(mp);
+        return 0;
+    }
+    g->ops->compute_liveness(g);
+
+    // build the interference matrix, walking each block backwards.
+    // a copy does not make its source and target interfere.
+    bool *interferes = mpallocn(mp, sizeof(bool) * n * n, interferes);
+    bool *live = mpallocn(mp, sizeof(bool) * n, live);
+    memset(interferes, 0, sizeof(bool) * n * n);
+    struct live_data ld = { g->min_reg_no, live };
+
+    for (int b = 0; b < g->blocks_count; b++) {
+        basic_block *block = &g->blocks_arr[b];
+        memcpy(live, block->live_out, sizeof(bool) * n);
+        for (int i = block->last; i >= block->first; i--) {
+            ir_entry *e = l->entries_arr[i];
+            ir_value *lv = ir_entry_lvalue(e);
+            if (lv != NULL && lv->type == IR_TREG) {
+                int def = lv->val.temp_reg_no - g->min_reg_no;
+                int src = _is_treg_copy(e) ? e->t.three_address_code.op2->val.temp_reg_no - g->min_reg_no : -1;
+                for (int k = 0; k < n; k++) {
+                    if (live[k] && k != def && k != src) {
+                        interferes[def * n + k] = true;
+                        interferes[k * n + def] = true;
+                    }
+                }
+                live[def] = false;
+            }
+            ir_entry_foreach_rvalue_slot(e, _mark_live, &ld);
+        }
+    }
+
+    // union the copy related pairs that do not interfere
+    int *parent = mpallocn(mp, sizeof(int) * n, parent);
+    for (int k = 0; k < n; k++)
+        parent[k] = k;
+
+    int coalesced = 0;
+    for (int i = g->start; i < g->end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (!_is_treg_copy(e))
+            continue;
+        int a = _find_root(parent, e->t.three_address_code.lvalue->val.temp_reg_no - g->min_reg_no);
+        int b = _find_root(parent, e->t.three_address_code.op2->val.temp_reg_no - g->min_reg_no);
+        if (a == b || interferes[a * n + b])
+            continue;
+
+        parent[b] = a;
+        for (int k = 0; k < n; k++) {
+            if (interferes[b * n + k]) {
+                interferes[a * n + k] = true;
+                interferes[k * n + a] = true;
+            }
+        }
+        coalesced++;
+    }
+
+    if (coalesced > 0) {
+        struct rename_data rd = { g->min_reg_no, parent };
+        int end = g->end;
+        for (int i = g->start; i < end; i++) {
+            ir_entry *e = l->entries_arr[i];
+            e->ops->foreach_ir_value(e, _rename_to_root, &rd, i);
+        }
+
+        // copies between the same register are now pointless
+        for (int i = end - 1; i > g->start; i--) {
+            ir_entry *e = l->entries_arr[i];
+            if (_is_treg_copy(e) && e->t.three_address_code.lvalue->val.temp_reg_no == e->t.three_address_code.op2->val.temp_reg_no)
+                l->ops->remove(l, i);
+        }
+    }
+
+    mempool_release(mp);
+    return coalesced;
+}
+
+struct renumber_data {
+    int *new_numbers; // indexed by old reg_no
+    int next;
+};
+
+static void _renumber(ir_value *v, void *pdata, int idata) {
+    struct renumber_data *d = (struct renumber_data *)pdata;
+    if (v == NULL || v->type != IR_TREG)
+        return;
+    if (d->new_numbers[v->val.temp_reg_no] == 0)
+        d->new_numbers[v->val.temp_reg_no] = d->next++;
+    v->val.temp_reg_no = d->new_numbers[v->val.temp_reg_no];
+}
+
+int ir_renumber_temp_regs(ir_listing *l) {
+    // make temp regs dense, in order of appearance,
+    // so the statistics and the allocator track fewer of them
+    int max = ir_next_temp_reg_no(l) - 1;
+
+    struct renumber_data d;
+    d.new_numbers = malloc(sizeof(int) * (max + 1));
+    memset(d.new_numbers, 0, sizeof(int) * (max + 1));
+    d.next = 1;
+    for (int i = 0; i < l->length; i++)
+        l->entries_arr[i]->ops->foreach_ir_value(l->entries_arr[i], _renumber, &d, i);
+
+    free(d.new_numbers);
+    return d.next - 1;
+}
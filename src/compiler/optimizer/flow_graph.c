@@ -0,0 +1,476 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "flow_graph.h"
+
+
+static int _block_of_entry(flow_graph *g, int index);
+static int _block_of_label(flow_graph *g, const char *label);
+static void _compute_liveness(flow_graph *g);
+static bool _is_live_out(flow_graph *g, int block_no, int reg_no);
+static void _compute_dominators(flow_graph *g);
+static bool _dominates(flow_graph *g, int a, int b);
+static void _find_loops(flow_graph *g);
+static bool _is_reachable(flow_graph *g, int block_no);
+static void _print(flow_graph *g, FILE *stream);
+
+static struct flow_graph_ops ops = {
+    .block_of_entry = _block_of_entry,
+    .block_of_label = _block_of_label,
+    .compute_liveness = _compute_liveness,
+    .is_live_out = _is_live_out,
+    .compute_dominators = _compute_dominators,
+    .dominates = _dominates,
+    .find_loops = _find_loops,
+    .is_reachable = _is_reachable,
+    .print = _print,
+};
+
+static void _find_regs_range(ir_value *v, void *pdata, int idata) {
+    flow_graph *g = (flow_graph *)pdata;
+    if (v == NULL || v->type != IR_TREG)
+        return;
+
+    // we keep min and max in min_reg_no and regs_count for now
+    int reg_no = v->val.temp_reg_no;
+    if (g->regs_count == 0) {
+        g->min_reg_no = reg_no;
+        g->regs_count = reg_no; // max for now
+    } else {
+        if (reg_no < g->min_reg_no) g->min_reg_no = reg_no;
+        if (reg_no > g->regs_count) g->regs_count = reg_no;
+    }
+}
+
+static void _add_successor(flow_graph *g, basic_block *b, int block_no) {
+    if (block_no < 0 || block_no >= g->blocks_count)
+        return;
+    if (b->succs_count == 1 && b->succs[0] == block_no)
+        return; // jump to the next block
+    b->succs[b->succs_count++] = block_no;
+}
+
+flow_graph *new_flow_graph(mempool *mp, ir_listing *listing, int func_start) {
+    flow_graph *g = mpalloc(mp, flow_graph);
+    g->mp = mp;
+    g->listing = listing;
+    g->start = func_start;
+    g->end = ir_function_end(listing, func_start);
+    g->min_reg_no = 0;
+    g->regs_count = 0;
+    g->rpo_arr = NULL;
+    g->rpo_count = 0;
+    g->loops_arr = NULL;
+    g->loops_count = 0;
+    g->ops = &ops;
+
+    for (int i = g->start; i < g->end; i++) {
+        ir_entry *e = listing->entries_arr[i];
+        e->ops->foreach_ir_value(e, _find_regs_range, g, i);
+    }
+    if (g->regs_count > 0)
+        g->regs_count = g->regs_count - g->min_reg_no + 1;
+
+    // leaders: first entry, labels, entries right after jumps or returns
+    int first = g->start + 1;
+    g->blocks_count = 0;
+    for (int i = first; i < g->end; i++) {
+        if (i == first || listing->entries_arr[i]->type == IR_LABEL ||
+            ir_entry_is_block_end(listing->entries_arr[i - 1]))
+            g->blocks_count++;
+    }
+
+    g->blocks_arr = mpallocn(mp, sizeof(basic_block) * (g->blocks_count + 1), basic_blocks);
+    memset(g->blocks_arr, 0, sizeof(basic_block) * (g->blocks_count + 1));
+    int block_no = -1;
+    for (int i = first; i < g->end; i++) {
+        if (i == first || listing->entries_arr[i]->type == IR_LABEL ||
+            ir_entry_is_block_end(listing->entries_arr[i - 1])) {
+            block_no++;
+            g->blocks_arr[block_no].id = block_no;
+            g->blocks_arr[block_no].first = i;
+            g->blocks_arr[block_no].idom = -1;
+        }
+        g->blocks_arr[block_no].last = i;
+    }
+
+    // successors, depending on how each block ends
+    for (int b = 0; b < g->blocks_count; b++) {
+        basic_block *block = &g->blocks_arr[b];
+        ir_entry *e = listing->entries_arr[block->last];
+        if (e->type == IR_UNCONDITIONAL_JUMP) {
+            _add_successor(g, block, _block_of_label(g, e->t.unconditional_jump.str));
+        } else if (e->type == IR_CONDITIONAL_JUMP) {
+            _add_successor(g, block, b + 1);
+            _add_successor(g, block, _block_of_label(g, e->t.conditional_jump.target_label));
+        } else if (!ir_entry_is_function_exit(e)) {
+            _add_successor(g, block, b + 1);
+        }
+    }
+
+    // predecessors, count them first
+    for (int b = 0; b < g->blocks_count; b++) {
+        for (int s = 0; s < g->blocks_arr[b].succs_count; s++)
+            g->blocks_arr[g->blocks_arr[b].succs[s]].preds_count++;
+    }
+    for (int b = 0; b < g->blocks_count; b++) {
+        basic_block *block = &g->blocks_arr[b];
+        block->preds_arr = mpallocn(mp, sizeof(int) * (block->preds_count + 1), preds_arr);
+        block->preds_count = 0;
+    }
+    for (int b = 0; b < g->blocks_count; b++) {
+        for (int s = 0; s < g->blocks_arr[b].succs_count; s++) {
+            basic_block *succ = &g->blocks_arr[g->blocks_arr[b].succs[s]];
+            succ->preds_arr[succ->preds_count++] = b;
+        }
+    }
+
+    return g;
+}
+
+static int _block_of_entry(flow_graph *g, int index) {
+    for (int b = 0; b < g->blocks_count; b++) {
+        if (index >= g->blocks_arr[b].first && index <= g->blocks_arr[b].last)
+            return b;
+    }
+    return -1;
+}
+
+static int _block_of_label(flow_graph *g, const char *label) {
+    // labels are leaders, so they can only be found at the start of blocks
+    for (int b = 0; b < g->blocks_count; b++) {
+        ir_entry *e = g->listing->entries_arr[g->blocks_arr[b].first];
+        if (e->type == IR_LABEL && strcmp(e->t.label.str, label) == 0)
+            return b;
+    }
+    return -1;
+}
+
+struct use_def_data {
+    flow_graph *g;
+    bool *use;
+    bool *def;
+};
+
+static void _collect_upward_exposed_uses(ir_entry *e, ir_value **slot, void *pdata) {
+    struct use_def_data *d = (struct use_def_data *)pdata;
+    if (*slot == NULL || (*slot)->type != IR_TREG)
+        return;
+    int n = (*slot)->val.temp_reg_no - d->g->min_reg_no;
+    if (!d->def[n])
+        d->use[n] = true;
+}
+
+static void _compute_liveness(flow_graph *g) {
+    // classic backwards data flow analysis, on temp registers only
+    // variables live in memory, so they are not our concern here
+    int n = g->regs_count;
+    bool *use_arr = mpallocn(g->mp, sizeof(bool) * (n + 1) * g->blocks_count, use_arr);
+    bool *def_arr = mpallocn(g->mp, sizeof(bool) * (n + 1) * g->blocks_count, def_arr);
+    memset(use_arr, 0, sizeof(bool) * (n + 1) * g->blocks_count);
+    memset(def_arr, 0, sizeof(bool) * (n + 1) * g->blocks_count);
+
+    for (int b = 0; b < g->blocks_count; b++) {
+        basic_block *block = &g->blocks_arr[b];
+        block->live_in = mpallocn(g->mp, sizeof(bool) * (n + 1), live_in);
+        block->live_out = mpallocn(g->mp, sizeof(bool) * (n + 1), live_out);
+        memset(block->live_in, 0, sizeof(bool) * (n + 1));
+        memset(block->live_out, 0, sizeof(bool) * (n + 1));
+
+        struct use_def_data d = { g, &use_arr[b * (n + 1)], &def_arr[b * (n + 1)] };
+        for (int i = block->first; i <= block->last; i++) {
+            ir_entry *e = g->listing->entries_arr[i];
+            ir_entry_foreach_rvalue_slot(e, _collect_upward_exposed_uses, &d);
+            ir_value *lv = ir_entry_lvalue(e);
+            if (lv != NULL && lv->type == IR_TREG)
+                d.def[lv->val.temp_reg_no - g->min_reg_no] = true;
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = g->blocks_count - 1; b >= 0; b--) {
+            basic_block *block = &g->blocks_arr[b];
+            bool *use = &use_arr[b * (n + 1)];
+            bool *def = &def_arr[b * (n + 1)];
+            for (int r = 0; r < n; r++) {
+                bool out = false;
+                for (int s = 0; s < block->succs_count && !out; s++)
+                    out = g->blocks_arr[block->succs[s]].live_in[r];
+                bool in = use[r] || (out && !def[r]);
+                if (out != block->live_out[r] || in != block->live_in[r]) {
+                    block->live_out[r] = out;
+                    block->live_in[r] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+static bool _is_live_out(flow_graph *g, int block_no, int reg_no) {
+    int n = reg_no - g->min_reg_no;
+    if (n < 0 || n >= g->regs_count || g->blocks_arr[block_no].live_out == NULL)
+        return false;
+    return g->blocks_arr[block_no].live_out[n];
+}
+
+static void _compute_reverse_post_order(flow_graph *g) {
+    // iterative depth first search from the entry block
+    int n = g->blocks_count;
+    int *stack = mpallocn(g->mp, sizeof(int) * (n + 1), dfs_stack);
+    int *next_succ = mpallocn(g->mp, sizeof(int) * (n + 1), next_succ);
+    bool *visited = mpallocn(g->mp, sizeof(bool) * (n + 1), visited);
+    memset(next_succ, 0, sizeof(int) * (n + 1));
+    memset(visited, 0, sizeof(bool) * (n + 1));
+    g->rpo_arr = mpallocn(g->mp, sizeof(int) * (n + 1), rpo_arr);
+    g->rpo_count = 0;
+    if (n == 0)
+        return;
+
+    int post_order_len = 0;
+    int *post_order = mpallocn(g->mp, sizeof(int) * (n + 1), post_order);
+    int sp = 0;
+    stack[sp++] = 0;
+    visited[0] = true;
+    while (sp > 0) {
+        basic_block *b = &g->blocks_arr[stack[sp - 1]];
+        if (next_succ[b->id] < b->succs_count) {
+            int s = b->succs[next_succ[b->id]++];
+            if (!visited[s]) {
+                visited[s] = true;
+                stack[sp++] = s;
+            }
+        } else {
+            post_order[post_order_len++] = b->id;
+            sp--;
+        }
+    }
+
+    for (int i = post_order_len - 1; i >= 0; i--)
+        g->rpo_arr[g->rpo_count++] = post_order[i];
+}
+
+static void _compute_dominators(flow_graph *g) {
+    // see "A Simple, Fast Dominance Algorithm", Cooper, Harvey & Kennedy
+    _compute_reverse_post_order(g);
+    if (g->rpo_count == 0)
+        return;
+
+    int *rpo_index = mpallocn(g->mp, sizeof(int) * (g->blocks_count + 1), rpo_index);
+    for (int b = 0; b < g->blocks_count; b++) {
+        rpo_index[b] = -1;
+        g->blocks_arr[b].idom = -1;
+    }
+    for (int i = 0; i < g->rpo_count; i++)
+        rpo_index[g->rpo_arr[i]] = i;
+
+    int entry = g->rpo_arr[0];
+    g->blocks_arr[entry].idom = entry;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < g->rpo_count; i++) {
+            basic_block *b = &g->blocks_arr[g->rpo_arr[i]];
+            int new_idom = -1;
+            for (int p = 0; p < b->preds_count; p++) {
+                int pred = b->preds_arr[p];
+                if (rpo_index[pred] == -1 || g->blocks_arr[pred].idom == -1)
+                    continue;
+                if (new_idom == -1) {
+                    new_idom = pred;
+                    continue;
+                }
+                // intersect
+                int f1 = pred, f2 = new_idom;
+                while (f1 != f2) {
+                    while (rpo_index[f1] > rpo_index[f2]) f1 = g->blocks_arr[f1].idom;
+                    while (rpo_index[f2] > rpo_index[f1]) f2 = g->blocks_arr[f2].idom;
+                }
+                new_idom = f1;
+            }
+            if (new_idom != b->idom) {
+                b->idom = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    g->blocks_arr[entry].idom = -1;
+}
+
+static bool _dominates(flow_graph *g, int a, int b) {
+    // walk up the dominator tree, from b
+    while (b != -1) {
+        if (a == b)
+            return true;
+        b = g->blocks_arr[b].idom;
+    }
+    return false;
+}
+
+static bool _is_reachable(flow_graph *g, int block_no) {
+    // only valid after compute_dominators()
+    return (g->rpo_count > 0 && g->rpo_arr[0] == block_no) || g->blocks_arr[block_no].idom != -1;
+}
+
+static void _find_loops(flow_graph *g) {
+    // a back edge goes to a block that dominates the source
+    if (g->rpo_arr == NULL)
+        _compute_dominators(g);
+
+    int n = g->blocks_count;
+    g->loops_arr = mpallocn(g->mp, sizeof(natural_loop) * (n + 1), loops_arr);
+    g->loops_count = 0;
+    int *stack = mpallocn(g->mp, sizeof(int) * (n + 1), loop_stack);
+
+    for (int r = 0; r < g->rpo_count; r++) {
+        int header = g->rpo_arr[r];
+        natural_loop *loop = NULL;
+
+        for (int p = 0; p < g->blocks_arr[header].preds_count; p++) {
+            int tail = g->blocks_arr[header].preds_arr[p];
+            if (!_is_reachable(g, tail) || !_dominates(g, header, tail))
+                continue;
+
+            if (loop == NULL) {
+                loop = &g->loops_arr[g->loops_count++];
+                loop->header = header;
+                loop->body = mpallocn(g->mp, sizeof(bool) * (n + 1), loop_body);
+                memset(loop->body, 0, sizeof(bool) * (n + 1));
+                loop->body[header] = true;
+                loop->blocks_count = 1;
+            }
+
+            // walk backwards from the tail, up to the header
+            int sp = 0;
+            if (!loop->body[tail]) {
+                loop->body[tail] = true;
+                loop->blocks_count++;
+                stack[sp++] = tail;
+            }
+            while (sp > 0) {
+                basic_block *b = &g->blocks_arr[stack[--sp]];
+                for (int q = 0; q < b->preds_count; q++) {
+                    int pred = b->preds_arr[q];
+                    if (loop->body[pred] || !_is_reachable(g, pred))
+                        continue;
+                    loop->body[pred] = true;
+                    loop->blocks_count++;
+                    stack[sp++] = pred;
+                }
+            }
+        }
+    }
+}
+
+static void _print(flow_graph *g, FILE *stream) {
+    for (int b = 0; b < g->blocks_count; b++) {
+        basic_block *block = &g->blocks_arr[b];
+        fprintf(stream, "    block %d, entries %d..%d, succs:", b, block->first, block->last);
+        for (int s = 0; s < block->succs_count; s++)
+            fprintf(stream, " %d", block->succs[s]);
+        fprintf(stream, ", preds:");
+        for (int p = 0; p < block->preds_count; p++)
+            fprintf(stream, " %d", block->preds_arr[p]);
+        if (block->idom != -1)
+            fprintf(stream, ", idom: %d", block->idom);
+        fprintf(stream, "\n");
+    }
+}
+
+static void _find_max_reg_no(ir_value *v, void *pdata, int idata) {
+    int *max = (int *)pdata;
+    if (v != NULL && v->type == IR_TREG && v->val.temp_reg_no > *max)
+        *max = v->val.temp_reg_no;
+}
+
+int ir_next_temp_reg_no(ir_listing *l) {
+    // for passes that need new temp regs
+    int max = 0;
+    for (int i = 0; i < l->length; i++)
+        l->entries_arr[i]->ops->foreach_ir_value(l->entries_arr[i], _find_max_reg_no, &max, i);
+    return max + 1;
+}
+
+int ir_function_end(ir_listing *l, int func_start) {
+    int end = l->ops->find_next_function_def(l, func_start + 1);
+    return end == -1 ? l->length : end;
+}
+
+ir_value *ir_entry_lvalue(ir_entry *e) {
+    if (e->type == IR_THREE_ADDR_CODE)
+        return e->t.three_address_code.lvalue;
+    if (e->type == IR_FUNCTION_CALL)
+        return e->t.function_call.lvalue;
+    return NULL;
+}
+
+void ir_entry_foreach_rvalue_slot(ir_entry *e, ir_value_slot_visitor visitor, void *pdata) {
+    switch (e->type) {
+        case IR_THREE_ADDR_CODE:
+            if (e->t.three_address_code.op1 != NULL)
+                visitor(e, &e->t.three_address_code.op1, pdata);
+            if (e->t.three_address_code.op2 != NULL)
+                visitor(e, &e->t.three_address_code.op2, pdata);
+            break;
+        case IR_FUNCTION_CALL:
+            visitor(e, &e->t.function_call.func_addr, pdata);
+            for (int i = 0; i < e->t.function_call.args_len; i++)
+                visitor(e, &e->t.function_call.args_arr[i], pdata);
+            break;
+        case IR_CONDITIONAL_JUMP:
+            visitor(e, &e->t.conditional_jump.v1, pdata);
+            visitor(e, &e->t.conditional_jump.v2, pdata);
+            break;
+        case IR_RETURN:
+            if (e->t.return_stmt.ret_val != NULL)
+                visitor(e, &e->t.return_stmt.ret_val, pdata);
+            break;
+        default:
+            break;
+    }
+}
+
+bool ir_entry_slot_accepts(ir_entry *e, ir_value **slot, enum ir_value_type type) {
+    // what the ir-to-asm converter can handle in each position
+    if (e->type == IR_THREE_ADDR_CODE) {
+        ir_operation op = e->t.three_address_code.op;
+        if (op == IR_ADDR_OF)
+            return false; // needs the symbol itself, not its value
+        if (slot == &e->t.three_address_code.op1 || type != IR_IMM)
+            return true;
+        // a pointer cannot be an immediate
+        return op != IR_VALUE_AT;
+
+    } else if (e->type == IR_FUNCTION_CALL) {
+        return slot != &e->t.function_call.func_addr || type == IR_TREG;
+
+    } else if (e->type == IR_CONDITIONAL_JUMP) {
+        // the converter swaps an immediate to the right, but needs one side not immediate
+        ir_value *other = (slot == &e->t.conditional_jump.v1) ? e->t.conditional_jump.v2 : e->t.conditional_jump.v1;
+        return type != IR_IMM || other->type != IR_IMM;
+    }
+
+    return true;
+}
+
+bool ir_entry_is_block_end(ir_entry *e) {
+    return e->type == IR_CONDITIONAL_JUMP ||
+           e->type == IR_UNCONDITIONAL_JUMP ||
+           ir_entry_is_function_exit(e);
+}
+
+bool ir_entry_is_function_exit(ir_entry *e) {
+    return e->type == IR_RETURN ||
+           (e->type == IR_FUNCTION_CALL && e->t.function_call.is_tail_call);
+}
+
+bool ir_entry_is_copy(ir_entry *e) {
+    return e->type == IR_THREE_ADDR_CODE &&
+        e->t.three_address_code.lvalue != NULL &&
+        e->t.three_address_code.op1 == NULL &&
+        e->t.three_address_code.op == IR_NONE &&
+        e->t.three_address_code.op2 != NULL;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <stdbool.h>
+#include <stdio.h>
+#include "../codegen/ir_listing.h"
+#include "../../utils/all.h"
+
+
+struct flow_graph_ops;
+
+// a straight run of IR entries, only entered at the top and left at the bottom
+typedef struct basic_block {
+    int id;
+    int first;   // index of first entry in the listing
+    int last;    // index of last entry in the listing (inclusive)
+    int succs_count;
+    int succs[2]; // fallthrough first, then jump target
+    int preds_count;
+    int *preds_arr;
+
+    // per temp reg, indexed by (reg_no - min_reg_no), filled by compute_liveness()
+    bool *live_in;
+    bool *live_out;
+
+    // filled by compute_dominators(), -1 for the entry and unreachable blocks
+    int idom;
+} basic_block;
+
+// blocks that can reach a back edge to the header, without passing through it
+typedef struct natural_loop {
+    int header;   // block number
+    bool *body;   // per block, header included
+    int blocks_count;
+} natural_loop;
+
+// control flow graph of a single function in an IR listing.
+// it points into the listing, so it must be rebuilt after the listing changes
+typedef struct flow_graph {
+    mempool *mp;
+    ir_listing *listing;
+    int start;  // index of the function definition entry
+    int end;    // non-inclusive, next function or end of listing
+    int blocks_count;
+    basic_block *blocks_arr;
+    int min_reg_no;
+    int regs_count;
+    int *rpo_arr;   // reachable blocks in reverse post order, by compute_dominators()
+    int rpo_count;
+    natural_loop *loops_arr; // by find_loops(), one per header
+    int loops_count;
+
+    struct flow_graph_ops *ops;
+} flow_graph;
+
+flow_graph *new_flow_graph(mempool *mp, ir_listing *listing, int func_start);
+
+struct flow_graph_ops {
+    int (*block_of_entry)(flow_graph *g, int index);
+    int (*block_of_label)(flow_graph *g, const char *label);
+    void (*compute_liveness)(flow_graph *g);
+    bool (*is_live_out)(flow_graph *g, int block_no, int reg_no);
+    void (*compute_dominators)(flow_graph *g);
+    bool (*dominates)(flow_graph *g, int a, int b);
+    void (*find_loops)(flow_graph *g);
+    bool (*is_reachable)(flow_graph *g, int block_no);
+    void (*print)(flow_graph *g, FILE *stream);
+};
+
+// helpers for looking at entries the way the optimizer passes need.
+// slots are the places an entry reads values from, passes can replace them.
+typedef void (*ir_value_slot_visitor)(ir_entry *e, ir_value **slot, void *pdata);
+
+int ir_function_end(ir_listing *l, int func_start);
+int ir_next_temp_reg_no(ir_listing *l);
+ir_value *ir_entry_lvalue(ir_entry *e);
+void ir_entry_foreach_rvalue_slot(ir_entry *e, ir_value_slot_visitor visitor, void *pdata);
+bool ir_entry_slot_accepts(ir_entry *e, ir_value **slot, enum ir_value_type type);
+bool ir_entry_is_block_end(ir_entry *e);
+bool ir_entry_is_function_exit(ir_entry *e);
+bool ir_entry_is_copy(ir_entry *e);
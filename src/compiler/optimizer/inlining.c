@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../run_info.h"
+#include "optimizer.h"
+
+
+/*
+    Function inlining, on the IR of the whole module.
+    A call to a function defined in this module is replaced by a copy
+    of the callee's body, when the callee is small, or when this is
+    the only call to it. The callee's arguments become temp regs
+    (or renamed locals, if the callee writes to them or takes their address),
+    its locals and labels are renamed, and each return becomes an
+    assignment to the call's lvalue and a jump to the end of the copy.
+    We never look into the code we just inlined, so recursion stops there.
+*/
+
+#define SMALL_FUNCTION_SIZE         8   // always inlined
+#define SINGLE_CALL_FUNCTION_SIZE   40  // inlined if called only once
+#define MAX_CALLER_SIZE             500 // don't grow functions beyond this
+
+struct inline_data {
+    ir_listing *listing;
+    struct ir_entry_func_def_info *callee;
+    int callee_start;
+    int callee_end;
+    int suffix;              // makes names unique per inlined copy
+    int reg_offset;          // added to the callee temp regs
+    int *arg_regs;           // per callee arg, the temp reg holding it, or 0 if it's a local
+    list *local_names;       // callee locals and args that become caller locals
+};
+
+static int _find_function(ir_listing *l, const char *name) {
+    int start = 0;
+    while ((start = l->ops->find_next_function_def(l, start)) != -1) {
+        if (strcmp(l->entries_arr[start]->t.function_def.func_name, name) == 0)
+            return start;
+        start++;
+    }
+    return -1;
+}
+
+// entries that turn into instructions
+static int _function_size(ir_listing *l, int start) {
+    int size = 0;
+    int end = ir_function_end(l, start);
+    for (int i = start + 1; i < end; i++) {
+        enum ir_entry_type t = l->entries_arr[i]->type;
+        if (t != IR_COMMENT && t != IR_LABEL && t != IR_DATA_DECLARATION && t != IR_FUNCTION_END)
+            size++;
+    }
+    return size;
+}
+
+static const char *_called_function(ir_entry *e) {
+    if (e->type != IR_FUNCTION_CALL || e->t.function_call.func_addr->type != IR_SYM)
+        return NULL;
+    return e->t.function_call.func_addr->val.symbol_name;
+}
+
+static int _count_calls(ir_listing *l, const char *name, int start, int end) {
+    int count = 0;
+    for (int i = start; i < end; i++) {
+        const char *called = _called_function(l->entries_arr[i]);
+        if (called != NULL && strcmp(called, name) == 0)
+            count++;
+    }
+    return count;
+}
+
+static bool _is_local_name(ir_listing *l, int start, const char *name) {
+    struct ir_entry_func_def_info *f = &l->entries_arr[start]->t.function_def;
+    for (int i = 0; i < f->args_len; i++) {
+        if (strcmp(f->args_arr[i].name, name) == 0)
+            return true;
+    }
+    int end = ir_function_end(l, start);
+    for (int i = start + 1; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type == IR_DATA_DECLARATION && e->t.data_decl.storage == IR_LOCAL &&
+            strcmp(e->t.data_decl.symbol_name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+struct collision_data {
+    ir_listing *listing;
+    int caller_start;
+    int callee_start;
+    bool collides;
+};
+
+static void _check_collision(ir_value *v, void *pdata, int idata) {
+    // a global the callee uses, would resolve to a caller local of the same name
+    struct collision_data *d = (struct collision_data *)pdata;
+    if (v == NULL || v->type != IR_SYM)
+        return;
+    if (!_is_local_name(d->listing, d->callee_start, v->val.symbol_name) &&
+        _is_local_name(d->listing, d->caller_start, v->val.symbol_name))
+        d->collides = true;
+}
+
+// returns NULL if the call can be inlined, or the reason why not
+static const char *_check_inlining(ir_listing *l, int caller_start, int callee_start, int calls_count) {
+    const char *callee_name = l->entries_arr[callee_start]->t.function_def.func_name;
+    int callee_end = ir_function_end(l, callee_start);
+
+    if (caller_start == callee_start || _count_calls(l, callee_name, callee_start, callee_end) > 0)
+        return "recursive";
+    int size = _function_size(l, callee_start);
+    if (size > SINGLE_CALL_FUNCTION_SIZE || (size > SMALL_FUNCTION_SIZE && calls_count > 1))
+        return "too large";
+    if (_function_size(l, caller_start) + size > MAX_CALLER_SIZE)
+        return "caller too large";
+
+    struct collision_data d = { l, caller_start, callee_start, false };
+    for (int i = callee_start + 1; i < callee_end; i++)
+        l->entries_arr[i]->ops->foreach_ir_value(l->entries_arr[i], _check_collision, &d, i);
+    if (d.collides)
+        return "name collision";
+    return NULL;
+}
+
+static bool _is_written_arg(ir_listing *l, int start, int end, const char *name) {
+    for (int i = start + 1; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        ir_value *lv = ir_entry_lvalue(e);
+        if (lv != NULL && lv->type == IR_SYM && strcmp(lv->val.symbol_name, name) == 0)
+            return true;
+        if (e->type == IR_THREE_ADDR_CODE && e->t.three_address_code.op == IR_ADDR_OF &&
+            e->t.three_address_code.op2->type == IR_SYM &&
+            strcmp(e->t.three_address_code.op2->val.symbol_name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+static ir_value *_map_value(struct inline_data *d, ir_value *v) {
+    if (v == NULL)
+        return NULL;
+    if (v->type == IR_TREG)
+        return new_ir_value_temp_reg(v->val.temp_reg_no + d->reg_offset);
+    if (v->type == IR_IMM)
+        return new_ir_value_immediate(v->val.immediate);
+
+    for (int i = 0; i < d->callee->args_len; i++) {
+        if (d->arg_regs[i] != 0 && strcmp(d->callee->args_arr[i].name, v->val.symbol_name) == 0)
+            return new_ir_value_temp_reg(d->arg_regs[i]);
+    }
+    for_list(d->local_names, char, name) {
+        if (strcmp(name, v->val.symbol_name) == 0) {
+            char buffer[128];
+            snprintf(buffer, sizeof(buffer), "%s_inl%d", name, d->suffix);
+            return new_ir_value_symbol(buffer);
+        }
+    }
+    return new_ir_value_symbol(v->val.symbol_name);
+}
+
+// copies a callee entry for the caller, NULL if it's not needed there
+static ir_entry *_map_entry(struct inline_data *d, ir_entry *e, ir_value *call_lvalue) {
+    switch (e->type) {
+        case IR_LABEL:
+            return new_ir_label("%s_inl%d", e->t.label.str, d->suffix);
+        case IR_THREE_ADDR_CODE: {
+            ir_entry *t = new_ir_three_address_code(
+                _map_value(d, e->t.three_address_code.lvalue),
+                _map_value(d, e->t.three_address_code.op1),
+                e->t.three_address_code.op,
+                _map_value(d, e->t.three_address_code.op2));
+            t->t.three_address_code.is_unsigned = e->t.three_address_code.is_unsigned;
+            return t;
+        }
+        case IR_FUNCTION_CALL: {
+            struct ir_entry_function_call_info *c = &e->t.function_call;
+            ir_value **args = NULL;
+            if (c->args_len > 0) {
+                args = malloc(sizeof(ir_value *) * c->args_len);
+                for (int i = 0; i < c->args_len; i++)
+                    args[i] = _map_value(d, c->args_arr[i]);
+            }
+            return new_ir_function_call(_map_value(d, c->lvalue), _map_value(d, c->func_addr), c->args_len, args);
+        }
+        case IR_CONDITIONAL_JUMP: {
+            ir_entry *j = new_ir_conditional_jump(
+                _map_value(d, e->t.conditional_jump.v1),
+                e->t.conditional_jump.cmp,
+                _map_value(d, e->t.conditional_jump.v2),
+                "%s_inl%d", e->t.conditional_jump.target_label, d->suffix);
+            j->t.conditional_jump.is_unsigned = e->t.conditional_jump.is_unsigned;
+            return j;
+        }
+        case IR_UNCONDITIONAL_JUMP:
+            return new_ir_unconditional_jump("%s_inl%d", e->t.unconditional_jump.str, d->suffix);
+        case IR_RETURN:
+            if (call_lvalue == NULL || e->t.return_stmt.ret_val == NULL)
+                return NULL;
+            return new_ir_assignment(clone_ir_value(call_lvalue), _map_value(d, e->t.return_stmt.ret_val));
+        default:
+            return NULL; // comments, declarations (moved to the caller), function end
+    }
+}
+
+// replaces the call at call_index with the callee's body
+static void _inline_call(ir_listing *l, int caller_start, int call_index, int callee_start, int suffix) {
+    mempool *mp = new_mempool();
+    ir_entry *call = l->entries_arr[call_index];
+    struct inline_data d;
+    d.listing = l;
+    d.callee = &l->entries_arr[callee_start]->t.function_def;
+    d.callee_start = callee_start;
+    d.callee_end = ir_function_end(l, callee_start);
+    d.suffix = suffix;
+    d.arg_regs = mpallocn(mp, sizeof(int) * (d.callee->args_len + 1), arg_regs);
+    d.local_names = new_list(mp);
+
+    // arguments never written to can live in temp regs, the rest become locals
+    list *entries = new_list(mp);
+    list *decls = new_list(mp);
+    int next_reg_no = ir_next_temp_reg_no(l);
+    for (int i = 0; i < d.callee->args_len; i++) {
+        const char *name = d.callee->args_arr[i].name;
+        ir_value *arg = i < call->t.function_call.args_len ? call->t.function_call.args_arr[i] : NULL;
+        if (arg != NULL && !_is_written_arg(l, callee_start, d.callee_end, name)) {
+            d.arg_regs[i] = next_reg_no++;
+            list_add(entries, new_ir_assignment(new_ir_value_temp_reg(d.arg_regs[i]), clone_ir_value(arg)));
+            continue;
+        }
+        d.arg_regs[i] = 0;
+        list_add(d.local_names, (void *)name);
+        list_add(decls, new_ir_data_declaration(d.callee->args_arr[i].size, NULL, name, IR_LOCAL));
+        if (arg != NULL)
+            list_add(entries, new_ir_assignment(new_ir_value_symbol(name), clone_ir_value(arg)));
+    }
+    for (int i = callee_start + 1; i < d.callee_end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type == IR_DATA_DECLARATION && e->t.data_decl.storage == IR_LOCAL) {
+            list_add(d.local_names, (void *)e->t.data_decl.symbol_name);
+            list_add(decls, new_ir_data_declaration(e->t.data_decl.size, e->t.data_decl.initial_data, e->t.data_decl.symbol_name, IR_LOCAL));
+        }
+    }
+    d.reg_offset = next_reg_no;
+
+    // the stores to arguments above used the original names, rename them like the rest
+    char end_label[128];
+    snprintf(end_label, sizeof(end_label), "%s_inl%d_end", d.callee->func_name, suffix);
+    list *body = new_list(mp);
+    for_list(entries, ir_entry, e) {
+        if (e->t.three_address_code.lvalue->type == IR_SYM) {
+            ir_value *renamed = _map_value(&d, e->t.three_address_code.lvalue);
+            free_ir_value(e->t.three_address_code.lvalue);
+            e->t.three_address_code.lvalue = renamed;
+        }
+        list_add(body, e);
+    }
+    for (int i = callee_start + 1; i < d.callee_end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        ir_entry *copy = _map_entry(&d, e, call->t.function_call.lvalue);
+        if (copy != NULL)
+            list_add(body, copy);
+        // the last return can fall through to the end
+        if (e->type == IR_RETURN && i + 1 < d.callee_end && l->entries_arr[i + 1]->type != IR_FUNCTION_END)
+            list_add(body, new_ir_unconditional_jump("%s", end_label));
+    }
+    list_add(body, new_ir_label("%s", end_label));
+    for_list(decls, ir_entry, e) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "%s_inl%d", e->t.data_decl.symbol_name, suffix);
+        free((void *)e->t.data_decl.symbol_name);
+        e->t.data_decl.symbol_name = strdup(buffer);
+    }
+
+    // callee is copied, now we can touch the caller
+    l->ops->remove(l, call_index);
+    int at = call_index;
+    for_list(body, ir_entry, e)
+        l->ops->insert(l, at++, e);
+    at = caller_start + 1;
+    for_list(decls, ir_entry, e)
+        l->ops->insert(l, at++, e);
+
+    mempool_release(mp);
+}
+
+int ir_inline_functions(ir_listing *l) {
+    int inlined = 0;
+    int caller_start = 0;
+    while ((caller_start = l->ops->find_next_function_def(l, caller_start)) != -1) {
+        const char *caller_name = l->entries_arr[caller_start]->t.function_def.func_name;
+
+        for (int i = caller_start + 1; i < ir_function_end(l, caller_start); i++) {
+            const char *callee_name = _called_function(l->entries_arr[i]);
+            if (callee_name == NULL)
+                continue;
+            int callee_start = _find_function(l, callee_name);
+            if (callee_start == -1)
+                continue; // defined in another module
+
+            const char *reason = _check_inlining(l, caller_start, callee_start, _count_calls(l, callee_name, 0, l->length));
+            if (reason != NULL) {
+                if (run_info->options->verbose)
+                    printf("    not inlining %s() into %s(): %s\n", callee_name, caller_name, reason);
+                continue;
+            }
+            if (run_info->options->verbose)
+                printf("    inlining %s() into %s(), %d entries\n", callee_name, caller_name, _function_size(l, callee_start));
+
+            // skip over the inlined copy, we don't inline into it again
+            int length = l->length;
+            _inline_call(l, caller_start, i, callee_start, ++inlined);
+            i += l->length - length;
+        }
+        caller_start++;
+    }
+    return inlined;
+}
@@ -0,0 +1,550 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "optimizer.h"
+
+
+/*
+    Loop optimizations, on the natural loops of the flow graph.
+    - computations that give the same result on every iteration
+      are hoisted into a preheader, right before the loop header,
+      and so are stores of such values to locals, when it's safe.
+    - multiplications of an induction variable by a constant ("i * 4")
+      become a temp reg, bumped by the constant whenever the variable is.
+    Entries move around, so each loop is processed on a fresh flow graph.
+    Inner loops go first, their hoisted entries can move out again
+    when we get to the outer loop.
+*/
+
+struct loop_info {
+    ir_listing *listing;
+    flow_graph *g;
+    natural_loop *loop;
+    mempool *mp;
+    bool has_calls;
+    list *stored_symbols; // one item per store in the loop
+    int *defs;            // per temp reg, assignments in the function
+    int *def_index;       // per temp reg, listing index of the (last) assignment
+    bool *defined_in_loop;
+};
+
+static bool _entry_in_loop(struct loop_info *li, int index) {
+    int b = li->g->ops->block_of_entry(li->g, index);
+    return b != -1 && li->loop->body[b];
+}
+
+static int _count_stores(struct loop_info *li, const char *name) {
+    int count = 0;
+    for_list(li->stored_symbols, char, sym) {
+        if (strcmp(sym, name) == 0)
+            count++;
+    }
+    return count;
+}
+
+// locals and arguments that nobody takes the address of, calls cannot change them
+static bool _is_private_variable(struct loop_info *li, const char *name) {
+    bool declared = false;
+    struct ir_entry_func_def_info *f = &li->listing->entries_arr[li->g->start]->t.function_def;
+    for (int i = 0; i < f->args_len; i++) {
+        if (strcmp(f->args_arr[i].name, name) == 0)
+            declared = true;
+    }
+
+    for (int i = li->g->start; i < li->g->end; i++) {
+        ir_entry *e = li->listing->entries_arr[i];
+        if (e->type == IR_DATA_DECLARATION && e->t.data_decl.storage == IR_LOCAL &&
+            strcmp(e->t.data_decl.symbol_name, name) == 0)
+            declared = true;
+        if (e->type == IR_THREE_ADDR_CODE && e->t.three_address_code.op == IR_ADDR_OF &&
+            e->t.three_address_code.op2->type == IR_SYM &&
+            strcmp(e->t.three_address_code.op2->val.symbol_name, name) == 0)
+            return false;
+    }
+    return declared;
+}
+
+static bool _is_read_only_variable(struct loop_info *li, const char *name) {
+    for (int i = 0; i < li->listing->length; i++) {
+        ir_entry *e = li->listing->entries_arr[i];
+        if (e->type == IR_DATA_DECLARATION && e->t.data_decl.storage == IR_GLOBAL_RO &&
+            strcmp(e->t.data_decl.symbol_name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+// only stores we can see in the loop change the variable
+static bool _is_tracked_variable(struct loop_info *li, const char *name) {
+    return !li->has_calls || _is_private_variable(li, name);
+}
+
+static bool _is_invariant_operand(struct loop_info *li, ir_value *v, ir_operation op) {
+    if (v == NULL || v->type == IR_IMM)
+        return true;
+    if (v->type == IR_TREG) {
+        int n = v->val.temp_reg_no - li->g->min_reg_no;
+        return li->defs[n] == 1 && !li->defined_in_loop[n];
+    }
+    if (op == IR_ADDR_OF)
+        return true; // the address of a symbol never changes
+    const char *name = v->val.symbol_name;
+    return _count_stores(li, name) == 0 && (_is_read_only_variable(li, name) || _is_tracked_variable(li, name));
+}
+
+struct symbol_read {
+    const char *name;
+    bool found;
+};
+
+static void _check_symbol_read(ir_entry *e, ir_value **slot, void *pdata) {
+    struct symbol_read *r = (struct symbol_read *)pdata;
+    if ((*slot)->type == IR_SYM && strcmp((*slot)->val.symbol_name, r->name) == 0)
+        r->found = true;
+}
+
+// whether a read of the variable can be reached from the loop header without a store to it first,
+// i.e. whether the value it had before the loop, or in the previous iteration, is ever used
+static bool _is_live_into_header(struct loop_info *li, const char *name) {
+    flow_graph *g = li->g;
+    bool *visited = mpallocn(li->mp, sizeof(bool) * (g->blocks_count + 1), visited);
+    int *pending = mpallocn(li->mp, sizeof(int) * (g->blocks_count + 1), pending);
+    memset(visited, 0, sizeof(bool) * (g->blocks_count + 1));
+    int pending_count = 0;
+    pending[pending_count++] = li->loop->header;
+    visited[li->loop->header] = true;
+
+    while (pending_count > 0) {
+        basic_block *b = &g->blocks_arr[pending[--pending_count]];
+        bool stored = false;
+        for (int i = b->first; i <= b->last && !stored; i++) {
+            ir_entry *e = li->listing->entries_arr[i];
+            struct symbol_read r = { name, false };
+            ir_entry_foreach_rvalue_slot(e, _check_symbol_read, &r);
+            if (r.found)
+                return true;
+            ir_value *lv = ir_entry_lvalue(e);
+            stored = lv != NULL && lv->type == IR_SYM && strcmp(lv->val.symbol_name, name) == 0;
+        }
+        if (stored)
+            continue;
+        for (int s = 0; s < b->succs_count; s++) {
+            if (!visited[b->succs[s]]) {
+                visited[b->succs[s]] = true;
+                pending[pending_count++] = b->succs[s];
+            }
+        }
+    }
+    return false;
+}
+
+// "t = k * 3" can go before the loop, if nothing else in the loop stores to t,
+// nothing reads t behind our back, and the value t had before is never used
+static bool _is_hoistable_store(struct loop_info *li, const char *name) {
+    return _count_stores(li, name) == 1 && _is_private_variable(li, name) && !_is_live_into_header(li, name);
+}
+
+static bool _is_invariant_entry(struct loop_info *li, ir_entry *e) {
+    if (e->type != IR_THREE_ADDR_CODE)
+        return false;
+    struct ir_entry_three_addr_code_info *c = &e->t.three_address_code;
+    if (c->lvalue == NULL)
+        return false; // expression statements, e.g. "i++;", are kept in place
+    if (c->lvalue->type == IR_SYM) {
+        if (!_is_hoistable_store(li, c->lvalue->val.symbol_name))
+            return false;
+    } else if (li->defs[c->lvalue->val.temp_reg_no - li->g->min_reg_no] != 1)
+        return false;
+
+    // the preheader runs even if the loop body would not, nothing that may fault
+    if (c->op == IR_VALUE_AT)
+        return false;
+    if ((c->op == IR_DIV || c->op == IR_MOD) && (c->op2->type != IR_IMM || c->op2->val.immediate == 0))
+        return false;
+
+    return _is_invariant_operand(li, c->op1, c->op) && _is_invariant_operand(li, c->op2, c->op);
+}
+
+static void _prepare_loop_info(struct loop_info *li, ir_listing *l, flow_graph *g, natural_loop *loop, mempool *mp) {
+    li->listing = l;
+    li->g = g;
+    li->loop = loop;
+    li->mp = mp;
+    li->has_calls = false;
+    li->stored_symbols = new_list(mp);
+    li->defs = mpallocn(mp, sizeof(int) * (g->regs_count + 1), defs);
+    li->def_index = mpallocn(mp, sizeof(int) * (g->regs_count + 1), def_index);
+    li->defined_in_loop = mpallocn(mp, sizeof(bool) * (g->regs_count + 1), defined_in_loop);
+    memset(li->defs, 0, sizeof(int) * (g->regs_count + 1));
+    memset(li->def_index, 0, sizeof(int) * (g->regs_count + 1));
+    memset(li->defined_in_loop, 0, sizeof(bool) * (g->regs_count + 1));
+
+    for (int i = g->start; i < g->end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        ir_value *lv = ir_entry_lvalue(e);
+        bool in_loop = _entry_in_loop(li, i);
+        if (lv != NULL && lv->type == IR_TREG) {
+            int n = lv->val.temp_reg_no - g->min_reg_no;
+            li->defs[n]++;
+            li->def_index[n] = i;
+            if (in_loop)
+                li->defined_in_loop[n] = true;
+        }
+        if (!in_loop)
+            continue;
+        if (e->type == IR_FUNCTION_CALL)
+            li->has_calls = true;
+        if (lv != NULL && lv->type == IR_SYM)
+            list_add(li->stored_symbols, (void *)lv->val.symbol_name);
+    }
+}
+
+static const char *_jump_target(ir_entry *e) {
+    if (e->type == IR_UNCONDITIONAL_JUMP)
+        return e->t.unconditional_jump.str;
+    if (e->type == IR_CONDITIONAL_JUMP)
+        return e->t.conditional_jump.target_label;
+    return NULL;
+}
+
+// makes room for a preheader, returns the listing index to insert entries at,
+// right before the header label, or -1 if the loop is not laid out for one.
+// jumps into the loop from outside are sent to a new preheader label.
+static int _prepare_preheader(struct loop_info *li) {
+    flow_graph *g = li->g;
+    basic_block *header = &g->blocks_arr[li->loop->header];
+    ir_entry *label = li->listing->entries_arr[header->first];
+    if (label->type != IR_LABEL || li->loop->header == 0)
+        return -1;
+
+    // whatever falls into the header would fall into the preheader too
+    basic_block *prev = &g->blocks_arr[li->loop->header - 1];
+    ir_entry *prev_last = li->listing->entries_arr[prev->last];
+    bool prev_falls_through = prev_last->type != IR_UNCONDITIONAL_JUMP && !ir_entry_is_function_exit(prev_last);
+    if (prev_falls_through && li->loop->body[li->loop->header - 1])
+        return -1;
+
+    list *jumps = new_list(li->mp);
+    for (int p = 0; p < header->preds_count; p++) {
+        int pred = header->preds_arr[p];
+        if (li->loop->body[pred])
+            continue;
+        ir_entry *e = li->listing->entries_arr[g->blocks_arr[pred].last];
+        const char *target = _jump_target(e);
+        if (target != NULL && strcmp(target, label->t.label.str) == 0)
+            list_add(jumps, e);
+    }
+    if (list_is_empty(jumps))
+        return header->first;
+
+    char name[128];
+    snprintf(name, sizeof(name), "%s_preheader", label->t.label.str);
+    for_list(jumps, ir_entry, e) {
+        if (e->type == IR_UNCONDITIONAL_JUMP) {
+            free(e->t.unconditional_jump.str);
+            e->t.unconditional_jump.str = strdup(name);
+        } else {
+            free(e->t.conditional_jump.target_label);
+            e->t.conditional_jump.target_label = strdup(name);
+        }
+    }
+    li->listing->ops->insert(li->listing, header->first, new_ir_label("%s", name));
+    return header->first + 1;
+}
+
+static int _index_of(ir_listing *l, ir_entry *e, int from) {
+    for (int i = from; i < l->length; i++) {
+        if (l->entries_arr[i] == e)
+            return i;
+    }
+    return -1;
+}
+
+static int _hoist_invariants(struct loop_info *li) {
+    flow_graph *g = li->g;
+    int header_first = g->blocks_arr[li->loop->header].first;
+    bool *hoist = mpallocn(li->mp, sizeof(bool) * (g->end - g->start), hoist);
+    memset(hoist, 0, sizeof(bool) * (g->end - g->start));
+
+    // hoisting a computation may make the ones using it invariant, go until nothing changes
+    int count = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = header_first; i < g->end; i++) {
+            ir_entry *e = li->listing->entries_arr[i];
+            if (hoist[i - g->start] || !_entry_in_loop(li, i) || !_is_invariant_entry(li, e))
+                continue;
+            hoist[i - g->start] = true;
+            ir_value *lv = ir_entry_lvalue(e);
+            if (lv != NULL && lv->type == IR_TREG)
+                li->defined_in_loop[lv->val.temp_reg_no - g->min_reg_no] = false;
+            changed = true;
+            count++;
+        }
+    }
+    if (count == 0)
+        return 0;
+
+    // keep the entries themselves, indexes change as we go
+    list *moved = new_list(li->mp);
+    for (int i = header_first; i < g->end; i++) {
+        if (hoist[i - g->start])
+            list_add(moved, li->listing->entries_arr[i]);
+    }
+
+    int at = _prepare_preheader(li);
+    if (at == -1)
+        return 0;
+    for_list(moved, ir_entry, e) {
+        int index = _index_of(li->listing, e, at);
+        li->listing->ops->detach(li->listing, index);
+        li->listing->ops->insert(li->listing, at++, e);
+    }
+    return count;
+}
+
+struct induction_var {
+    const char *name;
+    ir_entry *store;  // the only store in the loop, "v = v + step"
+    int store_index;
+    int step;
+};
+
+struct reduced_mul {
+    struct induction_var *iv;
+    int factor;
+    int reg_no;       // holds iv * factor throughout the loop
+};
+
+static bool _is_constant(struct loop_info *li, ir_value *v, int *value) {
+    if (v->type == IR_IMM) {
+        *value = v->val.immediate;
+        return true;
+    }
+    if (v->type != IR_TREG || li->defs[v->val.temp_reg_no - li->g->min_reg_no] != 1)
+        return false;
+    ir_entry *def = li->listing->entries_arr[li->def_index[v->val.temp_reg_no - li->g->min_reg_no]];
+    if (!ir_entry_is_copy(def) || def->t.three_address_code.op2->type != IR_IMM)
+        return false;
+    *value = def->t.three_address_code.op2->val.immediate;
+    return true;
+}
+
+// whether v holds the current value of the variable at entry index,
+// either the variable itself, or a copy of it made earlier in the same block
+static bool _reads_variable(struct loop_info *li, int index, ir_value *v, const char *name, int store_index) {
+    if (v->type == IR_SYM)
+        return strcmp(v->val.symbol_name, name) == 0;
+    if (v->type != IR_TREG || li->defs[v->val.temp_reg_no - li->g->min_reg_no] != 1)
+        return false;
+
+    int def_index = li->def_index[v->val.temp_reg_no - li->g->min_reg_no];
+    ir_entry *def = li->listing->entries_arr[def_index];
+    if (!ir_entry_is_copy(def) || def->t.three_address_code.op2->type != IR_SYM ||
+        strcmp(def->t.three_address_code.op2->val.symbol_name, name) != 0)
+        return false;
+    if (def_index >= index || li->g->ops->block_of_entry(li->g, def_index) != li->g->ops->block_of_entry(li->g, index))
+        return false;
+    return store_index <= def_index || store_index >= index;
+}
+
+static bool _find_induction_var(struct loop_info *li, int index, struct induction_var *iv) {
+    ir_entry *e = li->listing->entries_arr[index];
+    ir_value *lv = ir_entry_lvalue(e);
+    if (e->type != IR_THREE_ADDR_CODE || lv == NULL || lv->type != IR_SYM)
+        return false;
+    struct ir_entry_three_addr_code_info *c = &e->t.three_address_code;
+    const char *name = lv->val.symbol_name;
+    if (_count_stores(li, name) != 1 || !_is_tracked_variable(li, name))
+        return false;
+    if (c->op != IR_ADD && c->op != IR_SUB)
+        return false;
+
+    ir_value *var = c->op1;
+    ir_value *step = c->op2;
+    if (c->op == IR_ADD && var->type == IR_IMM) {
+        var = c->op2;
+        step = c->op1;
+    }
+    if (step->type != IR_IMM || !_reads_variable(li, index, var, name, index))
+        return false;
+
+    iv->name = name;
+    iv->store = e;
+    iv->store_index = index;
+    iv->step = (c->op == IR_ADD) ? step->val.immediate : -step->val.immediate;
+    return true;
+}
+
+static struct reduced_mul *_find_reduction(struct loop_info *li, int index, struct induction_var *ivs, int ivs_count) {
+    ir_entry *e = li->listing->entries_arr[index];
+    ir_value *lv = ir_entry_lvalue(e);
+    if (e->type != IR_THREE_ADDR_CODE || e->t.three_address_code.op != IR_MUL ||
+        lv == NULL || lv->type != IR_TREG)
+        return NULL;
+
+    struct reduced_mul *r = mpalloc(li->mp, struct reduced_mul);
+    ir_value *operands[2] = { e->t.three_address_code.op1, e->t.three_address_code.op2 };
+    for (int k = 0; k < 2; k++) {
+        if (!_is_constant(li, operands[1 - k], &r->factor))
+            continue;
+        for (int v = 0; v < ivs_count; v++) {
+            if (_reads_variable(li, index, operands[k], ivs[v].name, ivs[v].store_index)) {
+                r->iv = &ivs[v];
+                return r;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void _count_use(ir_entry *e, ir_value **slot, void *pdata) {
+    int *d = (int *)pdata; // reg_no, count
+    if ((*slot)->type == IR_TREG && (*slot)->val.temp_reg_no == d[0])
+        d[1]++;
+}
+
+static int _count_treg_uses(ir_listing *l, int start, int end, int reg_no) {
+    int d[2] = { reg_no, 0 };
+    for (int i = start; i < end; i++)
+        ir_entry_foreach_rvalue_slot(l->entries_arr[i], _count_use, d);
+    return d[1];
+}
+
+// the copies of the variable and of the constant may be left unused
+static void _remove_unused_copy(ir_listing *l, int start, ir_value *v) {
+    if (v->type != IR_TREG)
+        return;
+    int end = ir_function_end(l, start);
+    if (_count_treg_uses(l, start, end, v->val.temp_reg_no) > 0)
+        return;
+    for (int i = start; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        ir_value *lv = ir_entry_lvalue(e);
+        if (ir_entry_is_copy(e) && lv != NULL && lv->type == IR_TREG && lv->val.temp_reg_no == v->val.temp_reg_no) {
+            l->ops->remove(l, i);
+            return;
+        }
+    }
+}
+
+static int _reduce_induction_variables(struct loop_info *li) {
+    flow_graph *g = li->g;
+    int header_first = g->blocks_arr[li->loop->header].first;
+
+    struct induction_var *ivs = mpallocn(li->mp, sizeof(struct induction_var) * (g->end - g->start), ivs);
+    int ivs_count = 0;
+    for (int i = header_first; i < g->end; i++) {
+        if (_entry_in_loop(li, i) && _find_induction_var(li, i, &ivs[ivs_count]))
+            ivs_count++;
+    }
+    if (ivs_count == 0)
+        return 0;
+
+    // a new temp reg per variable and factor, shared by all multiplications
+    list *reductions = new_list(li->mp);
+    list *entries = new_list(li->mp);
+    list *candidates = new_list(li->mp);
+    int next_reg_no = ir_next_temp_reg_no(li->listing);
+    for (int i = header_first; i < g->end; i++) {
+        if (!_entry_in_loop(li, i))
+            continue;
+        struct reduced_mul *r = _find_reduction(li, i, ivs, ivs_count);
+        if (r == NULL)
+            continue;
+        struct reduced_mul *existing = NULL;
+        for_list(reductions, struct reduced_mul, x) {
+            if (x->iv == r->iv && x->factor == r->factor)
+                existing = x;
+        }
+        if (existing == NULL) {
+            r->reg_no = next_reg_no++;
+            list_add(reductions, r);
+            existing = r;
+        }
+        list_add(entries, li->listing->entries_arr[i]);
+        list_add(candidates, existing);
+    }
+    if (list_is_empty(entries))
+        return 0;
+
+    int at = _prepare_preheader(li);
+    if (at == -1)
+        return 0;
+    for_list(reductions, struct reduced_mul, r) {
+        // "t = factor * v" before the loop, "t = t + factor * step" after each store
+        li->listing->ops->insert(li->listing, at++, new_ir_three_address_code(
+            new_ir_value_temp_reg(r->reg_no), new_ir_value_immediate(r->factor), IR_MUL, new_ir_value_symbol(r->iv->name)));
+        int store_index = _index_of(li->listing, r->iv->store, at);
+        li->listing->ops->insert(li->listing, store_index + 1, new_ir_three_address_code(
+            new_ir_value_temp_reg(r->reg_no), new_ir_value_temp_reg(r->reg_no), IR_ADD, new_ir_value_immediate(r->factor * r->iv->step)));
+    }
+
+    int count = 0;
+    for (int n = 0; n < list_length(entries); n++) {
+        ir_entry *e = list_get(entries, n);
+        struct reduced_mul *r = list_get(candidates, n);
+        ir_value *op1 = e->t.three_address_code.op1;
+        ir_value *op2 = e->t.three_address_code.op2;
+        e->t.three_address_code.op1 = NULL;
+        e->t.three_address_code.op = IR_NONE;
+        e->t.three_address_code.op2 = new_ir_value_temp_reg(r->reg_no);
+        _remove_unused_copy(li->listing, g->start, op1);
+        _remove_unused_copy(li->listing, g->start, op2);
+        free_ir_value(op1);
+        free_ir_value(op2);
+        count++;
+    }
+    return count;
+}
+
+static int _process_loops(ir_listing *l, int func_start, int (*process)(struct loop_info *li)) {
+    mempool *mp = new_mempool();
+    flow_graph *g = new_flow_graph(mp, l, func_start);
+    g->ops->find_loops(g);
+
+    // loops are known by their header label, innermost first
+    int *order = mpallocn(mp, sizeof(int) * (g->loops_count + 1), order);
+    for (int i = 0; i < g->loops_count; i++) {
+        int j = i;
+        while (j > 0 && g->loops_arr[order[j - 1]].blocks_count > g->loops_arr[i].blocks_count) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    list *headers = new_list(mp);
+    for (int i = 0; i < g->loops_count; i++) {
+        ir_entry *e = l->entries_arr[g->blocks_arr[g->loops_arr[order[i]].header].first];
+        if (e->type == IR_LABEL)
+            list_add(headers, e->t.label.str);
+    }
+
+    int count = 0;
+    for (int i = 0; i < list_length(headers); i++) {
+        mempool *loop_mp = new_mempool();
+        flow_graph *lg = new_flow_graph(loop_mp, l, func_start);
+        lg->ops->find_loops(lg);
+        int header = lg->ops->block_of_label(lg, list_get(headers, i));
+        for (int n = 0; n < lg->loops_count; n++) {
+            if (lg->loops_arr[n].header != header)
+                continue;
+            struct loop_info li;
+            _prepare_loop_info(&li, l, lg, &lg->loops_arr[n], loop_mp);
+            count += process(&li);
+        }
+        mempool_release(loop_mp);
+    }
+
+    mempool_release(mp);
+    return count;
+}
+
+int ir_hoist_loop_invariants(ir_listing *l, int func_start) {
+    return _process_loops(l, func_start, _hoist_invariants);
+}
+
+int ir_reduce_induction_variables(ir_listing *l, int func_start) {
+    return _process_loops(l, func_start, _reduce_induction_variables);
+}
@@ -0,0 +1,661 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../run_info.h"
+#include "../../utils/unit_tests.h"
+#include "optimizer.h"
+
+
+/*
+    IR level optimizations, run between codegen and the asm converter.
+    Each pass works on one function at a time and returns how many
+    changes it made, which we report in verbose mode.
+*/
+
+static void _collect_slot(ir_entry *e, ir_value **slot, void *pdata) {
+    list *slots = (list *)pdata;
+    list_add(slots, slot);
+}
+
+static int _compare_slot_values(const void *a, const void *b) {
+    ir_value *va = **(ir_value ***)a;
+    ir_value *vb = **(ir_value ***)b;
+    return va < vb ? -1 : (va > vb ? 1 : 0);
+}
+
+static void _unshare_values(ir_listing *listing) {
+    // codegen may use the same ir_value in more than one entry (e.g. "i++"),
+    // passes replace and free values in place, so each slot gets its own.
+    mempool *mp = new_mempool();
+    list *slots = new_list(mp);
+    for (int i = 0; i < listing->length; i++) {
+        ir_entry *e = listing->entries_arr[i];
+        if (e->type == IR_THREE_ADDR_CODE)
+            list_add(slots, &e->t.three_address_code.lvalue);
+        else if (e->type == IR_FUNCTION_CALL && e->t.function_call.lvalue != NULL)
+            list_add(slots, &e->t.function_call.lvalue);
+        ir_entry_foreach_rvalue_slot(e, _collect_slot, slots);
+    }
+
+    int len = list_length(slots);
+    ir_value ***arr = mpallocn(mp, sizeof(ir_value **) * (len + 1), slots_arr);
+    int n = 0;
+    for_list(slots, ir_value *, slot)
+        arr[n++] = (ir_value **)slot;
+    qsort(arr, len, sizeof(ir_value **), _compare_slot_values);
+    ir_value *prev = NULL;
+    for (int i = 0; i < len; i++) {
+        ir_value *v = *arr[i];
+        if (v == prev)
+            *arr[i] = clone_ir_value(v);
+        prev = v;
+    }
+
+    mempool_release(mp);
+}
+
+static void optimize_function(ir_listing *listing, int start, int level) {
+    const char *func_name = listing->entries_arr[start]->t.function_def.func_name;
+    int copies = 0;
+    int subexpressions = 0;
+    int coalesced = 0;
+    int hoisted = 0;
+    int reduced = 0;
+    int tail_calls = 0;
+    int jumps = 0;
+
+    if (level >= 1) {
+        copies = ir_propagate_copies(listing, start);
+        subexpressions = ir_eliminate_common_subexpressions(listing, start);
+    }
+    if (level >= 2) {
+        // recursion turned into a loop, gets the loop optimizations too
+        tail_calls = ir_eliminate_tail_calls(listing, start);
+        hoisted = ir_hoist_loop_invariants(listing, start);
+        reduced = ir_reduce_induction_variables(listing, start);
+        if (hoisted + reduced > 0)
+            copies += ir_propagate_copies(listing, start);
+    }
+    if (level >= 1) {
+        coalesced = ir_coalesce_temp_regs(listing, start);
+        jumps = ir_optimize_jumps(listing, start);
+    }
+
+    if (run_info->options->verbose) {
+        printf("    %s(): %d copies propagated, %d common subexpressions eliminated, %d temp regs coalesced, %d jumps optimized\n", 
+            func_name, copies, subexpressions, coalesced, jumps);
+        if (level >= 2)
+            printf("    %s(): %d tail calls eliminated, %d loop invariants hoisted, %d induction variable multiplications reduced\n", 
+                func_name, tail_calls, hoisted, reduced);
+    }
+}
+
+void optimize_ir_listing(ir_listing *listing, int level) {
+    if (level <= 0)
+        return;
+
+    if (run_info->options->verbose)
+        printf("--------- IR optimizations (-O%d) ---------\n", level);
+
+    _unshare_values(listing);
+
+    if (level >= 3) {
+        int inlined = ir_inline_functions(listing);
+        if (run_info->options->verbose)
+            printf("    %d calls inlined\n", inlined);
+    }
+
+    // passes may add or remove entries, so we look for the next function every time
+    int start = 0;
+    while ((start = listing->ops->find_next_function_def(listing, start)) != -1) {
+        optimize_function(listing, start, level);
+        start++;
+    }
+
+    int regs = ir_renumber_temp_regs(listing);
+    if (run_info->options->verbose)
+        printf("    %d temp regs remaining\n", regs);
+}
+
+
+#ifdef INCLUDE_UNIT_TESTS
+static ir_listing *_new_test_listing() {
+    ir_listing *l = new_ir_listing();
+    struct ir_entry_func_arg_info *args = malloc(sizeof(struct ir_entry_func_arg_info));
+    args[0].name = "a";
+    args[0].size = 4;
+    l->ops->add(l, new_ir_function_definition("f", args, 1, 4));
+    return l;
+}
+
+static ir_value **_args_of(ir_value *v) {
+    ir_value **args = malloc(sizeof(ir_value *));
+    args[0] = v;
+    return args;
+}
+
+// compares the body of the last function in the listing, entries "; " separated
+static bool _body_is(ir_listing *l, const char *expected) {
+    int start = l->length - 1;
+    while (l->entries_arr[start]->type != IR_FUNCTION_DEFINITION)
+        start--;
+    mempool *mp = new_mempool();
+    str *s = new_str(mp, NULL);
+    for (int i = start + 1; i < l->length - 1; i++) {
+        if (i > start + 1)
+            str_cats(s, "; ");
+        str_cat(s, l->entries_arr[i]->ops->to_string(mp, l->entries_arr[i]));
+    }
+    bool same = str_cmps(s, (char *)expected) == 0;
+    if (!same)
+        printf("    got: %s\n", str_charptr(s));
+    mempool_release(mp);
+    return same;
+}
+
+static void _copy_propagation_unit_tests() {
+    // r1 = a; r2 = 1; r3 = r1 + r2; r4 = r3; return r4
+    ir_listing *l = _new_test_listing();
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(2), new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(3), new_ir_value_temp_reg(1), IR_ADD, new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(4), new_ir_value_temp_reg(3)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(4)));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_propagate_copies(l, 0) == 3);
+    assert(l->length == 4);
+    struct ir_entry_three_addr_code_info *c = &l->entries_arr[1]->t.three_address_code;
+    assert(c->op1->type == IR_SYM && strcmp(c->op1->val.symbol_name, "a") == 0);
+    assert(c->op2->type == IR_IMM && c->op2->val.immediate == 1);
+    assert(l->entries_arr[2]->t.return_stmt.ret_val->val.temp_reg_no == 3);
+    assert(ir_renumber_temp_regs(l) == 1);
+    assert(c->lvalue->val.temp_reg_no == 1);
+    l->ops->free(l);
+
+    // a variable must not be forwarded past a write to it: r1 = a; a = 5; return r1
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("a"), new_ir_value_immediate(5)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_propagate_copies(l, 0) == 0);
+    assert(l->length == 5);
+    l->ops->free(l);
+
+    // an immediate on either side is fine, but not on both: r1 = 0; if r1 == a goto x; if r1 == 1 goto x
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_immediate(0)));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_temp_reg(1), IR_EQ, new_ir_value_symbol("a"), "x"));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_temp_reg(1), IR_EQ, new_ir_value_immediate(1), "x"));
+    l->ops->add(l, new_ir_label("x"));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_propagate_copies(l, 0) == 0);
+    assert(l->entries_arr[2]->t.conditional_jump.v1->type == IR_IMM);
+    assert(l->entries_arr[3]->t.conditional_jump.v1->type == IR_TREG);
+    l->ops->free(l);
+
+    // r1 = call g; r2 = r1; r2 = r2 + 1; return r2 -> a single register
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("g"), 0, NULL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(2), new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(2), new_ir_value_temp_reg(2), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_propagate_copies(l, 0) == 0);
+    assert(ir_coalesce_temp_regs(l, 0) == 1);
+    assert(l->length == 5);
+    int reg_no = l->entries_arr[1]->t.function_call.lvalue->val.temp_reg_no;
+    assert(l->entries_arr[2]->t.three_address_code.op1->val.temp_reg_no == reg_no);
+    assert(l->entries_arr[2]->t.three_address_code.lvalue->val.temp_reg_no == reg_no);
+    assert(l->entries_arr[3]->t.return_stmt.ret_val->val.temp_reg_no == reg_no);
+    l->ops->free(l);
+
+    // interfering registers are kept apart: r1 = call g; r2 = r1; r2 = r2 + 1; r3 = r1 + r2
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("g"), 0, NULL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(2), new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(2), new_ir_value_temp_reg(2), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(3), new_ir_value_temp_reg(1), IR_ADD, new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(3)));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_coalesce_temp_regs(l, 0) == 0);
+    l->ops->free(l);
+
+    // what codegen emits for "x = a + 1; return x * x;", before and after
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "x", IR_LOCAL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(2), new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(3), new_ir_value_temp_reg(1), IR_ADD, new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_temp_reg(3)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(4), new_ir_value_symbol("x")));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(5), new_ir_value_symbol("x")));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(6), new_ir_value_temp_reg(4), IR_MUL, new_ir_value_temp_reg(5)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(6)));
+    l->ops->add(l, new_ir_function_end());
+    assert(_body_is(l, "local data \"x\", 4 bytes; r1 = a; r2 = 1; r3 = r1 + r2; x = r3; r4 = x; r5 = x; r6 = r4 * r5; return r6"));
+
+    assert(ir_propagate_copies(l, 0) > 0);
+    ir_coalesce_temp_regs(l, 0);
+    ir_renumber_temp_regs(l);
+    assert(_body_is(l, "local data \"x\", 4 bytes; r1 = a + 1; x = r1; r2 = x * x; return r2"));
+    l->ops->free(l);
+}
+
+static void _value_numbering_unit_tests() {
+    // r1 = call g; r2 = r1 * 3; if r1 > 0 goto x; r3 = 3 * r1; x: r4 = r1 * 3; r5 = r2 + r4; return r5
+    ir_listing *l = _new_test_listing();
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("g"), 0, NULL));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(2), new_ir_value_temp_reg(1), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_temp_reg(1), IR_GT, new_ir_value_immediate(0), "x"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(3), new_ir_value_immediate(3), IR_MUL, new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_function_call(NULL, new_ir_value_symbol("h"), 1, _args_of(new_ir_value_temp_reg(3))));
+    l->ops->add(l, new_ir_label("x"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(4), new_ir_value_temp_reg(1), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(5), new_ir_value_temp_reg(2), IR_ADD, new_ir_value_temp_reg(4)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(5)));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_eliminate_common_subexpressions(l, 0) == 2);
+    assert(l->length == 9);
+    assert(l->entries_arr[4]->t.function_call.args_arr[0]->val.temp_reg_no == 2);
+    assert(l->entries_arr[6]->t.three_address_code.op2->val.temp_reg_no == 2);
+    l->ops->free(l);
+
+    // loads are not reused across stores or calls: r1 = a; a = 1; r2 = a; call g; r3 = a; r4 = a
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("a"), new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(2), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_function_call(NULL, new_ir_value_symbol("g"), 0, NULL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(3), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(4), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(4)));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_eliminate_common_subexpressions(l, 0) == 1);
+    assert(l->entries_arr[6]->t.return_stmt.ret_val->val.temp_reg_no == 3);
+    l->ops->free(l);
+
+    // reused values may now live across loops: r1 = call g; x: call h passing r1; goto x
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("g"), 0, NULL));
+    l->ops->add(l, new_ir_label("x"));
+    l->ops->add(l, new_ir_function_call(NULL, new_ir_value_symbol("h"), 1, _args_of(new_ir_value_temp_reg(1))));
+    l->ops->add(l, new_ir_unconditional_jump("x"));
+    l->ops->add(l, new_ir_function_end());
+    l->ops->run_statistics(l);
+    assert(l->ops->get_register_last_usage(l, 1) == 4);
+    l->ops->free(l);
+
+    // "return a * 3 + (3 * a) - a * 3;", the later products reuse the first one
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(1), new_ir_value_symbol("a"), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(2), new_ir_value_immediate(3), IR_MUL, new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(3), new_ir_value_temp_reg(1), IR_ADD, new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(4), new_ir_value_symbol("a"), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(5), new_ir_value_temp_reg(3), IR_SUB, new_ir_value_temp_reg(4)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(5)));
+    l->ops->add(l, new_ir_function_end());
+    assert(_body_is(l, "r1 = a * 3; r2 = 3 * a; r3 = r1 + r2; r4 = a * 3; r5 = r3 - r4; return r5"));
+
+    assert(ir_eliminate_common_subexpressions(l, 0) == 2);
+    assert(_body_is(l, "r1 = a * 3; r3 = r1 + r1; r5 = r3 - r1; return r5"));
+    l->ops->free(l);
+
+    // "a++; return a * 3 + a * 3;", the expression statement has no lvalue
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("a"), new_ir_value_temp_reg(1), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_assignment(NULL, new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(2), new_ir_value_symbol("a"), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(3), new_ir_value_symbol("a"), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(4), new_ir_value_temp_reg(2), IR_ADD, new_ir_value_temp_reg(3)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(4)));
+    l->ops->add(l, new_ir_function_end());
+    assert(_body_is(l, "r1 = a; a = r1 + 1; (null) = r1; r2 = a * 3; r3 = a * 3; r4 = r2 + r3; return r4"));
+
+    assert(ir_eliminate_common_subexpressions(l, 0) == 1);
+    assert(_body_is(l, "r1 = a; a = r1 + 1; (null) = r1; r2 = a * 3; r4 = r2 + r2; return r4"));
+    l->ops->free(l);
+}
+
+static void _loop_optimizations_unit_tests() {
+    // i = 0; L: r1 = i; if r1 >= a goto E; r2 = a + 5; r3 = 4; r6 = i; r4 = r6 * r3;
+    // call h(r2); call h(r4); r5 = i; i = r5 + 1; goto L; E: return
+    ir_listing *l = _new_test_listing();
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "i", IR_LOCAL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("i"), new_ir_value_immediate(0)));
+    l->ops->add(l, new_ir_label("L"));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("i")));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_temp_reg(1), IR_GE, new_ir_value_symbol("a"), "E"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(2), new_ir_value_symbol("a"), IR_ADD, new_ir_value_immediate(5)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(3), new_ir_value_immediate(4)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(6), new_ir_value_symbol("i")));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(4), new_ir_value_temp_reg(6), IR_MUL, new_ir_value_temp_reg(3)));
+    l->ops->add(l, new_ir_function_call(NULL, new_ir_value_symbol("h"), 1, _args_of(new_ir_value_temp_reg(2))));
+    l->ops->add(l, new_ir_function_call(NULL, new_ir_value_symbol("h"), 1, _args_of(new_ir_value_temp_reg(4))));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(5), new_ir_value_symbol("i")));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("i"), new_ir_value_temp_reg(5), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_unconditional_jump("L"));
+    l->ops->add(l, new_ir_label("E"));
+    l->ops->add(l, new_ir_return(NULL));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_hoist_loop_invariants(l, 0) == 2);
+    assert(l->entries_arr[3]->t.three_address_code.lvalue->val.temp_reg_no == 2);
+    assert(l->entries_arr[4]->t.three_address_code.lvalue->val.temp_reg_no == 3);
+    assert(l->entries_arr[5]->type == IR_LABEL);
+
+    assert(ir_reduce_induction_variables(l, 0) == 1);
+    assert(l->length == 18);
+    struct ir_entry_three_addr_code_info *c = &l->entries_arr[4]->t.three_address_code;
+    assert(c->lvalue->val.temp_reg_no == 7 && c->op == IR_MUL && c->op1->val.immediate == 4);
+    assert(c->op2->type == IR_SYM && strcmp(c->op2->val.symbol_name, "i") == 0);
+    c = &l->entries_arr[8]->t.three_address_code;
+    assert(c->lvalue->val.temp_reg_no == 4 && ir_entry_is_copy(l->entries_arr[8]) && c->op2->val.temp_reg_no == 7);
+    c = &l->entries_arr[13]->t.three_address_code;
+    assert(c->lvalue->val.temp_reg_no == 7 && c->op == IR_ADD && c->op2->val.immediate == 4);
+    l->ops->free(l);
+
+    // globals may change in calls, jumps from outside go to the preheader:
+    // if a == 0 goto L; call h(); L: r1 = a + 1; r2 = g; call h(r1, r2); goto L
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("a"), IR_EQ, new_ir_value_immediate(0), "L"));
+    l->ops->add(l, new_ir_function_call(NULL, new_ir_value_symbol("h"), 0, NULL));
+    l->ops->add(l, new_ir_label("L"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(1), new_ir_value_symbol("a"), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(2), new_ir_value_symbol("g")));
+    ir_value **args = malloc(sizeof(ir_value *) * 2);
+    args[0] = new_ir_value_temp_reg(1);
+    args[1] = new_ir_value_temp_reg(2);
+    l->ops->add(l, new_ir_function_call(NULL, new_ir_value_symbol("h"), 2, args));
+    l->ops->add(l, new_ir_unconditional_jump("L"));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_hoist_loop_invariants(l, 0) == 1);
+    assert(l->length == 10);
+    assert(strcmp(l->entries_arr[1]->t.conditional_jump.target_label, "L_preheader") == 0);
+    assert(strcmp(l->entries_arr[3]->t.label.str, "L_preheader") == 0);
+    assert(l->entries_arr[4]->t.three_address_code.lvalue->val.temp_reg_no == 1);
+    assert(strcmp(l->entries_arr[5]->t.label.str, "L") == 0);
+    assert(ir_reduce_induction_variables(l, 0) == 0);
+    l->ops->free(l);
+
+    // "while (i < a) { i++; j = j + a * 3; } return j;", the product moves above the loop,
+    // "i++;" leaves an entry without lvalue that stays, and i has no multiplication to reduce
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "i", IR_LOCAL));
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "j", IR_LOCAL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("i"), new_ir_value_immediate(0)));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("j"), new_ir_value_immediate(0)));
+    l->ops->add(l, new_ir_label("L"));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("i"), IR_GE, new_ir_value_symbol("a"), "E"));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("i")));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("i"), new_ir_value_temp_reg(1), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_assignment(NULL, new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(2), new_ir_value_symbol("a"), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("j"), new_ir_value_symbol("j"), IR_ADD, new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_unconditional_jump("L"));
+    l->ops->add(l, new_ir_label("E"));
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("j")));
+    l->ops->add(l, new_ir_function_end());
+    assert(_body_is(l, "local data \"i\", 4 bytes; local data \"j\", 4 bytes; i = 0; j = 0; L:; if i >= a goto E; "
+        "r1 = i; i = r1 + 1; (null) = r1; r2 = a * 3; j = j + r2; goto L; E:; return j"));
+
+    assert(ir_hoist_loop_invariants(l, 0) == 1);
+    assert(ir_reduce_induction_variables(l, 0) == 0);
+    assert(_body_is(l, "local data \"i\", 4 bytes; local data \"j\", 4 bytes; i = 0; j = 0; r2 = a * 3; L:; if i >= a goto E; "
+        "r1 = i; i = r1 + 1; (null) = r1; j = j + r2; goto L; E:; return j"));
+    l->ops->free(l);
+
+    // "while (i < a) { t = a * 3; i = i + t; }", the store to t goes too, as its old value is never read
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "i", IR_LOCAL));
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "t", IR_LOCAL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("i"), new_ir_value_immediate(0)));
+    l->ops->add(l, new_ir_label("L"));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("i"), IR_GE, new_ir_value_symbol("a"), "E"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("t"), new_ir_value_symbol("a"), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("i"), new_ir_value_symbol("i"), IR_ADD, new_ir_value_symbol("t")));
+    l->ops->add(l, new_ir_unconditional_jump("L"));
+    l->ops->add(l, new_ir_label("E"));
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("i")));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_hoist_loop_invariants(l, 0) == 1);
+    assert(_body_is(l, "local data \"i\", 4 bytes; local data \"t\", 4 bytes; i = 0; t = a * 3; L:; if i >= a goto E; i = i + t; goto L; E:; return i"));
+    l->ops->free(l);
+
+    // but not when t is read before the store, in the loop or after a loop that may not run at all
+    for (int k = 0; k < 2; k++) {
+        l = _new_test_listing();
+        l->ops->add(l, new_ir_data_declaration(4, NULL, "i", IR_LOCAL));
+        l->ops->add(l, new_ir_data_declaration(4, NULL, "t", IR_LOCAL));
+        l->ops->add(l, new_ir_assignment(new_ir_value_symbol("i"), new_ir_value_immediate(0)));
+        l->ops->add(l, new_ir_assignment(new_ir_value_symbol("t"), new_ir_value_immediate(1)));
+        l->ops->add(l, new_ir_label("L"));
+        l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("i"), IR_GE, new_ir_value_symbol("a"), "E"));
+        if (k == 0)
+            l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("i"), new_ir_value_symbol("i"), IR_ADD, new_ir_value_symbol("t")));
+        l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("t"), new_ir_value_symbol("a"), IR_MUL, new_ir_value_immediate(3)));
+        if (k == 1)
+            l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("i"), new_ir_value_symbol("i"), IR_ADD, new_ir_value_immediate(1)));
+        l->ops->add(l, new_ir_unconditional_jump("L"));
+        l->ops->add(l, new_ir_label("E"));
+        l->ops->add(l, new_ir_return(new_ir_value_symbol(k == 0 ? "i" : "t")));
+        l->ops->add(l, new_ir_function_end());
+        assert(ir_hoist_loop_invariants(l, 0) == 0);
+        l->ops->free(l);
+    }
+
+    // nor for globals, that the callers can see
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_label("L"));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LE, new_ir_value_immediate(0), "E"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("g"), new_ir_value_immediate(5), IR_MUL, new_ir_value_immediate(3)));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("a"), new_ir_value_symbol("a"), IR_SUB, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_unconditional_jump("L"));
+    l->ops->add(l, new_ir_label("E"));
+    l->ops->add(l, new_ir_return(NULL));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_hoist_loop_invariants(l, 0) == 0);
+    l->ops->free(l);
+}
+
+static void _inlining_unit_tests() {
+    // g(x) { r1 = x + 1; return r1 }  f(a) { r2 = g(a); return r2 }
+    ir_listing *l = new_ir_listing();
+    struct ir_entry_func_arg_info *args = malloc(sizeof(struct ir_entry_func_arg_info));
+    args[0].name = "x";
+    args[0].size = 4;
+    l->ops->add(l, new_ir_function_definition("g", args, 1, 4));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(1), new_ir_value_symbol("x"), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_function_end());
+    args = malloc(sizeof(struct ir_entry_func_arg_info));
+    args[0].name = "a";
+    args[0].size = 4;
+    l->ops->add(l, new_ir_function_definition("f", args, 1, 4));
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(2), new_ir_value_symbol("g"), 1, _args_of(new_ir_value_symbol("a"))));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_inline_functions(l) == 1);
+    assert(l->length == 11);
+    struct ir_entry_three_addr_code_info *c = &l->entries_arr[5]->t.three_address_code;
+    assert(c->lvalue->val.temp_reg_no == 3 && strcmp(c->op2->val.symbol_name, "a") == 0);
+    c = &l->entries_arr[6]->t.three_address_code;
+    assert(c->lvalue->val.temp_reg_no == 5 && c->op1->val.temp_reg_no == 3 && c->op == IR_ADD);
+    c = &l->entries_arr[7]->t.three_address_code;
+    assert(c->lvalue->val.temp_reg_no == 2 && c->op2->val.temp_reg_no == 5);
+    assert(strcmp(l->entries_arr[8]->t.label.str, "g_inl1_end") == 0);
+    l->ops->free(l);
+
+    // recursive functions are left alone: f(a) { r1 = f(a); return r1 }
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("f"), 1, _args_of(new_ir_value_symbol("a"))));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_inline_functions(l) == 0);
+    l->ops->free(l);
+
+    // g(x) { int y; y = x * 2; if (y > 9) { x = 9; return x; } return y; }
+    // f(a) { int y; y = g(a); return y; }, the callee locals, labels and written args are renamed
+    l = new_ir_listing();
+    args = malloc(sizeof(struct ir_entry_func_arg_info));
+    args[0].name = "x";
+    args[0].size = 4;
+    l->ops->add(l, new_ir_function_definition("g", args, 1, 4));
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "y", IR_LOCAL));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("y"), new_ir_value_symbol("x"), IR_MUL, new_ir_value_immediate(2)));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("y"), IR_LE, new_ir_value_immediate(9), "small"));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("x"), new_ir_value_immediate(9)));
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("x")));
+    l->ops->add(l, new_ir_label("small"));
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("y")));
+    l->ops->add(l, new_ir_function_end());
+    args = malloc(sizeof(struct ir_entry_func_arg_info));
+    args[0].name = "a";
+    args[0].size = 4;
+    l->ops->add(l, new_ir_function_definition("f", args, 1, 4));
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "y", IR_LOCAL));
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("g"), 1, _args_of(new_ir_value_symbol("a"))));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("y"), new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("y")));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_inline_functions(l) == 1);
+    assert(_body_is(l, "local data \"x_inl1\", 4 bytes; local data \"y_inl1\", 4 bytes; local data \"y\", 4 bytes; "
+        "x_inl1 = a; y_inl1 = x_inl1 * 2; if y_inl1 <= 9 goto small_inl1; x_inl1 = 9; r1 = x_inl1; goto g_inl1_end; "
+        "small_inl1:; r1 = y_inl1; g_inl1_end:; y = r1; return y"));
+    l->ops->free(l);
+}
+
+static void _tail_calls_unit_tests() {
+    // f(a) { if a == 0 goto x; r1 = a - 1; r2 = f(r1); return r2; x: return a }
+    ir_listing *l = _new_test_listing();
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("a"), IR_EQ, new_ir_value_immediate(0), "x"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(1), new_ir_value_symbol("a"), IR_SUB, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(2), new_ir_value_symbol("f"), 1, _args_of(new_ir_value_temp_reg(1))));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_label("x"));
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_eliminate_tail_calls(l, 0) == 1);
+    assert(l->length == 9);
+    assert(strcmp(l->entries_arr[1]->t.label.str, "f_tail_entry") == 0);
+    struct ir_entry_three_addr_code_info *c = &l->entries_arr[4]->t.three_address_code;
+    assert(strcmp(c->lvalue->val.symbol_name, "a") == 0 && c->op2->val.temp_reg_no == 1);
+    assert(strcmp(l->entries_arr[5]->t.unconditional_jump.str, "f_tail_entry") == 0);
+    l->ops->free(l);
+
+    // other functions are jumped to, if their arguments fit: return g(a), return g(a, a)
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("g"), 1, _args_of(new_ir_value_symbol("a"))));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_eliminate_tail_calls(l, 0) == 1);
+    assert(l->length == 3);
+    assert(l->entries_arr[1]->t.function_call.is_tail_call && l->entries_arr[1]->t.function_call.lvalue == NULL);
+    l->ops->free(l);
+
+    l = _new_test_listing();
+    ir_value **args = malloc(sizeof(ir_value *) * 2);
+    args[0] = new_ir_value_symbol("a");
+    args[1] = new_ir_value_symbol("a");
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(1), new_ir_value_symbol("g"), 2, args));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(1)));
+    l->ops->add(l, new_ir_function_end());
+    assert(ir_eliminate_tail_calls(l, 0) == 0);
+    l->ops->free(l);
+
+    // "if (a > 9) return f(a / 2); return g(a);", a loop and a jump instead of two calls
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LE, new_ir_value_immediate(9), "x"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_temp_reg(1), new_ir_value_symbol("a"), IR_DIV, new_ir_value_immediate(2)));
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(2), new_ir_value_symbol("f"), 1, _args_of(new_ir_value_temp_reg(1))));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(2)));
+    l->ops->add(l, new_ir_label("x"));
+    l->ops->add(l, new_ir_function_call(new_ir_value_temp_reg(3), new_ir_value_symbol("g"), 1, _args_of(new_ir_value_symbol("a"))));
+    l->ops->add(l, new_ir_return(new_ir_value_temp_reg(3)));
+    l->ops->add(l, new_ir_function_end());
+    assert(_body_is(l, "if a <= 9 goto x; r1 = a / 2; r2 = call f passing r1; return r2; x:; r3 = call g passing a; return r3"));
+
+    assert(ir_eliminate_tail_calls(l, 0) == 2);
+    assert(_body_is(l, "f_tail_entry:; if a <= 9 goto x; r1 = a / 2; a = r1; goto f_tail_entry; x:; tail call g passing a"));
+    l->ops->free(l);
+}
+
+static void _block_layout_unit_tests() {
+    // if a == 0 goto F; goto G; F: r1 = a; goto M; G: goto M; M: return
+    ir_listing *l = _new_test_listing();
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("a"), IR_EQ, new_ir_value_immediate(0), "F"));
+    l->ops->add(l, new_ir_unconditional_jump("G"));
+    l->ops->add(l, new_ir_label("F"));
+    l->ops->add(l, new_ir_assignment(new_ir_value_temp_reg(1), new_ir_value_symbol("a")));
+    l->ops->add(l, new_ir_unconditional_jump("M"));
+    l->ops->add(l, new_ir_label("G"));
+    l->ops->add(l, new_ir_unconditional_jump("M"));
+    l->ops->add(l, new_ir_label("M"));
+    l->ops->add(l, new_ir_return(NULL));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_optimize_jumps(l, 0) > 0);
+    assert(l->length == 6);
+    assert(l->entries_arr[1]->t.conditional_jump.cmp == IR_NE);
+    assert(strcmp(l->entries_arr[1]->t.conditional_jump.target_label, "M") == 0);
+    assert(l->entries_arr[2]->type == IR_THREE_ADDR_CODE);
+    assert(l->entries_arr[3]->type == IR_LABEL);
+    l->ops->free(l);
+
+    // loops get their test at the bottom: L: if a <= 0 goto E; a = a - 1; goto L; E: return
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_label("L"));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("a"), IR_LE, new_ir_value_immediate(0), "E"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("a"), new_ir_value_symbol("a"), IR_SUB, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_unconditional_jump("L"));
+    l->ops->add(l, new_ir_label("E"));
+    l->ops->add(l, new_ir_return(NULL));
+    l->ops->add(l, new_ir_function_end());
+
+    assert(ir_optimize_jumps(l, 0) == 2); // rotated, then "L" is no longer used
+    assert(l->length == 8);
+    assert(l->entries_arr[1]->type == IR_CONDITIONAL_JUMP);
+    assert(strcmp(l->entries_arr[2]->t.label.str, "L_body") == 0);
+    struct ir_entry_cond_jump_info *j = &l->entries_arr[4]->t.conditional_jump;
+    assert(j->cmp == IR_GT && strcmp(j->target_label, "L_body") == 0);
+    assert(strcmp(l->entries_arr[5]->t.label.str, "E") == 0);
+    l->ops->free(l);
+
+    // "while (i < a) { if (i == 3) break; i = i + 1; } return i;", as codegen emits it
+    l = _new_test_listing();
+    l->ops->add(l, new_ir_data_declaration(4, NULL, "i", IR_LOCAL));
+    l->ops->add(l, new_ir_assignment(new_ir_value_symbol("i"), new_ir_value_immediate(0)));
+    l->ops->add(l, new_ir_label("W"));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("i"), IR_GE, new_ir_value_symbol("a"), "E"));
+    l->ops->add(l, new_ir_conditional_jump(new_ir_value_symbol("i"), IR_NE, new_ir_value_immediate(3), "C"));
+    l->ops->add(l, new_ir_unconditional_jump("E"));
+    l->ops->add(l, new_ir_label("C"));
+    l->ops->add(l, new_ir_three_address_code(new_ir_value_symbol("i"), new_ir_value_symbol("i"), IR_ADD, new_ir_value_immediate(1)));
+    l->ops->add(l, new_ir_unconditional_jump("W"));
+    l->ops->add(l, new_ir_label("E"));
+    l->ops->add(l, new_ir_return(new_ir_value_symbol("i")));
+    l->ops->add(l, new_ir_function_end());
+    assert(_body_is(l, "local data \"i\", 4 bytes; i = 0; W:; if i >= a goto E; if i != 3 goto C; goto E; C:; i = i + 1; goto W; E:; return i"));
+
+    assert(ir_optimize_jumps(l, 0) > 0);
+    assert(_body_is(l, "local data \"i\", 4 bytes; i = 0; if i >= a goto E; W_body:; if i == 3 goto E; i = i + 1; if i < a goto W_body; E:; return i"));
+    l->ops->free(l);
+}
+
+void optimizer_unit_tests() {
+    _copy_propagation_unit_tests();
+    _value_numbering_unit_tests();
+    _loop_optimizations_unit_tests();
+    _inlining_unit_tests();
+    _tail_calls_unit_tests();
+    _block_layout_unit_tests();
+}
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdbool.h>
+#include "../codegen/ir_listing.h"
+#include "flow_graph.h"
+
+
+// optimizer.c
+void optimize_ir_listing(ir_listing *listing, int level);
+void optimizer_unit_tests();
+
+// copy_propagation.c
+int ir_propagate_copies(ir_listing *l, int func_start);
+int ir_coalesce_temp_regs(ir_listing *l, int func_start);
+int ir_renumber_temp_regs(ir_listing *l);
+
+// value_numbering.c
+int ir_eliminate_common_subexpressions(ir_listing *l, int func_start);
+
+// loop_optimizations.c
+int ir_hoist_loop_invariants(ir_listing *l, int func_start);
+int ir_reduce_induction_variables(ir_listing *l, int func_start);
+
+// inlining.c
+int ir_inline_functions(ir_listing *l);
+
+// tail_calls.c
+int ir_eliminate_tail_calls(ir_listing *l, int func_start);
+
+// block_layout.c
+int ir_optimize_jumps(ir_listing *l, int func_start);
@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "optimizer.h"
+
+
+/*
+    Tail calls, i.e. "return f(...)".
+    A function calling itself this way stores the new argument values
+    and jumps back to its beginning, turning the recursion into a loop.
+    Other tail calls are marked, so the converter can pass the arguments
+    in our own argument area, tear down our frame and jump to the callee,
+    which then returns directly to our caller.
+    Neither is possible if something may point into our frame.
+*/
+
+static bool _takes_local_addresses(ir_listing *l, int start, int end) {
+    for (int i = start + 1; i < end; i++) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type == IR_THREE_ADDR_CODE && e->t.three_address_code.op == IR_ADDR_OF &&
+            e->t.three_address_code.op2->type == IR_SYM)
+            return true; // globals too, we don't bother telling them apart
+    }
+    return false;
+}
+
+// the return following the call at index, if it returns what the call returned
+static int _find_tail_return(ir_listing *l, int index, int end) {
+    ir_value *lv = l->entries_arr[index]->t.function_call.lvalue;
+    int next = index + 1;
+    while (next < end && l->entries_arr[next]->type == IR_COMMENT)
+        next++;
+    if (next >= end || l->entries_arr[next]->type != IR_RETURN)
+        return -1;
+
+    ir_value *ret_val = l->entries_arr[next]->t.return_stmt.ret_val;
+    if (ret_val == NULL)
+        return next;
+    if (lv != NULL && lv->type == IR_TREG && ret_val->type == IR_TREG &&
+        lv->val.temp_reg_no == ret_val->val.temp_reg_no)
+        return next;
+    return -1;
+}
+
+static int _arg_index(struct ir_entry_func_def_info *f, ir_value *v) {
+    if (v->type != IR_SYM)
+        return -1;
+    for (int i = 0; i < f->args_len; i++) {
+        if (strcmp(f->args_arr[i].name, v->val.symbol_name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// replaces the call at index with argument stores and a jump to the function start
+static void _make_loop(ir_listing *l, int start, int index, int *next_reg_no) {
+    struct ir_entry_func_def_info *f = &l->entries_arr[start]->t.function_def;
+    ir_entry *call = l->entries_arr[index];
+    int args_len = call->t.function_call.args_len;
+    ir_value **args = call->t.function_call.args_arr;
+    mempool *mp = new_mempool();
+
+    // arguments passed in other argument positions, must be read before we store any
+    list *entries = new_list(mp);
+    for (int i = 0; i < args_len; i++) {
+        int k = _arg_index(f, args[i]);
+        if (k == -1 || k == i)
+            continue;
+        ir_value *reg = new_ir_value_temp_reg((*next_reg_no)++);
+        list_add(entries, new_ir_assignment(reg, args[i]));
+        args[i] = clone_ir_value(reg);
+    }
+    for (int i = 0; i < args_len; i++) {
+        if (_arg_index(f, args[i]) == i)
+            continue;
+        list_add(entries, new_ir_assignment(new_ir_value_symbol(f->args_arr[i].name), clone_ir_value(args[i])));
+    }
+    list_add(entries, new_ir_unconditional_jump("%s_tail_entry", f->func_name));
+
+    l->ops->remove(l, index);
+    for_list(entries, ir_entry, e)
+        l->ops->insert(l, index++, e);
+    mempool_release(mp);
+}
+
+int ir_eliminate_tail_calls(ir_listing *l, int func_start) {
+    struct ir_entry_func_def_info *f = &l->entries_arr[func_start]->t.function_def;
+    int end = ir_function_end(l, func_start);
+    if (_takes_local_addresses(l, func_start, end))
+        return 0;
+
+    int count = 0;
+    bool needs_label = false;
+    int next_reg_no = ir_next_temp_reg_no(l);
+    for (int i = end - 1; i > func_start; i--) {
+        ir_entry *e = l->entries_arr[i];
+        if (e->type != IR_FUNCTION_CALL || e->t.function_call.func_addr->type != IR_SYM)
+            continue;
+        int ret_index = _find_tail_return(l, i, end);
+        if (ret_index == -1)
+            continue;
+
+        struct ir_entry_function_call_info *c = &e->t.function_call;
+        bool is_self = strcmp(c->func_addr->val.symbol_name, f->func_name) == 0;
+        if (is_self && c->args_len == f->args_len) {
+            l->ops->remove(l, ret_index);
+            _make_loop(l, func_start, i, &next_reg_no);
+            needs_label = true;
+            count++;
+        } else if (c->args_len <= f->args_len) {
+            // the callee's arguments fit where ours are
+            l->ops->remove(l, ret_index);
+            if (c->lvalue != NULL)
+                free_ir_value(c->lvalue);
+            c->lvalue = NULL;
+            c->is_tail_call = true;
+            count++;
+        }
+    }
+
+    if (needs_label)
+        l->ops->insert(l, func_start + 1, new_ir_label("%s_tail_entry", f->func_name));
+    return count;
+}
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "optimizer.h"
+
+
+/*
+    Value numbering, to remove redundant computations.
+    Temp regs are (almost always) assigned once, so the temp reg holding
+    a result can stand for its value number. We keep a table of available
+    expressions, walking the dominator tree, so an expression computed in
+    a block is reused in every block it dominates. Expressions reading
+    variables (or through pointers) are killed on stores and calls.
+*/
+
+struct operand_key {
+    bool present;
+    enum ir_value_type type;
+    int num;          // temp reg number or immediate value
+    const char *sym;  // symbol name
+};
+
+struct available_expr {
+    ir_operation op;  // IR_NONE stands for loading a variable
+    struct operand_key k1;
+    struct operand_key k2;
+    int result_reg_no;
+    bool reads_memory;
+    bool reads_pointer; // killed by any store
+    bool killed;
+};
+
+struct vn_data {
+    ir_listing *listing;
+    flow_graph *g;
+    int *defs;              // per temp reg, how many times assigned
+    int *rename_arr;        // per temp reg, the reg to use instead, or 0
+    bool *remove_arr;       // per listing entry, relative to g->start
+    struct available_expr *table;
+    int table_len;
+    int *kill_log;          // indexes of table entries killed, to undo them
+    int kill_log_len;
+    int eliminated;
+};
+
+static bool _make_key(struct vn_data *d, ir_value *v, struct operand_key *k) {
+    memset(k, 0, sizeof(struct operand_key));
+    if (v == NULL)
+        return true;
+    k->present = true;
+    k->type = v->type;
+    if (v->type == IR_TREG) {
+        // only single assignment regs hold a value number
+        k->num = v->val.temp_reg_no;
+        return d->defs[v->val.temp_reg_no - d->g->min_reg_no] == 1;
+    } else if (v->type == IR_IMM) {
+        k->num = v->val.immediate;
+    } else {
+        k->sym = v->val.symbol_name;
+    }
+    return true;
+}
+
+static bool _same_key(struct operand_key *a, struct operand_key *b) {
+    if (a->present != b->present)
+        return false;
+    if (!a->present)
+        return true;
+    if (a->type != b->type)
+        return false;
+    if (a->type == IR_SYM)
+        return strcmp(a->sym, b->sym) == 0;
+    return a->num == b->num;
+}
+
+static bool _is_commutative(ir_operation op) {
+    return op == IR_ADD || op == IR_MUL || op == IR_AND || op == IR_OR || op == IR_XOR;
+}
+
+static void _kill(struct vn_data *d, int index) {
+    if (d->table[index].killed)
+        return;
+    d->table[index].killed = true;
+    d->kill_log[d->kill_log_len++] = index;
+}
+
+static bool _key_reads(struct operand_key *k, const char *sym) {
+    return k->present && k->type == IR_SYM && (sym == NULL || strcmp(k->sym, sym) == 0);
+}
+
+// a store to sym, or to anything if sym is NULL (e.g. a function call)
+static void _kill_memory_reads(struct vn_data *d, const char *sym) {
+    for (int i = 0; i < d->table_len; i++) {
+        struct available_expr *x = &d->table[i];
+        if (!x->reads_memory)
+            continue;
+        if (sym == NULL || x->reads_pointer || _key_reads(&x->k1, sym) || _key_reads(&x->k2, sym))
+            _kill(d, i);
+    }
+}
+
+static void _rename_slot(ir_entry *e, ir_value **slot, void *pdata) {
+    struct vn_data *d = (struct vn_data *)pdata;
+    if ((*slot)->type != IR_TREG)
+        return;
+    int n = (*slot)->val.temp_reg_no - d->g->min_reg_no;
+    if (d->rename_arr[n] != 0)
+        (*slot)->val.temp_reg_no = d->rename_arr[n];
+}
+
+static void _number_entry(struct vn_data *d, int index) {
+    ir_entry *e = d->listing->entries_arr[index];
+    ir_entry_foreach_rvalue_slot(e, _rename_slot, d);
+
+    if (e->type == IR_FUNCTION_CALL) {
+        _kill_memory_reads(d, NULL);
+        return;
+    }
+    if (e->type != IR_THREE_ADDR_CODE)
+        return;
+
+    struct ir_entry_three_addr_code_info *c = &e->t.three_address_code;
+    if (c->lvalue == NULL)
+        return; // expression statements, e.g. "i++;", store nothing
+    if (c->lvalue->type == IR_SYM) {
+        _kill_memory_reads(d, c->lvalue->val.symbol_name);
+        return;
+    }
+    if (c->lvalue->type != IR_TREG || d->defs[c->lvalue->val.temp_reg_no - d->g->min_reg_no] != 1)
+        return;
+    if (c->op == IR_NONE && (c->op1 != NULL || c->op2->type != IR_SYM))
+        return; // plain copies are for copy propagation
+
+    struct available_expr x;
+    memset(&x, 0, sizeof(x));
+    x.op = c->op;
+    x.result_reg_no = c->lvalue->val.temp_reg_no;
+    if (!_make_key(d, c->op1, &x.k1) || !_make_key(d, c->op2, &x.k2))
+        return;
+    if (_is_commutative(x.op) && x.k1.present) {
+        // canonical order, so "a + b" and "b + a" match
+        bool swap = (x.k1.type > x.k2.type) ||
+            (x.k1.type == x.k2.type && x.k1.type != IR_SYM && x.k1.num > x.k2.num) ||
+            (x.k1.type == x.k2.type && x.k1.type == IR_SYM && strcmp(x.k1.sym, x.k2.sym) > 0);
+        if (swap) {
+            struct operand_key tmp = x.k1;
+            x.k1 = x.k2;
+            x.k2 = tmp;
+        }
+    }
+    x.reads_pointer = (x.op == IR_VALUE_AT);
+    x.reads_memory = x.reads_pointer || (x.op != IR_ADDR_OF &&
+        ((x.k1.present && x.k1.type == IR_SYM) || (x.k2.present && x.k2.type == IR_SYM)));
+
+    for (int i = d->table_len - 1; i >= 0; i--) {
+        struct available_expr *y = &d->table[i];
+        if (y->killed || y->op != x.op || !_same_key(&y->k1, &x.k1) || !_same_key(&y->k2, &x.k2))
+            continue;
+
+        // found it, later uses will take the existing register
+        d->rename_arr[x.result_reg_no - d->g->min_reg_no] = y->result_reg_no;
+        d->remove_arr[index - d->g->start] = true;
+        d->eliminated++;
+        return;
+    }
+
+    d->table[d->table_len++] = x;
+}
+
+static void _number_block(struct vn_data *d, int block_no) {
+    basic_block *b = &d->g->blocks_arr[block_no];
+    int table_mark = d->table_len;
+    int kill_mark = d->kill_log_len;
+
+    // memory values only flow in from the dominator, if it's the only way in
+    if (!(b->preds_count == 1 && b->preds_arr[0] == b->idom))
+        _kill_memory_reads(d, NULL);
+
+    for (int i = b->first; i <= b->last; i++)
+        _number_entry(d, i);
+
+    // children in the dominator tree
+    for (int r = 0; r < d->g->rpo_count; r++) {
+        int child = d->g->rpo_arr[r];
+        if (d->g->blocks_arr[child].idom == block_no)
+            _number_block(d, child);
+    }
+
+    // leave the table as our dominator had it
+    while (d->kill_log_len > kill_mark)
+        d->table[d->kill_log[--d->kill_log_len]].killed = false;
+    d->table_len = table_mark;
+}
+
+int ir_eliminate_common_subexpressions(ir_listing *l, int func_start) {
+    mempool *mp = new_mempool();
+    flow_graph *g = new_flow_graph(mp, l, func_start);
+    if (g->regs_count == 0 || g->blocks_count == 0) {
+        mempool_release(mp);
+        return 0;
+    }
+    g->ops->compute_dominators(g);
+
+    int entries = g->end - g->start;
+    struct vn_data d;
+    memset(&d, 0, sizeof(d));
+    d.listing = l;
+    d.g = g;
+    d.defs = mpallocn(mp, sizeof(int) * g->regs_count, defs);
+    d.rename_arr = mpallocn(mp, sizeof(int) * g->regs_count, rename_arr);
+    d.remove_arr = mpallocn(mp, sizeof(bool) * entries, remove_arr);
+    d.table = mpallocn(mp, sizeof(struct available_expr) * entries, table);
+    d.kill_log = mpallocn(mp, sizeof(int) * entries * 2, kill_log);
+    memset(d.defs, 0, sizeof(int) * g->regs_count);
+    memset(d.rename_arr, 0, sizeof(int) * g->regs_count);
+    memset(d.remove_arr, 0, sizeof(bool) * entries);
+
+    for (int i = g->start; i < g->end; i++) {
+        ir_value *lv = ir_entry_lvalue(l->entries_arr[i]);
+        if (lv != NULL && lv->type == IR_TREG)
+            d.defs[lv->val.temp_reg_no - g->min_reg_no]++;
+    }
+
+    _number_block(&d, g->rpo_arr[0]);
+
+    if (d.eliminated > 0) {
+        // catch uses in blocks we did not visit, then drop the redundant entries
+        for (int i = g->start; i < g->end; i++)
+            ir_entry_foreach_rvalue_slot(l->entries_arr[i], _rename_slot, &d);
+        for (int i = g->end - 1; i > g->start; i--) {
+            if (d.remove_arr[i - g->start])
+                l->ops->remove(l, i);
+        }
+    }
+
+    mempool_release(mp);
+    return d.eliminated;
+}
@@ -5,6 +5,8 @@
 #include "../ast/all.h"
 #include "../../err_handler.h"
 #include "../lexer/lexer.h"
+#include "../analysis/analysis.h"
+#include "../codegen/codegen.h"
 
 
 
@@ -95,6 +97,39 @@ void parser_unit_tests() {
     assert(st->expr->arg2->op == OP_SYMBOL_NAME);
     assert(strcmp(st->expr->arg2->value.str, "b") == 0);
     
+    code = new_str(mp, "int f(int a, int b) { while (!(a > 1) && b != 0) a = a + 1; return a; }");
+    tokens = lexer_parse_source_code_into_tokens(mp, filename, code);
+    ast = parse_file_tokens_into_ast(mp, tokens);
+    fd = list_get(ast->functions, 0);
+    st = fd->stmts_list;
+    assert(st->stmt_type == ST_WHILE);
+    assert(st->expr->op == OP_LOGICAL_AND);
+    assert(st->expr->arg1->op == OP_LOGICAL_NOT);
+    assert(st->expr->arg1->arg1->op == OP_GT);
+    assert(st->expr->arg2->op == OP_NE);
+
+    // conditions become jumps, no 0/1 values: the "if" skips its body when the condition
+    // is false, so comparisons are inverted, "||" and "&&" short circuit to cond_N_skip labels
+    code = new_str(mp, "int f(int a, int b) { if ((a > 1 && b < 2) || !(a == b)) return 1; return 0; }");
+    tokens = lexer_parse_source_code_into_tokens(mp, filename, code);
+    ast = parse_file_tokens_into_ast(mp, tokens);
+    perform_module_analysis(ast);
+    assert(errors_count == 0);
+    // not freed afterwards, as in the compile path, codegen shares values between entries
+    ir_listing *ir = new_ir_listing();
+    code_gen *cg = new_code_generator(ir);
+    cg->ops->generate_for_module(cg, ast);
+    str *ir_text = new_str(mp, NULL);
+    for (int i = 0; i < ir->length; i++) {
+        if (ir->entries_arr[i]->type == IR_CONDITIONAL_JUMP || ir->entries_arr[i]->type == IR_UNCONDITIONAL_JUMP ||
+            ir->entries_arr[i]->type == IR_LABEL) {
+            str_cat(ir_text, ir->entries_arr[i]->ops->to_string(mp, ir->entries_arr[i]));
+            str_cats(ir_text, "; ");
+        }
+    }
+    assert(str_cmps(ir_text, "if a <= 1 goto cond_3_skip; if b < 2 goto cond_2_skip; cond_3_skip:; "
+                             "if a == b goto if_1_end; cond_2_skip:; if_1_end:; ") == 0);
+
     // ideally we should test loop, break, continue, conditions etc
     // also, should test operator hierarchy, i.e. "result = x + y * z;"
     // finally, test calling a function from pointer of an array in a struct member
@@ -66,6 +66,7 @@ static elf64_section *elf64_contents_create_section(elf64_contents *contents, st
     s->header->type = type;
     s->contents = new_bin(contents->mempool);
     s->ops = &elf64_section_ops;
+    s->mempool = contents->mempool;
 
     return s;
 }
@@ -183,6 +184,29 @@ static void elf64_section_add_relocation(elf64_section *s, size_t offset, size_t
     bin_add_mem(s->contents, &rela, sizeof(elf64_rela));
 }
 
+// a module has a string and a symbol per label, searching the contents
+// for every one of them would be quadratic, so they are hashed
+static void index_strings(elf64_section *s) {
+    if (s->strings_index == NULL)
+        s->strings_index = new_hashtable(s->mempool, 64);
+
+    size_t length = bin_len(s->contents);
+    while (s->indexed_length < length) {
+        char *string = bin_ptr_at(s->contents, s->indexed_length);
+        size_t string_len = strnlen(string, length - s->indexed_length);
+        if (string_len > 0) {
+            str *key = new_str(s->mempool, NULL);
+            str_catsn(key, string, string_len);
+            if (!hashtable_contains(s->strings_index, key)) {
+                int *offset = mpalloc(s->mempool, int);
+                *offset = s->indexed_length;
+                hashtable_set(s->strings_index, key, offset);
+            }
+        }
+        s->indexed_length += string_len + 1;
+    }
+}
+
 static size_t elf64_section_add_strz_get_offset(elf64_section *s, str *string) {
     // first byte is always zero to allow empty strings
     if (bin_len(s->contents) == 0)
@@ -192,30 +216,38 @@ static size_t elf64_section_add_strz_get_offset(elf64_section *s, str *string) {
         return 0;
     
     // in case the name already exists, reuse it
-    int index = bin_index_of(s->contents, str_charptr(string), str_len(string) + 1);
-    if (index >= 0)
-        return index;
+    index_strings(s);
+    int *offset = hashtable_get(s->strings_index, string);
+    if (offset != NULL)
+        return *offset;
 
     // otherwise add it, saving address first
-    index = bin_len(s->contents);
+    int index = bin_len(s->contents);
     bin_add_str(s->contents, string);
 
     return index;
 }
 
-static int elf64_section_find_named_symbol(elf64_section *s, str *name, elf64_section *strtab) {
-    // we could speed things up with a hashtable
-    elf64_sym *sym_ptr;
-    char *name_ptr;
+static void index_symbols(elf64_section *s, elf64_section *strtab) {
+    if (s->symbols_index == NULL)
+        s->symbols_index = new_hashtable(s->mempool, 64);
 
     int total_syms = bin_len(s->contents) / sizeof(elf64_sym);
-    for (int i = 0; i < total_syms; i++) {
-        sym_ptr = bin_ptr_at(s->contents, i * sizeof(elf64_sym));
-        char *name_ptr = bin_ptr_at(strtab->contents, sym_ptr->st_name);
-        if (str_cmps(name, name_ptr) == 0)
-            return i;
+    for (; s->indexed_symbols < total_syms; s->indexed_symbols++) {
+        elf64_sym *sym_ptr = bin_ptr_at(s->contents, s->indexed_symbols * sizeof(elf64_sym));
+        str *name = new_str(s->mempool, bin_ptr_at(strtab->contents, sym_ptr->st_name));
+        if (hashtable_contains(s->symbols_index, name))
+            continue;
+        int *symbol_no = mpalloc(s->mempool, int);
+        *symbol_no = s->indexed_symbols;
+        hashtable_set(s->symbols_index, name, symbol_no);
     }
-    return -1;
+}
+
+static int elf64_section_find_named_symbol(elf64_section *s, str *name, elf64_section *strtab) {
+    index_symbols(s, strtab);
+    int *symbol_no = hashtable_get(s->symbols_index, name);
+    return symbol_no == NULL ? -1 : *symbol_no;
 }
 
 static void elf64_section_add_named_symbol(elf64_section *s, str *name, size_t value, size_t size, int type, int binding, int section_index, elf64_section *strtab) {
@@ -554,7 +586,7 @@ elf64_contents *new_elf64_contents_from_binary(mempool *mp, bin *buffer) {
         return false;
     if (contents->header->identity[ELF_IDENTITY_CLASS] != ELF_CLASS_64)
         return false;
-    if (contents->header->file_type != ELF_TYPE_REL)
+    if (contents->header->file_type != ELF_TYPE_REL && contents->header->file_type != ELF_TYPE_EXEC)
         return false;
 
     // let's load all the sections, headers and bodies (we don't load programs)
@@ -34,6 +34,12 @@ struct elf64_section {
     elf64_section_header *header;
     bin *contents;
 
+    // name lookups, they catch up with the contents on every use
+    hashtable *strings_index;  // strtab: offset of each string, item is int
+    size_t indexed_length;     // strtab: contents up to here are indexed
+    hashtable *symbols_index;  // symtab: number of the first symbol of each name, item is int
+    int indexed_symbols;       // symtab: symbols up to here are indexed
+
     struct elf64_section_ops {
         void (*add_symbol)(elf64_section *s, size_t name_offset, size_t value, size_t size, int type, int binding, int section_index);
         void (*add_relocation)(elf64_section *s, size_t offset, size_t symbol_no, size_t type, long addendum);
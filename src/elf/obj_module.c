@@ -85,6 +85,8 @@ static elf64_contents *obj_module_prepare_elf_contents(obj_module *module, int e
             (obj_sect->flags.executable ? SECTION_FLAGS_EXECINSTR : 0);
         elf_sect->header->virt_address = obj_sect->address; // needed for program_headers
         elf_sect->header->address_alignment = obj_sect->flags.executable ? 1 : 4;
+        if (obj_sect->alignment > elf_sect->header->address_alignment)
+            elf_sect->header->address_alignment = obj_sect->alignment;
         bin_cpy(elf_sect->contents, obj_sect->contents);
         pi->elf->ops->add_section(pi->elf, elf_sect);
 
@@ -268,6 +270,9 @@ obj_section *create_obj_section_from_elf_section(elf64_section *elf_sect, mempoo
     obj_sect->flags.allocate     = (elf_sect->header->flags & SECTION_FLAGS_ALLOC) != 0;
     obj_sect->flags.executable   = (elf_sect->header->flags & SECTION_FLAGS_EXECINSTR) != 0;
     obj_sect->flags.init_to_zero = (elf_sect->header->type == SECTION_TYPE_NOBITS);
+    obj_sect->address = elf_sect->header->virt_address; // zero in object files
+    if (elf_sect->header->address_alignment > 1)
+        obj_sect->alignment = elf_sect->header->address_alignment;
     bin_cpy(obj_sect->contents, elf_sect->contents);
 
     return obj_sect;
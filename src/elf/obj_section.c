@@ -1,6 +1,7 @@
 #include <string.h>
 #include "elf_format.h"
 #include "obj_section.h"
+#include "../utils.h"
 
 
 
@@ -39,6 +40,7 @@ obj_section *new_obj_section(mempool *mp) {
     s->contents = new_bin(mp);
     s->relocations = new_list(mp);
     s->symbols = new_list(mp);
+    s->alignment = 1;
     s->mempool = mp;
     s->ops = &section_ops;
     return s;
@@ -105,6 +107,12 @@ static void obj_section_print(obj_section *s, bool show_details, FILE *f) {
 
 static void obj_section_append(obj_section *s, obj_section *other, size_t rounding_value) {
     // any relocations or adjustments are considered already done.
+    // pad the same way the addresses were distributed, code is padded with NOPs
+    size_t alignment = other->alignment > rounding_value ? other->alignment : rounding_value;
+    if (alignment > 1)
+        bin_pad(s->contents, s->flags.executable ? 0x90 : 0, round_up(bin_len(s->contents), alignment));
+    if (alignment > s->alignment)
+        s->alignment = alignment;
     bin_cat(s->contents, other->contents);
     list_add_all(s->symbols, other->symbols);
     list_add_all(s->relocations, other->relocations);
@@ -116,18 +124,29 @@ static void obj_section_change_address(obj_section *s, long delta) {
         sym->value += delta;
 }
 
+static void obj_section_index_symbol(obj_section *s, obj_symbol *sym) {
+    if (!hashtable_contains(s->symbols_by_name, sym->name))
+        hashtable_set(s->symbols_by_name, sym->name, sym);
+    if (sym->global && !hashtable_contains(s->exported_by_name, sym->name))
+        hashtable_set(s->exported_by_name, sym->name, sym);
+    s->indexed_symbols++;
+}
+
+// add_symbol() keeps the index current, anything else is caught up here
+static void obj_section_index_symbols(obj_section *s) {
+    if (s->symbols_by_name != NULL && s->indexed_symbols == list_length(s->symbols))
+        return;
+    s->symbols_by_name = new_hashtable(s->mempool, 64);
+    s->exported_by_name = new_hashtable(s->mempool, 64);
+    s->indexed_symbols = 0;
+    for_list(s->symbols, obj_symbol, sym)
+        obj_section_index_symbol(s, sym);
+}
+
 static obj_symbol *obj_section_find_symbol(obj_section *s, str *name, bool exported) {
-    for_list (s->symbols, obj_symbol, sym) {
-        if (str_cmp(sym->name, name) != 0)
-            continue;
-        
-        // do we need it to be exported?
-        if (exported && !sym->global)
-            continue;
-        
-        return sym;
-    }
-    return NULL;
+    // the first one with that name, the first exported one if we need it exported
+    obj_section_index_symbols(s);
+    return hashtable_get(exported ? s->exported_by_name : s->symbols_by_name, name);
 }
 
 static obj_symbol *obj_section_add_symbol(obj_section *s, str *name, size_t value, size_t size, bool global) {
@@ -139,6 +158,8 @@ static obj_symbol *obj_section_add_symbol(obj_section *s, str *name, size_t valu
     sym->global = global;
     sym->ops = &symbol_ops;
     list_add(s->symbols, sym);
+    if (s->symbols_by_name != NULL && s->indexed_symbols == list_length(s->symbols) - 1)
+        obj_section_index_symbol(s, sym);
 
     return sym;
 }
@@ -13,9 +13,16 @@ struct obj_section {
     str *name;           // e.g. ".text"
     bin *contents;       // binary contents
     size_t address;      // e.g. 0x800000
+    size_t alignment;    // the address must be a multiple of this, e.g. 16 for aligned code
     list *symbols;      // item type is <obj_symbol>
     list *relocations;  // item type is <obj_relocation>
 
+    // for find_symbol(), the first symbol per name. symbols may also
+    // get added to the list directly, so it is checked against its length
+    hashtable *symbols_by_name;
+    hashtable *exported_by_name;
+    int indexed_symbols;
+
     struct {
         unsigned int allocate: 1;
         unsigned int executable: 1;
@@ -6,9 +6,13 @@
 int warnings_count = 0;
 int errors_count = 0;
 
+// the assembler reports from several threads, counts and messages must not get mixed up
+#define count_one(counter)   __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+
 static void print_stderr(const char *filename, int line_no, char *severity, char *msg, va_list args) {
-    errors_count++;
+    count_one(errors_count);
     
+    flockfile(stderr);
     if (filename != NULL) {
         fprintf(stderr, "%s:", filename);
         if (line_no > 0)
@@ -19,10 +23,11 @@ static void print_stderr(const char *filename, int line_no, char *severity, char
     fprintf(stderr, "%s: ", severity);
     vfprintf(stderr, msg, args);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
 }
 
 void warn_at(const char *filename, int line_no, char *msg, ...) {
-    warnings_count++;
+    count_one(warnings_count);
 
     va_list args;
     va_start(args, msg);
@@ -31,7 +36,7 @@ void warn_at(const char *filename, int line_no, char *msg, ...) {
 }
 
 void error_at(const char *filename, int line_no, char *msg, ...) {
-    errors_count++;
+    count_one(errors_count);
 
     va_list args;
     va_start(args, msg);
@@ -40,7 +45,7 @@ void error_at(const char *filename, int line_no, char *msg, ...) {
 }
 
 void error(char *msg, ...) {
-    errors_count++;
+    count_one(errors_count);
 
     va_list args;
     va_start(args, msg);
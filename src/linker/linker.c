@@ -11,7 +11,7 @@
 #include "../elf/obj_module.h"
 #include "../elf/ar.h"
 
-#define SECTION_ROUNDING_VALUE     1  // e.g. between data of different modules
+#define SECTION_ROUNDING_VALUE     1  // e.g. between data of different modules, sections may ask for more
 #define GROUP_ROUNDING_VALUE    4096  // e.g. between .text and .data 
 
 #define R_X86_64_PC32   2
@@ -338,10 +338,12 @@ static void prepare_grouping_map(link2_info *info) {
 void distribute_address_to_group(link2_info *info, str *group_key, size_t *address, size_t section_rounding, size_t group_rounding) {
     list *group_sections = hashtable_get(info->sections_per_group, group_key);
     for_list(group_sections, obj_section, section) {
+        // merge_grouped_sections() pads the contents the same way
+        size_t rounding = section->alignment > section_rounding ? section->alignment : section_rounding;
+        if (rounding > 1)
+            (*address) = round_up(*address, rounding);
         section->ops->change_address(section, (long)(*address));
         (*address) += bin_len(section->contents);
-        if (section_rounding > 1)
-            (*address) = round_up(*address, section_rounding);
     }
 
     if (group_rounding > 1)
@@ -19,9 +19,13 @@
 #include "compiler/analysis/analysis.h"
 #include "compiler/codegen/codegen.h"
 #include "compiler/codegen/ir_listing.h"
+#include "compiler/optimizer/optimizer.h"
 #include "assembler/ir_to_asm_converter.h"
 #include "assembler/assembler.h"
 #include "assembler/asm_listing.h"
+#include "assembler/asm_peephole.h"
+#include "assembler/parse_asm.h"
+#include "assembler/disassembler.h"
 #include "assembler/encoder/encoder.h"
 #include "elf/elf64_contents.h"
 #include "linker/linker.h"
@@ -41,8 +45,14 @@ static bool run_unit_tests() {
     parser_unit_tests();
 
     // code generation unit tests
+    codegen_unit_tests();
+    optimizer_unit_tests();
 
+    ir_to_asm_converter_unit_tests();
     assembler_unit_tests();
+    asm_peephole_unit_tests();
+    parse_asm_unit_tests();
+    disassembler_unit_tests();
     linker_unit_tests();
 
     elf_unit_tests();
@@ -99,7 +109,13 @@ static void generate_intermediate_code(ast_module *ast, ir_listing *listing) {
         listing->ops->print(listing, stdout);
     }
 
-    // we could run IR optimizations here
+    optimize_ir_listing(listing, run_info->options->optimization_level);
+    if (errors_count) return;
+
+    if (run_info->options->verbose && run_info->options->optimization_level > 0) {
+        printf("--------- Optimized Intermediate Representation ---------\n");
+        listing->ops->print(listing, stdout);
+    }
 
     // save result, if required
     if (run_info->options->generate_ir) {
@@ -146,10 +162,20 @@ static void process_one_file(mempool *mp, file_run_info *fi) {
     // then a linker that,     given the machine code generates the executable (executable file)
 
     asm_listing *asm_list = new_asm_listing(mp);
+    // the comments are only for people reading the listing, skip them otherwise
+    asm_list->with_comments = run_info->options->generate_asm || run_info->options->verbose;
     convert_ir_listing_to_asm_listing(mp, ir_listing, asm_list);
     if (errors_count)
         return;
 
+    if (run_info->options->optimization_level > 0 && !run_info->options->no_peephole) {
+        int rewrites = asm_peephole_optimize(asm_list);
+        if (run_info->options->verbose) {
+            printf("--------- Peephole optimizations (%d) ---------\n", rewrites);
+            asm_peephole_print_hits(stdout);
+        }
+    }
+
     if (run_info->options->verbose) {
         printf("--------- Generated Assembly Code ---------\n");
         asm_list->ops->print(asm_list, stdout);
@@ -170,7 +196,7 @@ static void process_one_file(mempool *mp, file_run_info *fi) {
     // ---- old, i386 code ----
     
     char *mod_name = set_extension(str_charptr(fi->source_filename), "o");
-    obj_code *cod = new_obj_code();
+    obj_code *cod = new_obj_code(mp);
     cod->vt->set_name(cod, mod_name);
     free(mod_name);
 
@@ -208,6 +234,50 @@ static void process_one_file(mempool *mp, file_run_info *fi) {
     }
 }
 
+static void assemble_one_file(mempool *mp, file_run_info *fi) {
+    // assembly source, read a line at a time, into an object file
+    FILE *f = fopen(str_charptr(fi->source_filename), "r");
+    if (f == NULL) {
+        error_at(str_charptr(fi->source_filename), 0, "Failed opening assembly source");
+        return;
+    }
+    asm_listing *asm_list = new_asm_listing(mp);
+    asm_list->with_comments = false;
+    bool parsed = parse_asm_stream(asm_list, f, str_charptr(fi->source_filename));
+    fclose(f);
+    if (!parsed)
+        return;
+
+    if (run_info->options->verbose) {
+        printf("--------- Parsed Assembly Code ---------\n");
+        asm_list->ops->print(asm_list, stdout);
+    }
+
+    assembler *as = new_assembler(mp);
+    fi->module = as->ops->assemble_listing_into_x86_64_code(as, asm_list, fi->source_filename);
+    if (fi->module == NULL || errors_count)
+        return;
+
+    elf64_contents *elf64 = fi->module->ops->prepare_elf_contents(fi->module, ELF_TYPE_REL, mp);
+    elf64->ops->save(elf64, str_change_extension(fi->source_filename, "o64"));
+}
+
+static void disassemble_one_file(mempool *mp, file_run_info *fi) {
+    // an object file or an executable, its code listed to stdout
+    bin *data = new_bin_from_file(mp, fi->source_filename);
+    if (data == NULL) {
+        error_at(str_charptr(fi->source_filename), 0, "Failed reading file");
+        return;
+    }
+    elf64_contents *elf64 = new_elf64_contents_from_binary(mp, data);
+    if (elf64 == NULL) {
+        error_at(str_charptr(fi->source_filename), 0, "Not an ELF64 file");
+        return;
+    }
+    obj_module *module = new_obj_module_from_elf64_contents(elf64, mp);
+    x86_64_disassemble_module(module, stdout);
+}
+
 static void process_all_files(mempool *mp) {
     
     init_operators();
@@ -370,6 +440,10 @@ int main(int argc, char *argv[]) {
         void perform_asm_test();
         perform_asm_test();
         return 0;
+    } else if (run_info->options->asm_bench) {
+        void perform_asm_benchmark();
+        perform_asm_benchmark();
+        return 0;
     } else if (run_info->options->e2e_test) {
         printf("Running end-to-end test... \n");
         bool passed = perform_end_to_end_test();
@@ -382,8 +456,22 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // process each file, then link them all together
-    process_all_files(mp);
+    if (run_info->options->assemble) {
+        for_list(run_info->files, file_run_info, fi) {
+            assemble_one_file(mp, fi);
+            if (errors_count)
+                break;
+        }
+    } else if (run_info->options->disassemble) {
+        for_list(run_info->files, file_run_info, fi) {
+            disassemble_one_file(mp, fi);
+            if (errors_count)
+                break;
+        }
+    } else {
+        // process each file, then link them all together
+        process_all_files(mp);
+    }
 
     // mempool_print_allocations(mp, stdout);
     mempool_release(mp);
@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "run_info.h"
 #include "utils/unit_tests.h"
@@ -26,26 +27,49 @@ void initialize_run_info(mempool *mp, int argc, char *argv[]) {
 
 void show_syntax() {
     printf("Syntax: mcc [options] file.c\n");
+    printf("       mcc --assemble file.asm\n");
+    printf("       mcc --disasm file.o64\n");
     printf("\t-v           verbose\n");
     // printf("\t-c           compile only\n");
     // printf("\t-S           assemble only\n");
     // printf("\t-E           pre-process only\n");
     printf("\t-m32         generate 32 bits code\n");
     printf("\t-m64         generate 64 bits code\n");
+    printf("\t-O0..-O3     optimization level (default 0)\n");
+    printf("\t--sysv-calls pass arguments in registers, System V style (64 bits only)\n");
+    printf("\t-fomit-frame-pointer address locals through SP, use BP as a general register\n");
+    printf("\t-fno-peephole skip the peephole optimizations on the assembly code\n");
+    printf("\t-fno-if-conversion keep the branches that could be conditional moves\n");
+    printf("\t-j<N>        assemble on N threads (default one per CPU)\n");
+    printf("\t-falign-functions[=N] start functions at N bytes boundaries (default 16)\n");
+    printf("\t-falign-loops[=N] start loops at N bytes boundaries (default 16)\n");
     printf("\t--gen-ast    generate abstract syntax tree file (.ast)\n");
     printf("\t--gen-ir     generate intermediate representation file (.ir)\n");
     printf("\t--gen-asm    generate assembly file (.asm)\n");
     printf("\t--gen-obj    generate object file (.o)\n");
     printf("\t--gen-map    generate linker map file (.map)\n");
+    printf("\t--assemble   assemble intel syntax source into object file (.o64)\n");
+    printf("\t--disasm     list the code of object files (.o64) and executables\n");
     #ifdef INCLUDE_UNIT_TESTS
         printf("\t--unit-tests run unit tests\n");
     #endif
     printf("\t--elf-test   run elf test\n");
     printf("\t--link-test  run link test\n");
     printf("\t--asm-test   run asm test\n");
+    printf("\t--asm-bench  measure the encoders throughput\n");
     printf("\t--e2e-test   run end-to-end test\n");
 }
 
+// e.g. "=32" after "-falign-loops", anything but a power of two gets the default
+static int parse_alignment(const char *p, int default_value) {
+    if (*p == 0)
+        return default_value;
+    if (*p != '=')
+        return 0;
+    int value = atoi(p + 1);
+    return (value > 0 && value <= 4096 && (value & (value - 1)) == 0) ? value : default_value;
+}
+
 static void parse_options(mempool *mp, int argc, char *argv[]) {
 
     // defaults
@@ -76,6 +100,22 @@ static void parse_options(mempool *mp, int argc, char *argv[]) {
         } else if (strcmp(p, "-m64") == 0) { // what should be the default?
             run_info->options->is_32_bits = false;
             run_info->options->is_64_bits = true;
+        } else if (p[1] == 'O' && p[2] >= '0' && p[2] <= '3' && p[3] == 0) {
+            run_info->options->optimization_level = p[2] - '0';
+        } else if (p[1] == 'j' && p[2] >= '1' && p[2] <= '9') {
+            run_info->options->asm_threads = atoi(p + 2);
+        } else if (strcmp(p, "--sysv-calls") == 0) {
+            run_info->options->sysv_calls = true;
+        } else if (strcmp(p, "-fomit-frame-pointer") == 0) {
+            run_info->options->omit_frame_pointer = true;
+        } else if (strcmp(p, "-fno-peephole") == 0) {
+            run_info->options->no_peephole = true;
+        } else if (strcmp(p, "-fno-if-conversion") == 0) {
+            run_info->options->no_if_conversion = true;
+        } else if (strncmp(p, "-falign-functions", 17) == 0) {
+            run_info->options->align_functions = parse_alignment(p + 17, 16);
+        } else if (strncmp(p, "-falign-loops", 13) == 0) {
+            run_info->options->align_loops = parse_alignment(p + 13, 16);
         } else if (strcmp(p, "--unit-tests") == 0) {
             run_info->options->unit_tests = true;
         } else if (strcmp(p, "--elf-test") == 0) {
@@ -84,8 +124,14 @@ static void parse_options(mempool *mp, int argc, char *argv[]) {
             run_info->options->link_test = true;
         } else if (strcmp(p, "--asm-test") == 0) {
             run_info->options->asm_test = true;
+        } else if (strcmp(p, "--asm-bench") == 0) {
+            run_info->options->asm_bench = true;
         } else if (strcmp(p, "--e2e-test") == 0) {
             run_info->options->e2e_test = true;
+        } else if (strcmp(p, "--assemble") == 0) {
+            run_info->options->assemble = true;
+        } else if (strcmp(p, "--disasm") == 0) {
+            run_info->options->disassemble = true;
 
         } else if (strcmp(p, "--gen-ast") == 0) {
             run_info->options->generate_ast = true;
@@ -103,5 +149,7 @@ static void parse_options(mempool *mp, int argc, char *argv[]) {
     // derived values that help execution
     run_info->options->pointer_size_bytes = run_info->options->is_32_bits ? 4 : 8;
     run_info->options->register_prefix = run_info->options->is_32_bits ? 'E' : 'R';
+    if (run_info->options->is_32_bits)
+        run_info->options->sysv_calls = false; // no such registers in 32 bits
 }
 
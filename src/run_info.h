@@ -18,7 +18,10 @@ struct prog_run_options {
     bool elf_test;
     bool link_test;
     bool asm_test;
+    bool asm_bench;
     bool e2e_test;
+    bool assemble; // the files are assembly source, into object files only
+    bool disassemble; // the files are object files or executables, list their code
 
     bool generate_ast;
     bool generate_ir;
@@ -26,6 +29,15 @@ struct prog_run_options {
     bool generate_obj;
     bool generate_map;
 
+    int optimization_level; // 0 = none
+    bool sysv_calls; // arguments in registers, 64 bits only
+    bool omit_frame_pointer; // locals relative to SP, BP is allocatable
+    bool no_peephole; // skip the peephole pass on the assembly listing
+    bool no_if_conversion; // keep branches that could be conditional moves
+    int asm_threads; // for assembling functions concurrently, 0 = one per CPU
+    int align_functions; // boundary for function entries, padded with NOPs, 0 = none
+    int align_loops; // boundary for the targets of backward jumps, 0 = none
+
     char *filename;
     
     // derived values to aid execution
@@ -63,7 +63,31 @@ static hashtable_node *hashtable_create_node(hashtable *h, str *key, void *data)
     return node;
 }
 
+// more than this many items per slot and the slots are quadrupled,
+// so chains stay short, whatever the initial capacity
+#define MAX_LOAD_FACTOR  2
+
+static void hashtable_grow(hashtable *h) {
+    int new_capacity = h->capacity * 4;
+    hashtable_node **new_arr = (hashtable_node **)mpallocn(h->mempool, new_capacity * sizeof(void *), "hashtable_items_arr");
+    for (int i = 0; i < h->capacity; i++) {
+        hashtable_node *n = h->items_arr[i];
+        while (n != NULL) {
+            hashtable_node *next = n->next;
+            int slot = (int)(str_hash(n->key) % new_capacity);
+            n->next = new_arr[slot];
+            new_arr[slot] = n;
+            n = next;
+        }
+    }
+    h->items_arr = new_arr;
+    h->capacity = new_capacity;
+}
+
 void hashtable_set(hashtable *h, str *key, void *data) { // O(1)
+    if (h->items_count >= h->capacity * MAX_LOAD_FACTOR)
+        hashtable_grow(h);
+
     int slot = (int)(str_hash(key) % h->capacity);
 
     // easy solution if slot is empty
@@ -283,6 +307,16 @@ void hashtable_unit_tests() {
     // this is flaky, order depends on hashing function.
     assert(str_cmps(collated, "payload 1,payload 2,payload 3,") == 0);
 
+    // growing keeps all the items
+    hashtable *growing = new_hashtable(mp, 1);
+    for (int i = 0; i < 1000; i++)
+        hashtable_set(growing, new_strf(mp, "key %d", i), (void *)(long)(i + 1));
+    assert(hashtable_length(growing) == 1000);
+    assert(growing->capacity >= 1000 / MAX_LOAD_FACTOR);
+    assert(hashtable_get(growing, new_str(mp, "key 0")) == (void *)1L);
+    assert(hashtable_get(growing, new_str(mp, "key 999")) == (void *)1000L);
+    assert(!hashtable_contains(growing, new_str(mp, "key 1000")));
+
     // a statistical test...
     int test_size = 1024;
     hashtable *bighash = new_hashtable(mp, test_size);